@@ -44,6 +44,7 @@ enum Command: String, EnumCollection {      // rawValues are automatically the n
     case merge
     case reproject
     case merge2
+    case process
     
     // camera calibration
     case calibrate  // 'x'
@@ -97,10 +98,11 @@ func getUsage(_ command: Command) -> String {
     case .proj: return "proj ([projector_#]|all) (on/1|off/0)"
     case .refine: return "refine    [proj]    [pos]\nrefine    -a    [pos]\nrefine    -a    -a\nrefine  -r    [proj]    [left] [right]\nrefine     -r    -a    [left] [right]\nrefine    -r    -a    -a"
     case .disparity: return "disparity (-r)? [proj] [left] [right]\n       disparity (-r)?   -a   [left] [right]\n       disparity (-r)?   -a   -a"
-    case .rectify: return "rectify [proj] [left] [right]\n       rectify   -a   [left] [right]\n       rectify   -a    -a"
+    case .rectify: return "rectify (-d)? [proj] [left] [right]\n       rectify (-d)?  -a   [left] [right]\n       rectify (-d)?  -a    -a\n       -d = also refine & compute disparities, without saving rectified images"
     case .merge: return "merge (-r)? [left] [right]\n       merge (-r)?  -a"
     case .reproject: return "reproject [left] [right]\n       reproject -a"
     case .merge2: return "merge2 [left] [right]\n       merge2 -a"
+    case .process: return "process [maxMemoryMB=0]? [fromStage]? [-m]?\n       (refine, rectify -d, disparity -r, merge -r, reproject & merge2 for all projectors & positions;\n       up-to-date steps are skipped, fromStage = refine|rectify|disparity|merge|reproject|merge2 forces a re-run from that stage,\n       -m keeps intermediate images in memory and writes them when done)"
     case .getintrinsics: return "getintrinsics"
     case .getextrinsics: return "getextrinsics [leftpos] [rightpos]\ngetextrinsics -a"
     case .dispres: return "dispres"
@@ -1122,6 +1124,7 @@ func processCommand(_ input: String) -> Bool {
         
         var allproj = false
         var allpos = false
+        var match = false
         for flag in flags {
             switch flag {
             case "-a":
@@ -1130,6 +1133,8 @@ func processCommand(_ input: String) -> Bool {
                 } else {
                     allpos = true
                 }
+            case "-d":
+                match = true
             default:
                 print("rectify: invalid flag \(flag)")
                 break cmdSwitch
@@ -1181,8 +1186,12 @@ func processCommand(_ input: String) -> Bool {
             } else {
                 posIDpairs = [singlePosPair!]
             }
-            for (left, right) in posIDpairs {
-                rectify(left: left, right: right, proj: proj)
+            if match {
+                for (left, right) in posIDpairs {
+                    rectifyAndMatch(left: left, right: right, proj: proj)
+                }
+            } else {
+                rectify(pairs: posIDpairs, proj: proj)
             }
         }
         
@@ -1380,6 +1389,54 @@ func processCommand(_ input: String) -> Bool {
 //        }
 //        mergeReprojected(left: left, right: right)
         
+    // runs all processing steps on the decoded images of all projectors & positions,
+    //    independent steps in parallel
+    case .process:
+        guard tokens.count <= 4 else {
+            print(usage)
+            break
+        }
+        var memoryMB = 0
+        var forceFrom: String? = nil
+        var inMemory = false
+        let stages = ["refine", "rectify", "disparity", "merge", "reproject", "merge2"]
+        var valid = true
+        for token in tokens[1...] {
+            if let mb = Int(token) {
+                memoryMB = mb
+            } else if stages.contains(token) {
+                forceFrom = token
+            } else if token == "-m" {
+                inMemory = true
+            } else {
+                valid = false
+            }
+        }
+        guard valid else {
+            print(usage)
+            break
+        }
+        
+        var projdirs = (try! FileManager.default.contentsOfDirectory(atPath: dirStruc.decoded(false)))
+        let projs = getIDs(projdirs, prefix: "proj", suffix: "")
+        guard !projs.isEmpty else {
+            print("process: no decoded images found in \(dirStruc.decoded(false))")
+            break
+        }
+        projdirs = projs.map {
+            return dirStruc.decoded(proj: $0, rectified: false)
+        }
+        
+        let positions2D: [[Int]] = projdirs.map {
+            let positiondirs = try! FileManager.default.contentsOfDirectory(atPath: $0)
+            let positions = getIDs(positiondirs, prefix: "pos", suffix: "")
+            return positions
+        }
+        let posset = positions2D.reduce(Set<Int>(positions2D.first!)) { (set: Set<Int>, list: [Int]) in
+            return set.intersection(list)
+        }
+        processAll(projectors: projs, positions: [Int](posset).sorted(), memoryMB: memoryMB, forceFrom: forceFrom, inMemory: inMemory)
+        
     // calculates camera's intrinsics using chessboard calibration photos in orig/calibration/chessboard
     // TO-DO: TEMPLATE PATHS SHOULD BE COPIED TO SAME DIRECTORY AS MAC EXECUTABLE SO
         // ABSOLUTE PATHS NOT REQUIRED
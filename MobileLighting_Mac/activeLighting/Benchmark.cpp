@@ -0,0 +1,407 @@
+//
+//  Benchmark.cpp
+//  activeLighting
+//
+//  times the processing stages on synthetic scenes (see SyntheticScene.h) and measures their
+//  accuracy against the known ground-truth disparities.
+//
+//  usage: Benchmark [options]
+//    -s WxH,WxH,...   image sizes (default 1000x750,2000x1500,4000x3000,6000x4000, i.e. up to 24MP)
+//    -p nproj         number of projectors (default 2)
+//    -n noise         standard deviation of code values (default 0.3)
+//    -u outliers      fraction of pixels with random codes (default 0.002)
+//    -H holes         undecodable holes per megapixel (default 20)
+//    -t nthreads      number of threads (default: numThreads())
+//    -r seed          random seed (default 1)
+//    -o dir           directory for the reprojection matrices, logs and scenes (default .)
+//    -k               keep the scene directories of the end-to-end runs
+//    -c file.csv      also append the results to file.csv
+//
+//  the stages run in memory with the same parameters as the processing steps of the scene graph
+//  (Scheduler.cpp): refine, match (matchImages in both directions), crosscheck (before and after
+//  filter), filter, merge (with cross-check of the merged disparities), reproject (with filter),
+//  and merge2 (with the final filters and cross-checks).  the end-to-end time is that of
+//  processScene on a scene directory dir/sceneWxH holding the decoded images and a calibration
+//  under which rectification leaves the images unchanged, i.e. it includes rectification, the
+//  final clipping and all file I/O.  the disparity search range is that of the ground truth.
+//  throughput is in megapixels of input images per second; accuracy is measured on the left view
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <ftw.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <opencv2/core/core.hpp>
+#include "imageLib.h"
+#include "Utils.h"
+#include "Disparities.h"
+#include "Decode.h"
+#include "Reproject.h"
+#include "Parallel.h"
+#include "Scheduler.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "SyntheticScene.h"
+
+// pixels added to both ends of the ground-truth disparity range for matching
+#define DISP_MARGIN 2
+
+struct StageResult {
+    std::string name;
+    double seconds, mpix;
+    bool hasacc;
+    DispAccuracy acc;
+};
+
+struct BenchmarkRun {
+    std::vector<StageResult> stages;
+
+    // time fn as stage name processing mpix megapixels; repeated stages are accumulated
+    void time(const char *name, double mpix, const std::function<void()> &fn) {
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        {
+            StageScope scope(name);
+            fn();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        StageResult &s = stage(name);
+        s.seconds += seconds;
+        s.mpix += mpix;
+    }
+
+    void accuracy(const char *name, CFloatImage disp, const SyntheticScene &scene) {
+        StageResult &s = stage(name);
+        s.hasacc = true;
+        s.acc = dispAccuracy(disp, scene.gtdisp[0], scene.occluded[0]);
+    }
+
+    StageResult &stage(const char *name) {
+        for (size_t i = 0; i < stages.size(); i++)
+            if (stages[i].name == name)
+                return stages[i];
+        StageResult s;
+        s.name = name;
+        s.seconds = s.mpix = 0;
+        s.hasacc = false;
+        stages.push_back(s);
+        return stages.back();
+    }
+};
+
+static CFloatImage xband(CFloatImage flo)
+{
+    return splitFloImage(flo).first;
+}
+
+static CFloatImage withUnkY(CFloatImage x)
+{
+    CFloatImage blank(x.Shape());
+    blank.FillPixels(UNK);
+    return mergeToFloImage(x, blank);
+}
+
+// run all stages on scene with the parameters of the scene steps; images are indexed
+// [projector][camera][direction] like the scene codes
+static void runPipeline(SyntheticScene &scene, const SceneParams &sp, const char *outdir, BenchmarkRun &run)
+{
+    int nproj = (int)scene.codes.size();
+    CShape sh = scene.gtdisp[0].Shape();
+    double mp = sh.width * sh.height / 1e6;
+
+    // refine
+    std::vector<std::vector<std::vector<CFloatImage> > > refined(nproj, std::vector<std::vector<CFloatImage> >(2, std::vector<CFloatImage>(2)));
+    for (int p = 0; p < nproj; p++) {
+        for (int c = 0; c < 2; c++) {
+            for (int d = 0; d < 2; d++) {
+                char posID[10];
+                sprintf(posID, "%d", c);
+                run.time("refine", mp, [&]() {
+                    refined[p][c][d] = refineCodeImage((char *)outdir, d, scene.codes[p][c][d], d == 0 ? 0 : M_PI / 2, posID, 0);
+                });
+            }
+        }
+    }
+
+    // match, cross-check and filter per projector
+    std::vector<std::vector<CFloatImage> > view(nproj, std::vector<CFloatImage>(2));     // cross-checked (flo)
+    std::vector<std::vector<CFloatImage> > filtered(nproj, std::vector<CFloatImage>(2)); // x disparities before 2nd cross-check
+    for (int p = 0; p < nproj; p++) {
+        CFloatImage code0 = mergeToFloImage(refined[p][0][0], refined[p][0][1]);
+        CFloatImage code1 = mergeToFloImage(refined[p][1][0], refined[p][1][1]);
+        CFloatImage disp0, disp1;
+        run.time("match", 2 * mp, [&]() {
+            computeDisparities(code0, code1, disp0, disp1, sp.dXmin, sp.dXmax, sp.dYmin, sp.dYmax);
+        });
+        if (p == 0)
+            run.accuracy("match", disp0, scene);
+
+        pair<CFloatImage,CFloatImage> checked;
+        run.time("crosscheck", 2 * mp, [&]() {
+            checked = runCrossCheck(disp0, disp1, sp.viewThresh, 0, 0);
+        });
+        CFloatImage f[2];
+        run.time("filter", 2 * mp, [&]() {
+            f[0] = runFilter(checked.first, sp.filterYthresh, sp.filterKx, sp.filterKy, sp.filterMinCompSize, sp.filterMaxHoleSize);
+            f[1] = runFilter(checked.second, sp.filterYthresh, sp.filterKx, sp.filterKy, sp.filterMinCompSize, sp.filterMaxHoleSize);
+        });
+        if (p == 0)
+            run.accuracy("filter", f[0], scene);
+        for (int c = 0; c < 2; c++)
+            filtered[p][c] = xband(f[c]);
+        run.time("crosscheck", 2 * mp, [&]() {
+            checked = runCrossCheck(f[0], f[1], sp.viewThresh, 1, 0);
+        });
+        if (p == 0)
+            run.accuracy("crosscheck", checked.first, scene);
+        view[p][0] = checked.first;
+        view[p][1] = checked.second;
+    }
+
+    // merge the projectors
+    CFloatImage merged[2];
+    pair<CFloatImage,CFloatImage> mchecked;
+    run.time("merge", 2 * nproj * mp, [&]() {
+        for (int c = 0; c < 2; c++) {
+            std::vector<CFloatImage> images;
+            for (int p = 0; p < nproj; p++)
+                images.push_back(view[p][c]);
+            merged[c] = mergeDisparityMaps(images.data(), nproj, sp.mergeMinGroup, sp.mergeMaxDiff);
+        }
+        mchecked = runCrossCheck(merged[0], merged[1], sp.mergeThresh, 1, 0);
+    });
+    run.accuracy("merge", mchecked.first, scene);
+    CFloatImage mdisp[2] = {xband(mchecked.first), xband(mchecked.second)};
+
+    // reproject with each projector
+    std::vector<std::vector<CFloatImage> > reproj(nproj, std::vector<CFloatImage>(2));
+    for (int c = 0; c < 2; c++) {
+        for (int p = 0; p < nproj; p++) {
+            char matfile[1000], logfile[1000];
+            sprintf(matfile, "%s/mat%d%d.txt", outdir, p, c);
+            sprintf(logfile, "%s/log%d%d.txt", outdir, p, c);
+            run.time("reproject", mp, [&]() {
+                CFloatImage r = reprojectDisp(mdisp[c], refined[p][c][0], refined[p][c][1], NULL, matfile, logfile);
+                reproj[p][c] = xband(runFilter(withUnkY(r), -1, sp.reprojKx, 0, 0, sp.reprojMaxHoleSize));
+            });
+            if (p == 0 && c == 0)
+                run.accuracy("reproject", reproj[p][c], scene);
+        }
+    }
+
+    // merge view and reprojected disparities, then filter and cross-check
+    CFloatImage result[2];
+    run.time("merge2", 2 * (2 * nproj + 1) * mp, [&]() {
+        for (int c = 0; c < 2; c++) {
+            std::vector<CFloatImage> vd, rd;
+            for (int p = 0; p < nproj; p++) {
+                vd.push_back(filtered[p][c]);
+                rd.push_back(reproj[p][c]);
+            }
+            CFloatImage state = initMergeState(mdisp[c], vd.data(), nproj, rd.data(), nproj, sp.merge2MaxDiff);
+            CFloatImage outd, outsd;
+            CByteImage outn;
+            finalizeMergeState(state, outd, outsd, outn);
+            result[c] = runFilter(withUnkY(outd), -1, 0, 0, sp.merge2MinCompSize, sp.merge2MaxHoleSize);
+        }
+        pair<CFloatImage,CFloatImage> checked = runCrossCheck(result[0], result[1], sp.merge2Thresh, 1, 1);
+        result[0] = runFilter(checked.first, -1, 0, 0, sp.merge2MinCompSize, sp.merge2MaxHoleSize);
+        result[1] = runFilter(checked.second, -1, 0, 0, sp.merge2MinCompSize, sp.merge2MaxHoleSize);
+        checked = runCrossCheck(result[0], result[1], sp.merge2Thresh, 1, 1);
+        result[0] = checked.first;
+        result[1] = checked.second;
+    });
+    run.accuracy("merge2", result[0], scene);
+}
+
+// write the decoded images of scene to the scene directory layout, with the stripe angles and a
+// calibration of two identical cameras whose rectification only rotates the images by 180° (the
+// rotation rectification undoes, see Rectify.cpp), so the rectified images are the synthetic ones
+static void writeScene(SyntheticScene &scene, const SyntheticSceneParams &params, const SceneLayout &layout)
+{
+    int nproj = (int)scene.codes.size();
+    for (int p = 0; p < nproj; p++) {
+        for (int c = 0; c < 2; c++) {
+            std::string dir = layout.decoded(p, c, false);
+            makedirs(dir);
+            for (int d = 0; d < 2; d++) {
+                std::string file = dir + "/result" + std::to_string(c) + "uv"[d] + "-0initial.pfm";
+                WriteImageVerb(scene.codes[p][c][d], file.c_str(), 0);
+                std::string metadata = layout.metadataFile(d, p, c);
+                makedirs(metadata.substr(0, metadata.rfind('/')));
+                FILE *fp = fopen(metadata.c_str(), "w");
+                if (fp == NULL)
+                    throw CError("cannot write %s", metadata.c_str());
+                fprintf(fp, "angle: %.17g\n", d == 0 ? 0 : M_PI / 2);
+                fclose(fp);
+            }
+        }
+    }
+
+    // same camera matrix as generateSyntheticScene
+    double f = (params.focal > 0) ? params.focal : 0.9 * params.width;
+    cv::Mat K = cv::Mat::eye(3, 3, CV_64F), R = cv::Mat::eye(3, 3, CV_64F), P = cv::Mat::zeros(3, 4, CV_64F);
+    K.at<double>(0, 0) = K.at<double>(1, 1) = f;
+    K.at<double>(0, 2) = 0.5 * (params.width - 1);
+    K.at<double>(1, 2) = 0.5 * (params.height - 1);
+    R.at<double>(0, 0) = R.at<double>(1, 1) = -1;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            P.at<double>(i, j) = K.at<double>(i, j);
+    std::string extrinsics = layout.extrinsics(0, 1);
+    makedirs(extrinsics.substr(0, extrinsics.rfind('/')));
+    makedirs(layout.scene + "/settings");
+    cv::FileStorage intr(layout.intrinsics(), cv::FileStorage::WRITE);
+    intr << "Camera_Matrix" << K << "Distortion_Coefficients" << cv::Mat::zeros(5, 1, CV_64F);
+    cv::FileStorage extr(extrinsics, cv::FileStorage::WRITE);
+    extr << "Rectification_Parameters" << "{"
+         << "Rectification_Transformation_1" << R << "Rectification_Transformation_2" << R
+         << "Projection_Matrix_1" << P << "Projection_Matrix_2" << P << "}";
+    cv::FileStorage settings(layout.calibrationSettings(), cv::FileStorage::WRITE);
+    settings << "Settings" << "{" << "Resizing factor" << 1 << "}";
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *)
+{
+    return remove(path);
+}
+
+// time processScene on scene, written to a scene directory in outdir, as stage "end-to-end"
+static void runScene(SyntheticScene &scene, const SyntheticSceneParams &params, const SceneParams &sp,
+                     const char *outdir, bool keep, BenchmarkRun &run)
+{
+    int nproj = (int)scene.codes.size();
+    SceneLayout layout(std::string(outdir) + "/scene" + std::to_string(params.width) + "x" + std::to_string(params.height));
+    nftw(layout.scene.c_str(), removeEntry, 20, FTW_DEPTH | FTW_PHYS);
+    writeScene(scene, params, layout);
+
+    std::vector<int> projectors;
+    for (int p = 0; p < nproj; p++)
+        projectors.push_back(p);
+    int failed = 0;
+    run.time("end-to-end", params.width * params.height / 1e6, [&]() {
+        failed = processScene(layout, projectors, {0, 1}, 0, 0, false, "", sp);
+    });
+    if (failed > 0)
+        throw CError("end-to-end: %d steps failed", failed);
+    CFloatImage disp;
+    ReadImageVerb(disp, (layout.merged2(0) + "/disp01x-5final" + sp.processing.mapExt).c_str(), 0);
+    run.accuracy("end-to-end", disp, scene);
+    if (!keep)
+        nftw(layout.scene.c_str(), removeEntry, 20, FTW_DEPTH | FTW_PHYS);
+}
+
+// one line per stage, the last one the end-to-end run
+static void report(BenchmarkRun &run, int width, int height, int nproj, FILE *csv)
+{
+    double mp = width * height / 1e6;
+    logFlush();
+    printf("\n%dx%d (%.1f MP), %d projectors, %d threads\n", width, height, mp, nproj, numThreads());
+    printf("%-12s %9s %9s %9s %9s %8s %8s\n", "stage", "seconds", "MPix/s", "coverage", "occluded", "bad>1", "rms");
+    for (size_t i = 0; i < run.stages.size(); i++) {
+        const StageResult &s = run.stages[i];
+        printf("%-12s %9.3f %9.2f", s.name.c_str(), s.seconds, s.mpix / s.seconds);
+        if (s.hasacc)
+            printf(" %8.2f%% %8.2f%% %7.2f%% %8.3f", s.acc.coverage, s.acc.occcoverage, s.acc.bad, s.acc.rms);
+        printf("\n");
+        if (csv != NULL) {
+            fprintf(csv, "%d,%d,%d,%d,%s,%.4f,%.3f", width, height, nproj, numThreads(), s.name.c_str(), s.seconds, s.mpix / s.seconds);
+            if (s.hasacc)
+                fprintf(csv, ",%.3f,%.3f,%.3f,%.4f\n", s.acc.coverage, s.acc.occcoverage, s.acc.bad, s.acc.rms);
+            else
+                fprintf(csv, ",,,,\n");
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s WxH,...] [-p nproj] [-n noise] [-u outliers] [-H holes] [-t nthreads] [-r seed] [-o dir] [-k] [-c file.csv]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    std::string sizes = "1000x750,2000x1500,4000x3000,6000x4000";
+    int nproj = 2;
+    SyntheticSceneParams defaults = defaultSyntheticSceneParams(0, 0);
+    double noise = defaults.noise, outliers = defaults.outliers, holes = defaults.holes;
+    unsigned seed = defaults.seed;
+    const char *outdir = ".", *csvfile = NULL;
+    bool keep = false;
+
+    int o;
+    while ((o = getopt(argc, argv, "s:p:n:u:H:t:r:o:kc:")) != -1) {
+        switch (o) {
+            case 's': sizes = optarg; break;
+            case 'p': nproj = atoiSafe(optarg); break;
+            case 'n': noise = atof(optarg); break;
+            case 'u': outliers = atof(optarg); break;
+            case 'H': holes = atof(optarg); break;
+            case 't': setNumThreads(atoiSafe(optarg)); break;
+            case 'r': seed = (unsigned)atoiSafe(optarg); break;
+            case 'o': outdir = optarg; break;
+            case 'k': keep = true; break;
+            case 'c': csvfile = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind < argc || nproj < 1)
+        usage(argv[0]);
+
+    try {
+        FILE *csv = NULL;
+        if (csvfile != NULL) {
+            bool exists = access(csvfile, F_OK) == 0;
+            csv = fopen(csvfile, "a");
+            if (csv == NULL)
+                throw CError("cannot write %s", csvfile);
+            if (!exists)
+                fprintf(csv, "width,height,projectors,threads,stage,seconds,mpix_per_s,coverage,occluded_coverage,bad,rms\n");
+        }
+
+        std::vector<ScenePatch> patches;
+        std::vector<SceneProjector> projectors;
+        defaultSyntheticScene(patches, projectors, nproj);
+
+        for (size_t pos = 0; pos < sizes.size(); ) {
+            size_t end = sizes.find(',', pos);
+            if (end == std::string::npos)
+                end = sizes.size();
+            int width, height;
+            if (sscanf(sizes.substr(pos, end - pos).c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+                usage(argv[0]);
+            pos = end + 1;
+
+            SyntheticSceneParams params = defaultSyntheticSceneParams(width, height);
+            params.noise = noise;
+            params.outliers = outliers;
+            params.holes = holes;
+            params.seed = seed;
+            logPrintf(log_info, "generating %dx%d scene\n", width, height);
+            SyntheticScene scene;
+            generateSyntheticScene(params, patches, projectors, scene);
+
+            SceneParams sp;
+            syntheticDispRange(scene, DISP_MARGIN, sp.dXmin, sp.dXmax);
+            sp.mergeMinGroup = std::min(sp.mergeMinGroup, nproj);
+            logPrintf(log_info, "disparity range %d..%d\n", sp.dXmin, sp.dXmax);
+            BenchmarkRun run;
+            runPipeline(scene, sp, outdir, run);
+            runScene(scene, params, sp, outdir, keep, run);
+            report(run, width, height, nproj, csv);
+        }
+        if (csv != NULL)
+            fclose(csv);
+    }
+    catch (CError &err) {
+        logPrintf(log_error, "%s\n", err.message);
+        return 1;
+    }
+    return 0;
+}
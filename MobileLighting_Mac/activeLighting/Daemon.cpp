@@ -0,0 +1,450 @@
+//
+//  Daemon.cpp
+//  activeLighting
+//
+//  long-running processing daemon: runs the processing steps for clients over a Unix domain socket
+//
+
+#include "Daemon.h"
+#include "Parallel.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "Params.h"
+#include "Progress.h"
+#include "imageLib.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "activeLighting.h"
+}
+
+#define DAEMON_MAXBYTES (64 << 20)  // largest request accepted
+#define DAEMON_NULL 0xffffffffu     // length of a NULL string
+
+static const char *opnames[] = {"ping", "shutdown", "threads", "refine", "rectify & disparity", "crosscheck",
+                                "filter", "merge", "reproject", "merge2", "process scene", "params", "cancel"};
+
+// a decoded request or reply
+struct DaemonRequest {
+    int op;
+    std::vector<int> ints;
+    std::vector<double> doubles;
+    std::vector<std::string> strings;
+    std::vector<bool> nulls;
+
+    // check the number of arguments (-1: any)
+    void need(int ni, int nd, int ns) const {
+        if ((ni >= 0 && (int)ints.size() != ni) || (nd >= 0 && (int)doubles.size() != nd) || (ns >= 0 && (int)strings.size() != ns))
+            throw CError("daemon: wrong number of arguments for request %d", op);
+    }
+    char *str(int i) {
+        return nulls[i] ? NULL : &strings[i][0];
+    }
+    // strings first .. first+n-1
+    std::vector<char *> strs(int first, int n) {
+        if (first < 0 || n < 0 || first + n > (int)strings.size())
+            throw CError("daemon: wrong number of arguments for request %d", op);
+        std::vector<char *> v;
+        for (int i = first; i < first + n; i++)
+            v.push_back(str(i));
+        return v;
+    }
+};
+
+static std::string encodeMessage(int op, int nints, const int *ints, int ndoubles, const double *doubles, int nstrings, char **strings)
+{
+    std::string data;
+    data.append((const char *)ints, nints * sizeof(int32_t));
+    data.append((const char *)doubles, ndoubles * sizeof(double));
+    for (int i = 0; i < nstrings; i++) {
+        uint32_t len = (strings[i] != NULL) ? (uint32_t)strlen(strings[i]) : DAEMON_NULL;
+        data.append((const char *)&len, sizeof(len));
+        if (strings[i] != NULL)
+            data.append(strings[i], len);
+    }
+    DaemonMessage hdr = {DAEMON_MAGIC, (uint32_t)op, (uint32_t)nints, (uint32_t)ndoubles, (uint32_t)nstrings, (uint32_t)data.size()};
+    return std::string((const char *)&hdr, sizeof(hdr)) + data;
+}
+
+static bool readAll(int fd, void *buf, size_t n)
+{
+    char *p = (char *)buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const std::string &s)
+{
+    const char *p = s.data();
+    size_t n = s.size();
+    while (n > 0) {
+        ssize_t r = write(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+// read one message; false at the end of the connection
+static bool readMessage(int fd, DaemonRequest &msg)
+{
+    DaemonMessage hdr;
+    if (!readAll(fd, &hdr, sizeof(hdr)))
+        return false;
+    if (hdr.magic != DAEMON_MAGIC || hdr.bytes > DAEMON_MAXBYTES)
+        throw CError("daemon: bad message header");
+    std::vector<char> data(hdr.bytes);
+    if (!readAll(fd, data.data(), hdr.bytes))
+        throw CError("daemon: incomplete message");
+
+    size_t pos = 0, fixed = (size_t)hdr.nints * sizeof(int32_t) + (size_t)hdr.ndoubles * sizeof(double);
+    if (fixed > hdr.bytes)
+        throw CError("daemon: bad message");
+    msg.op = hdr.op;
+    msg.ints.resize(hdr.nints);
+    msg.doubles.resize(hdr.ndoubles);
+    for (uint32_t i = 0; i < hdr.nints; i++, pos += sizeof(int32_t))
+        memcpy(&msg.ints[i], &data[pos], sizeof(int32_t));
+    for (uint32_t i = 0; i < hdr.ndoubles; i++, pos += sizeof(double))
+        memcpy(&msg.doubles[i], &data[pos], sizeof(double));
+    msg.strings.clear();
+    msg.nulls.clear();
+    for (uint32_t i = 0; i < hdr.nstrings; i++) {
+        uint32_t len;
+        if (pos + sizeof(len) > hdr.bytes)
+            throw CError("daemon: bad message");
+        memcpy(&len, &data[pos], sizeof(len));
+        pos += sizeof(len);
+        bool null = (len == DAEMON_NULL);
+        if (null)
+            len = 0;
+        if (pos + len > hdr.bytes)
+            throw CError("daemon: bad message");
+        msg.strings.push_back(std::string(&data[pos], len));
+        msg.nulls.push_back(null);
+        pos += len;
+    }
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// server
+
+struct DaemonState {
+    std::string socketpath;
+    std::atomic<bool> shutdown;
+    std::mutex lock;
+    std::condition_variable idle;
+    int active;                     // requests being processed (guarded by lock)
+    // cancellation flags of the requests being processed, by client process (guarded by lock)
+    std::multimap<pid_t, std::atomic<bool> *> running;
+};
+
+// settings of one connection
+struct DaemonConnection {
+    pid_t client;                   // process of the client (0: unknown)
+    std::unique_ptr<ProcessingParams> params; // parameters of the requests (NULL: those of the daemon)
+    int threads;                    // thread limit of the requests (0: the daemon's threads)
+};
+
+// process at the other end of a connection, 0 if unknown
+static pid_t peerProcess(int fd)
+{
+#ifdef __APPLE__
+    pid_t pid = 0;
+    socklen_t len = sizeof(pid);
+    if (getsockopt(fd, SOL_LOCAL, LOCAL_PEERPID, &pid, &len) != 0)
+        return 0;
+    return pid;
+#else
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return 0;
+    return cred.pid;
+#endif
+}
+
+static int handle(DaemonRequest &req, DaemonState &state, DaemonConnection &conn)
+{
+    switch (req.op) {
+        case DAEMON_PING:
+            return 0;
+        case DAEMON_SHUTDOWN:
+            state.shutdown = true;
+            return 0;
+        case DAEMON_THREADS:
+            req.need(1, 0, 0);
+            conn.threads = std::max(req.ints[0], 0);
+            return (conn.threads > 0) ? std::min(conn.threads, numThreads()) : numThreads();
+        case DAEMON_REFINE:
+            req.need(1, 1, 3);
+            refineDecodedIm(req.str(0), req.ints[0], req.str(1), req.doubles[0], req.str(2));
+            return 0;
+        case DAEMON_RECTIFY_DISPARITY: {
+            req.need(6, 4, 9);
+            std::vector<char *> s = req.strs(0, 9);
+            int *i = &req.ints[0];
+            rectifyRefineDisparities(s[0], s[1], s[2], s[3], s[4], s[5], s[6], s[7], s[8], i[0], i[1], &req.doubles[0], i[2], i[3], i[4], i[5]);
+            return 0;
+        }
+        case DAEMON_CROSSCHECK:
+            req.need(4, 1, 4);
+            crosscheckDisparities(req.str(0), req.str(1), req.ints[0], req.ints[1], (float)req.doubles[0], req.ints[2], req.ints[3],
+                                  req.str(2), req.str(3));
+            return 0;
+        case DAEMON_FILTER:
+            req.need(6, 1, 4);
+            filterDisparities(req.str(0), req.str(1), req.str(2), req.str(3), req.ints[0], req.ints[1], (float)req.doubles[0],
+                              req.ints[2], req.ints[3], req.ints[4], req.ints[5]);
+            return 0;
+        case DAEMON_MERGE: {
+            req.need(2, 1, -1);
+            int count = req.ints[0];
+            bool withy = (int)req.strings.size() == 2 + 2 * count;
+            std::vector<char *> x = req.strs(2, count), y = req.strs(2 + count, withy ? count : 0);
+            if ((int)req.strings.size() != 2 + (withy ? 2 : 1) * count)
+                throw CError("daemon: wrong number of arguments for request %d", req.op);
+            mergeDisparities(x.data(), withy ? y.data() : NULL, req.str(0), req.str(1), count, req.ints[1], (float)req.doubles[0]);
+            return 0;
+        }
+        case DAEMON_REPROJECT: {
+            req.need(1, 0, 2 + 7 * req.ints.at(0));
+            int n = req.ints[0];
+            std::vector<char *> f[7];
+            for (int k = 0; k < 7; k++)
+                for (int p = 0; p < n; p++)
+                    f[k].push_back(req.str(2 + 7 * p + k));
+            reprojectDisparitiesBatch(req.str(0), req.str(1), n, f[0].data(), f[1].data(), f[2].data(), f[3].data(), f[4].data(),
+                                      f[5].data(), f[6].data());
+            return 0;
+        }
+        case DAEMON_MERGE2: {
+            req.need(2, 1, 4 + req.ints.at(0) + req.ints.at(1));
+            int nV = req.ints[0], nR = req.ints[1];
+            std::vector<char *> vd = req.strs(4, nV), rd = req.strs(4 + nV, nR);
+            mergeDisparityMaps2((float)req.doubles[0], nV, nR, req.str(0), req.str(1), req.str(2), req.str(3), vd.data(), rd.data());
+            return 0;
+        }
+        case DAEMON_PROCESS_SCENE: {
+            if (req.ints.size() < 5 || req.ints[3] < 0 || req.ints[4] < 0)
+                throw CError("daemon: wrong number of arguments for request %d", req.op);
+            req.need(5 + req.ints[3] + req.ints[4], 0, 2);
+            int *i = &req.ints[0];
+            return processScene(req.str(0), i[3], i + 5, i[4], i + 5 + i[3], i[0], i[1], i[2], req.str(1));
+        }
+        case DAEMON_PARAMS:
+            req.need(0, 0, 1);
+            if (req.str(0) == NULL) {
+                conn.params.reset();
+            } else {
+                std::unique_ptr<ProcessingParams> p(new ProcessingParams());
+                p->load(req.str(0));
+                conn.params = std::move(p);
+            }
+            return 0;
+        case DAEMON_CANCEL: {
+            req.need(1, 0, 0);
+            // only the requests of the same client process
+            std::lock_guard<std::mutex> guard(state.lock);
+            auto range = state.running.equal_range(conn.client);
+            for (auto r = range.first; r != range.second; ++r)
+                *r->second = (req.ints[0] != 0);
+            return 0;
+        }
+    }
+    throw CError("daemon: unknown request %d", req.op);
+}
+
+// answer the requests of one connection
+static void serve(int fd, DaemonState *state)
+{
+    try {
+        DaemonRequest req;
+        DaemonConnection conn;
+        conn.client = peerProcess(fd);
+        conn.threads = 0;
+        while (readMessage(fd, req)) {
+            std::atomic<bool> cancelled(false);
+            std::multimap<pid_t, std::atomic<bool> *>::iterator entry;
+            {
+                std::lock_guard<std::mutex> guard(state->lock);
+                state->active++;
+                entry = state->running.insert(std::make_pair(conn.client, &cancelled));
+            }
+            const char *name = ((unsigned)req.op < sizeof(opnames) / sizeof(opnames[0])) ? opnames[req.op] : "unknown";
+            int status = 0, result = 0;
+            std::string msg;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            try {
+                StageScope scope(name);
+                ParamsScope use(conn.params.get());
+                CancelScope cancel(&cancelled);
+                setThreadLimit(conn.threads);
+                result = handle(req, *state, conn);
+                // the entry points return without results when cancelled
+                if (req.op >= DAEMON_REFINE && req.op <= DAEMON_PROCESS_SCENE && cancelRequested())
+                    throw CCancelled();
+            } catch (CError &err) {
+                status = 1;
+                msg = err.message;
+            } catch (std::exception &err) {
+                status = 1;
+                msg = err.what();
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (status == 0)
+                logPrintf(log_info, "daemon: %s (%.3f s)\n", name, seconds);
+            else
+                logPrintf(log_error, "daemon: %s: %s\n", name, msg.c_str());
+            char *msgs[1] = {&msg[0]};
+            bool sent = writeAll(fd, encodeMessage(status, 1, &result, 0, NULL, status ? 1 : 0, msgs));
+
+            setThreadLimit(0);
+            bool shutdown = state->shutdown;
+            {
+                std::lock_guard<std::mutex> guard(state->lock);
+                state->active--;
+                state->running.erase(entry);
+            }
+            state->idle.notify_all();
+            if (shutdown) {
+                // wake up the accept loop
+                int wake = socket(AF_UNIX, SOCK_STREAM, 0);
+                struct sockaddr_un addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sun_family = AF_UNIX;
+                strncpy(addr.sun_path, state->socketpath.c_str(), sizeof(addr.sun_path) - 1);
+                connect(wake, (struct sockaddr *)&addr, sizeof(addr));
+                close(wake);
+            }
+            if (!sent)
+                break;
+        }
+    } catch (CError &err) {
+        logPrintf(log_error, "%s\n", err.message);
+    }
+    close(fd);
+}
+
+void runDaemon(const char *socketpath, int cachedpairs)
+{
+    signal(SIGPIPE, SIG_IGN);
+    setRectificationContextCache(cachedpairs);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketpath) >= sizeof(addr.sun_path))
+        throw CError("daemon: socket path too long: %s", socketpath);
+    strcpy(addr.sun_path, socketpath);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw CError("daemon: cannot create socket");
+    unlink(socketpath);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        throw CError("daemon: cannot listen on %s", socketpath);
+    }
+
+    // start the worker threads now rather than with the first request
+    parallelFor(numThreads(), [](int) {});
+    logPrintf(log_info, "daemon: listening on %s (%d threads, maps of %d stereo pairs cached)\n", socketpath, numThreads(), cachedpairs);
+    logFlush();
+
+    DaemonState *state = new DaemonState();     // connection threads may outlive this function
+    state->socketpath = socketpath;
+    state->shutdown = false;
+    state->active = 0;
+    while (!state->shutdown) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            close(fd);
+            throw CError("daemon: cannot accept connections on %s", socketpath);
+        }
+        if (state->shutdown) {
+            close(conn);
+            break;
+        }
+        std::thread(serve, conn, state).detach();
+    }
+    close(fd);
+    unlink(socketpath);
+
+    // let requests of other connections finish
+    std::unique_lock<std::mutex> guard(state->lock);
+    state->idle.wait(guard, [state]() { return state->active == 0; });
+    logPrintf(log_info, "daemon: shut down\n");
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// C interface
+
+// send one request (DAEMON_* and arguments as described in Daemon.h) to the daemon at socketpath
+// and wait for the reply.  returns the result of the request, or -1 if it failed, with the error
+// message in errmsg (errlen bytes, may be NULL)
+extern "C" int daemonRequest(char *socketpath, int op, int nints, int *ints, int ndoubles, double *doubles,
+                             int nstrings, char **strings, char *errmsg, int errlen)
+{
+    std::string err;
+    int result = -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketpath, sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        err = std::string("cannot connect to daemon at ") + socketpath;
+    } else if (!writeAll(fd, encodeMessage(op, nints, ints, ndoubles, doubles, nstrings, strings))) {
+        err = "cannot send request to daemon";
+    } else {
+        DaemonRequest reply;
+        try {
+            if (!readMessage(fd, reply) || reply.ints.size() != 1)
+                err = "no reply from daemon";
+            else if (reply.op != 0)
+                err = reply.strings.empty() ? "request failed" : reply.strings[0];
+            else
+                result = reply.ints[0];
+        } catch (CError &e) {
+            err = e.message;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    if (!err.empty() && errmsg != NULL && errlen > 0)
+        snprintf(errmsg, errlen, "%s", err.c_str());
+    return err.empty() ? result : -1;
+}
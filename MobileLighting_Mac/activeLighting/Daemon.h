@@ -0,0 +1,67 @@
+//
+//  Daemon.h
+//  activeLighting
+//
+//  long-running processing daemon: runs the processing steps for clients over a Unix domain socket
+//
+
+#ifndef Daemon_h
+#define Daemon_h
+
+// the daemon keeps what the C entry points otherwise set up on every call: the worker threads
+// of the parallel stages, and the rectification maps of the last stereo pairs (see
+// setRectificationContextCache), so repeated small jobs start right away.
+//
+// protocol (native byte order, the client runs on the same machine): a request is a
+// DaemonMessage header followed by nints int32 values, ndoubles float64 values and nstrings
+// strings, each a uint32 length and that many bytes (length 0xffffffff: NULL string).  the
+// reply is a header with op = status (0: ok, 1: failed), nints = 1 and the result, and on
+// failure nstrings = 1 and the error message.  a connection can carry any number of requests,
+// which are answered in order; connections are served concurrently.
+//
+// requests (DAEMON_* in activeLighting.h), arguments in order:
+//   PING                   -
+//   SHUTDOWN               -
+//   THREADS                ints: nthreads (0: the daemon's threads); limits the following requests
+//                          of the connection to at most nthreads of the daemon's threads;
+//                          result: the threads they use
+//   REFINE                 strings: outdir, decodedIm, posID; ints: direction; doubles: angle
+//   RECTIFY_DISPARITY      strings: intr, extr, settings, decodeddir0, decodeddir1, rectdir0, rectdir1,
+//                          outdir0, outdir1; ints: pos0, pos1, dXmin, dXmax, dYmin, dYmax;
+//                          doubles: 4 angles
+//   CROSSCHECK             strings: posdir0, posdir1, in_suffix, out_suffix; ints: pos0, pos1, xonly,
+//                          halfocc; doubles: thresh
+//   FILTER                 strings: dispx, dispy, outx, outy; ints: pos0, pos1, kx, ky, mincompsize,
+//                          maxholesize; doubles: ythresh
+//   MERGE                  strings: outx, outy, count x files, count y files (or none);
+//                          ints: count, mingroup; doubles: maxdiff
+//   REPROJECT              strings: dispx, dispy, then codex, codey, outx, outy, err, mat, log of each
+//                          projector; ints: nproj
+//   MERGE2                 strings: outd, outsd, outn, inmd, nV view files, nR reprojected files;
+//                          ints: nV, nR; doubles: maxdiff
+//   PROCESS_SCENE          strings: scenedir, forcestage; ints: nthreads, memorymb, incremental, nproj,
+//                          npos, projectors, positions; result: number of failed steps
+//   PARAMS                 strings: yamlfile (see ProcessingParams::load; NULL: the daemon's parameters);
+//                          used by the following requests of the connection only
+//   CANCEL                 ints: cancel; sent on another connection, it stops the requests the
+//                          client process has running in the daemon, which fail with "processing
+//                          cancelled" (unlike processingCancel, requests sent later run normally,
+//                          and requests of other clients are not affected)
+// the arguments are those of the C entry points of the same name
+
+#include <stdint.h>
+
+#define DAEMON_MAGIC 0x31444c41     // "ALD1"
+
+struct DaemonMessage {
+    uint32_t magic;
+    uint32_t op;
+    uint32_t nints, ndoubles, nstrings;
+    uint32_t bytes;                 // size of the data following the header
+};
+
+// serve requests on socketpath until a SHUTDOWN request; keeps the maps of up to cachedpairs
+// stereo pairs in memory
+void runDaemon(const char *socketpath, int cachedpairs);
+
+#endif /* Daemon_h */
@@ -20,13 +20,13 @@
 #include <iostream>
 #include <fstream>
 #include "Utils.h"
-#include "Debug.h"
+#include "Decode.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "Progress.h"
 
 #define MAXCODES 1024
 
-int pixelToCode[MAXCODES];
-int codeToPixel[MAXCODES];
-
 // load code file
 /*
 void loadCodes(char* file){
@@ -96,12 +96,13 @@ void decodeCode(CIntImage val, CIntImage unk, CFloatImage &result)
 
 */
 
-// fill holes in a line of code map
-void fillCodeHolesLine(float *val, int stride, int n, int maxwidth, int maxborderdiff)
+// fill holes in a line of code map, returns number of pixels filled
+int fillCodeHolesLine(float *val, int stride, int n, int maxwidth, int maxborderdiff)
 {	
     float oldv = UNK;
     int cnt = 0;
     int hole = 0;
+    int nfilled = 0;
     for (int x = 0; x < n; x++, val += stride) {
 	float v = *val;
 	if (v != UNK) {
@@ -110,6 +111,7 @@ void fillCodeHolesLine(float *val, int stride, int n, int maxwidth, int maxborde
 		    float fillv = (v + oldv) / 2.0;
 		    for (int k = 1; k <= cnt; k++)
 			val[-k * stride] = fillv;
+		    nfilled += cnt;
 		}
 	    }
 	    cnt = 0;
@@ -120,6 +122,7 @@ void fillCodeHolesLine(float *val, int stride, int n, int maxwidth, int maxborde
 	    cnt++;
 	}
     }
+    return nfilled;
 }
 
 // fill holes in code map. if directon==0, in x direction, else in y direction
@@ -128,20 +131,22 @@ void fillCodeHoles(CFloatImage im0, int maxwidth, float maxborderdiff, int direc
     CShape sh = im0.Shape();
     int x, y, w = sh.width, h = sh.height;
     int stride;
+    long long nfilled = 0;
 
     if (direction==0) { // x direction
 	stride = 1;
 	for (y = 0; y < h; y++) {
 	    float *val = &im0.Pixel(0, y, 0);
-	    fillCodeHolesLine(val, stride, w, maxwidth, maxborderdiff);
+	    nfilled += fillCodeHolesLine(val, stride, w, maxwidth, maxborderdiff);
 	}
     } else { // y direction
         stride = (int) (&im0.Pixel(0, 1, 0) - &im0.Pixel(0, 0, 0));
 	for (x = 0; x < w; x++) {
 	    float *val = &im0.Pixel(x, 0, 0);
-	    fillCodeHolesLine(val, stride, h, maxwidth, maxborderdiff);
+	    nfilled += fillCodeHolesLine(val, stride, h, maxwidth, maxborderdiff);
 	}
     }
+    instrumentCount("hole pixels filled", nfilled);
 }
 
 
@@ -247,14 +252,22 @@ void refineCodesPlanePixel(CFloatImage val, CFloatImage &fval, int x0, int y0, i
 }
 
 // refine codes using angle of prominent stripe direction
-// - mode: determines refinement algorithm to use
-void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, double angle)
+// - params.refineMode: determines refinement algorithm to use
+// - progress: counts w + h units, one per line refined
+void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, double angle, const ProcessingParams &params,
+                 ProgressScope &progress)
 {
     CShape sh = val.Shape();
     fval.ReAllocate(sh);
+    // the lines below step through val and fval with the same stride; val can be stored
+    // bottom-up (e.g., mapped from a PFM file)
+    if (&val.Pixel(0, 1, 0) - &val.Pixel(0, 0, 0) != &fval.Pixel(0, 1, 0) - &fval.Pixel(0, 0, 0))
+        val = copyImage(val);
     int x, y, w = sh.width, h = sh.height;
+    int lines = 0;
+    auto next = [&]() { progress.add(); lines++; };
 	
-	switch (refine_mode) {
+	switch (params.refineMode) {
 	case refine_old:
 	{
 		double dx, dy;
@@ -273,6 +286,7 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 		        int stride = (int) (&val.Pixel(1, 0, 0) - &val.Pixel(0, 0, 0));
 		        // assume that f has same stride!
 		    //int debugy = (y == 617) ? y : 0;
+		        next();
 		        refineCodesLine(v, f, stride, w, rad, maxgrad); //, debugy);
 		    }
 		} else {
@@ -282,6 +296,7 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 	        int stride = (int) (&val.Pixel(0, 1, 0) - &val.Pixel(0, 0, 0));
 		        // assume that f has same stride!
 		    //int debugy = (x == 998) ? x : 0;
+	        next();
 	        refineCodesLine(v, f, stride, h, rad, maxgrad); //, debugy);
 		    }
 		}
@@ -302,6 +317,7 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 			for (y = 0; y < h; ++y) {
 				v = &val.Pixel(0, y, 0);
 				f = &fval.Pixel(0, y, 0);
+				next();
 				refineCodesLine(v, f, stride, w, rad, maxgrad);
 			}	
 		} else if (dx == 0 && dy == 1) {
@@ -309,6 +325,7 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 			for (x = 0; x < w; ++x) {
 				v = &val.Pixel(x, 0, 0);
 				f = &fval.Pixel(x, 0, 0);
+				next();
 				refineCodesLine(v, f, stride, h, rad, maxgrad);
 			}
 		} else if (dx == 1 && dy == 1) {
@@ -319,12 +336,14 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 				v = &val.Pixel(x, 0, 0);
 				f = &fval.Pixel(x, 0, 0);
 				int n = min(w-x, h);	// the maximum number of windows (center pixels) to consider
+				next();
 				refineCodesLine(v, f, stride, n, rad_adj, maxgrad_adj);
 			}
 			for (y = 1; y < h; ++y) {		// don't count (0,0) twice
 				v = &val.Pixel(0, y, 0);
 				f = &fval.Pixel(0, y, 0);
 				int n = min(w, h-y);
+				next();
 				refineCodesLine(v, f, stride, n, rad_adj, maxgrad_adj);
 			}
 		} else if (dx == -1 && dy == 1) {
@@ -335,6 +354,7 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 				v = &val.Pixel(x, 0, 0);
 				f = &fval.Pixel(x, 0, 0);
 				int n = min(x+1, h);	// the maximum number of windows (center pixels) to consider
+				next();
 				refineCodesLine(v, f, stride, n, rad_adj, maxgrad_adj);
 			}
 			for (y = 1; y < h; ++y) {
@@ -342,6 +362,7 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 				v = &val.Pixel(w-1, y, 0);
 				f = &fval.Pixel(w-1, y, 0);
 				int n = min(w, h-y);
+				next();
 				refineCodesLine(v, f, stride, n, rad_adj, maxgrad_adj);
 			}
 		} else {
@@ -353,11 +374,12 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 	}
 	case refine_planar:
 	{
-		// refine_plane_windowsize is height & width of window
-		int rad = (refine_plane_windowsize-1)/2;
-		float maxdiff = refine_plane_maxdiff;
-		int minsupport = refine_plane_minsupport;
+		// planeWindowSize is height & width of window
+		int rad = (params.planeWindowSize-1)/2;
+		float maxdiff = params.planeMaxDiff;
+		int minsupport = params.planeMinSupport;
 		for (x = 0; x < w; ++x) {
+			next();
 			for (y = 0; y < h; ++y) {
 				refineCodesPlanePixel(val, fval, x, y, rad, maxdiff, minsupport);
 			}
@@ -371,6 +393,7 @@ void refineCodes(CFloatImage val, CFloatImage &fval, int rad, float maxgrad, dou
 		throw CError(error);
 	}
 	}
+	progress.add(w + h - lines);
 	return;
 }
 
@@ -405,7 +428,8 @@ void fval2rgb(int N, CFloatImage val, CByteImage &result)
 // new filter with different idea: require certain fraction (1/4?) of pixels with almost identical 
 // code (+/- maxdiff) in window.  should better filter out isolated pixels.
 // DS 11/25/2013
-void filter(CFloatImage val, int radius, float fraction, float maxdiff)
+// progress counts one unit per row
+void filter(CFloatImage val, int radius, float fraction, float maxdiff, ProgressScope &progress)
 {
     CShape sh = val.Shape();
     int w = sh.width, h = sh.height;
@@ -414,6 +438,7 @@ void filter(CFloatImage val, int radius, float fraction, float maxdiff)
     int nfiltered = 0;
 
     for (int y = 0; y < h; y++) {
+        progress.add();
         for (int x = 0; x < w; x++) {
             float p0 = val.Pixel(x, y, 0);
 	    tmp.Pixel(x, y, 0) = p0;
@@ -450,7 +475,9 @@ void filter(CFloatImage val, int radius, float fraction, float maxdiff)
             val.Pixel(x, y, 0) = tmp.Pixel(x, y, 0);
         }
     }
-    printf("%d pixels filtered (%.3f%%)\n", nfiltered, (float)nfiltered * 100.0 / (w * h));
+    logPrintf(log_verbose, "%d pixels filtered (%.3f%%)\n", nfiltered, (float)nfiltered * 100.0 / (w * h));
+    instrumentCount("pixels processed", (long long)w * h);
+    instrumentCount("filtered pixels", nfiltered);
 }
 
 //erases foreground object from fval
@@ -473,61 +500,76 @@ void foregroundErase(CFloatImage fval, CByteImage mask)
 
 // *** MobileLighting (Mac) currently calls this to do post-decoding refinement ***
 // edited 07/2018 by NHM to use position identifiers in filenames
-CFloatImage refine(char *outdir, int direction, char* decodedIm, double angle, char *posID) {
-	CFloatImage fval, fval1, fval2;
-	CShape sh;
-	int verbose = 1;
-	char filename[1000];
-    char uv = direction == 0 ? 'u' : 'v';
+CFloatImage refine(char *outdir, int direction, char* decodedIm, double angle, char *posID, const ProcessingParams &params) {
+	CFloatImage fval;
+	int verbose = logEnabled(log_verbose);
 	
 	// read in PFM
 	ReadImageVerb(fval, decodedIm, verbose);
 	
+	return refineCodeImage(outdir, direction, fval, angle, posID, REFINE_SAVE_INTERMEDIATE | REFINE_SAVE_FINAL, params);
+}
+
+// refine decoded image fval that is already in memory (e.g., a rectified view); fval is modified.
+// save selects which results are saved: REFINE_SAVE_INTERMEDIATE (-1filtered, -2holefilled,
+// -3refined1) and/or REFINE_SAVE_FINAL (-4refined2)
+CFloatImage refineCodeImage(char *outdir, int direction, CFloatImage fval, double angle, char *posID, int save, const ProcessingParams &params) {
+	CFloatImage fval1, fval2;
+	int verbose = logEnabled(log_verbose);
+	char filename[1000];
+    char uv = direction == 0 ? 'u' : 'v';
+    CShape sh = fval.Shape();
+    // rows filtered, then lines of both refinement passes
+    ProgressScope progress("refine", sh.height + 2 * (sh.width + sh.height));
+	
 	// FILTER
 	// filter to remove isolated pixels with different code values
     if (1) {
-	int rad = 4;
-	float fraction = 0.25;
-	float maxdiff = 4.0;
-	printf("Filtering image with radius %d, fraction %g, and maxdiff %g\n", rad, fraction, maxdiff);
-	filter(fval, rad, fraction, maxdiff);
+	int rad = params.filterRadius;
+	float fraction = params.filterFraction;
+	float maxdiff = params.filterMaxDiff;
+	logPrintf(log_verbose, "Filtering image with radius %d, fraction %g, and maxdiff %g\n", rad, fraction, maxdiff);
+	StageScope scope("refine: filter");
+	filter(fval, rad, fraction, maxdiff, progress);
     }	
 	
-    if (1) { // save filtered image
-	sprintf(filename, "%s/result%s%c-1filtered.pfm", outdir, posID, uv);
+    if (save & REFINE_SAVE_INTERMEDIATE) { // save filtered image
+	sprintf(filename, "%s/result%s%c-1filtered%s", outdir, posID, uv, params.mapExt.c_str());
 	WriteImageVerb(fval, filename, verbose);
     }
 	
 	// FILL CODE HOLES
 	if (1) {
-	if (verbose) printf("filling holes\n");
-	//int maxwidth = 7; // since higher resolution, try filling larger holes
-	int maxwidth = 5; // nope, back to 5 pixels, seems to be a good compromise
-	float maxborderdiff = 2; // still sometimes need 2, e.g. Newkuba/P4 on the lamp
-	fillCodeHoles(fval, maxwidth, maxborderdiff, direction);
-	maxborderdiff = 0;
-	fillCodeHoles(fval, maxwidth, maxborderdiff, 1-direction);
-	maxborderdiff = 1;
-	fillCodeHoles(fval, maxwidth, maxborderdiff, direction);
+	if (verbose) logPrintf(log_verbose, "filling holes\n");
+	StageScope scope("refine: fill holes");
+	int maxwidth = params.holeMaxWidth;
+	fillCodeHoles(fval, maxwidth, params.holeBorderDiff[0], direction);
+	fillCodeHoles(fval, maxwidth, params.holeBorderDiff[1], 1-direction);
+	fillCodeHoles(fval, maxwidth, params.holeBorderDiff[2], direction);
+	checkCancel();
     }
 
-    if (1) { // save hole-filled image
-	sprintf(filename, "%s/result%s%c-2holefilled.pfm", outdir, posID, uv);
+    if (save & REFINE_SAVE_INTERMEDIATE) { // save hole-filled image
+	sprintf(filename, "%s/result%s%c-2holefilled%s", outdir, posID, uv, params.mapExt.c_str());
 	WriteImageVerb(fval, filename, verbose);
     }
 	
 	// REFINE CODES
-	if (verbose) printf("refining code values\n");
-    //int radius = 3;
-    int radius = 7;// try larger radius since higher resolution
-    refineCodes(fval,  fval1, radius, maxgrad0, angle);
-    refineCodes(fval1, fval2, radius, maxgrad1, M_PI/2.0 - angle); // also refine in perpendicular direction
+	if (verbose) logPrintf(log_verbose, "refining code values\n");
+    int radius = params.refineRadius;
+    {
+    StageScope scope("refine: refine codes");
+    refineCodes(fval,  fval1, radius, params.maxgrad0, angle, params, progress);
+    refineCodes(fval1, fval2, radius, params.maxgrad1, M_PI/2.0 - angle, params, progress); // also refine in perpendicular direction
+    }
 
 
-    if (1) { // save refined image
-	sprintf(filename, "%s/result%s%c-3refined1.pfm", outdir, posID, uv);
+    if (save & REFINE_SAVE_INTERMEDIATE) { // save refined image
+	sprintf(filename, "%s/result%s%c-3refined1%s", outdir, posID, uv, params.mapExt.c_str());
 	WriteImageVerb(fval1, filename, verbose);
-	sprintf(filename, "%s/result%s%c-4refined2.pfm", outdir, posID, uv);
+    }
+    if (save & REFINE_SAVE_FINAL) {
+	sprintf(filename, "%s/result%s%c-4refined2%s", outdir, posID, uv, params.mapExt.c_str());
 	WriteImageVerb(fval2, filename, verbose);
     }
 	
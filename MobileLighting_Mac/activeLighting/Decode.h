@@ -9,6 +9,13 @@
 #ifndef Decode_h
 #define Decode_h
 
-CFloatImage refine(char *outdir, int direction, char* decodedIm, double angle, char *posID);
+#include "Params.h"
+
+CFloatImage refine(char *outdir, int direction, char* decodedIm, double angle, char *posID,
+                   const ProcessingParams &params = currentParams());
+#define REFINE_SAVE_INTERMEDIATE 1
+#define REFINE_SAVE_FINAL 2
+CFloatImage refineCodeImage(char *outdir, int direction, CFloatImage fval, double angle, char *posID, int save,
+                            const ProcessingParams &params = currentParams());
 
 #endif /* Decode_h */
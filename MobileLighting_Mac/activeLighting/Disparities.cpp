@@ -23,6 +23,11 @@
 #include "imageLib.h"
 #include "Utils.h"
 #include "flowIO.h"
+#include "Disparities.h"
+#include "Session.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "Progress.h"
 #include "assert.h"
 
 
@@ -284,8 +289,8 @@ void printstats(CIntImage rmin, CIntImage rmax)
         }
     }
     float f = 100.0 / (ncodes * ncodes);
-    printf("avg range x = %.2f, max = %d (%.1f%% of code pairs)\n", (float)sumx / nx, maxx, f * nx);
-    printf("avg range y = %.2f, max = %d (%.1f%% of code pairs)\n", (float)sumy / ny, maxy, f * ny);
+    logPrintf(log_verbose, "avg range x = %.2f, max = %d (%.1f%% of code pairs)\n", (float)sumx / nx, maxx, f * nx);
+    logPrintf(log_verbose, "avg range y = %.2f, max = %d (%.1f%% of code pairs)\n", (float)sumy / ny, maxy, f * ny);
 }
 
 // store location range of each rounded code value in rmin, rmax to speed up search
@@ -304,7 +309,7 @@ void initRange(CFloatImage code, int ncodes, CIntImage& rmin, CIntImage& rmax)
     rmin0.FillPixels(w+h); // large value
     rmax0.FillPixels(-1);  // small value
     
-    printf("precomputing ranges\n");
+    logPrintf(log_verbose, "precomputing ranges\n");
     
     // determine initial ranges rmin0, rmax0
     for(int y = 0; y < h; y++){
@@ -324,7 +329,7 @@ void initRange(CFloatImage code, int ncodes, CIntImage& rmin, CIntImage& rmax)
     printstats(rmin0, rmax0);
     
     int neigh = 8; // 1, 4, or 8
-    printf("blurring with %d neighbors\n", neigh);
+    logPrintf(log_verbose, "blurring with %d neighbors\n", neigh);
     
     // "blur" ranges to include 1, 4, or 8 neighbors into rmin, rmax
     for(int y = 0; y < ncodes; y++){
@@ -366,31 +371,31 @@ void initRange(CFloatImage code, int ncodes, CIntImage& rmin, CIntImage& rmax)
 // preprocesses code map to find search range for each code value
 // find matches between code images fim0 and fim1, store in flow image dim
 // if search range is now known, pass in dmin = dmax = 0
-void matchImages(CFloatImage fim0, CFloatImage fim1, CFloatImage dim, int dmin, int dmax, int ymin, int ymax)
+void matchImages(CFloatImage fim0, CFloatImage fim1, CFloatImage dim, int dmin, int dmax, int ymin, int ymax, const ProcessingParams &params)
 {
     CShape sh = fim0.Shape();
     int w = sh.width, h = sh.height;
     
     // maximal allowable code difference:
-    float maxdiff = 0.5;
+    float maxdiff = params.matchMaxDiff;
     float maxdiffsq = maxdiff * maxdiff;
     
-    int ncodes = 1024;
+    int ncodes = params.ncodes;
     CIntImage rmin, rmax;
     initRange(fim1, ncodes, rmin, rmax);
     
     int userange = (dmin < dmax);
     if (userange) // further restrict to given search range
-        printf("restricting to given ranges %d..%d, %d..%d\n", dmin, dmax, ymin, ymax);
+        logPrintf(log_verbose, "restricting to given ranges %d..%d, %d..%d\n", dmin, dmax, ymin, ymax);
     else
-        printf("ignoring given ranges\n");
+        logPrintf(log_verbose, "ignoring given ranges\n");
     
     int good = 0;
     int unique = 0;
     
+    ProgressScope progress("match", h);
     for(int y0 = 0; y0 < h; y0++){
-        if (y0 % 100 == 0) printf(".");
-        fflush(stdout);
+        progress.add();
         
         for(int x0 = 0; x0 < w; x0++){
             //        std::cout << "" << std::endl;
@@ -425,13 +430,13 @@ void matchImages(CFloatImage fim0, CFloatImage fim1, CFloatImage dim, int dmin,
             
             for(int y1 = rymin; y1 <= rymax; y1++){
                 if (y1 < 0 || y1 >= h) {
-                    printf("y = %d shouldn't happen\n", y1);
+                    logPrintf(log_warning, "y = %d shouldn't happen\n", y1);
                     continue;
                 }
                 
                 for(int x1 = rxmin; x1 <= rxmax; x1++){
                     if (x1 < 0 || x1 >= w) {
-                        printf("x shouldn't happen\n");
+                        logPrintf(log_warning, "x shouldn't happen\n");
                         continue;
                     }
                     
@@ -487,11 +492,11 @@ void matchImages(CFloatImage fim0, CFloatImage fim1, CFloatImage dim, int dmin,
                     dim.Pixel(x0, y0, 1) = besty + cory;
                     
                     if (isnan(dim.Pixel(x0, y0, 0)))
-                        printf("error: dx(%d, %d) = %f\n", x0, y0, dim.Pixel(x0, y0, 0));
+                        logPrintf(log_error, "error: dx(%d, %d) = %f\n", x0, y0, dim.Pixel(x0, y0, 0));
                     if (isnan(dim.Pixel(x0, y0, 1))) {
-                        printf("error: dy(%d, %d) = %f\n", x0, y0, dim.Pixel(x0, y0, 1));
-                        printf("valy=%f besty=%d cory=%f\n", valy, besty, cory);
-                        printf("%f %f %f\n", fim1.Pixel(x1, y1m, 1), fim1.Pixel(x1, y1, 1), fim1.Pixel(x1, y1p, 1));
+                        logPrintf(log_error, "error: dy(%d, %d) = %f\n", x0, y0, dim.Pixel(x0, y0, 1));
+                        logPrintf(log_error, "valy=%f besty=%d cory=%f\n", valy, besty, cory);
+                        logPrintf(log_error, "%f %f %f\n", fim1.Pixel(x1, y1m, 1), fim1.Pixel(x1, y1, 1), fim1.Pixel(x1, y1p, 1));
                     }
                 } else { // more than one equally good code, don't interpolate, just use average
                     float scale = 1.0 / bestcnt;
@@ -502,14 +507,18 @@ void matchImages(CFloatImage fim0, CFloatImage fim1, CFloatImage dim, int dmin,
         }
     }
     
-    printf("found %d matches, %d unique (maxdiff=%.2f)\n", good, unique, maxdiff);
+    logPrintf(log_verbose, "found %d matches, %d unique (maxdiff=%.2f)\n", good, unique, maxdiff);
+    instrumentCount("pixels processed", (long long)w * h);
+    instrumentCount("matches", good);
+    instrumentCount("unique matches", unique);
 }
 
 
 
 // compute pair of disparity maps from code images
 // edited 06/06/2018 by Nicholas Mosier to eliminate saving .flo files
-void computeDisparities(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &fout0, CFloatImage &fout1, int dXmin, int dXmax, int dYmin, int dYmax)
+void computeDisparities(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &fout0, CFloatImage &fout1, int dXmin, int dXmax, int dYmin, int dYmax,
+                        const ProcessingParams &params)
 {
     if (fim0.Shape() != fim1.Shape())
         throw CError("computeDisparities: all images need to have same size");
@@ -517,9 +526,9 @@ void computeDisparities(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &fout0
     fout0.ReAllocate(fim0.Shape());
     fout1.ReAllocate(fim0.Shape());
     
-    matchImages(fim0, fim1, fout0, -dXmax, -dXmin, -dYmax, -dYmin);
+    matchImages(fim0, fim1, fout0, -dXmax, -dXmin, -dYmax, -dYmin, params);
     
-    matchImages(fim1, fim0, fout1, dXmin, dXmax, dYmin, dYmax);
+    matchImages(fim1, fim0, fout1, dXmin, dXmax, dYmin, dYmax, params);
 }
 
 
@@ -530,7 +539,7 @@ void computeDisparities(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &fout0
 //void runCrossCheck(char *in0, char *in1, char *out0, char *out1, float thresh, int xonly, int halfocc)
 pair<CFloatImage,CFloatImage> runCrossCheck(CFloatImage d0, CFloatImage d1, float thresh, int xonly, int halfocc)
 {
-    int verbose=1;
+    int verbose = logEnabled(log_verbose);
     
     //    CFloatImage d0, d1;
     
@@ -541,8 +550,10 @@ pair<CFloatImage,CFloatImage> runCrossCheck(CFloatImage d0, CFloatImage d1, floa
         throw CError("runCrossCheck: all images need to have same size");
     
     if (verbose)
-        printf("cross-checking with thresh=%g, xonly=%d, halfocc=%d\n", thresh, xonly, halfocc);
+        logPrintf(log_verbose, "cross-checking with thresh=%g, xonly=%d, halfocc=%d\n", thresh, xonly, halfocc);
     
+    StageScope scope("crosscheck: compare");
+    instrumentCount("pixels processed", 2LL * d0.Shape().width * d0.Shape().height);
     CFloatImage crossed0 = floatCrossCheck(d0, d1, thresh, xonly, -halfocc);
     CFloatImage crossed1 = floatCrossCheck(d1, d0, thresh, xonly,  halfocc);
     
@@ -594,7 +605,7 @@ void fillDispHoles(CFloatImage img, int band, vector<struct ccomp> comp, CIntIma
         int dy = cc.y2 - cc.y1;
         if (dx <= maxsize && dy <= maxsize && cc.n <= maxpixels) {
             if (debug)
-                printf("k=%3d, n=%3d, x=%4d..%4d, y=%4d..%4d  ", k, cc.n, cc.x1, cc.x2, cc.y1, cc.y2);
+                logPrintf(log_debug, "k=%3d, n=%3d, x=%4d..%4d, y=%4d..%4d  ", k, cc.n, cc.x1, cc.x2, cc.y1, cc.y2);
             int borderx = max(3, 6-dx); // pixels to include around each hole
             int bordery = max(3, 6-dy); // pixels to include around each hole
             int x1 = max(cc.x1 - borderx, 0);
@@ -615,7 +626,7 @@ void fillDispHoles(CFloatImage img, int band, vector<struct ccomp> comp, CIntIma
             float pa=0, pb=0, pc=0;
             fitPlane(vx, vy, vz, pa, pb, pc);
             if (debug)
-                printf("a=%5.2f b=%5.2f c=%6.1f  ", pa, pb, pc);
+                logPrintf(log_debug, "a=%5.2f b=%5.2f c=%6.1f  ", pa, pb, pc);
             
             // compute residual
             vector<float> res;
@@ -640,7 +651,7 @@ void fillDispHoles(CFloatImage img, int band, vector<struct ccomp> comp, CIntIma
             int minpts = 10; // require at least this many border pixels
             int fillhole = (np >= minpts && q75 <= q75thresh && q90 <= q90thresh);
             if (debug)
-                printf("np=%3d, q75=%5.2f, q90=%5.2f, filling: %s\n", np, q75, q90, fillhole ? "YES" : "NO");
+                logPrintf(log_debug, "np=%3d, q75=%5.2f, q90=%5.2f, filling: %s\n", np, q75, q90, fillhole ? "YES" : "NO");
             if (fillhole) {
                 n++;
                 for (int y=y1; y<=y2; y++) {
@@ -662,7 +673,8 @@ void fillDispHoles(CFloatImage img, int band, vector<struct ccomp> comp, CIntIma
             }
         }
     }
-    printf("%d / %d holes filled\n", n, (int)comp.size()-1);
+    logPrintf(log_verbose, "%d / %d holes filled\n", n, (int)comp.size()-1);
+    instrumentCount("holes filled", n);
 }
 
 void removeSmallComponents(CFloatImage img, int band, vector<struct ccomp> comp, CIntImage compimg, int mincompsize)
@@ -682,7 +694,8 @@ void removeSmallComponents(CFloatImage img, int band, vector<struct ccomp> comp,
         if (comp[k].n < mincompsize)
             n++;
     }
-    printf("%d / %d components removed\n", n, (int)comp.size()-1);
+    logPrintf(log_verbose, "%d / %d components removed\n", n, (int)comp.size()-1);
+    instrumentCount("components removed", n);
 }
 
 
@@ -692,9 +705,9 @@ void removeSmallComponents(CFloatImage img, int band, vector<struct ccomp> comp,
 // 3. remove small x-disparity components with size < mincompsize
 // 3. fill x-disp holes with size <= maxholesize where surrounding disps fit plane model
 //void runFilter(char *srcfile, char *dstfile, float ythresh, int kx, int ky, int mincompsize, int maxholesize)
-CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincompsize, int maxholesize, char *debugdir = NULL)
+CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincompsize, int maxholesize, char *debugdir)
 {
-    int verbose=1;
+    int verbose = logEnabled(log_verbose);
     
 //    CFloatImage mergeToNBandImage(vector<CFloatImage*> imgs)
 //    vector<CFloatImage> splitNBandImage(CFloatImage &merged)
@@ -712,7 +725,7 @@ CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincom
     }
     
     if (ythresh >= 0) {
-        if (verbose) fprintf(stderr, "invalidating pixels with |ydisp| > %g\n", ythresh);
+        if (verbose) logPrintf(log_verbose, "invalidating pixels with |ydisp| > %g\n", ythresh);
         removeLargeYdisps(img, ythresh);
         if (debugimgs) {
             sprintf(debugbuffer, "%s/im1_ythresh.pfm", debugdir);
@@ -725,7 +738,7 @@ CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincom
     imgy = img_split[1];
 
     if (kx > 1) {
-        if (verbose) fprintf(stderr, "running %dx%d median filter in x\n", kx, kx);
+        if (verbose) logPrintf(log_verbose, "running %dx%d median filter in x\n", kx, kx);
         medianfilter(imgx, img2, kx, 0);
 //        img = img2;
         imgx = img2;
@@ -737,7 +750,7 @@ CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincom
 
     img2.DeAllocate();
     if (ky > 1) {
-        if (verbose) fprintf(stderr, "running %dx%d median filter in y\n", ky, ky);
+        if (verbose) logPrintf(log_verbose, "running %dx%d median filter in y\n", ky, ky);
         medianfilter(imgy, img2, ky, 0);
         imgy = img2;
     }
@@ -750,7 +763,7 @@ CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincom
     
     if (mincompsize > 0) {
         float thresh = 2.0; // allowable difference to be considered same component (i.e. disparity gradient)
-        if (verbose) fprintf(stderr, "removing dispcomps smaller than %d (thresh=%g)\n", mincompsize, thresh);
+        if (verbose) logPrintf(log_verbose, "removing dispcomps smaller than %d (thresh=%g)\n", mincompsize, thresh);
         CIntImage compimg;
         vector<struct ccomp> comp = computeDispComponents(img, 0, compimg, thresh);
         removeSmallComponents(img, 0, comp, compimg, mincompsize);
@@ -763,7 +776,7 @@ CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincom
     
     if (maxholesize > 0) {
         if (verbose)
-            fprintf(stderr, "filling holes up to %d pixels\n", maxholesize);
+            logPrintf(log_verbose, "filling holes up to %d pixels\n", maxholesize);
         CIntImage compimg;
         vector<struct ccomp> comp = computeUnkComponents(img, 0, compimg);
         
@@ -797,11 +810,9 @@ CFloatImage mergeDisparityMaps(CFloatImage images[], int count, int mingroup, fl
     CShape sh = images[0].Shape();
     out.ReAllocate(sh);
     
+    ProgressScope progress("merge", sh.height);
     for(int j =0; j < sh.height; j++){
-        if(j % 100 == 0){
-            printf(".");
-            fflush(stdout);
-        }
+        progress.add();
         
         float* row[count];
         for(int k =0; k < count; k++){
@@ -861,12 +872,12 @@ CFloatImage mergeDisparityMaps(CFloatImage images[], int count, int mingroup, fl
                     }else{
                         outrow[x] = robustAverage(pixels, maxdiff, mingroup); // call robust avg (in Utils.cpp)
                         if ((0)){
-                            printf("values were: ");
+                            logPrintf(log_debug, "values were: ");
                             for(int i = 0; i < (int)pixels.size(); i++){
-                                printf(" %.2f",pixels[i]);
+                                logPrintf(log_debug, " %.2f",pixels[i]);
                             }
-                            printf("\n");
-                            printf("average was: %f\n\n",outrow[x]);
+                            logPrintf(log_debug, "\n");
+                            logPrintf(log_debug, "average was: %f\n\n",outrow[x]);
                         }
                     }
                     break; // and break k loop
@@ -875,115 +886,408 @@ CFloatImage mergeDisparityMaps(CFloatImage images[], int count, int mingroup, fl
         }
         
     }
-    printf("\n");
     return out;
 }
 
 
-// final merge, ignores y channel of .flo images
+// merge state for the final merge: per-pixel accumulators that allow folding in
+// additional illumination disparities later without re-reading all previous maps.
+// stored as a 7-band float image (saved as .pmf) with the following bands:
+enum {
+    MS_REF = 0,             // reference disparity md (UNK if no sample seen yet)
+    MS_N,                   // number of samples N within maxdiff of md
+    MS_SUMD,                // sum of those disparities
+    MS_SUMR,                // sum of their residuals d - md
+    MS_SUMRR = MS_SUMR + 2, // sum of their squared residuals
+    MS_NBANDS = MS_SUMRR + 2
+};
+// the residual sums are doubles like in the one-pass merge, each kept bit for bit in two float
+// bands, so the merged results don't depend on whether the state was saved in between
+
+static inline double getStateSum(const float *ms, int band)
+{
+    double sum;
+    memcpy(&sum, ms + band, sizeof(sum));
+    return sum;
+}
+
+static inline void setStateSum(float *ms, int band, double sum)
+{
+    memcpy(ms + band, &sum, sizeof(sum));
+}
+
+// fold the k values vals[0..k-1] into the accumulators of one pixel of the merge state
+// values that are further than maxdiff from the reference value md are ignored
+static void accumulateMergeState(float *ms, float *vals, int k, float maxdiff)
+{
+    float md = ms[MS_REF];
+
+    // for numerical stability, compute SD of residuals w.r.t. md
+    float s = ms[MS_SUMD];
+    double sr = getStateSum(ms, MS_SUMR);
+    double srr = getStateSum(ms, MS_SUMRR);
+    int n = (int)ms[MS_N];
+    for (int i = 0; i < k; i++) {
+        float d = vals[i];
+        double r = d - md;
+        if (fabs(r) > maxdiff)
+            continue;
+        s += d;
+        sr += r;
+        srr += r * r;
+        n++;
+    }
+    ms[MS_N] = n;
+    ms[MS_SUMD] = s;
+    setStateSum(ms, MS_SUMR, sr);
+    setStateSum(ms, MS_SUMRR, srr);
+}
+
+// compute merge state from scratch
 // input:
-//  maxdiff -- threshold for robust average
 //  mdisp   -- high-confidence merged view disparities from previous stage
 //  vdisps  -- nV individual view disparities
 //  rdisps  -- nR individual illumination disps
-// outputs:
-//  outd  -- merged disparities
-//  outsd -- std dev of merged disparities (i.e. RMS error)
-//  outn  -- number of samples N
-//
-// edited 07/2018 by Nicholas Mosier to eliminate flo files & replace with 1-band PFMs
-extern "C" void mergeDisparityMaps2(float maxdiff, int nV, int nR, char* outdfile, char* outsdfile, char* outnfile, char *inmdfile, char **invdfiles, char **inrdfiles)
+//  maxdiff -- threshold for robust average
+CFloatImage initMergeState(CFloatImage mdisp, CFloatImage vdisps[], int nV, CFloatImage rdisps[], int nR, float maxdiff)
 {
-    int verbose = 1;
-    CFloatImage mdisp;
-    CFloatImage vdisps[nV];
-    CFloatImage rdisps[nR];
-    
-    ReadImageVerb(mdisp, inmdfile, verbose);
     CShape sh = mdisp.Shape();
-    for (int i = 0; i < nV; i++)
-        ReadImageVerb(vdisps[i], invdfiles[i], verbose);
-    for (int i = 0; i < nR; i++)
-        ReadImageVerb(rdisps[i], inrdfiles[i], verbose);
-    
-    CFloatImage outd(sh); // merged disparities
-//    sh.nBands = 1;
-    CFloatImage outsd(sh); // stddev of disps
-    CByteImage outn(sh);  // samples N used per pixel
-    
+    sh.nBands = MS_NBANDS;
+    CFloatImage state(sh);
+    state.ClearPixels();
+
     float vals[nV + nR];
-    
+
+    ProgressScope progress("merge2", sh.height);
     for (int y = 0; y < sh.height; y++) {
-        if (y % 100 == 0) {
-            printf(".");
-            fflush(stdout);
-        }
-        
+        progress.add();
+
         for (int x = 0; x < sh.width; x++) {
             int i;
-            
+
             int k = 0;
-            
+
             for (i = 0; i < nV; i++) {
                 float vd = vdisps[i].Pixel(x, y, 0);
                 if (vd != UNK)
                     vals[k++] = vd;
             }
             int kv = k;
-            
+
             for (i = 0; i < nR; i++) {
                 float rd = rdisps[i].Pixel(x, y, 0);
                 if (rd != UNK)
                     vals[k++] = rd;
             }
-            
-            // initialize output images to default (UNK) values
-            outn.Pixel(x, y, 0) = 0;
-            outd.Pixel(x, y, 0) = UNK;
-//            outd.Pixel(x, y, 1) = UNK;
-            outsd.Pixel(x, y, 0) = UNK;
-            
+
+            float *ms = &state.Pixel(x, y, 0);
+
             float md = mdisp.Pixel(x, y, 0); // see if have reference value from merge1 step
-            
+
             if (md == UNK && kv > 0) // if not, try using median of viewdisps
                 md = median2(vals, kv);
-            
+
             if (md == UNK && k > 0) // if still no value, use median of all values
                 md = median2(vals, k);
-            
+
+            ms[MS_REF] = md;
             if (md == UNK)
                 continue;
-            
+
             // now, collect statistics of vals that are within maxdist of reference value
-            // for numerical stability, compute SD of residuals w.r.t. md
-            float s = 0;
-            double sr = 0;
-            double srr = 0;
-            int n = 0;
-            for (i = 0; i < k; i++) {
-                float d = vals[i];
-                double r = d - md;
-                if (fabs(r) > maxdiff)
-                    continue;
-                s += d;
-                sr += r;
-                srr += r * r;
-                n++;
+            accumulateMergeState(ms, vals, k, maxdiff);
+        }
+    }
+    return state;
+}
+
+// fold nR additional illumination disparities into existing merge state
+// pixels without reference value use the median of the new values as reference.
+// note that the reference value of a pixel is fixed once set; this is exact if it came
+// from the merge1 step or the view disparities, but if a pixel only had illumination
+// disps before, mergeDisparityMaps2 would recompute their median over all values
+void updateMergeState(CFloatImage state, CFloatImage rdisps[], int nR, float maxdiff)
+{
+    CShape sh = state.Shape();
+    if (sh.nBands != MS_NBANDS)
+        throw CError("updateMergeState: merge state needs %d bands", MS_NBANDS);
+    for (int i = 0; i < nR; i++) {
+        if (! rdisps[i].Shape().SameIgnoringNBands(sh))
+            throw CError("updateMergeState: all images need to have same size");
+    }
+
+    float vals[nR];
+
+    ProgressScope progress("merge2", sh.height);
+    for (int y = 0; y < sh.height; y++) {
+        progress.add();
+
+        for (int x = 0; x < sh.width; x++) {
+            int k = 0;
+            for (int i = 0; i < nR; i++) {
+                float rd = rdisps[i].Pixel(x, y, 0);
+                if (rd != UNK)
+                    vals[k++] = rd;
             }
-            if (n < 1)
+            if (k == 0)
                 continue;
-            outn.Pixel(x, y, 0) = n;
-            outd.Pixel(x, y, 0) = s / n;
-            outsd.Pixel(x, y, 0) = (n > 1 ? sqrt((srr - sr*sr/n) / (n - 1.0)) : UNK);
+
+            float *ms = &state.Pixel(x, y, 0);
+            if (ms[MS_REF] == UNK) // no samples so far, so median of new values is median of all values
+                ms[MS_REF] = median2(vals, k);
+
+            accumulateMergeState(ms, vals, k, maxdiff);
         }
     }
-    printf("\n");
-//    WriteFlowFileVerb(outd, outdfile, verbose);
-    WriteImageVerb(outd, outdfile, verbose);
-    WriteImageVerb(outsd, outsdfile, verbose);
-    WriteImageVerb(outn, outnfile, verbose);
 }
 
+// derive merged disparities, their std dev, and number of samples from merge state in one pass
+void finalizeMergeState(CFloatImage state, CFloatImage &outd, CFloatImage &outsd, CByteImage &outn)
+{
+    CShape sh = state.Shape();
+    if (sh.nBands != MS_NBANDS)
+        throw CError("finalizeMergeState: merge state needs %d bands", MS_NBANDS);
+    sh.nBands = 1;
+    outd.ReAllocate(sh);  // merged disparities
+    outsd.ReAllocate(sh); // stddev of disps
+    outn.ReAllocate(sh);  // samples N used per pixel
+
+    for (int y = 0; y < sh.height; y++) {
+        float *ms = &state.Pixel(0, y, 0);
+        float *d = &outd.Pixel(0, y, 0);
+        float *sd = &outsd.Pixel(0, y, 0);
+        uchar *nn = &outn.Pixel(0, y, 0);
+
+        for (int x = 0; x < sh.width; x++, ms += MS_NBANDS) {
+            int n = (int)ms[MS_N];
+            if (ms[MS_REF] == UNK || n < 1) {
+                nn[x] = 0;
+                d[x] = UNK;
+                sd[x] = UNK;
+                continue;
+            }
+            double sr = getStateSum(ms, MS_SUMR);
+            double srr = getStateSum(ms, MS_SUMRR);
+            nn[x] = min(n, 255);
+            d[x] = ms[MS_SUMD] / n;
+            sd[x] = (n > 1 ? sqrt(max(0.0, srr - sr*sr/n) / (n - 1.0)) : UNK);
+        }
+    }
+}
+
+// final merge, ignores y channel of .flo images
+// input:
+//  maxdiff -- threshold for robust average
+//  mdisp   -- high-confidence merged view disparities from previous stage
+//  vdisps  -- nV individual view disparities
+//  rdisps  -- nR individual illumination disps
+// outputs:
+//  outd  -- merged disparities
+//  outsd -- std dev of merged disparities (i.e. RMS error)
+//  outn  -- number of samples N
+//
+// edited 07/2018 by Nicholas Mosier to eliminate flo files & replace with 1-band PFMs
+// now computed via initMergeState / finalizeMergeState
+extern "C" void mergeDisparityMaps2(float maxdiff, int nV, int nR, char* outdfile, char* outsdfile, char* outnfile, char *inmdfile, char **invdfiles, char **inrdfiles)
+try {
+    StageScope scope("merge2");
+    CFloatImage mdisp;
+    CFloatImage vdisps[nV];
+    CFloatImage rdisps[nR];
+    
+    pipelineRead(mdisp, inmdfile);
+    for (int i = 0; i < nV; i++)
+        pipelineRead(vdisps[i], invdfiles[i]);
+    for (int i = 0; i < nR; i++)
+        pipelineRead(rdisps[i], inrdfiles[i]);
+    
+    CFloatImage state = initMergeState(mdisp, vdisps, nV, rdisps, nR, maxdiff);
+    
+    CFloatImage outd, outsd;
+    CByteImage outn;
+    finalizeMergeState(state, outd, outsd, outn);
+    
+    pipelineWrite(outd, outdfile, "merge2");
+    pipelineWrite(outsd, outsdfile, "merge2");
+    pipelineWrite(outn, outnfile, "merge2");
+} catch (CCancelled &) {
+}
+
+// incremental final merge, split into three steps that communicate via a merge state file (.pmf)
+// mergeDisparityMaps2Init followed by mergeDisparityMaps2Finalize gives the same results as
+// mergeDisparityMaps2.  further reprojected disparities can be folded in with
+// mergeDisparityMaps2Update without re-reading the maps that were merged before; this matches
+// merging all maps at once up to the order of summation, except for pixels whose reference value
+// was the median of illumination disparities only (see updateMergeState)
+
+// compute merge state from merge1 disps, nV view disps, and nR illumination disps
+// returns 0 if processing was cancelled, the state file is not written then
+extern "C" int mergeDisparityMaps2Init(float maxdiff, int nV, int nR, char *statefile, char *inmdfile, char **invdfiles, char **inrdfiles)
+try {
+    StageScope scope("merge2 init");
+    checkCancel();
+    CFloatImage mdisp;
+    CFloatImage vdisps[nV];
+    CFloatImage rdisps[nR];
+    
+    pipelineRead(mdisp, inmdfile);
+    for (int i = 0; i < nV; i++)
+        pipelineRead(vdisps[i], invdfiles[i]);
+    for (int i = 0; i < nR; i++)
+        pipelineRead(rdisps[i], inrdfiles[i]);
+    
+    CFloatImage state = initMergeState(mdisp, vdisps, nV, rdisps, nR, maxdiff);
+    checkCancel();
+    pipelineWrite(state, statefile, "merge2");
+    return 1;
+} catch (CCancelled &) {
+    return 0;
+}
+
+// fold nR additional illumination disps into merge state file (updated in place)
+// returns 0 if processing was cancelled, the state file is left unchanged then
+extern "C" int mergeDisparityMaps2Update(float maxdiff, int nR, char *statefile, char **inrdfiles)
+try {
+    StageScope scope("merge2 update");
+    checkCancel();
+    CFloatImage state;
+    CFloatImage rdisps[nR];
+    
+    pipelineRead(state, statefile);
+    for (int i = 0; i < nR; i++)
+        pipelineRead(rdisps[i], inrdfiles[i]);
+    
+    updateMergeState(state, rdisps, nR, maxdiff);
+    checkCancel();
+    pipelineWrite(state, statefile, "merge2");
+    return 1;
+} catch (CCancelled &) {
+    return 0;
+}
+
+// write merged disps, std dev, and number of samples from merge state file
+extern "C" void mergeDisparityMaps2Finalize(char *statefile, char* outdfile, char* outsdfile, char* outnfile)
+try {
+    StageScope scope("merge2 finalize");
+    checkCancel();
+    CFloatImage state;
+    pipelineRead(state, statefile);
+    
+    CFloatImage outd, outsd;
+    CByteImage outn;
+    finalizeMergeState(state, outd, outsd, outn);
+    
+    pipelineWrite(outd, outdfile, "merge2");
+    pipelineWrite(outsd, outsdfile, "merge2");
+    pipelineWrite(outn, outnfile, "merge2");
+} catch (CCancelled &) {
+}
+
+
+// final post-processing of merged disparities, replaces running maskdisps, clipdisps, and
+// small-component removal one after another on files
+// inputs/outputs:
+//   imd  -- final merged and filtered disparities (all bands are updated)
+//   imsd -- std dev of merged disparities (i.e. RMS error), may be unallocated
+//   imn  -- number of samples N, may be unallocated
+// inputs:
+//   mask        -- where mask==0 set imd to UNK; ignored if unallocated
+//   dmin, dmax  -- range of valid disparities; use -UNK, UNK to disable clipping
+//   mincompsize -- remove disparity components smaller than this (if > 0)
+//   compthresh  -- allowable disparity difference within a component
+// update sd and n (as in clipdisps):
+//   if d == UNK, set n to 0 and sd to UNK
+//   if d != UNK but n == 0, set n to 1 and sd to UNK (which it should be already)
+// makes one pass for masking and clipping, then one pass for component removal and
+// the sd/n update in addition to the two passes needed for computing the components
+// returns the same statistics that maskdisps, clipdisps, and removeSmallComponents print
+finalstats finalFilterDisps(CFloatImage imd, CFloatImage imsd, CByteImage imn, CByteImage mask,
+                            float dmin, float dmax, int mincompsize, float compthresh)
+{
+    int verbose = logEnabled(log_verbose);
+    CShape sh = imd.Shape();
+    int w = sh.width, h = sh.height, nB = sh.nBands;
+    int usemask = mask.Shape().width > 0;
+    int usesd = imsd.Shape().width > 0;
+    int usen = imn.Shape().width > 0;
+    
+    if (usemask && ! mask.Shape().SameIgnoringNBands(sh))
+        throw CError("finalFilterDisps: mask needs to have same size as disparities");
+    if ((usesd && ! imsd.Shape().SameIgnoringNBands(sh)) || (usen && ! imn.Shape().SameIgnoringNBands(sh)))
+        throw CError("finalFilterDisps: sd and n images need to have same size as disparities");
+    
+    finalstats st = {0, 0, 0, 0, 0, 0};
+    
+    // pass 1: masking and clipping
+    for (int y = 0; y < h; y++) {
+        float *d = &imd.Pixel(0, y, 0);
+        uchar *m = usemask ? &mask.Pixel(0, y, 0) : NULL;
+        for (int x = 0; x < w; x++, d += nB) {
+            if (d[0] == UNK)
+                continue;
+            st.nvalid++;
+            if (m != NULL && m[x] == 0) {
+                st.nmasked++;
+            } else {
+                st.nvalidmasked++;
+                if (d[0] >= dmin && d[0] <= dmax)
+                    continue;
+                st.nclipped++;
+            }
+            for (int b = 0; b < nB; b++)
+                d[b] = UNK;
+        }
+    }
+    if (verbose && usemask)
+        logPrintf(log_verbose, "%d pixels (%6.3f%% of valid disparities) masked\n", st.nmasked, 100.0 * st.nmasked / st.nvalid);
+    if (verbose && (dmin != -UNK || dmax != UNK))
+        logPrintf(log_verbose, "%d pixels (%6.3f%% of valid disparities) clipped\n", st.nclipped, 100.0 * st.nclipped / st.nvalidmasked);
+    
+    CIntImage compimg;
+    vector<struct ccomp> comp;
+    if (mincompsize > 0) {
+        if (verbose) logPrintf(log_verbose, "removing dispcomps smaller than %d (thresh=%g)\n", mincompsize, compthresh);
+        comp = computeDispComponents(imd, 0, compimg, compthresh);
+        st.ncomps = (int)comp.size() - 1;
+        for (int k = 1; k < (int)comp.size(); k++) {
+            if (comp[k].n < mincompsize)
+                st.ncompsremoved++;
+        }
+    }
+    
+    // pass 2: component removal and update of sd and n
+    for (int y = 0; y < h; y++) {
+        float *d = &imd.Pixel(0, y, 0);
+        float *sd = usesd ? &imsd.Pixel(0, y, 0) : NULL;
+        uchar *n = usen ? &imn.Pixel(0, y, 0) : NULL;
+        int *c = (mincompsize > 0) ? &compimg.Pixel(0, y, 0) : NULL;
+        for (int x = 0; x < w; x++, d += nB) {
+            if (c != NULL && c[x] > 0 && comp[c[x]].n < mincompsize) {
+                for (int b = 0; b < nB; b++)
+                    d[b] = UNK;
+            }
+            if (sd == NULL && n == NULL)
+                continue;
+            if (d[0] == UNK) { // like clipdisps, also make other bands consistent
+                for (int b = 1; b < nB; b++)
+                    d[b] = UNK;
+                if (n) n[x] = 0;
+                if (sd) sd[x] = UNK;
+            } else if (n && n[x] == 0) {
+                n[x] = 1;
+                if (sd) sd[x] = UNK;
+            }
+        }
+    }
+    if (mincompsize > 0)
+        logPrintf(log_verbose, "%d / %d components removed\n", st.ncompsremoved, st.ncomps);
+    instrumentCount("pixels processed", (long long)w * h);
+    instrumentCount("pixels masked", st.nmasked);
+    instrumentCount("pixels clipped", st.nclipped);
+    instrumentCount("components removed", st.ncompsremoved);
+    
+    return st;
+}
 
 // clipping to given disparity range and update of stddev and N files after filtering
 // inputs/outputs:
@@ -999,42 +1303,14 @@ extern "C" void mergeDisparityMaps2(float maxdiff, int nV, int nR, char* outdfil
 //   if d != UNK but n == 0, set n to 1 and sd to UNK (which it should be already)
 void clipdisps(char* indfile, char* insdfile, char* innfile, char* outdfile, char* outsdfile, char* outnfile, float dmin, float dmax)
 {
-    int verbose = 1;
+    int verbose = logEnabled(log_verbose);
     CFloatImage imd, imsd;
-    CByteImage imn;
+    CByteImage imn, nomask;
     ReadFlowFileVerb(imd, indfile, verbose);
     ReadImageVerb(imsd, insdfile, verbose);
     ReadImageVerb(imn, innfile, verbose);
     
-    CShape sh = imd.Shape();
-    
-    int c = 0;
-    int n = 0;
-    for (int y = 0; y < sh.height; y++) {
-        for (int x = 0; x < sh.width; x++) {
-            float d = imd.Pixel(x, y, 0);
-            if (d != UNK) {
-                n++;
-                if (d < dmin || d > dmax) {
-                    d = UNK;
-                    c++;
-                }
-            }
-            if (d == UNK) {
-                imd.Pixel(x, y, 0) = UNK;
-                imd.Pixel(x, y, 1) = UNK;
-                imn.Pixel(x, y, 0) = 0;
-                imsd.Pixel(x, y, 0) = UNK;
-            } else {
-                if (imn.Pixel(x, y, 0) == 0) {
-                    imn.Pixel(x, y, 0) = 1;
-                    imsd.Pixel(x, y, 0) = UNK;
-                }
-            }
-        }
-    }
-    if (verbose)
-        fprintf(stderr, "%d pixels (%6.3f%% of valid disparities) clipped\n", c, 100.0 * c / n);
+    finalFilterDisps(imd, imsd, imn, nomask, dmin, dmax, 0, 0);
     
     WriteFlowFileVerb(imd, outdfile, verbose);
     WriteImageVerb(imsd, outsdfile, verbose);
@@ -1049,36 +1325,41 @@ void clipdisps(char* indfile, char* insdfile, char* innfile, char* outdfile, cha
 //   mask -- .pgm file, where mask==0 set imd to UNK
 void maskdisps(char *indfile, char *outdfile, char *mfile)
 {
-    int verbose = 1;
-    CFloatImage disp;
-    CByteImage mask;
+    int verbose = logEnabled(log_verbose);
+    CFloatImage disp, nosd;
+    CByteImage mask, non;
     ReadFlowFileVerb(disp, indfile, verbose);
     ReadImageVerb(mask, mfile, verbose);
     
-    CShape sh = disp.Shape();
-    
-    int c = 0;
-    int n = 0;
-    for (int y = 0; y < sh.height; y++) {
-        for (int x = 0; x < sh.width; x++) {
-            float d = disp.Pixel(x, y, 0);
-            int m = mask.Pixel(x, y, 0);
-            if (d != UNK) {
-                n++;
-                if (m == 0) {
-                    c++;
-                    disp.Pixel(x, y, 0) = UNK;
-                    disp.Pixel(x, y, 1) = UNK;
-                }
-            }
-        }
-    }
-    if (verbose)
-        fprintf(stderr, "%d pixels (%6.3f%% of valid disparities) masked\n", c, 100.0 * c / n);
+    finalFilterDisps(disp, nosd, non, mask, -UNK, UNK, 0, 0);
     
     WriteFlowFileVerb(disp, outdfile, verbose);
 }
 
+// final post-processing of merged2 results in one step (1-band PFMs, see finalFilterDisps)
+// mfile may be NULL if there is no manual mask, mincompsize <= 0 disables component removal
+extern "C" void finalizeDisparities(char *indfile, char *insdfile, char *innfile, char *mfile, char *outdfile, char *outsdfile, char *outnfile,
+                                    float dmin, float dmax, int mincompsize, float compthresh)
+try {
+    StageScope scope("finalize");
+    checkCancel();
+    int verbose = logEnabled(log_verbose);
+    CFloatImage imd, imsd;
+    CByteImage imn, mask;
+    pipelineRead(imd, indfile);
+    pipelineRead(imsd, insdfile);
+    pipelineRead(imn, innfile);
+    if (mfile != NULL)
+        ReadImageVerb(mask, mfile, verbose);
+    
+    finalFilterDisps(imd, imsd, imn, mask, dmin, dmax, mincompsize, compthresh);
+    
+    pipelineWrite(imd, outdfile, "merge2");
+    pipelineWrite(imsd, outsdfile, "merge2");
+    pipelineWrite(imn, outnfile, "merge2");
+} catch (CCancelled &) {
+}
+
 
 
 /* ***********************************************************************************
@@ -1,6 +1,24 @@
-void computeDisparities(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &fout0, CFloatImage &fout1, int dXmin, int dXmax, int dYmin, int dYmax);
+#include "Params.h"
+
+void computeDisparities(CFloatImage &fim0, CFloatImage &fim1, CFloatImage &fout0, CFloatImage &fout1, int dXmin, int dXmax, int dYmin, int dYmax,
+                        const ProcessingParams &params = currentParams());
 pair<CFloatImage,CFloatImage> runCrossCheck(CFloatImage d0, CFloatImage d1, float thresh, int xonly, int halfocc);
 //CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincompsize, int maxholesize);
 CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincompsize, int maxholesize, char *debugdir = NULL);
 CFloatImage mergeDisparityMaps(CFloatImage images[], int count, int mingroup, float maxdiff);
-void mergeDisparityMaps2(float maxdiff, int nV, int nR, char* outdfile, char* outsdfile, char* outnfile, char *inmdfile, char **invdfiles, char **inrdfiles);
+extern "C" void mergeDisparityMaps2(float maxdiff, int nV, int nR, char* outdfile, char* outsdfile, char* outnfile, char *inmdfile, char **invdfiles, char **inrdfiles);
+CFloatImage initMergeState(CFloatImage mdisp, CFloatImage vdisps[], int nV, CFloatImage rdisps[], int nR, float maxdiff);
+void updateMergeState(CFloatImage state, CFloatImage rdisps[], int nR, float maxdiff);
+void finalizeMergeState(CFloatImage state, CFloatImage &outd, CFloatImage &outsd, CByteImage &outn);
+
+// statistics of final post-processing
+struct finalstats {
+    int nvalid;        // valid disparities before masking
+    int nmasked;       // pixels invalidated by mask
+    int nvalidmasked;  // valid disparities after masking
+    int nclipped;      // pixels outside of valid disparity range
+    int ncomps;        // number of disparity components
+    int ncompsremoved; // number of components smaller than mincompsize
+};
+finalstats finalFilterDisps(CFloatImage imd, CFloatImage imsd, CByteImage imn, CByteImage mask,
+                            float dmin, float dmax, int mincompsize, float compthresh);
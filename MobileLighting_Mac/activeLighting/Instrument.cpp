@@ -0,0 +1,379 @@
+//
+//  Instrument.cpp
+//  activeLighting
+//
+//  timing, memory and counter instrumentation of the processing stages
+//
+
+#include "Instrument.h"
+#include "Log.h"
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define NHWCOUNTERS 3
+static const char *hwnames[NHWCOUNTERS] = {"cycles", "instructions", "cache misses"};
+
+// one finished scope
+struct StageRecord {
+    std::string name;
+    int tid;
+    double start, wall, cpu;    // seconds
+    long rss;                   // growth of peak RSS in KB
+    bool hashw;
+    long long hw[NHWCOUNTERS];
+    std::map<std::string, long long> counters;
+};
+
+struct StageScope::Data {
+    StageRecord rec;
+    double cpu0;
+    long rss0;
+    std::chrono::steady_clock::time_point t0;
+    std::mutex lock;            // guards rec.counters and workercpu (worker threads add to them)
+    double workercpu;
+    int hwfd[NHWCOUNTERS];
+};
+
+static std::atomic<bool> enabled(false);
+static bool hwcounters = false;
+static std::mutex recordlock;
+static std::vector<StageRecord> records;
+static std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+static std::atomic<int> nthreadids(0);
+static thread_local int threadid = -1;
+static thread_local StageScope *current = NULL;
+
+static double threadCpu()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// peak resident set size in KB
+static long peakRss()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024; // bytes on macOS
+#else
+    return ru.ru_maxrss;
+#endif
+}
+
+// hardware counters of the calling thread and the threads it creates from now on; -1 if unavailable
+static void openHwCounters(int *fd)
+{
+    for (int i = 0; i < NHWCOUNTERS; i++)
+        fd[i] = -1;
+#ifdef __linux__
+    static const unsigned long long configs[NHWCOUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+    for (int i = 0; i < NHWCOUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd[i] < 0) {
+            static bool warned = false;
+            if (!warned)
+                logPrintf(log_warning, "instrumentation: hardware counters not available\n");
+            warned = true;
+        }
+    }
+#endif
+}
+
+static bool readHwCounters(int *fd, long long *values)
+{
+    bool ok = true;
+    for (int i = 0; i < NHWCOUNTERS; i++) {
+        values[i] = 0;
+        if (fd[i] < 0 || read(fd[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+            ok = false;
+        if (fd[i] >= 0)
+            close(fd[i]);
+    }
+    return ok;
+}
+
+static void writeAtExit()
+{
+    std::string prefix = getenv("ACTIVELIGHTING_TRACE");
+    instrumentStop((prefix + ".json").c_str(), (prefix + ".csv").c_str());
+}
+
+bool instrumentEnabled()
+{
+    static std::once_flag once;
+    std::call_once(once, []() {
+        char *s = getenv("ACTIVELIGHTING_TRACE");
+        if (s != NULL && *s != 0) {
+            char *perf = getenv("ACTIVELIGHTING_PERF");
+            instrumentStart(perf != NULL && atoi(perf) != 0);
+            atexit(writeAtExit);
+        }
+    });
+    return enabled;
+}
+
+void instrumentStart(bool hw)
+{
+    std::lock_guard<std::mutex> guard(recordlock);
+    records.clear();
+    origin = std::chrono::steady_clock::now();
+    hwcounters = hw;
+    enabled = true;
+}
+
+
+StageScope::StageScope(const char *name)
+: data(NULL), parent(current)
+{
+    if (!instrumentEnabled())
+        return;
+    if (threadid < 0)
+        threadid = nthreadids++;
+    data = new Data();
+    data->rec.name = name;
+    data->rec.tid = threadid;
+    data->workercpu = 0;
+    data->rss0 = peakRss();
+    data->cpu0 = threadCpu();
+    if (hwcounters)
+        openHwCounters(data->hwfd);
+    data->t0 = std::chrono::steady_clock::now();
+    current = this;
+}
+
+StageScope::~StageScope()
+{
+    if (data == NULL)
+        return;
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+    StageRecord &rec = data->rec;
+    rec.start = std::chrono::duration<double>(data->t0 - origin).count();
+    rec.wall = std::chrono::duration<double>(t1 - data->t0).count();
+    rec.hashw = hwcounters && readHwCounters(data->hwfd, rec.hw);
+    {
+        std::lock_guard<std::mutex> guard(data->lock);
+        rec.cpu = threadCpu() - data->cpu0 + data->workercpu;
+    }
+    rec.rss = peakRss() - data->rss0;
+    current = parent;
+    // CPU time of the workers of this scope also counts for the enclosing scope
+    if (parent != NULL)
+        parent->addWorkerCpu(data->workercpu);
+    {
+        std::lock_guard<std::mutex> guard(recordlock);
+        if (enabled)
+            records.push_back(rec);
+    }
+    delete data;
+}
+
+void StageScope::count(const char *counter, long long n)
+{
+    if (data == NULL)
+        return;
+    std::lock_guard<std::mutex> guard(data->lock);
+    data->rec.counters[counter] += n;
+}
+
+void StageScope::addWorkerCpu(double seconds)
+{
+    if (data == NULL)
+        return;
+    std::lock_guard<std::mutex> guard(data->lock);
+    data->workercpu += seconds;
+}
+
+StageScopeWorker::StageScopeWorker(StageScope *scope)
+: scope(scope), prev(current), cpu0(0)
+{
+    if (scope == NULL)
+        return;
+    cpu0 = threadCpu();
+    current = scope;
+}
+
+StageScopeWorker::~StageScopeWorker()
+{
+    if (scope == NULL)
+        return;
+    scope->addWorkerCpu(threadCpu() - cpu0);
+    current = prev;
+}
+
+StageScope *currentStageScope()
+{
+    return current;
+}
+
+void instrumentCount(const char *counter, long long n)
+{
+    if (current != NULL)
+        current->count(counter, n);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// export
+
+static std::string jsonString(const std::string &s)
+{
+    std::string r = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"' || s[i] == '\\')
+            r += '\\';
+        r += s[i];
+    }
+    return r + "\"";
+}
+
+// Chrome trace events ("complete" events with duration), times in microseconds
+static void writeTrace(const char *path, const std::vector<StageRecord> &recs)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        logPrintf(log_error, "instrumentation: cannot write %s\n", path);
+        return;
+    }
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < recs.size(); i++) {
+        const StageRecord &r = recs[i];
+        fprintf(fp, "{\"name\":%s,\"cat\":\"stage\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f,\"args\":{\"cpu_ms\":%.3f,\"rss_growth_kb\":%ld",
+                jsonString(r.name).c_str(), (int)getpid(), r.tid, 1e6 * r.start, 1e6 * r.wall, 1e3 * r.cpu, r.rss);
+        if (r.hashw) {
+            for (int k = 0; k < NHWCOUNTERS; k++)
+                fprintf(fp, ",%s:%lld", jsonString(hwnames[k]).c_str(), r.hw[k]);
+        }
+        for (std::map<std::string, long long>::const_iterator it = r.counters.begin(); it != r.counters.end(); ++it)
+            fprintf(fp, ",%s:%lld", jsonString(it->first).c_str(), it->second);
+        fprintf(fp, "}}%s\n", (i + 1 < recs.size()) ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+}
+
+// one line per stage name: number of calls, total wall and CPU time, largest RSS growth,
+// sums of the hardware counters and of the counters
+static void writeCSV(const char *path, const std::vector<StageRecord> &recs)
+{
+    struct Summary {
+        int calls;
+        double wall, cpu;
+        long rss;
+        long long hw[NHWCOUNTERS];
+        std::map<std::string, long long> counters;
+    };
+    std::vector<std::string> order;
+    std::map<std::string, Summary> stages;
+    std::set<std::string> counternames;
+    bool hashw = false;
+    for (size_t i = 0; i < recs.size(); i++) {
+        const StageRecord &r = recs[i];
+        if (stages.count(r.name) == 0) {
+            order.push_back(r.name);
+            Summary &s = stages[r.name];
+            s.calls = 0;
+            s.wall = s.cpu = 0;
+            s.rss = 0;
+            memset(s.hw, 0, sizeof(s.hw));
+        }
+        Summary &s = stages[r.name];
+        s.calls++;
+        s.wall += r.wall;
+        s.cpu += r.cpu;
+        if (r.rss > s.rss)
+            s.rss = r.rss;
+        if (r.hashw) {
+            hashw = true;
+            for (int k = 0; k < NHWCOUNTERS; k++)
+                s.hw[k] += r.hw[k];
+        }
+        for (std::map<std::string, long long>::const_iterator it = r.counters.begin(); it != r.counters.end(); ++it) {
+            s.counters[it->first] += it->second;
+            counternames.insert(it->first);
+        }
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        logPrintf(log_error, "instrumentation: cannot write %s\n", path);
+        return;
+    }
+    fprintf(fp, "stage,calls,wall_ms,cpu_ms,max_rss_growth_kb");
+    if (hashw)
+        for (int k = 0; k < NHWCOUNTERS; k++)
+            fprintf(fp, ",%s", hwnames[k]);
+    for (std::set<std::string>::iterator it = counternames.begin(); it != counternames.end(); ++it)
+        fprintf(fp, ",%s", it->c_str());
+    fprintf(fp, "\n");
+    for (size_t i = 0; i < order.size(); i++) {
+        Summary &s = stages[order[i]];
+        fprintf(fp, "\"%s\",%d,%.3f,%.3f,%ld", order[i].c_str(), s.calls, 1e3 * s.wall, 1e3 * s.cpu, s.rss);
+        if (hashw)
+            for (int k = 0; k < NHWCOUNTERS; k++)
+                fprintf(fp, ",%lld", s.hw[k]);
+        for (std::set<std::string>::iterator it = counternames.begin(); it != counternames.end(); ++it) {
+            std::map<std::string, long long>::iterator c = s.counters.find(*it);
+            if (c != s.counters.end())
+                fprintf(fp, ",%lld", c->second);
+            else
+                fprintf(fp, ",");
+        }
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+}
+
+void instrumentStop(const char *tracefile, const char *csvfile)
+{
+    std::vector<StageRecord> recs;
+    {
+        std::lock_guard<std::mutex> guard(recordlock);
+        enabled = false;
+        recs.swap(records);
+    }
+    if (tracefile != NULL)
+        writeTrace(tracefile, recs);
+    if (csvfile != NULL)
+        writeCSV(csvfile, recs);
+    logPrintf(log_info, "instrumentation: %d stage records written\n", (int)recs.size());
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// C interface
+
+extern "C" void instrumentationStart(int hwcounters)
+{
+    instrumentStart(hwcounters != 0);
+}
+
+extern "C" void instrumentationStop(char *tracefile, char *csvfile)
+{
+    instrumentStop(tracefile, csvfile);
+}
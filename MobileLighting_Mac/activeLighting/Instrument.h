@@ -0,0 +1,59 @@
+//
+//  Instrument.h
+//  activeLighting
+//
+//  timing, memory and counter instrumentation of the processing stages
+//
+
+#ifndef Instrument_h
+#define Instrument_h
+
+// instrumentation is off by default and costs nothing but a check per scope then.
+// it is switched on by instrumentStart(), or by setting the environment variable
+// ACTIVELIGHTING_TRACE=<prefix>, in which case <prefix>.json and <prefix>.csv are written at exit
+// (ACTIVELIGHTING_PERF=1 also records hardware counters).
+//
+// for every scope it records wall time, CPU time (including the worker threads of parallelFor
+// calls made within the scope), growth of the peak resident set size, counters added with
+// instrumentCount(), and on Linux optionally the hardware counters cycles, instructions and
+// cache misses (perf_event_open).  the records are exported as Chrome trace events (open the
+// .json file in chrome://tracing) and as CSV summary with one line per stage name
+
+// a timed stage: from construction to destruction of the scope object
+class StageScope {
+public:
+    StageScope(const char *name);
+    ~StageScope();
+
+    void count(const char *counter, long long n);
+    void addWorkerCpu(double seconds);
+
+    struct Data;
+private:
+    Data *data;         // NULL if instrumentation is off
+    StageScope *parent;
+};
+
+// while it exists, the calling worker thread counts towards scope (counters and CPU time)
+class StageScopeWorker {
+public:
+    StageScopeWorker(StageScope *scope);
+    ~StageScopeWorker();
+private:
+    StageScope *scope, *prev;
+    double cpu0;
+};
+
+// innermost scope of the calling thread, NULL if none
+StageScope *currentStageScope();
+
+// add n to counter of the innermost scope of the calling thread (e.g. "matches")
+void instrumentCount(const char *counter, long long n);
+
+bool instrumentEnabled();
+// discard previous records and start recording (hwcounters: also record hardware counters)
+void instrumentStart(bool hwcounters);
+// stop recording and write the trace and summary files (either may be NULL)
+void instrumentStop(const char *tracefile, const char *csvfile);
+
+#endif /* Instrument_h */
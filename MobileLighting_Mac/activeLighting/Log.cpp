@@ -0,0 +1,290 @@
+//
+//  Log.cpp
+//  activeLighting
+//
+//  leveled logging of the processing stages
+//
+
+#include "Log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define LOGBUFSIZE (1 << 16)        // bytes of the buffer of a thread
+#define MAXMSG (LOGBUFSIZE / 4)     // longer messages are truncated
+#define HDRSIZE 4
+#define FLUSHMS 50                  // the writer thread wakes up at least this often
+
+static const char *levelnames[] = {"error", "warning", "info", "verbose", "debug"};
+#define NLEVELS 5
+
+// messages of a thread: records (header: length | level << 24, then the text) in a ring
+// buffer written by the thread and read under LogState::lock
+struct LogBuffer {
+    LogBuffer() : head(0), tail(0), finished(false) {}
+
+    char data[LOGBUFSIZE];
+    std::atomic<size_t> head, tail;     // bytes written / read so far
+    std::atomic<bool> finished;         // the thread has exited, free the buffer once it is read
+};
+
+struct LogState {
+    LogState() : wakeup(false), running(false) {}
+
+    std::mutex lock;                    // one reader at a time, guards buffers
+    std::vector<LogBuffer *> buffers;
+    std::mutex wakelock;
+    std::condition_variable wake;
+    bool wakeup;
+    std::thread writer;
+    std::atomic<bool> running;
+};
+
+// never destroyed, threads may still log while the process exits
+static LogState *state()
+{
+    static LogState *s = new LogState;
+    return s;
+}
+
+static int initialLevel()
+{
+    char *s = getenv("ACTIVELIGHTING_LOG");
+    int level = (s != NULL && *s != 0) ? parseLogLevel(s) : -1;
+    return level >= 0 ? level : log_info;
+}
+
+std::atomic<int> logCurrentLevel(initialLevel());
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// buffers
+
+// the buffer of a thread is registered by its first message and released when the thread exits
+struct LogOwner {
+    LogOwner() : buf(NULL) {}
+    ~LogOwner();
+
+    LogBuffer *buf;
+};
+
+static thread_local LogOwner owner;
+static thread_local bool exited = false;    // owner is gone, write directly
+
+LogOwner::~LogOwner()
+{
+    exited = true;
+    if (buf != NULL)
+        buf->finished.store(true, std::memory_order_release);
+}
+
+static LogBuffer *ownBuffer(LogState *s)
+{
+    if (owner.buf == NULL) {
+        LogBuffer *b = new LogBuffer;
+        std::lock_guard<std::mutex> guard(s->lock);
+        s->buffers.push_back(b);
+        owner.buf = b;
+    }
+    return owner.buf;
+}
+
+static void put(LogBuffer *b, size_t pos, const void *src, size_t n)
+{
+    pos %= LOGBUFSIZE;
+    size_t n1 = n < LOGBUFSIZE - pos ? n : LOGBUFSIZE - pos;
+    memcpy(b->data + pos, src, n1);
+    memcpy(b->data, (const char *)src + n1, n - n1);
+}
+
+static void get(LogBuffer *b, size_t pos, void *dst, size_t n)
+{
+    pos %= LOGBUFSIZE;
+    size_t n1 = n < LOGBUFSIZE - pos ? n : LOGBUFSIZE - pos;
+    memcpy(dst, b->data + pos, n1);
+    memcpy((char *)dst + n1, b->data, n - n1);
+}
+
+static void emit(int level, const char *text, size_t len)
+{
+    if (level <= log_warning) {
+        fflush(stdout);
+        fwrite(text, 1, len, stderr);
+    } else {
+        fwrite(text, 1, len, stdout);
+    }
+}
+
+// write the messages of b (LogState::lock held)
+static void drain(LogBuffer *b)
+{
+    size_t t = b->tail.load(std::memory_order_relaxed);
+    size_t h = b->head.load(std::memory_order_acquire);
+    while (t < h) {
+        uint32_t hdr;
+        get(b, t, &hdr, HDRSIZE);
+        size_t len = hdr & 0xffffff, pos = (t + HDRSIZE) % LOGBUFSIZE;
+        size_t n1 = len < LOGBUFSIZE - pos ? len : LOGBUFSIZE - pos;
+        emit(hdr >> 24, b->data + pos, n1);
+        if (n1 < len)
+            emit(hdr >> 24, b->data, len - n1);
+        t += HDRSIZE + len;
+    }
+    b->tail.store(t, std::memory_order_release);
+}
+
+void logFlush()
+{
+    LogState *s = state();
+    std::lock_guard<std::mutex> guard(s->lock);
+    for (size_t i = 0; i < s->buffers.size(); ) {
+        LogBuffer *b = s->buffers[i];
+        bool finished = b->finished.load(std::memory_order_acquire);
+        drain(b);
+        if (finished) {
+            delete b;
+            s->buffers.erase(s->buffers.begin() + i);
+        } else {
+            i++;
+        }
+    }
+    fflush(stdout);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// writer thread
+
+static void writerLoop(LogState *s)
+{
+    std::unique_lock<std::mutex> wl(s->wakelock);
+    while (s->running) {
+        s->wake.wait_for(wl, std::chrono::milliseconds(FLUSHMS), [s]() { return s->wakeup || !s->running; });
+        s->wakeup = false;
+        wl.unlock();
+        logFlush();
+        wl.lock();
+    }
+}
+
+static void wakeWriter(LogState *s)
+{
+    {
+        std::lock_guard<std::mutex> guard(s->wakelock);
+        s->wakeup = true;
+    }
+    s->wake.notify_one();
+}
+
+// at exit: stop the writer thread, the remaining messages are written synchronously
+static void stopWriter()
+{
+    LogState *s = state();
+    {
+        std::lock_guard<std::mutex> guard(s->wakelock);
+        s->running = false;
+    }
+    s->wake.notify_one();
+    if (s->writer.joinable())
+        s->writer.join();
+    logFlush();
+}
+
+// start the writer thread with the first message; false once it is stopped
+static bool writerRunning(LogState *s)
+{
+    static std::once_flag once;
+    std::call_once(once, [s]() {
+        s->running = true;
+        s->writer = std::thread(writerLoop, s);
+        atexit(stopWriter);
+    });
+    return s->running.load(std::memory_order_relaxed);
+}
+
+static void logWrite(int level, const char *text, size_t len)
+{
+    LogState *s = state();
+    if (len > MAXMSG)
+        len = MAXMSG;
+    if (exited) {
+        std::lock_guard<std::mutex> guard(s->lock);
+        emit(level, text, len);
+        fflush(stdout);
+        return;
+    }
+    LogBuffer *b = ownBuffer(s);
+    size_t need = HDRSIZE + len;
+    size_t h = b->head.load(std::memory_order_relaxed);
+    if (LOGBUFSIZE - (h - b->tail.load(std::memory_order_acquire)) < need)
+        logFlush();     // the writer thread falls behind
+    uint32_t hdr = (uint32_t)len | (uint32_t)level << 24;
+    put(b, h, &hdr, HDRSIZE);
+    put(b, h + HDRSIZE, text, len);
+    b->head.store(h + need, std::memory_order_release);
+    if (!writerRunning(s))
+        logFlush();
+    else if (h + need - b->tail.load(std::memory_order_relaxed) > LOGBUFSIZE / 2)
+        wakeWriter(s);
+}
+
+void logPrintf(int level, const char *fmt, ...)
+{
+    if (!logEnabled(level))
+        return;
+    char buf[1000];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if (n < (int)sizeof(buf)) {
+        logWrite(level, buf, n);
+        return;
+    }
+    std::vector<char> big(n + 1);
+    va_start(ap, fmt);
+    vsnprintf(&big[0], big.size(), fmt, ap);
+    va_end(ap);
+    logWrite(level, &big[0], n);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// level
+
+void setLogLevel(int level)
+{
+    logCurrentLevel = level;
+}
+
+int parseLogLevel(const char *name)
+{
+    for (int l = 0; l < NLEVELS; l++)
+        if (strcmp(name, levelnames[l]) == 0)
+            return l;
+    char *end;
+    long l = strtol(name, &end, 10);
+    if (end != name && *end == 0 && l >= 0)
+        return (int)l;
+    return -1;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// C interface
+
+// level: 0 error, 1 warning, 2 info (default), 3 verbose, 4 debug
+extern "C" void setLoggingLevel(int level)
+{
+    setLogLevel(level);
+}
+
+extern "C" void loggingFlush()
+{
+    logFlush();
+}
@@ -0,0 +1,46 @@
+//
+//  Log.h
+//  activeLighting
+//
+//  leveled logging of the processing stages
+//
+
+#ifndef Log_h
+#define Log_h
+
+#include <atomic>
+
+// messages above the current level are dropped after a load and a compare, so they may be used
+// in inner loops (guard the computation of expensive arguments with logEnabled()).  the default
+// level is log_info; the environment variable ACTIVELIGHTING_LOG=<level name or number> sets
+// another one.
+//
+// a message is formatted by the calling thread into a buffer of its own, without locks, and
+// written to stdout (errors and warnings: stderr) by a background thread, at the latest after
+// 50 ms and at exit.  the messages of a thread keep their order; those of different threads
+// are interleaved message by message.  output printed directly should be preceded by logFlush()
+enum log_level_t {
+    log_error,
+    log_warning,
+    log_info,       // progress of the stages
+    log_verbose,    // statistics of every call, files read and written
+    log_debug       // diagnostics of the algorithms
+};
+
+extern std::atomic<int> logCurrentLevel;
+
+inline bool logEnabled(int level)
+{
+    return level <= logCurrentLevel.load(std::memory_order_relaxed);
+}
+
+void logPrintf(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void setLogLevel(int level);
+// level of a name (error, warning, info, verbose, debug) or number, -1 if unknown
+int parseLogLevel(const char *name);
+
+// write all buffered messages now
+void logFlush();
+
+#endif /* Log_h */
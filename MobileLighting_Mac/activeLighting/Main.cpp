@@ -0,0 +1,366 @@
+//
+//  Main.cpp
+//  activeLighting
+//
+//  headless command-line driver for the processing stages (Linux or macOS, no app needed)
+//
+//  usage: ActiveLighting command scenedir [params.yml]
+//    commands: refine, rectify, disparity, crosscheck, filter, merge, reproject, merge2
+//              (only the steps of that stage or operation, see buildSceneGraph), or process
+//              (all stages, skipping steps whose outputs are up to date)
+//    distributed processing of all stages (see WorkQueue.h):
+//              coordinate (publish the steps in the queue directory and wait for them),
+//              worker (run steps of the queue until the coordinator finishes)
+//    coordinator and workers need the same scenedir path and the same parameter file
+//  usage: ActiveLighting daemon socketpath [params.yml]
+//    serve requests on a Unix domain socket (see Daemon.h); uses threads and daemon: { cachedpairs }
+//  usage: ActiveLighting sweep scenedir params.yml
+//    run one step of a stage with all combinations of the parameter values of sweep: { ... } on
+//    inputs loaded once (see Sweep.h), writing the results and a table <stage>.csv to the sweep
+//    directory; parameters not swept have their values of params.yml
+//
+//  params.yml (OpenCV FileStorage YAML, all keys optional):
+//    projectors: [ 0, 1 ]          default: all proj* directories of computed/decoded/unrectified
+//    positions: [ 0, 1, 2 ]        default: all pos* directories found for every projector
+//    threads: 8                    default: number of processors (worker: threads of each step)
+//    memoryMB: 8000                default: unlimited
+//    incremental: 1                process only: skip steps that are up to date (default 1)
+//    force: merge                  process only: run this stage and the following ones again
+//    trace: /tmp/run               write /tmp/run.json and /tmp/run.csv (see Instrument.h)
+//    log: verbose                  error, warning, info, verbose or debug (default info, see Log.h)
+//    disparity: { dXmin: -1080, dXmax: 1080, dYmin: -1, dYmax: 1, thresh: 0.5,
+//                 ythresh: 0.75, kx: 3, ky: 0, mincompsize: 20, maxholesize: 200 }
+//    merge: { mingroup: 2, maxdiff: 1.0, thresh: 0.5 }
+//    reproject: { kx: 3, maxholesize: 200, maxsamples: 200000, maxransac: 500, ransacthresh: 2.0,
+//                 maxirls: 20, maxerr: 1.0 }
+//    merge2: { maxdiff: 1.0, thresh: 1.0, mincompsize: 20, maxholesize: 20 }
+//    final: { dmin: -100, dmax: 800, mincompsize: 20, compthresh: 2.0 }
+//                                  clipping (default: none) and component removal of the merge2 results
+//    queue: { dir: /shared/scene/computed/queue, lease: 60, attempts: 3, workers: 4 }
+//                                  default dir: scenedir/computed/queue; lease in seconds;
+//                                  workers: local worker processes started by the coordinator
+//    daemon: { cachedpairs: 4 }    stereo pairs whose rectification maps the daemon keeps in memory
+//    sweep: { stage: filter, projector: 0, pair: [ 0, 1 ], position: 0, ythresh: [ 0.5, 1.0 ],
+//             kx: [ 1, 3, 5 ], ky: 0, mincompsize: [ 10, 20, 40 ], maxholesize: [ 50, 200 ] }
+//                                  stage filter: the filter of the cross-checked disparities of a
+//                                  projector at position of the pair; refine: filterradius,
+//                                  filterfraction, filtermaxdiff of the decoded images of a projector
+//                                  at position, direction: 0 (u) or 1 (v); merge2: maxdiff,
+//                                  mincompsize, maxholesize at position of the pair.
+//                                  out: sweep directory (default scenedir/computed/sweep); reference:
+//                                  image the results are compared with, e.g. ground-truth disparities
+//    refine: { mode: planar, maxgrad0: 1.0, maxgrad1: 0.1, radius: 7, ... }
+//    match: { maxdiff: 0.5, ncodes: 1024 }
+//                                  refine, match and the reprojection fit: see ProcessingParams::load
+//    output: { ext: .cfm }         code and disparity maps of the steps: .pfm (default) or compressed .cfm
+//
+//  exit status is 1 if a step failed
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <opencv2/core/core.hpp>
+#include "imageLib.h"
+#include "Scheduler.h"
+#include "Manifest.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "WorkQueue.h"
+#include "Parallel.h"
+#include "Daemon.h"
+#include "Sweep.h"
+
+using namespace cv;
+
+static const char *commands[] = {"refine", "rectify", "disparity", "crosscheck", "filter", "merge", "reproject", "merge2", "process",
+                                 "coordinate", "worker", "daemon", "sweep", NULL};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s command scenedir [params.yml]\n", prog);
+    fprintf(stderr, "  commands: refine, rectify, disparity, crosscheck, filter, merge, reproject, merge2, process,\n");
+    fprintf(stderr, "            coordinate, worker\n");
+    fprintf(stderr, "       %s daemon socketpath [params.yml]\n", prog);
+    fprintf(stderr, "       %s sweep scenedir params.yml\n", prog);
+    exit(1);
+}
+
+// numbers n of the entries <prefix>n of dir, sorted
+static std::vector<int> numberedEntries(const std::string &dir, const char *prefix)
+{
+    std::vector<int> nums;
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL)
+        return nums;
+    size_t len = strlen(prefix);
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        char *end;
+        if (strncmp(e->d_name, prefix, len) != 0 || e->d_name[len] == 0)
+            continue;
+        int n = (int)strtol(e->d_name + len, &end, 10);
+        if (*end == 0)
+            nums.push_back(n);
+    }
+    closedir(d);
+    std::sort(nums.begin(), nums.end());
+    return nums;
+}
+
+// positions found for all projectors
+static std::vector<int> findPositions(const std::string &scene, const std::vector<int> &projectors)
+{
+    std::string decoded = scene + "/computed/decoded/unrectified";
+    std::vector<int> positions;
+    for (size_t p = 0; p < projectors.size(); p++) {
+        std::vector<int> pos = numberedEntries(decoded + "/proj" + std::to_string(projectors[p]), "pos");
+        if (p == 0) {
+            positions = pos;
+        } else {
+            std::vector<int> both;
+            std::set_intersection(positions.begin(), positions.end(), pos.begin(), pos.end(), std::back_inserter(both));
+            positions = both;
+        }
+    }
+    return positions;
+}
+
+template <class T>
+static void readParam(const FileNode &section, const char *key, T &value)
+{
+    FileNode node = section[key];
+    if (!node.empty())
+        node >> value;
+}
+
+template <class T>
+static void readList(const FileNode &node, std::vector<T> &list)
+{
+    if (node.empty())
+        return;
+    list.clear();
+    for (FileNodeIterator it = node.begin(); it != node.end(); ++it)
+        list.push_back((T)*it);
+}
+
+struct DriverParams {
+    std::vector<int> projectors, positions;
+    int threads, memoryMB, incremental;
+    std::string force, trace, log;
+    SceneParams scene;
+    std::string queuedir;
+    int localworkers;
+    WorkQueueOptions queue;
+    int cachedpairs;
+    SweepConfig sweep;
+};
+
+static void readParams(const char *file, DriverParams &dp)
+{
+    FileStorage fs(file, FileStorage::READ);
+    if (!fs.isOpened())
+        throw CError("cannot read parameter file %s", file);
+    readList(fs["projectors"], dp.projectors);
+    readList(fs["positions"], dp.positions);
+    readParam(fs.root(), "threads", dp.threads);
+    readParam(fs.root(), "memoryMB", dp.memoryMB);
+    readParam(fs.root(), "incremental", dp.incremental);
+    readParam(fs.root(), "force", dp.force);
+    readParam(fs.root(), "trace", dp.trace);
+    readParam(fs.root(), "log", dp.log);
+
+    SceneParams &sp = dp.scene;
+    FileNode disp = fs["disparity"];
+    readParam(disp, "dXmin", sp.dXmin);
+    readParam(disp, "dXmax", sp.dXmax);
+    readParam(disp, "dYmin", sp.dYmin);
+    readParam(disp, "dYmax", sp.dYmax);
+    readParam(disp, "thresh", sp.viewThresh);
+    readParam(disp, "ythresh", sp.filterYthresh);
+    readParam(disp, "kx", sp.filterKx);
+    readParam(disp, "ky", sp.filterKy);
+    readParam(disp, "mincompsize", sp.filterMinCompSize);
+    readParam(disp, "maxholesize", sp.filterMaxHoleSize);
+    FileNode merge = fs["merge"];
+    readParam(merge, "mingroup", sp.mergeMinGroup);
+    readParam(merge, "maxdiff", sp.mergeMaxDiff);
+    readParam(merge, "thresh", sp.mergeThresh);
+    FileNode reproj = fs["reproject"];
+    readParam(reproj, "kx", sp.reprojKx);
+    readParam(reproj, "maxholesize", sp.reprojMaxHoleSize);
+    FileNode merge2 = fs["merge2"];
+    readParam(merge2, "maxdiff", sp.merge2MaxDiff);
+    readParam(merge2, "thresh", sp.merge2Thresh);
+    readParam(merge2, "mincompsize", sp.merge2MinCompSize);
+    readParam(merge2, "maxholesize", sp.merge2MaxHoleSize);
+    FileNode finalize = fs["final"];
+    readParam(finalize, "dmin", sp.finalDmin);
+    readParam(finalize, "dmax", sp.finalDmax);
+    readParam(finalize, "mincompsize", sp.finalMinCompSize);
+    readParam(finalize, "compthresh", sp.finalCompThresh);
+    FileNode queue = fs["queue"];
+    readParam(queue, "dir", dp.queuedir);
+    readParam(queue, "lease", dp.queue.lease);
+    readParam(queue, "attempts", dp.queue.maxAttempts);
+    readParam(queue, "workers", dp.localworkers);
+    readParam(fs["daemon"], "cachedpairs", dp.cachedpairs);
+    FileNode sweep = fs["sweep"];
+    SweepConfig &sc = dp.sweep;
+    readParam(sweep, "stage", sc.stage);
+    readParam(sweep, "projector", sc.projector);
+    std::vector<int> pair;
+    readList(sweep["pair"], pair);
+    if (pair.size() == 2) {
+        sc.left = pair[0];
+        sc.right = pair[1];
+    }
+    readParam(sweep, "position", sc.position);
+    readParam(sweep, "direction", sc.direction);
+    readParam(sweep, "out", sc.outdir);
+    readParam(sweep, "reference", sc.reference);
+    for (const char *key : {"ythresh", "kx", "ky", "mincompsize", "maxholesize", "filterradius", "filterfraction", "filtermaxdiff", "maxdiff"})
+        readList(sweep[key], sc.values[key]);
+    sp.processing.load(file);
+}
+
+// start n worker processes of this program on the same scene and parameters
+static std::vector<pid_t> startWorkers(int n, char *argv[])
+{
+    std::vector<pid_t> pids;
+    for (int i = 0; i < n; i++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            throw CError("cannot start worker %d", i);
+        if (pid == 0) {
+            char *args[] = {argv[0], (char *)"worker", argv[2], argv[3], NULL};
+            execvp(argv[0], args);
+            perror(argv[0]);
+            _exit(1);
+        }
+        pids.push_back(pid);
+    }
+    return pids;
+}
+
+static std::string workerId()
+{
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    return std::string(host) + "." + std::to_string(getpid());
+}
+
+static int run(const std::string &command, const std::string &scene, DriverParams &dp, char *argv[])
+{
+    if (dp.projectors.empty())
+        dp.projectors = numberedEntries(scene + "/computed/decoded/unrectified", "proj");
+    if (dp.positions.empty())
+        dp.positions = findPositions(scene, dp.projectors);
+    if (dp.projectors.empty() || dp.positions.size() < 2)
+        throw CError("no decoded images of a stereo pair found in %s/computed/decoded/unrectified", scene.c_str());
+    logPrintf(log_info, "%s: %d projectors, %d positions\n", command.c_str(), (int)dp.projectors.size(), (int)dp.positions.size());
+
+    SceneLayout layout(scene, dp.scene.processing.mapExt);
+    if (command == "sweep") {
+        if (dp.sweep.stage.empty())
+            throw CError("sweep: no stage given in the parameter file");
+        if (dp.threads > 0)
+            setNumThreads(dp.threads);
+        runSceneSweep(layout, dp.projectors, dp.scene, dp.sweep);
+        return 0;
+    }
+    std::unique_ptr<StageManifest> manifest;
+    if (command == "process" && dp.incremental)
+        manifest.reset(new StageManifest(scene + "/computed/manifest.txt"));
+    bool allstages = (command == "process" || command == "coordinate" || command == "worker");
+    std::string only = allstages ? "" : command;
+    StageScheduler sched;
+    buildSceneGraph(sched, layout, dp.projectors, dp.positions, manifest.get(), dp.force, dp.scene, only);
+
+    // the manifest is not used in distributed mode, every step runs
+    std::string queuedir = dp.queuedir.empty() ? scene + "/computed/queue" : dp.queuedir;
+    if (command == "worker") {
+        if (dp.threads > 0)
+            setNumThreads(dp.threads);
+        runWorkQueue(sched, queuedir, dp.queue, workerId());
+        return 0;
+    }
+    if (command == "coordinate") {
+        std::vector<pid_t> workers = startWorkers(dp.localworkers, argv);
+        int failed = coordinateWorkQueue(sched, queuedir, dp.queue);
+        for (size_t i = 0; i < workers.size(); i++)
+            waitpid(workers[i], NULL, 0);
+        if (failed > 0)
+            logPrintf(log_error, "%d of %d steps failed or were skipped\n", failed, sched.size());
+        return failed;
+    }
+
+    int failed = sched.run(dp.threads, (size_t)std::max(dp.memoryMB, 0) << 20);
+    if (failed > 0)
+        logPrintf(log_error, "%d of %d steps failed or were skipped\n", failed, sched.size());
+    if (manifest) {
+        manifest->recordPending();
+        manifest->save();
+    }
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3 || argc > 4)
+        usage(argv[0]);
+    if (strcmp(argv[1], "sweep") == 0 && argc != 4)
+        usage(argv[0]);
+    std::string command = argv[1], scene = argv[2];
+    int c = 0;
+    while (commands[c] != NULL && command != commands[c])
+        c++;
+    if (commands[c] == NULL)
+        usage(argv[0]);
+
+    DriverParams dp;
+    dp.threads = 0;
+    dp.memoryMB = 0;
+    dp.incremental = 1;
+    dp.localworkers = 0;
+    dp.cachedpairs = 4;
+    int failed;
+    try {
+        if (argc == 4)
+            readParams(argv[3], dp);
+        if (!dp.log.empty()) {
+            int level = parseLogLevel(dp.log.c_str());
+            if (level < 0)
+                throw CError("unknown log level %s", dp.log.c_str());
+            setLogLevel(level);
+        }
+        if (!dp.trace.empty())
+            instrumentStart(false);
+        if (command == "daemon") {
+            if (dp.threads > 0)
+                setNumThreads(dp.threads);
+            setDefaultParams(dp.scene.processing);
+            runDaemon(argv[2], dp.cachedpairs);
+            failed = 0;
+        } else {
+            failed = run(command, scene, dp, argv);
+        }
+        if (!dp.trace.empty())
+            instrumentStop((dp.trace + ".json").c_str(), (dp.trace + ".csv").c_str());
+    } catch (CError &err) {
+        logPrintf(log_error, "%s\n", err.message);
+        return 1;
+    } catch (std::exception &err) {
+        // e.g. cv::Exception of cv::FileStorage for a malformed parameter file
+        logPrintf(log_error, "%s\n", err.what());
+        return 1;
+    }
+    return failed > 0;
+}
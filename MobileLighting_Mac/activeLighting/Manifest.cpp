@@ -0,0 +1,205 @@
+//
+//  Manifest.cpp
+//  activeLighting
+//
+//  records which inputs and parameters the output files of the processing steps were computed from
+//
+//  manifest file format, one entry per line (later lines override earlier ones):
+//    O <key> <output file>                         output written by step with given key
+//    F <hash> <size> <mtime>.<nsec> <file>         content hash of file
+//    X <output file>                               output invalidated
+//
+
+#include "Manifest.h"
+#include "Session.h"
+#include "imageLib.h"
+#include <sys/stat.h>
+#include <stdio.h>
+
+// 64-bit FNV-1a
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static unsigned long long fnv(const void *data, size_t n, unsigned long long h)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+StageManifest::StageManifest(const std::string &path)
+: path(path)
+{
+    FILE *fp = fopen(path.c_str(), "r");
+    if (fp == NULL)
+        return;
+    char line[2000], name[2000];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long long key;
+        FileHash fh;
+        if (sscanf(line, "O %llx %1999[^\n]", &key, name) == 2) {
+            outputs[name] = key;
+        } else if (sscanf(line, "F %llx %lld %lld.%ld %1999[^\n]", &fh.hash, &fh.size, &fh.mtime, &fh.mtimensec, name) == 5) {
+            files[name] = fh;
+        } else if (sscanf(line, "X %1999[^\n]", name) == 1) {
+            outputs.erase(name);
+        }
+    }
+    fclose(fp);
+}
+
+void StageManifest::append(const std::string &line)
+{
+    FILE *fp = fopen(path.c_str(), "a");
+    if (fp == NULL)
+        throw CError("cannot write manifest %s", path.c_str());
+    fputs(line.c_str(), fp);
+    fclose(fp);
+}
+
+// written to the active session, but not to disk yet (the file may be an old version)
+static bool unsavedInSession(const std::string &file)
+{
+    PipelineSession *session = activeSession();
+    return session != NULL && session->unsaved(file.c_str());
+}
+
+// content hash of file, from the cache if its size and modification time did not change
+bool StageManifest::filehash(const std::string &file, unsigned long long &hash)
+{
+    if (unsavedInSession(file))
+        return false;
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0)
+        return false;
+#ifdef __APPLE__
+    long nsec = st.st_mtimespec.tv_nsec;
+#else
+    long nsec = st.st_mtim.tv_nsec;
+#endif
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<std::string, FileHash>::iterator it = files.find(file);
+        if (it != files.end() && it->second.size == (long long)st.st_size && it->second.mtime == (long long)st.st_mtime &&
+            it->second.mtimensec == nsec) {
+            hash = it->second.hash;
+            return true;
+        }
+    }
+
+    FILE *fp = fopen(file.c_str(), "rb");
+    if (fp == NULL)
+        return false;
+    std::vector<char> buf(1 << 20);
+    size_t n;
+    hash = FNV_OFFSET;
+    while ((n = fread(&buf[0], 1, buf.size(), fp)) > 0)
+        hash = fnv(&buf[0], n, hash);
+    fclose(fp);
+
+    FileHash fh;
+    fh.hash = hash;
+    fh.size = st.st_size;
+    fh.mtime = st.st_mtime;
+    fh.mtimensec = nsec;
+    char line[2100];
+    snprintf(line, sizeof(line), "F %016llx %lld %lld.%09ld %s\n", fh.hash, fh.size, fh.mtime, fh.mtimensec, file.c_str());
+    std::lock_guard<std::mutex> guard(lock);
+    files[file] = fh;
+    append(line);
+    return true;
+}
+
+unsigned long long StageManifest::key(const std::vector<std::string> &inputs, const std::string &params)
+{
+    unsigned long long h = fnv(params.c_str(), params.size() + 1, FNV_OFFSET);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        unsigned long long fh;
+        if (unsavedInSession(inputs[i]))
+            fh = 1; // written by an earlier step of this run, so it changed
+        else if (!filehash(inputs[i], fh))
+            fh = 0; // missing
+        h = fnv(inputs[i].c_str(), inputs[i].size() + 1, h);
+        h = fnv(&fh, sizeof(fh), h);
+    }
+    return h;
+}
+
+bool StageManifest::upToDate(const std::vector<std::string> &outs, unsigned long long key)
+{
+    for (size_t i = 0; i < outs.size(); i++) {
+        struct stat st;
+        if (stat(outs[i].c_str(), &st) != 0)
+            return false;
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<std::string, unsigned long long>::iterator it = outputs.find(outs[i]);
+        if (it == outputs.end() || it->second != key)
+            return false;
+    }
+    return true;
+}
+
+void StageManifest::record(const std::vector<std::string> &outs, unsigned long long key)
+{
+    for (size_t i = 0; i < outs.size(); i++) {
+        unsigned long long fh;
+        if (!filehash(outs[i], fh))
+            continue; // not written
+        char line[2100];
+        snprintf(line, sizeof(line), "O %016llx %s\n", key, outs[i].c_str());
+        std::lock_guard<std::mutex> guard(lock);
+        outputs[outs[i]] = key;
+        append(line);
+    }
+}
+
+void StageManifest::recordLater(const std::vector<std::string> &inputs, const std::string &params, const std::vector<std::string> &outs)
+{
+    Pending p;
+    p.inputs = inputs;
+    p.params = params;
+    p.outputs = outs;
+    std::lock_guard<std::mutex> guard(lock);
+    pending.push_back(p);
+}
+
+// the inputs that were in the session when the step ran are hashed from their files now
+void StageManifest::recordPending()
+{
+    std::vector<Pending> todo;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        todo.swap(pending);
+    }
+    for (size_t i = 0; i < todo.size(); i++)
+        record(todo[i].outputs, key(todo[i].inputs, todo[i].params));
+}
+
+void StageManifest::invalidate(const std::vector<std::string> &outs)
+{
+    for (size_t i = 0; i < outs.size(); i++) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (outputs.erase(outs[i]) > 0)
+            append("X " + outs[i] + "\n");
+    }
+}
+
+void StageManifest::save()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL)
+        throw CError("cannot write manifest %s", tmp.c_str());
+    for (std::map<std::string, FileHash>::iterator it = files.begin(); it != files.end(); ++it)
+        fprintf(fp, "F %016llx %lld %lld.%09ld %s\n", it->second.hash, it->second.size, it->second.mtime, it->second.mtimensec,
+                it->first.c_str());
+    for (std::map<std::string, unsigned long long>::iterator it = outputs.begin(); it != outputs.end(); ++it)
+        fprintf(fp, "O %016llx %s\n", it->second, it->first.c_str());
+    fclose(fp);
+    if (rename(tmp.c_str(), path.c_str()) != 0)
+        throw CError("cannot write manifest %s", path.c_str());
+}
@@ -0,0 +1,67 @@
+//
+//  Manifest.h
+//  activeLighting
+//
+//  records which inputs and parameters the output files of the processing steps were computed from
+//
+
+#ifndef Manifest_h
+#define Manifest_h
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// stage-output manifest, used to skip processing steps whose outputs are still up to date.
+// a step's key is a hash of its parameters and of the contents of its input files; after a step
+// ran, the key is recorded for each of its outputs.  a step is up to date if all of its outputs
+// exist and were recorded with the key it has now.
+// content hashes of files are cached together with their size and modification time (in
+// nanoseconds), so unchanged files are not read again on the next run.
+// inputs that are only in the active pipeline session count as changed.  outputs that a step
+// kept in the session are recorded with recordLater, and hashed by recordPending once the session
+// has written them.
+// the manifest is a text file; entries are appended as steps finish and the file is compacted by save()
+class StageManifest {
+public:
+    // load manifest from path (a missing file is an empty manifest)
+    StageManifest(const std::string &path);
+
+    // key of a step with given inputs and parameters; missing inputs are part of the key as well
+    unsigned long long key(const std::vector<std::string> &inputs, const std::string &params);
+    bool upToDate(const std::vector<std::string> &outputs, unsigned long long key);
+    // record that outputs were computed by a step with given key (and cache their content hashes)
+    void record(const std::vector<std::string> &outputs, unsigned long long key);
+    // record outputs of a step with given inputs and parameters when recordPending is called
+    void recordLater(const std::vector<std::string> &inputs, const std::string &params, const std::vector<std::string> &outputs);
+    // record the outputs passed to recordLater (which must exist as files by now)
+    void recordPending();
+    // drop the entries of outputs, so the steps producing them run again
+    void invalidate(const std::vector<std::string> &outputs);
+    // content hash of file (false if it does not exist or is only in the active session so far)
+    bool filehash(const std::string &path, unsigned long long &hash);
+
+    // rewrite the manifest file with the current entries only
+    void save();
+
+private:
+    struct FileHash {
+        unsigned long long hash;
+        long long size, mtime;
+        long mtimensec;
+    };
+    struct Pending {
+        std::vector<std::string> inputs, outputs;
+        std::string params;
+    };
+    void append(const std::string &line);
+
+    std::string path;
+    std::mutex lock;
+    std::map<std::string, unsigned long long> outputs;  // output file -> key of step that wrote it
+    std::map<std::string, FileHash> files;              // file -> content hash
+    std::vector<Pending> pending;                       // outputs to record later
+};
+
+#endif /* Manifest_h */
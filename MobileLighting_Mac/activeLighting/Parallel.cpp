@@ -0,0 +1,193 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Parallel.cpp -- simple multithreading helpers for the per-pixel stages
+//
+// DESCRIPTION
+//  Work items (row bands or indices) are handed out via an atomic counter
+//  to the calling thread and to helper threads of a pool that lives as long
+//  as the process, so a parallel call doesn't pay for creating threads.
+//  With a single thread no threads are created at all.  A parallel call
+//  offers itself to nt-1 pool threads; offers not taken by the time the
+//  caller has run out of work are withdrawn, so concurrent parallel calls
+//  (e.g. from the stage scheduler) never wait for each other.
+//  An exception thrown by a work item is rethrown in the calling thread.
+//  Helper threads count towards the caller's instrumentation scope and
+//  use its processing parameters (see Params.h) and cancellation flag
+//  (see Progress.h).
+//  Parallel calls made from within a work item run serially in that
+//  thread, so nesting (e.g. projectors in parallel, each solving with
+//  parallel row bands) does not oversubscribe the machine.
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "Parallel.h"
+#include "Instrument.h"
+#include "Params.h"
+#include "Progress.h"
+#include "imageLib.h"
+
+using namespace std;
+
+static int nthreads = 0; // 0: not yet determined
+static thread_local bool inParallel = false; // true while executing a work item
+static thread_local int threadLimit = 0; // limit set with setThreadLimit, 0: none
+
+int numThreads()
+{
+    if (nthreads <= 0) {
+        char *s = getenv("ACTIVELIGHTING_THREADS");
+        int n = (s != NULL) ? atoi(s) : 0;
+        if (n <= 0)
+            n = (int)thread::hardware_concurrency();
+        nthreads = (n > 0) ? n : 1;
+    }
+    return nthreads;
+}
+
+void setNumThreads(int n)
+{
+    nthreads = n;
+}
+
+void setThreadLimit(int n)
+{
+    threadLimit = n;
+}
+
+int getThreadLimit()
+{
+    return threadLimit;
+}
+
+// one parallel call
+struct ParallelJob {
+    const function<void(int i)> *fn;
+    int n;
+    atomic<int> next;
+    exception_ptr error;
+    mutex errorlock;
+    StageScope *scope;      // instrumentation scope of the caller
+    const ProcessingParams *params; // parameter scope of the caller
+    const atomic<bool> *cancel; // cancellation scope of the caller
+    int helpers;            // pool threads working on the job (guarded by the pool lock)
+};
+
+// pool threads and offers of parallel calls; never destroyed, so threads still waiting at
+// exit don't touch destroyed objects
+struct ThreadPool {
+    ThreadPool() : size(0) {}
+
+    mutex lock;
+    condition_variable offered, finished;
+    deque<ParallelJob *> offers;
+    int size;               // number of pool threads
+};
+static ThreadPool *pool = new ThreadPool();
+
+static void runJob(ParallelJob &job)
+{
+    inParallel = true;
+    for (int i = job.next++; i < job.n; i = job.next++) {
+        try {
+            (*job.fn)(i);
+        } catch (...) {
+            lock_guard<mutex> lock(job.errorlock);
+            if (! job.error)
+                job.error = current_exception();
+            job.next = job.n; // stop handing out work
+        }
+    }
+    inParallel = false;
+}
+
+static void poolThread()
+{
+    unique_lock<mutex> lock(pool->lock);
+    while (true) {
+        pool->offered.wait(lock, []() { return !pool->offers.empty(); });
+        ParallelJob *job = pool->offers.front();
+        pool->offers.pop_front();
+        job->helpers++;
+        lock.unlock();
+        {
+            // worker threads count towards the caller's instrumentation scope and use its parameters
+            // and cancellation flag
+            StageScopeWorker attach(job->scope);
+            ParamsScope params(job->params);
+            CancelScope cancel(job->cancel);
+            runJob(*job);
+        }
+        lock.lock();
+        if (--job->helpers == 0)
+            pool->finished.notify_all();
+    }
+}
+
+void parallelFor(int n, const function<void(int i)> &fn)
+{
+    int nt = inParallel ? 1 : min(numThreads(), n);
+    if (threadLimit > 0)
+        nt = min(nt, threadLimit);
+    if (nt <= 1) {
+        for (int i = 0; i < n; i++)
+            fn(i);
+        return;
+    }
+
+    ParallelJob job;
+    job.fn = &fn;
+    job.n = n;
+    job.next = 0;
+    job.scope = currentStageScope();
+    job.params = activeParams();
+    job.cancel = activeCancelFlag();
+    job.helpers = 0;
+    {
+        lock_guard<mutex> lock(pool->lock);
+        for (; pool->size < nt - 1; pool->size++)
+            thread(poolThread).detach();
+        for (int t = 1; t < nt; t++)
+            pool->offers.push_back(&job);
+    }
+    pool->offered.notify_all();
+
+    runJob(job);
+
+    {
+        unique_lock<mutex> lock(pool->lock);
+        pool->offers.erase(remove(pool->offers.begin(), pool->offers.end(), &job), pool->offers.end());
+        pool->finished.wait(lock, [&]() { return job.helpers == 0; });
+    }
+
+    if (job.error)
+        rethrow_exception(job.error);
+}
+
+void parallelBands(int h, int nbands, const function<void(int y0, int y1, int band)> &fn)
+{
+    nbands = max(1, min(nbands, h));
+    parallelFor(nbands, [&](int band) {
+        int y0 = (int)((long)h * band / nbands);
+        int y1 = (int)((long)h * (band + 1) / nbands);
+        fn(y0, y1, band);
+    });
+}
+
+// the bands of CFM image files (see imageLib/ImageIOcfm.cpp) are compressed with parallelFor,
+// so image I/O shares the pool and the thread limits of the caller
+static void imageIOParallelFor(int n, void (*fn)(int i, void *arg), void *arg)
+{
+    parallelFor(n, [&](int i) { fn(i, arg); });
+}
+
+static const bool imageIOParallel = (SetImageIOParallelFor(imageIOParallelFor), true);
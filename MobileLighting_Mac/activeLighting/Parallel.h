@@ -0,0 +1,33 @@
+//
+//  Parallel.h
+//  activeLighting
+//
+//  simple multithreading helpers for the per-pixel stages
+//
+
+#ifndef Parallel_h
+#define Parallel_h
+
+#include <functional>
+
+// number of worker threads used by the parallel stages
+// defaults to the number of hardware threads, can be overridden with the
+// environment variable ACTIVELIGHTING_THREADS or with setNumThreads()
+int numThreads();
+void setNumThreads(int n);
+
+// limit the parallel calls made by the calling thread to n threads (0: no limit).
+// used by the stage scheduler so that nodes running side by side share the machine
+void setThreadLimit(int n);
+int getThreadLimit();
+
+// split rows [0, h) into nbands contiguous bands and call fn(y0, y1, band) for each band,
+// running up to numThreads() bands concurrently.
+// the band layout only depends on h and nbands, not on the number of threads, so callers
+// that keep one partial result per band and combine them in band order get deterministic results
+void parallelBands(int h, int nbands, const std::function<void(int y0, int y1, int band)> &fn);
+
+// call fn(i) for i = 0 .. n-1, running up to numThreads() calls concurrently
+void parallelFor(int n, const std::function<void(int i)> &fn);
+
+#endif /* Parallel_h */
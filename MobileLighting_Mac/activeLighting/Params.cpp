@@ -0,0 +1,162 @@
+//
+//  Params.cpp
+//  activeLighting
+//
+//  tuning parameters of refinement, matching and reprojection
+//
+
+#include "Params.h"
+#include "imageLib.h"
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+using namespace cv;
+
+static const char *modenames[] = {"old", "angle", "planar"};
+
+ProcessingParams::ProcessingParams()
+: refineMode(refine_planar), maxgrad0(1.0), maxgrad1(0.1),
+  planeWindowSize(5), planeMinSupport(20), planeMaxDiff(2.0),
+  filterRadius(4), filterFraction(0.25), filterMaxDiff(4.0),
+  holeMaxWidth(5),  // since higher resolution, tried 7; back to 5 pixels, seems to be a good compromise
+  refineRadius(7),  // larger radius (used to be 3) since higher resolution
+  matchMaxDiff(0.5), ncodes(1024),
+  reprojMaxSamples(200000), reprojMaxRansac(500), reprojRansacThresh(2.0), reprojMaxIrls(20), reprojMaxErr(1.0),
+  mapExt(".pfm")
+{
+    holeBorderDiff[0] = 2;  // still sometimes need 2, e.g. Newkuba/P4 on the lamp
+    holeBorderDiff[1] = 0;
+    holeBorderDiff[2] = 1;
+}
+
+template <class T>
+static void readParam(const FileNode &section, const char *key, T &value)
+{
+    FileNode node = section[key];
+    if (!node.empty())
+        node >> value;
+}
+
+void ProcessingParams::load(const char *yamlfile)
+{
+    FileStorage fs(yamlfile, FileStorage::READ);
+    if (!fs.isOpened())
+        throw CError("cannot read parameter file %s", yamlfile);
+
+    FileNode refine = fs["refine"];
+    std::string mode;
+    readParam(refine, "mode", mode);
+    if (!mode.empty()) {
+        int m = 0;
+        while (m < 3 && mode != modenames[m])
+            m++;
+        if (m == 3)
+            throw CError("unknown refinement mode %s", mode.c_str());
+        refineMode = (refine_mode_t)m;
+    }
+    readParam(refine, "maxgrad0", maxgrad0);
+    readParam(refine, "maxgrad1", maxgrad1);
+    readParam(refine, "windowsize", planeWindowSize);
+    readParam(refine, "minsupport", planeMinSupport);
+    readParam(refine, "planemaxdiff", planeMaxDiff);
+    readParam(refine, "filterradius", filterRadius);
+    readParam(refine, "filterfraction", filterFraction);
+    readParam(refine, "filtermaxdiff", filterMaxDiff);
+    readParam(refine, "holewidth", holeMaxWidth);
+    FileNode border = refine["holeborderdiff"];
+    if (!border.empty()) {
+        std::vector<float> diffs;
+        for (FileNodeIterator it = border.begin(); it != border.end(); ++it)
+            diffs.push_back((float)*it);
+        if (diffs.size() != 3)
+            throw CError("refine: holeborderdiff needs 3 values in %s", yamlfile);
+        for (int i = 0; i < 3; i++)
+            holeBorderDiff[i] = diffs[i];
+    }
+    readParam(refine, "radius", refineRadius);
+
+    FileNode match = fs["match"];
+    readParam(match, "maxdiff", matchMaxDiff);
+    readParam(match, "ncodes", ncodes);
+
+    FileNode reproj = fs["reproject"];
+    readParam(reproj, "maxsamples", reprojMaxSamples);
+    readParam(reproj, "maxransac", reprojMaxRansac);
+    readParam(reproj, "ransacthresh", reprojRansacThresh);
+    readParam(reproj, "maxirls", reprojMaxIrls);
+    readParam(reproj, "maxerr", reprojMaxErr);
+
+    FileNode output = fs["output"];
+    readParam(output, "ext", mapExt);
+    if (mapExt != ".pfm" && mapExt != ".cfm")
+        throw CError("output: unknown map extension %s (.pfm or .cfm)", mapExt.c_str());
+}
+
+std::string ProcessingParams::describe(const char *section) const
+{
+    char buf[1000];
+    if (strcmp(section, "refine") == 0)
+        snprintf(buf, sizeof(buf), "%s %g %g %d %d %g %d %g %g %d %g %g %g %d", modenames[refineMode], maxgrad0, maxgrad1,
+                 planeWindowSize, planeMinSupport, planeMaxDiff, filterRadius, filterFraction, filterMaxDiff,
+                 holeMaxWidth, holeBorderDiff[0], holeBorderDiff[1], holeBorderDiff[2], refineRadius);
+    else if (strcmp(section, "match") == 0)
+        snprintf(buf, sizeof(buf), "%g %d", matchMaxDiff, ncodes);
+    else if (strcmp(section, "reproject") == 0)
+        snprintf(buf, sizeof(buf), "%d %d %g %d %g", reprojMaxSamples, reprojMaxRansac, reprojRansacThresh, reprojMaxIrls, reprojMaxErr);
+    else
+        throw CError("unknown parameter section %s", section);
+    return buf;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// current parameters
+
+static std::mutex defaultslock;
+static ProcessingParams defaults;
+static thread_local const ProcessingParams *active = NULL;
+
+ProcessingParams currentParams()
+{
+    if (active != NULL)
+        return *active;
+    std::lock_guard<std::mutex> lock(defaultslock);
+    return defaults;
+}
+
+void setDefaultParams(const ProcessingParams &params)
+{
+    std::lock_guard<std::mutex> lock(defaultslock);
+    defaults = params;
+}
+
+ParamsScope::ParamsScope(const ProcessingParams *params)
+: prev(active)
+{
+    active = params;
+}
+
+ParamsScope::~ParamsScope()
+{
+    active = prev;
+}
+
+const ProcessingParams *activeParams()
+{
+    return active;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// C interface
+
+// set the parameters used by the entry points from a YAML file (see ProcessingParams::load);
+// keys missing in the file keep the app's values.  yamlfile == NULL: the app's values
+extern "C" void setProcessingParams(char *yamlfile)
+{
+    ProcessingParams params;
+    if (yamlfile != NULL)
+        params.load(yamlfile);
+    setDefaultParams(params);
+}
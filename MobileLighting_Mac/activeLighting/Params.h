@@ -0,0 +1,85 @@
+//
+//  Params.h
+//  activeLighting
+//
+//  tuning parameters of refinement, matching and reprojection
+//
+
+#ifndef Params_h
+#define Params_h
+
+#include <string>
+
+enum refine_mode_t {
+    refine_old,
+    refine_angle,
+    refine_planar
+};
+
+// the parameters are passed explicitly to the functions that use them; functions whose
+// parameter argument is omitted (e.g., those called by the C entry points) use currentParams()
+struct ProcessingParams {
+    ProcessingParams();     // the values the app has always used
+
+    // refine (Decode.cpp)
+    refine_mode_t refineMode;
+    float maxgrad0;         // expected maximum gradient of code values per pixel in code direction
+    float maxgrad1;         // expected maximum gradient of code values per pixel in perpendicular direction
+    int planeWindowSize;    // # of pixels for width & height of window considered (refine_planar)
+    int planeMinSupport;
+    float planeMaxDiff;
+    int filterRadius;       // filter of isolated code values before refinement
+    float filterFraction, filterMaxDiff;
+    int holeMaxWidth;       // code holes filled before refinement
+    float holeBorderDiff[3];// max border difference of the three hole-filling passes
+    int refineRadius;
+
+    // match (Disparities.cpp)
+    float matchMaxDiff;     // maximal allowable code difference
+    int ncodes;             // code values are in [0, ncodes)
+
+    // reproject (Reproject.cpp)
+    int reprojMaxSamples;   // size of subsampled correspondence set
+    int reprojMaxRansac;    // max number of RANSAC iterations
+    float reprojRansacThresh; // RANSAC inlier threshold on disparity error
+    int reprojMaxIrls;      // max number of IRLS iterations
+    float reprojMaxErr;     // reprojected disparities further than this from the view disparities are removed
+
+    // outputs
+    std::string mapExt;     // extension of the code and disparity maps the stages name themselves,
+                            // .pfm or .cfm (compressed, see imageLib/ImageIOcfm.cpp)
+
+    // set the keys present in sections refine, match, reproject and output of an OpenCV
+    // FileStorage YAML file, e.g.
+    //   refine: { mode: planar, maxgrad0: 1.0, maxgrad1: 0.1, windowsize: 5, minsupport: 20,
+    //             planemaxdiff: 2.0, filterradius: 4, filterfraction: 0.25, filtermaxdiff: 4.0,
+    //             holewidth: 5, holeborderdiff: [ 2, 0, 1 ], radius: 7 }
+    //   match: { maxdiff: 0.5, ncodes: 1024 }
+    //   reproject: { maxsamples: 200000, maxransac: 500, ransacthresh: 2.0, maxirls: 20, maxerr: 1.0 }
+    //   output: { ext: .cfm }
+    void load(const char *yamlfile);
+
+    // the parameters of a section (refine, match or reproject) as text, part of the manifest
+    // key of the steps using them
+    std::string describe(const char *section) const;
+};
+
+// parameters of the calling thread: those of the innermost ParamsScope, otherwise the process
+// defaults.  the helper threads of a parallel call use those of the caller
+ProcessingParams currentParams();
+void setDefaultParams(const ProcessingParams &params);
+
+// use params in the calling thread (and its parallel calls) while the scope exists; the
+// object must outlive the scope.  NULL: the process defaults
+class ParamsScope {
+public:
+    ParamsScope(const ProcessingParams *params);
+    ~ParamsScope();
+private:
+    const ProcessingParams *prev;
+};
+
+// params of the innermost ParamsScope of the calling thread, NULL if there is none
+const ProcessingParams *activeParams();
+
+#endif /* Params_h */
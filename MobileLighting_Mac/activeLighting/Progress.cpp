@@ -0,0 +1,122 @@
+//
+//  Progress.cpp
+//  activeLighting
+//
+//  progress reports and cooperative cancellation of the processing stages
+//
+
+#include "Progress.h"
+#include <algorithm>
+#include <mutex>
+
+struct ProgressState {
+    ProgressState() : callback(NULL), userdata(NULL) {}
+
+    std::mutex lock;                // serializes the calls of the callback
+    std::atomic<progress_callback_t> callback;
+    void *userdata;                 // guarded by lock
+};
+
+// never destroyed, stages may still report while the process exits
+static ProgressState *state()
+{
+    static ProgressState *s = new ProgressState;
+    return s;
+}
+
+std::atomic<bool> cancelFlag(false);
+thread_local const std::atomic<bool> *threadCancelFlag = NULL;
+
+void setProgress(progress_callback_t callback, void *userdata)
+{
+    ProgressState *s = state();
+    std::lock_guard<std::mutex> guard(s->lock);
+    s->userdata = userdata;
+    s->callback = callback;
+}
+
+void reportProgress(const char *stage, double fraction)
+{
+    ProgressState *s = state();
+    if (s->callback.load(std::memory_order_relaxed) == NULL)
+        return;
+    std::lock_guard<std::mutex> guard(s->lock);
+    progress_callback_t cb = s->callback;
+    if (cb != NULL)
+        cb(stage, fraction, s->userdata);
+}
+
+void requestCancel(bool cancel)
+{
+    cancelFlag = cancel;
+}
+
+CancelScope::CancelScope(const std::atomic<bool> *flag)
+: prev(threadCancelFlag)
+{
+    threadCancelFlag = flag;
+}
+
+CancelScope::~CancelScope()
+{
+    threadCancelFlag = prev;
+}
+
+const std::atomic<bool> *activeCancelFlag()
+{
+    return threadCancelFlag;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// ProgressScope
+
+ProgressScope::ProgressScope(const char *stage, long long total)
+    : stage(stage), total(total), done(0), percent(0)
+{
+    checkCancel();
+    reportProgress(stage, 0);
+}
+
+void ProgressScope::add(long long n)
+{
+    checkCancel();
+    if (state()->callback.load(std::memory_order_relaxed) == NULL)
+        return;
+    long long d = done.fetch_add(n, std::memory_order_relaxed) + n;
+    int p = total > 0 ? (int)(100 * std::min(d, total) / total) : 100;
+    // only the thread that raises the percentage reports it, unless it was raised again meanwhile
+    int last = percent.load(std::memory_order_relaxed);
+    while (p > last) {
+        if (percent.compare_exchange_weak(last, p, std::memory_order_relaxed)) {
+            ProgressState *s = state();
+            std::lock_guard<std::mutex> guard(s->lock);
+            progress_callback_t cb = s->callback;
+            if (cb != NULL && percent.load(std::memory_order_relaxed) == p)
+                cb(stage, p / 100.0, s->userdata);
+            break;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// C interface
+
+// callback(stage, fraction, userdata) is called with the fraction (0..1) of the work of a stage
+// done so far; stages running side by side report separately.  NULL: no reports
+extern "C" void setProgressCallback(progress_callback_t callback, void *userdata)
+{
+    setProgress(callback, userdata);
+}
+
+// nonzero: stop the running calls at their next row or tile, and make the following calls
+// return right away, until processingCancel(0) is called
+extern "C" void processingCancel(int cancel)
+{
+    requestCancel(cancel != 0);
+}
+
+// whether processing is cancelled
+extern "C" int processingCancelled()
+{
+    return cancelRequested();
+}
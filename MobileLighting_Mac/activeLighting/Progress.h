@@ -0,0 +1,84 @@
+//
+//  Progress.h
+//  activeLighting
+//
+//  progress reports and cooperative cancellation of the processing stages
+//
+
+#ifndef Progress_h
+#define Progress_h
+
+#include "imageLib/Error.h"
+#include <atomic>
+
+// the long-running loops (rows of matchImages and the merges, passes of refinement, RANSAC
+// iterations, bands of reprojection and rectification) count their work in a ProgressScope,
+// which reports the fraction done to the callback set with setProgressCallback (the C entry
+// point setProgressCallback in activeLighting.h) whenever it grows by at least 1%.  the
+// callback may be called from any thread, but never concurrently.
+//
+// cancellation is a process-wide flag: while it is set, the loops throw CCancelled at their
+// next row or tile.  the exception unwinds the stage, freeing its images, and the C entry points
+// return without writing their results (processScene skips the steps not yet done).  the flag
+// stays set until it is cleared, so calls made in the meantime stop right away.  a CancelScope
+// adds a flag of its own, which only stops the calling thread (and its parallel calls and
+// scheduler workers), e.g. the requests of one client of the daemon
+
+typedef void (*progress_callback_t)(const char *stage, double fraction, void *userdata);
+
+void setProgress(progress_callback_t callback, void *userdata);
+// report fraction (0..1) of stage to the callback, if any
+void reportProgress(const char *stage, double fraction);
+
+// thrown by checkCancel()
+struct CCancelled : public CError {
+    CCancelled() : CError("processing cancelled") {}
+};
+
+extern std::atomic<bool> cancelFlag;
+extern thread_local const std::atomic<bool> *threadCancelFlag;
+
+void requestCancel(bool cancel);
+
+inline bool cancelRequested()
+{
+    return cancelFlag.load(std::memory_order_relaxed) ||
+           (threadCancelFlag != NULL && threadCancelFlag->load(std::memory_order_relaxed));
+}
+
+// throw CCancelled if cancellation was requested
+inline void checkCancel()
+{
+    if (cancelRequested())
+        throw CCancelled();
+}
+
+// also stop the calling thread while *flag is set; the flag must outlive the scope.
+// NULL: only the process-wide flag
+class CancelScope {
+public:
+    CancelScope(const std::atomic<bool> *flag);
+    ~CancelScope();
+private:
+    const std::atomic<bool> *prev;
+};
+
+// flag of the innermost CancelScope of the calling thread, NULL if there is none
+const std::atomic<bool> *activeCancelFlag();
+
+// progress of a stage of total units of work; add() may be called from several threads
+class ProgressScope {
+public:
+    ProgressScope(const char *stage, long long total);
+
+    // count n units as done, throws CCancelled if cancellation was requested
+    void add(long long n = 1);
+
+private:
+    const char *stage;
+    long long total;
+    std::atomic<long long> done;
+    std::atomic<int> percent;   // last reported
+};
+
+#endif /* Progress_h */
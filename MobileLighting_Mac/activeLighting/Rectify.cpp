@@ -15,7 +15,22 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/calib3d/calib3d.hpp>
 #include <string>
+#include <memory>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <list>
+#include <mutex>
 #include "pfmLib/ImageIOpfm.h"
+#include "imageLib/Error.h"
+#include "Parallel.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "Progress.h"
+#include "Rectify.hpp"
 #include "assert.h"
 
 using namespace cv;
@@ -100,88 +115,535 @@ void rectify(int nimages, int camera, int w, int h, char* destdir, char** matric
 
 // computemaps -- computes maps for stereo rectification based on intrinsics & extrinsics matrices
 // only needs to be computed once per stereo pair
+//
+// the maps are cached on disk, keyed by a hash of the contents of the intrinsics, extrinsics,
+// and settings files and the image size, so later sessions can memory-map them instead of
+// recomputing them.  by default the maps are stored in fixed-point format (CV_16SC2 map plus
+// CV_16UC1 interpolation table for linear remapping, rounded CV_16SC2 map for nearest-neighbor
+// remapping), which remap() uses directly on its integer path.  since remap() converts float
+// maps to the same fixed-point representation internally, this doesn't change the results.
+//
+// the maps live in a RectificationContext, one per stereo pair.  the C entry points below use
+// a single default context, which holds the maps of the last pair passed to computemaps().
 
-Mat mapx0, mapy0;
-Mat mapx1, mapy1;
-int resizing_factor;
+static RectificationContext defaultcontext;
 
-void computemaps(int width, int height, char *intrinsics, char *extrinsics, char *settings)
+static std::string rectcachedir;    // directory for cache files; empty: same as extrinsics file
+static int rectfixedpoint = 1;      // store and use fixed-point maps
+static int rectcaching = 1;         // use cache files at all
+
+#define RECTMAP_MAGIC   "RECTMAP"
+#define RECTMAP_VERSION 1
+#define RECTMAP_ALIGN   64
+
+struct RectMapHeader {
+    char magic[8];
+    int version;
+    int width, height;  // size of maps
+    int fixedpoint;
+    unsigned long long hash;
+    char pad[RECTMAP_ALIGN - 8 - 4*sizeof(int) - sizeof(unsigned long long)];
+};
+
+// set cache directory (NULL: directory of extrinsics file), whether to use fixed-point maps,
+// and whether to use the cache at all
+extern "C" void setRectificationCache(char *cachedir, int fixedpoint, int enabled)
+{
+    rectcachedir = (cachedir != NULL) ? cachedir : "";
+    rectfixedpoint = fixedpoint;
+    rectcaching = enabled;
+}
+
+// FNV-1a hash of file contents, combined with previous hash h
+static unsigned long long hashfile(const char *filename, unsigned long long h)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+        throw CError("hashfile: cannot open %s", filename);
+    unsigned char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            h ^= buf[i];
+            h *= 1099511628211ULL;
+        }
+    }
+    fclose(fp);
+    return h;
+}
+
+static size_t alignsize(size_t n)
+{
+    return (n + RECTMAP_ALIGN - 1) / RECTMAP_ALIGN * RECTMAP_ALIGN;
+}
+
+RectificationContext::RectificationContext() : resizing_factor(1), fixedpoint(0)
+{
+}
+
+bool RectificationContext::empty() const
+{
+    return fixedpoint ? lmap[0].empty() : mapx[0].empty();
+}
+
+// the maps stored in the cache file, in order
+std::vector<Mat*> RectificationContext::cachedmaps(int fixedpoint)
+{
+    if (fixedpoint)
+        return {&lmap[0], &ltab[0], &nmap[0], &lmap[1], &ltab[1], &nmap[1]};
+    else
+        return {&mapx[0], &mapy[0], &mapx[1], &mapy[1]};
+}
+
+static std::vector<int> cachedtypes(int fixedpoint)
+{
+    if (fixedpoint)
+        return {CV_16SC2, CV_16UC1, CV_16SC2, CV_16SC2, CV_16UC1, CV_16SC2};
+    else
+        return {CV_32FC1, CV_32FC1, CV_32FC1, CV_32FC1};
+}
+
+// try to memory-map maps of size ms from cache file, returns false if file is missing or doesn't match
+bool RectificationContext::loadmaps(const std::string &fname, cv::Size ms, unsigned long long hash, int fixedpoint)
+{
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    size_t expected = sizeof(RectMapHeader);
+    std::vector<int> types = cachedtypes(fixedpoint);
+    for (size_t i = 0; i < types.size(); i++)
+        expected += alignsize(ms.area() * Mat(1, 1, types[i]).elemSize());
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != expected) {
+        close(fd);
+        return false;
+    }
+    void *mem = mmap(NULL, expected, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return false;
+    std::shared_ptr<void> mapping(mem, [expected](void *p) { munmap(p, expected); });
+
+    RectMapHeader *hdr = (RectMapHeader *)mem;
+    if (strncmp(hdr->magic, RECTMAP_MAGIC, 8) != 0 || hdr->version != RECTMAP_VERSION || hdr->hash != hash ||
+        hdr->width != ms.width || hdr->height != ms.height || hdr->fixedpoint != fixedpoint)
+        return false;
+
+    std::vector<Mat*> maps = cachedmaps(fixedpoint);
+    uchar *data = (uchar *)mem + sizeof(RectMapHeader);
+    for (size_t i = 0; i < maps.size(); i++) {
+        *maps[i] = Mat(ms, types[i], data); // read-only, backed by the mapping
+        data += alignsize(maps[i]->total() * maps[i]->elemSize());
+    }
+    this->mapping = mapping;
+    this->fixedpoint = fixedpoint;
+    return true;
+}
+
+// write maps to cache file (via temporary file, so concurrent sessions never see partial files)
+void RectificationContext::savemaps(const std::string &fname, cv::Size ms, unsigned long long hash, int fixedpoint)
+{
+    static std::atomic<int> tmpcount(0); // contexts of one process may write the same file concurrently
+    std::string tmpname = fname + ".tmp" + std::to_string(getpid()) + "_" + std::to_string(tmpcount++);
+    FILE *fp = fopen(tmpname.c_str(), "wb");
+    if (fp == NULL) {
+        logPrintf(log_warning, "cannot write rectification map cache %s\n", fname.c_str());
+        return;
+    }
+    RectMapHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RECTMAP_MAGIC, strlen(RECTMAP_MAGIC));
+    hdr.version = RECTMAP_VERSION;
+    hdr.width = ms.width;
+    hdr.height = ms.height;
+    hdr.fixedpoint = fixedpoint;
+    hdr.hash = hash;
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+
+    std::vector<Mat*> maps = cachedmaps(fixedpoint);
+    std::vector<char> zeros(RECTMAP_ALIGN, 0);
+    for (size_t i = 0; i < maps.size(); i++) {
+        Mat &m = *maps[i];
+        size_t rowbytes = m.cols * m.elemSize();
+        for (int y = 0; y < m.rows; y++)
+            ok = ok && fwrite(m.ptr(y), 1, rowbytes, fp) == rowbytes;
+        size_t n = m.total() * m.elemSize();
+        size_t padding = alignsize(n) - n;
+        ok = ok && fwrite(&zeros[0], 1, padding, fp) == padding;
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if (ok && rename(tmpname.c_str(), fname.c_str()) == 0) {
+        logPrintf(log_verbose, "wrote rectification map cache %s\n", fname.c_str());
+    } else {
+        logPrintf(log_warning, "cannot write rectification map cache %s\n", fname.c_str());
+        unlink(tmpname.c_str());
+    }
+}
+
+void RectificationContext::computemaps(int width, int height, const char *intrinsics, const char *extrinsics, const char *settings)
 {
+    StageScope scope("rectify: compute maps");
     FileStorage calibSettings(settings, FileStorage::READ);
     calibSettings["Settings"]["Resizing factor"] >> resizing_factor;
     cv::Size ims(width, height);
-    std::clog << "computing maps " << ims << std::endl;
+    cv::Size ms = ims*resizing_factor;
+
+    // look for cached maps first
+    std::string cachefile;
+    unsigned long long hash = 14695981039346656037ULL;
+    if (rectcaching) {
+        hash = hashfile(intrinsics, hash);
+        hash = hashfile(extrinsics, hash);
+        hash = hashfile(settings, hash);
+        char buffer[100];
+        sprintf(buffer, "/rectmaps_%016llx_%dx%d%s.bin", hash, ms.width, ms.height, rectfixedpoint ? "_fixed" : "");
+        std::string dir = rectcachedir;
+        if (dir.empty()) {
+            std::string ext(extrinsics);
+            size_t slash = ext.rfind('/');
+            dir = (slash == std::string::npos) ? "." : ext.substr(0, slash);
+        }
+        cachefile = dir + buffer;
+        if (loadmaps(cachefile, ms, hash, rectfixedpoint)) {
+            logPrintf(log_verbose, "loaded cached maps %s\n", cachefile.c_str());
+            return;
+        }
+    }
+
+    logPrintf(log_verbose, "computing maps %dx%d\n", ims.width, ims.height);
     FileStorage fintr(intrinsics, FileStorage::READ);
     FileStorage fextr(extrinsics, FileStorage::READ);
     Mat k,d,rect0,rect1,proj0,proj1;
-    std::clog << "reading camera matrices..." << std::endl;
+    logPrintf(log_verbose, "reading camera matrices...\n");
     fintr["Camera_Matrix"] >> k;
     fintr["Distortion_Coefficients"] >> d;
     fextr["Rectification_Parameters"]["Rectification_Transformation_1"] >> rect0;
     fextr["Rectification_Parameters"]["Projection_Matrix_1"] >> proj0;
     fextr["Rectification_Parameters"]["Rectification_Transformation_2"] >> rect1;
     fextr["Rectification_Parameters"]["Projection_Matrix_2"] >> proj1;
-    std::clog << "read camera matrices" << std::endl;
-    std::clog << "undistorting first maps..." << std::endl;
-    initUndistortRectifyMap(k, d, rect0, proj0, ims*resizing_factor, CV_32FC1, mapx0, mapy0);
-    std::clog << "undistorting second maps..." << std::endl;
-    initUndistortRectifyMap(k, d, rect1, proj1, ims*resizing_factor, CV_32FC1, mapx1, mapy1);
-    std::clog << "done computing maps" << mapx0.size() << std::endl;
+    logPrintf(log_verbose, "read camera matrices\n");
+    mapping.reset();
+    for (int c = 0; c < 2; c++) {
+        lmap[c].release(); ltab[c].release(); nmap[c].release();
+    }
+    logPrintf(log_verbose, "undistorting first maps...\n");
+    initUndistortRectifyMap(k, d, rect0, proj0, ms, CV_32FC1, mapx[0], mapy[0]);
+    logPrintf(log_verbose, "undistorting second maps...\n");
+    initUndistortRectifyMap(k, d, rect1, proj1, ms, CV_32FC1, mapx[1], mapy[1]);
+    logPrintf(log_verbose, "done computing maps %dx%d\n", mapx[0].cols, mapx[0].rows);
+
+    fixedpoint = rectfixedpoint;
+    if (fixedpoint) {
+        for (int c = 0; c < 2; c++) {
+            convertMaps(mapx[c], mapy[c], lmap[c], ltab[c], CV_16SC2, false);
+            Mat unused;
+            convertMaps(mapx[c], mapy[c], nmap[c], unused, CV_16SC2, true);
+            mapx[c].release(); mapy[c].release();
+        }
+    }
+    if (rectcaching)
+        savemaps(cachefile, ms, hash, rectfixedpoint);
 }
 
-extern "C" void rectifyDecoded(int camera, char *impath, char *outpath)
+void computemaps(int width, int height, char *intrinsics, char *extrinsics, char *settings)
+{
+    defaultcontext.computemaps(width, height, intrinsics, extrinsics, settings);
+}
+
+// in-memory cache of contexts for long-running processes, most recently used first.
+// entries are keyed by image size, the files (with size and modification time) and the map type
+struct CachedContext {
+    std::string key;
+    std::shared_ptr<const RectificationContext> ctx;
+};
+static std::mutex contextlock;
+static std::list<CachedContext> contexts;
+static int maxcontexts = 0;
+
+static std::string filestamp(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return path;
+#ifdef __APPLE__
+    long nsec = st.st_mtimespec.tv_nsec;
+#else
+    long nsec = st.st_mtim.tv_nsec;
+#endif
+    return std::string(path) + ":" + std::to_string((long long)st.st_size) + ":" + std::to_string((long long)st.st_mtime) + "." + std::to_string(nsec);
+}
+
+std::shared_ptr<const RectificationContext> rectificationContext(int width, int height, const char *intrinsics, const char *extrinsics, const char *settings)
+{
+    std::string key = std::to_string(width) + "x" + std::to_string(height) + " " + filestamp(intrinsics) + " " + filestamp(extrinsics) + " " +
+                      filestamp(settings) + (rectfixedpoint ? " fixed" : "");
+    {
+        std::lock_guard<std::mutex> guard(contextlock);
+        for (std::list<CachedContext>::iterator it = contexts.begin(); it != contexts.end(); ++it) {
+            if (it->key == key) {
+                contexts.splice(contexts.begin(), contexts, it);
+                return it->ctx;
+            }
+        }
+    }
+    std::shared_ptr<RectificationContext> ctx = std::make_shared<RectificationContext>();
+    ctx->computemaps(width, height, intrinsics, extrinsics, settings);
+    std::lock_guard<std::mutex> guard(contextlock);
+    if (maxcontexts > 0) {
+        contexts.push_front({key, ctx});
+        while ((int)contexts.size() > maxcontexts)
+            contexts.pop_back();
+    }
+    return ctx;
+}
+
+// keep the maps of up to npairs stereo pairs in memory (0: none, the default)
+extern "C" void setRectificationContextCache(int npairs)
+{
+    std::lock_guard<std::mutex> guard(contextlock);
+    maxcontexts = std::max(npairs, 0);
+    while ((int)contexts.size() > maxcontexts)
+        contexts.pop_back();
+}
+
+// maps for given camera: map1/map2 for linear remapping, nmap1/nmap2 for nearest-neighbor remapping
+void RectificationContext::getmaps(int camera, Mat &map1, Mat &map2, Mat &nmap1, Mat &nmap2) const
+{
+    int c = (camera == 0) ? 0 : 1;
+    if (fixedpoint) {
+        map1 = lmap[c];
+        map2 = ltab[c];
+        nmap1 = nmap[c];
+        nmap2 = Mat();
+    } else {
+        map1 = nmap1 = mapx[c];
+        map2 = nmap2 = mapy[c];
+    }
+}
+
+// single-pass rectification of decoded images
+//
+// computes the same result as two full-size remaps (linear and nearest neighbor), their merge,
+// a 180° rotation (stereoRectify() rotates the maps) and a resize to the input size, but
+// without any intermediate images: for each output pixel, the needed pixels of the
+// supersampled rectified image are computed directly from the maps, with the rotation and
+// the downscaling folded into the index computation.  each supersampled pixel is the linear
+// interpolation of the source, unless one of the 4 source pixels is UNK or outside the image,
+// or it differs from the nearest-neighbor value by more than maxdiff, in which case the nearest
+// value is used.  remap()'s fixed-point arithmetic (1/32 pixel) is reproduced exactly.
+// resize() taps with zero weight are skipped (resize() would turn them into NaN if they are UNK);
+// otherwise the result can differ from resize() only in the last bit, depending on its SIMD path.
+
+// samples the supersampled rectified image at (sx, sy)
+struct DecodedSampler {
+    Mat src;                    // unrectified decoded image (CV_32FC1)
+    Mat map1, map2, nmap1;      // maps as returned by getmaps
+    bool fixedpoint;            // map1 is CV_16SC2 (with table map2), otherwise CV_32FC1 x and y maps
+    float maxdiff;
+    float wtab[INTER_TAB_SIZE * INTER_TAB_SIZE][4]; // bilinear weights, same as remap()
+
+    DecodedSampler(const RectificationContext &ctx, Mat image, int camera, float maxdiff_) : src(image), maxdiff(maxdiff_) {
+        Mat nmap2;
+        ctx.getmaps(camera, map1, map2, nmap1, nmap2);
+        fixedpoint = (map1.type() == CV_16SC2);
+        for (int fy = 0; fy < INTER_TAB_SIZE; fy++) {
+            for (int fx = 0; fx < INTER_TAB_SIZE; fx++) {
+                float ax = 1.f / INTER_TAB_SIZE * fx, ay = 1.f / INTER_TAB_SIZE * fy;
+                float *w = wtab[fy * INTER_TAB_SIZE + fx];
+                w[0] = (1.f - ay) * (1.f - ax);
+                w[1] = (1.f - ay) * ax;
+                w[2] = ay * (1.f - ax);
+                w[3] = ay * ax;
+            }
+        }
+    }
+
+    inline float pixel(int x, int y) const {
+        if ((unsigned)x >= (unsigned)src.cols || (unsigned)y >= (unsigned)src.rows)
+            return INFINITY;
+        return ((const float *)(src.data + y * src.step[0]))[x];
+    }
+
+    float operator()(int sx, int sy) const {
+        int ix, iy, tab, nx, ny;
+        if (fixedpoint) {
+            const short *l = (const short *)(map1.data + sy * map1.step[0]) + 2 * sx;
+            const short *n = (const short *)(nmap1.data + sy * nmap1.step[0]) + 2 * sx;
+            ix = l[0];
+            iy = l[1];
+            tab = ((const ushort *)(map2.data + sy * map2.step[0]))[sx] & (INTER_TAB_SIZE * INTER_TAB_SIZE - 1);
+            nx = n[0];
+            ny = n[1];
+        } else {
+            float mx = ((const float *)(map1.data + sy * map1.step[0]))[sx];
+            float my = ((const float *)(map2.data + sy * map2.step[0]))[sx];
+            int X = cvRound(mx * INTER_TAB_SIZE), Y = cvRound(my * INTER_TAB_SIZE);
+            ix = X >> INTER_BITS;
+            iy = Y >> INTER_BITS;
+            tab = (Y & (INTER_TAB_SIZE - 1)) * INTER_TAB_SIZE + (X & (INTER_TAB_SIZE - 1));
+            nx = cvRound(mx);
+            ny = cvRound(my);
+        }
+        float nearest = pixel(nx, ny);
+
+        float v0 = pixel(ix, iy), v1 = pixel(ix + 1, iy);
+        float v2 = pixel(ix, iy + 1), v3 = pixel(ix + 1, iy + 1);
+        if (v0 == INFINITY || v1 == INFINITY || v2 == INFINITY || v3 == INFINITY)
+            return nearest;
+        const float *w = wtab[tab];
+        float linear = v0 * w[0] + v1 * w[1] + v2 * w[2] + v3 * w[3];
+        return (fabs(linear - nearest) <= maxdiff) ? linear : nearest;
+    }
+};
+
+// taps and weights of resize() with INTER_LINEAR from ssize to dsize pixels
+static void resizetaps(int ssize, int dsize, std::vector<int> &tap, std::vector<float> &wgt)
+{
+    double scale = (double)ssize / dsize;
+    tap.resize(2 * dsize);
+    wgt.resize(2 * dsize);
+    for (int d = 0; d < dsize; d++) {
+        float f = (float)((d + 0.5) * scale - 0.5);
+        int s = cvFloor(f);
+        f -= s;
+        if (s < 0) {
+            f = 0;
+            s = 0;
+        }
+        if (s >= ssize - 1) {
+            f = 0;
+            s = ssize - 1;
+        }
+        tap[2*d] = s;
+        tap[2*d + 1] = min(s + 1, ssize - 1);
+        wgt[2*d] = 1.f - f;
+        wgt[2*d + 1] = f;
+    }
+}
+
+RectifiedView::RectifiedView(const RectificationContext &ctx, int camera, const Mat &image)
 {
-    printf("rectifying decoded image...\n");
-    Mat image, im_linear, im_nearest, image2;
-    Mat mapx, mapy;
     const float maxdiff = 0.5;
-    const int imtype = CV_32FC1;
-    
-    mapx = (camera == 0) ? mapx0 : mapx1;
-    mapy = (camera == 0) ? mapy0 : mapy1;
-    
-    
-    
-    ReadFilePFM(image, string(impath));
-    cv::Size ims = image.size() * resizing_factor;
-    
-    image2 = Mat(ims, imtype, 1);
-    im_linear = Mat(ims, imtype, 1);
-    im_nearest = Mat(ims, imtype, 1);
-    remap(image, im_linear, mapx, mapy, INTER_LINEAR, BORDER_CONSTANT, INFINITY);
-    remap(image, im_nearest, mapx, mapy, INTER_NEAREST, BORDER_CONSTANT, INFINITY);
-    
-    for (int j = 0; j < ims.height; ++j) {
-        for (int i = 0; i < ims.width; ++i) {
-            float val_linear = im_linear.at<float>(j,i);
-            float val_nearest = im_nearest.at<float>(j,i);
-            float val;
-            if (val_linear != INFINITY && fabs(val_linear - val_nearest) <= maxdiff) {
-                val = val_linear;
-            } else {
-                val = val_nearest;
+    if (ctx.empty())
+        throw CError("rectifyDecoded: maps have not been computed");
+    if (image.type() != CV_32FC1)
+        throw CError("rectifyDecoded: decoded image must have a single float band");
+    sample = std::make_shared<DecodedSampler>(ctx, image, camera, maxdiff);
+    resizing_factor = ctx.resizing_factor;
+    w = image.cols;
+    h = image.rows;
+    sw = w * resizing_factor; // supersampled size
+    sh = h * resizing_factor;
+    if (sample->map1.cols != sw || sample->map1.rows != sh)
+        throw CError("rectifyDecoded: maps were computed for a different image size");
+
+    resizetaps(sw, w, xtap, xwgt);
+    resizetaps(sh, h, ytap, ywgt);
+}
+
+void RectifiedView::tile(int y0, int y1, float *dst, size_t stride) const
+{
+    const DecodedSampler &sample = *this->sample;
+    for (int y = y0; y < y1; y++) {
+        float *o = dst + (y - y0) * stride;
+        for (int x = 0; x < w; x++) {
+            if (resizing_factor == 2) { // resize() uses INTER_AREA in this case
+                int sx = sw - 1 - 2*x, sy = sh - 1 - 2*y;
+                o[x] = ((sample(sx, sy) + sample(sx - 1, sy)) + (sample(sx, sy - 1) + sample(sx - 1, sy - 1))) * 0.25f;
+                continue;
+            }
+            float sum = 0;
+            for (int j = 0; j < 2; j++) {
+                float wy = ywgt[2*y + j];
+                if (wy == 0)
+                    continue;
+                int sy = sh - 1 - ytap[2*y + j]; // undo 180° rotation
+                float rowsum = 0;
+                for (int i = 0; i < 2; i++) {
+                    float wx = xwgt[2*x + i];
+                    if (wx == 0)
+                        continue;
+                    int sx = sw - 1 - xtap[2*x + i];
+                    rowsum += wx * sample(sx, sy);
+                }
+                sum += wy * rowsum;
             }
-            image2.at<float>(j,i) = val;
+            o[x] = sum;
         }
     }
-    
-    Mat image2_rotated;
-    rotate(image2, image2_rotated, ROTATE_180); // for some reason, stereoRectify() rotates the maps by 180°, so need to unrotate them
-    resize(image2_rotated, image2_rotated, image.size());
-    WriteFilePFM(image2_rotated, outpath, 1);
 }
 
-extern "C" void rectifyAmbient(int camera, char *impath, char *outpath) {
-    printf("rectifying ambient image...\n");
-    Mat image = imread(impath);
-    Mat mapx, mapy;
+void RectifiedView::materialize(float *dst, size_t stride) const
+{
+    instrumentCount("pixels processed", (long long)w * h);
+    parallelBands(h, 4 * numThreads(), [&](int y0, int y1, int) {
+        checkCancel();
+        tile(y0, y1, dst + y0 * stride, stride);
+    });
+}
+
+void RectificationContext::rectifyDecoded(int camera, const Mat &image, Mat &out) const
+{
+    RectifiedView view(*this, camera, image);
+    out.create(image.size(), CV_32FC1);
+    view.materialize((float *)out.data, out.step[0] / sizeof(float));
+}
+
+extern "C" void rectifyDecoded(int camera, char *impath, char *outpath)
+try {
+    StageScope scope("rectify");
+    logPrintf(log_verbose, "rectifying decoded image...\n");
+    Mat image, image2;
+    ReadFilePFM(image, string(impath));
+    defaultcontext.rectifyDecoded(camera, image, image2);
+    WriteFilePFM(image2, outpath, 1);
+} catch (CCancelled &) {
+}
+
+void RectificationContext::rectifyAmbient(int camera, const Mat &image, Mat &out) const
+{
+    Mat map1, map2, nmap1, nmap2;
     const int imtype = CV_32FC1;
     Mat image2 = Mat(image.size() * resizing_factor, imtype, 1);
 
-    mapx = (camera == 0) ? mapx0 : mapx1;
-    mapy = (camera == 0) ? mapy0 : mapy1;
+    if (empty())
+        throw CError("rectifyAmbient: maps have not been computed");
+    getmaps(camera, map1, map2, nmap1, nmap2);
     
-    remap(image, image2, mapx, mapy, INTER_LINEAR, BORDER_CONSTANT, 0);
-    resize(image2, image2, image.size());
+    remap(image, image2, map1, map2, INTER_LINEAR, BORDER_CONSTANT, 0);
+    resize(image2, out, image.size());
+}
+
+extern "C" void rectifyAmbient(int camera, char *impath, char *outpath) {
+    StageScope scope("rectify ambient");
+    logPrintf(log_verbose, "rectifying ambient image...\n");
+    Mat image = imread(impath);
+    Mat image2;
+    defaultcontext.rectifyAmbient(camera, image, image2);
     imwrite(outpath, image2);
 }
+
+// rectify many images of several stereo pairs concurrently, one job per worker.
+// (the per-row parallelism of rectifyDecoded is switched off inside the jobs)
+void rectifyBatch(const std::vector<RectificationContext> &pairs, const std::vector<RectifyJob> &jobs)
+{
+    ProgressScope progress("rectify", jobs.size());
+    parallelFor((int)jobs.size(), [&](int i) {
+        checkCancel();
+        const RectifyJob &job = jobs[i];
+        if (job.pair < 0 || job.pair >= (int)pairs.size())
+            throw CError("rectifyBatch: unknown stereo pair %d", job.pair);
+        const RectificationContext &ctx = pairs[job.pair];
+        Mat image, image2;
+        if (job.ambient) {
+            image = imread(job.inpath);
+            ctx.rectifyAmbient(job.camera, image, image2);
+            imwrite(job.outpath, image2);
+        } else {
+            ReadFilePFM(image, job.inpath);
+            ctx.rectifyDecoded(job.camera, image, image2);
+            WriteFilePFM(image2, job.outpath, 1);
+        }
+        progress.add();
+    });
+}
@@ -1,4 +1,3 @@
-
 //
 //  Header.h
 //  ImgProcessor_Mac
@@ -9,6 +8,86 @@
 
 #ifndef Header_h
 #define Header_h
+
+#include <opencv2/core/core.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+// rectification state for one stereo pair: the maps of both cameras and the resizing factor.
+// computemaps() must be called before rectifying; after that, the rectify methods only read
+// the context, so one context can be used by several threads at once, and several contexts
+// (one per stereo pair) can be used concurrently.
+class RectificationContext {
+public:
+    RectificationContext();
+
+    // computes (or loads from the cache) the maps for images of size width x height
+    void computemaps(int width, int height, const char *intrinsics, const char *extrinsics, const char *settings);
+    bool empty() const;
+
+    // maps for given camera: map1/map2 for linear remapping, nmap1/nmap2 for nearest-neighbor remapping
+    void getmaps(int camera, cv::Mat &map1, cv::Mat &map2, cv::Mat &nmap1, cv::Mat &nmap2) const;
+
+    // rectify decoded image (CV_32FC1) / ambient image; result has same size as image
+    void rectifyDecoded(int camera, const cv::Mat &image, cv::Mat &out) const;
+    void rectifyAmbient(int camera, const cv::Mat &image, cv::Mat &out) const;
+
+    int resizing_factor;
+
+private:
+    std::vector<cv::Mat*> cachedmaps(int fixedpoint);
+    bool loadmaps(const std::string &fname, cv::Size ms, unsigned long long hash, int fixedpoint);
+    void savemaps(const std::string &fname, cv::Size ms, unsigned long long hash, int fixedpoint);
+
+    cv::Mat mapx[2], mapy[2];           // float maps (only kept if fixed-point maps are disabled)
+    cv::Mat lmap[2], ltab[2], nmap[2];  // fixed-point maps: linear map, linear interpolation table, nearest map
+    int fixedpoint;                     // whether the fixed-point maps are used
+    std::shared_ptr<void> mapping;      // memory-mapped cache file backing the maps
+};
+
+struct DecodedSampler;
+
+// rectified view of a decoded image (CV_32FC1): rectifies the image with the maps of the context
+// into a caller's buffer, without going through the remapped supersampled image that
+// rectifyDecoded used to resize.  the view references (does not copy) the image and the maps
+class RectifiedView {
+public:
+    RectifiedView(const RectificationContext &ctx, int camera, const cv::Mat &image);
+    int width() const { return w; }
+    int height() const { return h; }
+
+    // compute the whole rectified image into dst (row stride in floats), bands of rows run
+    // concurrently on the worker pool
+    void materialize(float *dst, size_t stride) const;
+
+private:
+    // compute rectified rows y0 .. y1-1 into dst
+    void tile(int y0, int y1, float *dst, size_t stride) const;
+
+    std::shared_ptr<DecodedSampler> sample;
+    int resizing_factor;
+    int w, h, sw, sh;                   // size of image and of supersampled rectified image
+    std::vector<int> xtap, ytap;        // downscaling taps and weights
+    std::vector<float> xwgt, ywgt;
+};
+
+// one rectification job of a batch: rectify inpath with the maps of camera of pairs[pair]
+struct RectifyJob {
+    int pair;
+    int camera;
+    bool ambient;       // ambient image (read with imread), otherwise decoded PFM image
+    std::string inpath, outpath;
+};
+
+// context with the maps for images of size width x height, taken from the in-memory cache if
+// it is enabled (setRectificationContextCache) and has them, otherwise computed as by computemaps()
+std::shared_ptr<const RectificationContext> rectificationContext(int width, int height, const char *intrinsics,
+                                                                 const char *extrinsics, const char *settings);
+
+// run jobs concurrently on the worker pool; all contexts must have their maps computed
+void rectifyBatch(const std::vector<RectificationContext> &pairs, const std::vector<RectifyJob> &jobs);
+
 void computemaps(int, int, char *, char *, char *);
-void rectifyDecoded(int, char *, char *);
+extern "C" void rectifyDecoded(int, char *, char *);
 #endif /* Header_h */
@@ -40,144 +40,96 @@
 #include "imageLib/imageLib.h"
 #include "Utils.h"
 #include "flowIO.h"
-#include "opencv/cv.h"
+#include <opencv2/core/core.hpp>
+#include "Parallel.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "Progress.h"
+#include "Params.h"
+#include "Session.h"
+#include <random>
+#include <algorithm>
 
 // factors to divide x, y, u, and v by for improved numerical stability
 #define SCALE  1000.0
 #define VSCALE 1000.0    // try separate factor for v
 #define DSCALE 100.0   // try separate factor for d
 
-void writeMat(cv::Mat A, const char *fname)
-{
-    FILE *fp = fopen(fname, "w");
-    for (int i = 0; i < A.rows; i++){
-	for (int j = 0; j < A.cols; j++){
-	    fprintf(fp, "%f\t", A.at<float>(i,j));
-	}
-	fprintf(fp, "\n");
-    }
-    fclose(fp);
-}
-
-// attempt at new version
-void SolveProjectionCV(CFloatImage disp, CFloatImage codeu, CFloatImage codev, CByteImage badmap, double *M, int step)
-{
-    CShape sh = disp.Shape();
-    int x, y, w = sh.width, h = sh.height;
-    int verbose = 1;
-
-    //if (step < 3) 
-    //step = 3;  // always use median over 3x3 windows, so no smaller step size allowed
-
-    if (verbose) printf("building matrix (step=%d)\n", step);
-
-    // count unknowns:
-    int cntd = 0;
-    int cntc = 0;
-    int cnt = 0;
-    cv::Mat A;
-    vector<float> bvec;
-    // estimate the matrix
-//    WriteImageVerb(badmap, "/Users/nicholas/Desktop/badmap.pgm", 1);
-
-    
-    for (y = step; y < h-step; y += step) {
-	uchar *bad = &badmap.Pixel(0, y, 0);
-        
-	for (x=step; x < w-step; x += step) {
-	    if (bad[x])		// used for robust fit
-		continue;
+// normal equations A'A x = A'b of the projection-matrix system, accumulated in double precision
+// one point contributes the two equations shown at the top of this file; each has only 7
+// nonzero coefficients, so only those are accumulated (upper triangle of A'A)
+struct NormalEquations {
+    double ATA[11][11];
+    double ATb[11];
+    int nrows; // number of equations (rows of A)
 
-	    float d = disp.Pixel(x, y, 0);
-	    float u = codeu.Pixel(x, y, 0);
-	    float v = codev.Pixel(x, y, 0);
-
-	    // abandonded median filter idea, didn't work out
-	    //float d = median3x3(disp, x, y); // median seems to be ok for disparities
-	    //float u = median3x3(codeu, x, y); // ..but NOT for code values!
-	    //float v = median3x3(codev, x, y);
-
-	    cnt++;
-
-	    if (d == UNK )
-		cntd++;
-
-	    if (u == UNK || v == UNK)
-		cntc++;
-
-	    if (d == UNK || u == UNK || v == UNK )
-		continue;
-
-	    d /= DSCALE;
-	    u /= SCALE;
-	    v /= VSCALE;
-	    float xx = x / SCALE;
-	    float yy = y / SCALE;
-
-	    cv::Mat Arow(2,11,CV_32FC1);
-
-	    // even row (first equation)
-	    Arow.at<float>(0,0) =  xx;   Arow.at<float>(0,1) =  yy;   Arow.at<float>(0,2) =   d; Arow.at<float>(0,3) = 1;
-	    Arow.at<float>(0,4) =   0;   Arow.at<float>(0,5) =   0;   Arow.at<float>(0,6) =   0; Arow.at<float>(0,7) = 0;
-	    Arow.at<float>(0,8) = -xx*u; Arow.at<float>(0,9) = -yy*u; Arow.at<float>(0,10) = -d*u;
-	    bvec.push_back(u);
-
-	    // odd row (second equation)
-	    Arow.at<float>(1,0) =   0;   Arow.at<float>(1,1) =   0;   Arow.at<float>(1,2) =   0; Arow.at<float>(1,3) = 0;
-	    Arow.at<float>(1,4) =  xx;   Arow.at<float>(1,5) =  yy;   Arow.at<float>(1,6) =   d; Arow.at<float>(1,7) = 1;
-	    Arow.at<float>(1,8) = -xx*v; Arow.at<float>(1,9) = -yy*v; Arow.at<float>(1,10) = -d*v;
-	    bvec.push_back(v);
+    NormalEquations() { clear(); }
 
-	    if(A.cols == 0){
-		A = Arow;
-	    }else{
-		A.push_back(Arow);
-	    }
-	}
+    void clear() {
+        memset(ATA, 0, sizeof(ATA));
+        memset(ATb, 0, sizeof(ATb));
+        nrows = 0;
     }
 
-    if (verbose)
-	printf("unknown d: %.2f%%, unknown code: %.2f%%\n", 100.0*cntd/cnt, 100.0*cntc/cnt);
-    if (/* DISABLES CODE */ (0) && verbose) printf("solving matrix\n");
-
-    cv::Mat b(bvec);
-
-    cv::Mat sol;
-    cv::solve(A,b,sol,cv::DECOMP_LU | cv::DECOMP_NORMAL);  // seems to work more reliably and faster than SVD
-//    cv::solve(A,b,sol,cv::DECOMP_SVD);
-    //cv::solve(A,b,sol,cv::DECOMP_QR);
-    printf("A: %d x %d\n", A.rows, A.cols);
-    //printf("b: %d x %d\n", b.rows, b.cols);
-    //printf("sol: %d x %d\n", sol.rows, sol.cols);
-    for(int i = 0 ;i < sol.rows; i++){
-	for(int j = 0; j < sol.cols; j++){
-	    M[i*sol.cols+j] = sol.at<float>(i,j);
-	}
+    // add equation a[] x = b with nonzero coefficients at column indices idx[0..6] (ascending)
+    void addRow(const int *idx, const double *a, double b, double wgt) {
+        for (int i = 0; i < 7; i++) {
+            double ai = wgt * a[i];
+            double *row = ATA[idx[i]];
+            for (int j = i; j < 7; j++)
+                row[idx[j]] += ai * a[j];
+            ATb[idx[i]] += ai * b;
+        }
+        nrows++;
     }
 
-    M[11] = 1;
+    // add both equations for scene point (xx, yy, d) seen at (u, v) in the new view (all scaled)
+    void addPoint(double xx, double yy, double d, double u, double v, double wgt = 1.0) {
+        static const int idxu[7] = {0, 1, 2, 3, 8, 9, 10};
+        static const int idxv[7] = {4, 5, 6, 7, 8, 9, 10};
+        double au[7] = {xx, yy, d, 1, -xx*u, -yy*u, -d*u};
+        double av[7] = {xx, yy, d, 1, -xx*v, -yy*v, -d*v};
+        addRow(idxu, au, u, wgt);
+        addRow(idxv, av, v, wgt);
+    }
 
+    void add(const NormalEquations &other) {
+        for (int i = 0; i < 11; i++) {
+            for (int j = i; j < 11; j++)
+                ATA[i][j] += other.ATA[i][j];
+            ATb[i] += other.ATb[i];
+        }
+        nrows += other.nrows;
+    }
 
-    if (verbose) {
-	printf("projection matrix M:\n");
-	for (int i=0; i<3; i++) {
-	    for (int j=0; j<4; j++)
-		printf("%12.6f  ", M[i*4+j]);
-	    printf("\n");
-	}
+    // solve for the 11 unknowns using Cholesky decomposition; M[11] is fixed to 1
+    // falls back to LU if A'A is not numerically positive definite
+    bool solve(double *M) {
+        cv::Mat N(11, 11, CV_64FC1), r(11, 1, CV_64FC1), sol;
+        for (int i = 0; i < 11; i++) {
+            for (int j = 0; j < 11; j++)
+                N.at<double>(i, j) = (j >= i) ? ATA[i][j] : ATA[j][i];
+            r.at<double>(i, 0) = ATb[i];
+        }
+        bool ok = cv::solve(N, r, sol, cv::DECOMP_CHOLESKY);
+        if (! ok)
+            ok = cv::solve(N, r, sol, cv::DECOMP_LU);
+        for (int i = 0; i < 11; i++)
+            M[i] = ok ? sol.at<double>(i, 0) : 0;
+        M[11] = 1;
+        return ok;
     }
-    //writeMat(A, "Amat.txt");
-    //writeMat(b, "bmat.txt");
-    //writeMat(sol, "smat.txt");
-    //exit(1);
-}
+};
+
+// number of row bands for accumulating partial sums; fixed so results don't depend on number of threads
+#define NBANDS 64
 
 // old version
 void SolveProjectionCV_old(CFloatImage disp, CFloatImage codeu, CFloatImage codev, CByteImage badmap, double *M, int step)
 {
     CShape sh = disp.Shape();
     int x, y, w = sh.width, h = sh.height;
-    int verbose = 1;
+    int verbose = logEnabled(log_verbose);
 
     //if (verbose) printf("building matrix (step=%d)\n", step);
 
@@ -237,8 +189,8 @@ void SolveProjectionCV_old(CFloatImage disp, CFloatImage codeu, CFloatImage code
     }
 
     if (verbose)
-	printf("unknown d: %.2f%%, unknown code: %.2f%%\n", 100.0*cntd/cnt, 100.0*cntc/cnt);
-    if (/* DISABLES CODE */ (0) && verbose) printf("solving matrix\n");
+	logPrintf(log_verbose, "unknown d: %.2f%%, unknown code: %.2f%%\n", 100.0*cntd/cnt, 100.0*cntc/cnt);
+    if (/* DISABLES CODE */ (0) && verbose) logPrintf(log_verbose, "solving matrix\n");
 
     cv::Mat b(bvec);
 
@@ -254,98 +206,32 @@ void SolveProjectionCV_old(CFloatImage disp, CFloatImage codeu, CFloatImage code
 
 
     if (verbose) {
-	printf("projection matrix M:\n");
+	logPrintf(log_verbose, "projection matrix M:\n");
 	for (int i=0; i<3; i++) {
 	    for (int j=0; j<4; j++)
-		printf("%12.6f  ", M[i*4+j]);
-	    printf("\n");
+		logPrintf(log_verbose, "%12.6f  ", M[i*4+j]);
+	    logPrintf(log_verbose, "\n");
 	}
     }
 }
 
-// reproject a disparity map based on the recovered projection matrix
-void projectDisp(CFloatImage codeu, CFloatImage codev, CFloatImage ndisp, double *M)
+// recover (scaled) disparity of pixel (xx, yy) with (scaled) code values u, v using projection matrix M
+inline double projectPoint(const double *M, double xx, double yy, double u, double v)
 {
-    CShape sh = codeu.Shape();
-    int x, y, w = sh.width, h = sh.height;
-    double *M0 = &M[0];
-    double *M1 = &M[4];
-    double *M2 = &M[8];
-
-    for (y = 0; y < h; y++) {
-	float *cu = &codeu.Pixel(0, y, 0);
-	float *cv = &codev.Pixel(0, y, 0);
-	float *d = &ndisp.Pixel(0, y, 0);
-
-	for (x=0; x < w; x++) {
-	    float u = cu[x];
-	    float v = cv[x];
-	    if (u == UNK || v == UNK) {
-		d[x] = UNK;
-	    } else {
-		// do least squares combination of the two estimates for d
-		u /= SCALE;
-		v /= VSCALE;
-		float xx = x / SCALE;
-		float yy = y / SCALE;
-
-		double bu = xx * (M2[0]*u - M0[0]) + yy * (M2[1]*u - M0[1]) + (M2[3]*u - M0[3]);
-		double bv = xx * (M2[0]*v - M1[0]) + yy * (M2[1]*v - M1[1]) + (M2[3]*v - M1[3]);
-		double au =    - (M2[2]*u - M0[2]);
-		double av =    - (M2[2]*v - M1[2]);
-
-		double dd = (au * bu + av * bv) / (au * au + av * av);
-		//double dd =  bu / au;
-		d[x] = (float) dd * DSCALE;
-	    }
-	}
-    }
+    const double *M0 = &M[0];
+    const double *M1 = &M[4];
+    const double *M2 = &M[8];
+
+    // do least squares combination of the two estimates for d
+    double bu = xx * (M2[0]*u - M0[0]) + yy * (M2[1]*u - M0[1]) + (M2[3]*u - M0[3]);
+    double bv = xx * (M2[0]*v - M1[0]) + yy * (M2[1]*v - M1[1]) + (M2[3]*v - M1[3]);
+    double au =    - (M2[2]*u - M0[2]);
+    double av =    - (M2[2]*v - M1[2]);
+
+    return (au * bu + av * bv) / (au * au + av * av);
+    //return  bu / au;
 }
 
-
-// NEW: evaluate fit based on how well d is reconstructed
-// mark all pixels whose error is larger than maxerr in badmap
-void EvaluateFit(CFloatImage disp, CFloatImage codeu, CFloatImage codev, CByteImage badmap, double *M, float maxerr)
-{
-    CShape sh = disp.Shape();
-    CFloatImage ndisp(sh);
-    int x, y, w = sh.width, h = sh.height;
-    int verbose = 1;
-
-    int cnt = 0;
-    int badcnt = 0;
-    double sd = 0;
-
-    projectDisp(codeu, codev, ndisp, M);
-    badmap.ClearPixels();
-
-    for (y = 0; y < h; y++) {
-	float *dis = &disp.Pixel(0, y, 0);
-	float *ndis = &ndisp.Pixel(0, y, 0);
-	uchar *bad = &badmap.Pixel(0, y, 0);
-	
-	for (x=0; x < w; x++) {
-	    float d = dis[x];
-	    float nd = ndis[x];
-			
-	    if (d == UNK || nd==UNK)
-		continue;
-	
-	    cnt++;
-	    float dd = d - nd;
-	    if (fabs(dd) > maxerr) {
-		badcnt++;
-		bad[x] = 1;		// mark as bad pixel for subsequent passes
-	    } else
-		sd += dd * dd;
-	}
-    }
-    if (verbose) 
-	printf("rmstot=%6.2f, rmsgood=%6.2f,  bad=%5.2f%% (bad thresh= %g)\n",
-	       sqrt(sd/cnt), sqrt(sd/(cnt-badcnt)), 100.0*badcnt/cnt, maxerr);
-}
-
-
 // OLD -- evaluate fit based on (u, v)
 // evaluate goodness of fit of projection matrix M for disparity map and u and v code 
 // value maps, and mark all pixels whose error is larger than maxerr in badmap
@@ -354,7 +240,7 @@ void EvaluateFit_old(CFloatImage disp, CFloatImage codeu, CFloatImage codev, CBy
     CShape sh = disp.Shape();
     int x, y, w = sh.width, h = sh.height;
     int i, j;
-    int verbose = 1;
+    int verbose = logEnabled(log_verbose);
     double suu = 0, svv = 0;
     int badu = 0, badv = 0;
     int cnt = 0;
@@ -406,165 +292,380 @@ void EvaluateFit_old(CFloatImage disp, CFloatImage codeu, CFloatImage codev, CBy
 	}
     }
     if (verbose) 
-	printf("rmsu= %5.2f, rmsv= %5.2f, badu= %5.2f%%, badv= %5.2f%%  (bad thresh= %g)\n",
+	logPrintf(log_verbose, "rmsu= %5.2f, rmsv= %5.2f, badu= %5.2f%%, badv= %5.2f%%  (bad thresh= %g)\n",
 	       sqrt(suu/(cnt-badu)), sqrt(svv/(cnt-badv)), 100.0*badu/cnt, 100.0*badv/cnt, maxerr);
 
 }
 
 
 
-//compare two disparity maps and report statistics
-void compareDisp(const char *str, CFloatImage disp0, CFloatImage disp1, float badThresh, char *errFile, FILE *log)
-{
-    CShape sh = disp0.Shape();
-    int x, y, w = sh.width, h = sh.height;
-    int verbose = 1;
-
-    int cntBad = 0;
-    int cnt = 0;
-    float sd = 0;
-    CFloatImage err(sh);
-    
-    for (y = 0; y < h; y++) {
-	float *d0 = &disp0.Pixel(0, y, 0);
-	float *d1 = &disp1.Pixel(0, y, 0);
-	float *e = &err.Pixel(0, y, 0);
-
-	for (x=0; x < w; x++) {
-	    e[x] = UNK;
+// robust estimation of the projection matrix on a subsampled set of correspondences
+//
+// replaces the old schedule of alternating least-squares fits and outlier marking on the full image:
+//  1. collect valid (x, y, d, u, v) samples on a regular grid (at most maxsamples)
+//  2. RANSAC with minimal samples of 6 points (11 unknowns, 2 equations per point)
+//     to find an initial matrix and inlier set (error in reconstructed disparity <= thresh)
+//  3. IRLS with Tukey biweights on all samples, cutoff based on robust (MAD) estimate of
+//     the error scale, until the matrix no longer changes
+// the random generator is seeded with a constant, so results are repeatable
+
+struct ProjSample {
+    float xx, yy, d, u, v; // scaled coordinates, disparity, and code values
+};
+
+// error in disparity (unscaled) of sample s for matrix M
+static inline float sampleError(const double *M, const ProjSample &s)
+{
+    return (float)((projectPoint(M, s.xx, s.yy, s.u, s.v) - s.d) * DSCALE);
+}
 
-	    if (d0[x] == UNK || d1[x] == UNK)
-		continue;
+// accumulate weighted normal equations over all samples, in parallel
+static bool solveWeighted(vector<ProjSample> &samples, vector<float> &wgt, double *M)
+{
+    int n = (int)samples.size();
+    NormalEquations part[NBANDS];
+    parallelBands(n, NBANDS, [&](int i0, int i1, int band) {
+        for (int i = i0; i < i1; i++) {
+            if (wgt[i] > 0) {
+                ProjSample &s = samples[i];
+                part[band].addPoint(s.xx, s.yy, s.d, s.u, s.v, wgt[i]);
+            }
+        }
+    });
+    NormalEquations eq;
+    for (int b = 0; b < NBANDS; b++)
+        eq.add(part[b]);
+    return eq.solve(M);
+}
 
-	    cnt++;
-	    float diff = d0[x] - d1[x];
-	    sd += diff * diff;
+void RobustSolveProjection(CFloatImage disp, CFloatImage codeu, CFloatImage codev, double *M, const ProcessingParams &params)
+{
+    CShape sh = disp.Shape();
+    int w = sh.width, h = sh.height;
+    int verbose = logEnabled(log_verbose);
+
+    const int maxsamples = max(1, params.reprojMaxSamples); // size of subsampled correspondence set
+    const int minsample = 6;                                // points per minimal sample
+    const int maxransac = params.reprojMaxRansac;           // max number of RANSAC iterations
+    const int nransaceval = 5000;                           // number of samples used to score RANSAC hypotheses
+    const float thresh = params.reprojRansacThresh;         // RANSAC inlier threshold on disparity error
+    const float mincutoff = 0.5;                            // smallest allowed Tukey cutoff
+    const int maxirls = params.reprojMaxIrls;               // max number of IRLS iterations
+    const double eps = 1e-7;                                // convergence threshold on relative matrix change
+
+    // 1. subsampled correspondences (grid step chosen so that there are at most maxsamples)
+    int step = max(1, (int)ceil(sqrt((double)w * h / maxsamples)));
+    int nrows = (h + step - 1) / step;
+    vector<ProjSample> bandsamples[NBANDS];
+    parallelBands(nrows, NBANDS, [&](int r0, int r1, int band) {
+        for (int r = r0; r < r1; r++) {
+            int y = r * step;
+            float *dis = &disp.Pixel(0, y, 0);
+            float *urow = &codeu.Pixel(0, y, 0);
+            float *vrow = &codev.Pixel(0, y, 0);
+            for (int x = 0; x < w; x += step) {
+                if (dis[x] == UNK || urow[x] == UNK || vrow[x] == UNK)
+                    continue;
+                ProjSample s = {(float)(x / SCALE), (float)(y / SCALE), (float)(dis[x] / DSCALE),
+                                (float)(urow[x] / SCALE), (float)(vrow[x] / VSCALE)};
+                bandsamples[band].push_back(s);
+            }
+        }
+    });
+    vector<ProjSample> samples;
+    for (int b = 0; b < NBANDS; b++)
+        samples.insert(samples.end(), bandsamples[b].begin(), bandsamples[b].end());
+    int n = (int)samples.size();
+    if (verbose) logPrintf(log_verbose, "robust fit: %d samples (step=%d)\n", n, step);
+    if (n < minsample)
+        throw CError("RobustSolveProjection: only %d valid correspondences", n);
+
+    // 2. RANSAC
+    std::mt19937 rng(0);
+    int evalstep = max(1, n / nransaceval);
+    int neval = (n + evalstep - 1) / evalstep;
+    int bestinliers = -1;
+    double Mbest[12];
+    int maxiter = maxransac;
+    int iter;
+    for (iter = 0; iter < maxiter; iter++) {
+        checkCancel();
+        NormalEquations eq;
+        int idx[minsample];
+        for (int k = 0; k < minsample; k++) {
+            int i;
+            bool dup;
+            do {
+                i = (int)(rng() % n);
+                dup = false;
+                for (int j = 0; j < k; j++)
+                    dup = dup || (idx[j] == i);
+            } while (dup);
+            idx[k] = i;
+            ProjSample &s = samples[i];
+            eq.addPoint(s.xx, s.yy, s.d, s.u, s.v);
+        }
+        double Mh[12];
+        if (! eq.solve(Mh))
+            continue; // degenerate sample
+
+        int inliers = 0;
+        for (int i = 0; i < n; i += evalstep) {
+            if (fabs(sampleError(Mh, samples[i])) <= thresh)
+                inliers++;
+        }
+        if (inliers > bestinliers) {
+            bestinliers = inliers;
+            memcpy(Mbest, Mh, sizeof(Mbest));
+            // adaptive number of iterations for 99.9% confidence of drawing an all-inlier sample
+            double pgood = pow((double)inliers / neval, minsample);
+            if (pgood >= 1)
+                maxiter = 0;
+            else if (pgood > 0)
+                maxiter = min(maxransac, (int)ceil(log(0.001) / log(1 - pgood)));
+        }
+    }
+    if (bestinliers < 0)
+        throw CError("RobustSolveProjection: all RANSAC samples degenerate");
+    if (verbose)
+        logPrintf(log_verbose, "ransac: %d iterations, %.2f%% inliers (thresh= %g)\n", iter, 100.0 * bestinliers / neval, thresh);
+
+    // 3. IRLS, starting with inliers of best RANSAC hypothesis
+    vector<float> err(n), abserr(n), wgt(n);
+    for (int i = 0; i < n; i++)
+        wgt[i] = (fabs(sampleError(Mbest, samples[i])) <= thresh) ? 1 : 0;
+    memcpy(M, Mbest, 12 * sizeof(double));
+    for (iter = 0; iter < maxirls; iter++) {
+        checkCancel();
+        double Mnew[12];
+        if (! solveWeighted(samples, wgt, Mnew))
+            break; // keep previous estimate
+
+        double change = 0;
+        for (int j = 0; j < 11; j++)
+            change = max(change, fabs(Mnew[j] - M[j]) / (1 + fabs(M[j])));
+        memcpy(M, Mnew, 12 * sizeof(double));
+
+        // robust scale estimate from median absolute error
+        for (int i = 0; i < n; i++) {
+            err[i] = sampleError(M, samples[i]);
+            abserr[i] = fabs(err[i]);
+        }
+        nth_element(abserr.begin(), abserr.begin() + n/2, abserr.end());
+        float sigma = 1.4826 * abserr[n/2];
+        float cutoff = max(mincutoff, 4.685f * sigma);
+        int nin = 0;
+        double sd = 0;
+        for (int i = 0; i < n; i++) {
+            float r = err[i] / cutoff;
+            if (fabs(r) < 1) {
+                wgt[i] = (1 - r*r) * (1 - r*r);
+                sd += err[i] * err[i];
+                nin++;
+            } else {
+                wgt[i] = 0;
+            }
+        }
+        if (nin == 0)
+            throw CError("RobustSolveProjection: no inliers (cutoff=%g)", cutoff);
+        if (verbose)
+            logPrintf(log_verbose, "irls %d: sigma=%6.3f, cutoff=%6.3f, rmsgood=%6.3f, good=%5.2f%%\n",
+                   iter, sigma, cutoff, sqrt(sd / nin), 100.0 * nin / n);
+        if (change < eps)
+            break;
+    }
 
-	    if (fabs(diff) > badThresh)
-		cntBad++;
-	    e[x] = diff;
+    if (verbose) {
+	logPrintf(log_verbose, "projection matrix M:\n");
+	for (int i=0; i<3; i++) {
+	    for (int j=0; j<4; j++)
+		logPrintf(log_verbose, "%12.6f  ", M[i*4+j]);
+	    logPrintf(log_verbose, "\n");
 	}
     }
+}
+
+// statistics of comparing reprojected disparities with the original disparities
+struct CompareStats {
+    int cnt;     // pixels where both disparities are known
+    int cntBad;  // ... whose difference is larger than the bad threshold
+    float sd;    // sum of squared differences (in float, as compareDisp did)
+    double sd2;  // same sum in double (as markBad did)
+};
 
-    char buffer[200];
+// write compare statistics in the same format as compareDisp to log and screen
+void reportCompare(const char *str, CompareStats st, int npixels, float badThresh, std::string &log)
+{
+    int verbose = logEnabled(log_verbose);
+    char buffer[200];
     sprintf(buffer, "%s: compared: %5.2f   rms: %5.2f   bad: %5.2f   badthresh: %g\n",
-	       str, 100.0*cnt/(w*h), sqrt(sd/cnt), 100.0*cntBad/cnt, badThresh);
-    fprintf(log, "%s", buffer);
-    if (verbose)
-        printf("%s", buffer);
-    
-    if (errFile != NULL)
-	WriteImageVerb(err, errFile, verbose);
+	       str, 100.0*st.cnt/npixels, sqrt(st.sd/st.cnt), 100.0*st.cntBad/st.cnt, badThresh);
+    log += buffer;
+    if (verbose)
+        logPrintf(log_verbose, "%s", buffer);
 }
 
-// invalidate pixels that were identfied as outliers
-// ************ TODO
-// need to mark the pixels with large residuals as bad in the original disparity map too!
-// also should figure out where the errors get too big, and then don't fill occluded regions there either...?
-// *** update: might not be necessary any more... now that we have perfect rectification, many outliers are
-// already removed based on ydisps > 0.5
-void removeBad(CFloatImage ndisp, CByteImage badmap)
+// fused version of projectDisp, markBad, compareDisp("before"), removeBad, and compareDisp("after"):
+//  ndisp  -- reprojected disparities, with outliers (error > maxerr) removed
+//  err    -- differences disp - ndisp for the remaining pixels (UNK elsewhere)
+//  before -- statistics of all reprojected disparities before removing outliers
+//  after  -- statistics after removing outliers
+// the reprojection and the differences are computed in parallel; the statistics are summed in a
+// second, sequential pass in row order, with the same types as the old functions, so ndisp, err,
+// and the statistics are identical to those of the old sequence of functions
+void reprojectCompare(CFloatImage disp, CFloatImage codeu, CFloatImage codev, double *M, float maxerr, float badThresh,
+                      CFloatImage ndisp, CFloatImage err, CompareStats &before, CompareStats &after)
 {
-    CShape sh = ndisp.Shape();
-    int x, y, w = sh.width, h = sh.height;
-
-    for (y = 0; y < h; y++) {
-	float *d = &ndisp.Pixel(0, y, 0);
-	uchar *bad = &badmap.Pixel(0, y, 0);
-	for (x=0; x < w; x++) {
-	    if (bad[x]) {
-		d[x] = UNK;
-	    }
-	}
+    CShape sh = disp.Shape();
+    int w = sh.width, h = sh.height;
+
+    ProgressScope progress("reproject", h);
+    parallelBands(h, NBANDS, [&](int y0, int y1, int band) {
+        for (int y = y0; y < y1; y++) {
+            progress.add();
+            float *dis = &disp.Pixel(0, y, 0);
+            float *urow = &codeu.Pixel(0, y, 0);
+            float *vrow = &codev.Pixel(0, y, 0);
+            float *nd = &ndisp.Pixel(0, y, 0);
+            float *e = &err.Pixel(0, y, 0);
+            float yy = y / SCALE;
+
+            // reprojection (same as projectDisp)
+            for (int x = 0; x < w; x++) {
+                float u = urow[x];
+                float v = vrow[x];
+                if (u == UNK || v == UNK) {
+                    nd[x] = UNK;
+                } else {
+                    u /= SCALE;
+                    v /= VSCALE;
+                    float xx = x / SCALE;
+                    nd[x] = (float) projectPoint(M, xx, yy, u, v) * DSCALE;
+                }
+            }
+
+            // differences and outlier removal; e keeps the differences of the outliers
+            // for the statistics below
+            for (int x = 0; x < w; x++) {
+                e[x] = UNK;
+                if (dis[x] == UNK || nd[x] == UNK)
+                    continue;
+                float diff = dis[x] - nd[x];
+                e[x] = diff;
+                if (fabs(diff) > maxerr)
+                    nd[x] = UNK;
+            }
+        }
+    });
+
+    CompareStats b = {0, 0, 0, 0}, a = {0, 0, 0, 0};
+    for (int y = 0; y < h; y++) {
+        float *nd = &ndisp.Pixel(0, y, 0);
+        float *e = &err.Pixel(0, y, 0);
+        for (int x = 0; x < w; x++) {
+            if (e[x] == UNK)
+                continue;
+            float diff = e[x];
+            int bad = fabs(diff) > badThresh;
+            b.cnt++;
+            b.sd += diff * diff;
+            b.sd2 += diff * diff;
+            b.cntBad += bad;
+            if (nd[x] == UNK) {
+                e[x] = UNK;
+                continue;
+            }
+            a.cnt++;
+            a.sd += diff * diff;
+            a.sd2 += diff * diff;
+            a.cntBad += bad;
+        }
     }
+    before = b;
+    after = a;
 }
 
+
 // takes disparity map and two code maps and recovers projection matrix for projector
 // then reprojects projector's disparities into camera disparities
+// disp, codex, and codey are single-band images, returns single-band reprojected disparities
+// only reads its input images, so can be called concurrently for several projectors
+// sharing the same disp
 //void reproject(char *dispFile, char *codeFile, char* outFile, char* errFile, char* matfile)
-CFloatImage reproject(CFloatImage dispflo, CFloatImage codeflo, char* errFile, char* matfile, char *logfile)
+CFloatImage reprojectDisp(CFloatImage disp, CFloatImage codex, CFloatImage codey, char* errFile, char* matfile, char *logfile,
+                          const ProcessingParams &params)
 {
-    CFloatImage disp,dispboth,code,codex,codey;
     CShape sh;
 
     double M[12]; // projection matrix
 
-//    ReadFlowFile(dispboth, dispFile);
-    pair<CFloatImage, CFloatImage> d = splitFloImage(dispflo);
-    disp = d.first;
-
-//    ReadFlowFile(code, codeFile);
-    pair<CFloatImage, CFloatImage> p = splitFloImage(codeflo);
-    codex = p.first;
-    codey = p.second;
-
     sh = disp.Shape();
-    printf("sh=%dx%d\n", sh.width, sh.height);
+    logPrintf(log_verbose, "sh=%dx%d\n", sh.width, sh.height);
 
-    CByteImage badmap(sh);
-    badmap.ClearPixels();
-    int step;
     float maxerr;
 
 
-    /*
-    step = 6;     SolveProjectionCV(disp, codex, codey, badmap, M, step);
-    maxerr = 5;   EvaluateFit(disp, codex, codey, badmap, M, maxerr);
-    step = 6;     SolveProjectionCV(disp, codex, codey, badmap, M, step);
-    maxerr = .5;  EvaluateFit(disp, codex, codey, badmap, M, maxerr);
-    step = 6;     SolveProjectionCV(disp, codex, codey, badmap, M, step);
-    maxerr = .25; EvaluateFit(disp, codex, codey, badmap, M, maxerr);
-    step = 3;     SolveProjectionCV(disp, codex, codey, badmap, M, step);
-    maxerr = 1;   EvaluateFit(disp, codex, codey, badmap, M, maxerr);
-    */
-
-    // old schedule:
-    
-    step = 3;    SolveProjectionCV(disp, codex, codey, badmap, M, step);
-    maxerr = 40; EvaluateFit(disp, codex, codey, badmap, M, maxerr);
-    step = 2;    SolveProjectionCV(disp, codex, codey, badmap, M, step);
-    maxerr = 5;  EvaluateFit(disp, codex, codey, badmap, M, maxerr);
-    step = 2;    SolveProjectionCV(disp, codex, codey, badmap, M, step);
-    //maxerr = 3;  EvaluateFit(disp, codex, codey, badmap, M, maxerr);
-    //step = 1;    SolveProjectionCV(disp, codex, codey, badmap, M, step);
-    //maxerr = 3;  EvaluateFit(disp, codex, codey, badmap, M, maxerr);
-    //step = 1;    SolveProjectionCV(disp, codex, codey, badmap, M, step);
-    maxerr = 2;  EvaluateFit(disp, codex, codey, badmap, M, maxerr);
-    step = 1;    SolveProjectionCV(disp, codex, codey, badmap, M, step);
-    maxerr = 1;  EvaluateFit(disp, codex, codey, badmap, M, maxerr);
-
+    {
+    StageScope scope("reproject: solve");
+    RobustSolveProjection(disp, codex, codey, M, params);
+    }
 
 
     // write projection matrix to screen and to matfile
 
-    FILE *fp = fopen(matfile, "w");
-
-    printf("=======Matrix========\n");
+    std::string mat;
+    char buf[100];
+    logPrintf(log_verbose, "=======Matrix========\n");
     for(int i =0; i < 3; i++){
 	for(int j = 0; j < 4; j++){
-	    printf("%f ",M[4*i+j]);
-	    fprintf(fp, "%.12lf ",M[4*i+j]);
+	    logPrintf(log_verbose, "%f ",M[4*i+j]);
+	    sprintf(buf, "%.12lf ",M[4*i+j]);
+	    mat += buf;
 	}
-	printf("\n");
-	fprintf(fp, "\n");
+	logPrintf(log_verbose, "\n");
+	mat += "\n";
     }
 
-    fclose(fp);
-    printf("Wrote %s\n", matfile);
+    pipelineWriteText(mat, matfile, "reproject");
 
     CFloatImage ndisp(sh);
-    CFloatImage blank;
-    blank.ReAllocate(sh);
-    blank.FillPixels(UNK);
+    CFloatImage err(sh);
 
-    FILE *log = fopen(logfile, "w");
+    std::string log;
     
-    projectDisp(codex, codey, ndisp, M);
-    compareDisp("before", disp, ndisp, 1.0, NULL, log);
-    removeBad(ndisp, badmap);
-    compareDisp("after ", disp, ndisp, 1.0, errFile, log);
-    ndisp = mergeToFloImage(ndisp,blank);
+    // the only reprojection of the full image, fused with evaluation and outlier removal
+    // (used to be projectDisp, markBad, compareDisp, removeBad, compareDisp)
+    CompareStats before, after;
+    maxerr = params.reprojMaxErr;
+    reprojectCompare(disp, codex, codey, M, maxerr, 1.0, ndisp, err, before, after);
+    logPrintf(log_verbose, "rmstot=%6.2f, rmsgood=%6.2f,  bad=%5.2f%% (bad thresh= %g)\n",
+           sqrt(after.sd2/before.cnt), sqrt(after.sd2/after.cnt), 100.0*(before.cnt-after.cnt)/before.cnt, maxerr);
+    reportCompare("before", before, sh.width*sh.height, 1.0, log);
+    reportCompare("after ", after, sh.width*sh.height, 1.0, log);
+    instrumentCount("pixels processed", (long long)sh.width * sh.height);
+    instrumentCount("pixels compared", before.cnt);
+    instrumentCount("bad pixels removed", before.cnt - after.cnt);
+    if (errFile != NULL)
+        pipelineWrite(err, errFile, "reproject");
 
-    fclose(log);
+    pipelineWriteText(log, logfile, "reproject");
     return ndisp;
 }
+
+// same for .flo images; y disparities are ignored and returned as UNK
+CFloatImage reproject(CFloatImage dispflo, CFloatImage codeflo, char* errFile, char* matfile, char *logfile,
+                      const ProcessingParams &params)
+{
+//    ReadFlowFile(dispboth, dispFile);
+    pair<CFloatImage, CFloatImage> d = splitFloImage(dispflo);
+
+//    ReadFlowFile(code, codeFile);
+    pair<CFloatImage, CFloatImage> p = splitFloImage(codeflo);
+
+    CFloatImage ndisp = reprojectDisp(d.first, p.first, p.second, errFile, matfile, logfile, params);
+
+    CFloatImage blank;
+    blank.ReAllocate(ndisp.Shape());
+    blank.FillPixels(UNK);
+    return mergeToFloImage(ndisp,blank);
+}
@@ -9,7 +9,11 @@
 #ifndef Reproject_h
 #define Reproject_h
 
+#include "Params.h"
 
-CFloatImage reproject(CFloatImage dispflo, CFloatImage codeflo, char* errFile, char* matfile, char* logfile);
+CFloatImage reproject(CFloatImage dispflo, CFloatImage codeflo, char* errFile, char* matfile, char* logfile,
+                      const ProcessingParams &params = currentParams());
+CFloatImage reprojectDisp(CFloatImage disp, CFloatImage codex, CFloatImage codey, char* errFile, char* matfile, char* logfile,
+                          const ProcessingParams &params = currentParams());
 
 #endif /* Reproject_h */
@@ -0,0 +1,989 @@
+//
+//  Scheduler.cpp
+//  activeLighting
+//
+//  runs the processing stages of a scene as a dependency graph
+//
+
+#include "Scheduler.h"
+#include "Parallel.h"
+#include "Session.h"
+#include "Manifest.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "Progress.h"
+#include "Utils.h"
+#include "imageLib.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include <chrono>
+#include <thread>
+
+extern "C" {
+#include "activeLighting.h"
+}
+
+StageScheduler::StageScheduler()
+: queued(0), running(0), finished(0), failed(0), memoryInUse(0), memoryBudget(0), nworkers(1), threads(1)
+{
+}
+
+int StageScheduler::add(const std::string &name, const std::vector<int> &deps, size_t memory, const std::function<void()> &run)
+{
+    StageNode node;
+    node.name = name;
+    node.deps = deps;
+    node.memory = memory;
+    node.run = run;
+    nodes.push_back(node);
+    return (int)nodes.size() - 1;
+}
+
+void StageScheduler::push(int worker, int n)
+{
+    {
+        std::lock_guard<std::mutex> guard(queues[worker]->lock);
+        queues[worker]->nodes.push_back(n);
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    queued++;
+    wakeup.notify_one();
+}
+
+// newest node of own queue
+bool StageScheduler::pop(int worker, int &n)
+{
+    {
+        std::lock_guard<std::mutex> guard(queues[worker]->lock);
+        if (queues[worker]->nodes.empty())
+            return false;
+        n = queues[worker]->nodes.back();
+        queues[worker]->nodes.pop_back();
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    queued--;
+    return true;
+}
+
+// oldest node of another worker's queue
+bool StageScheduler::steal(int worker, int &n)
+{
+    for (int i = 1; i < nworkers; i++) {
+        WorkerQueue &q = *queues[(worker + i) % nworkers];
+        {
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.nodes.empty())
+                continue;
+            n = q.nodes.front();
+            q.nodes.pop_front();
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+// whether node n can start now (lock must be held)
+bool StageScheduler::fits(int n) const
+{
+    if (memoryBudget == 0 || running == 0)
+        return true;
+    // the images held by the active session take from the same budget
+    PipelineSession *session = activeSession();
+    size_t resident = (session != NULL) ? session->residentBytes() : 0;
+    return memoryInUse + nodes[n].memory + resident <= memoryBudget;
+}
+
+void StageScheduler::report(int n, int state, double seconds)
+{
+    int done, total = (int)nodes.size();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        done = finished;
+    }
+    if (state != NODE_RUNNING)
+        reportProgress("scene", (double)done / total);
+    if (progress) {
+        progress(nodes[n], state, done, total, seconds);
+        return;
+    }
+    switch (state) {
+        case NODE_RUNNING:
+            logPrintf(log_info, "[%d/%d] %s: started\n", done, total, nodes[n].name.c_str());
+            break;
+        case NODE_DONE:
+            logPrintf(log_info, "[%d/%d] %s: done (%.1f s)\n", done, total, nodes[n].name.c_str(), seconds);
+            break;
+        case NODE_FAILED:
+            logPrintf(log_error, "[%d/%d] %s: FAILED (%.1f s)\n", done, total, nodes[n].name.c_str(), seconds);
+            break;
+        case NODE_SKIPPED:
+            logPrintf(log_warning, "[%d/%d] %s: skipped\n", done, total, nodes[n].name.c_str());
+            break;
+    }
+}
+
+void StageScheduler::execute(int worker, int n)
+{
+    bool skip;
+    int limit;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        skip = (state[n] == NODE_SKIPPED || cancelRequested());
+        if (!skip)
+            state[n] = NODE_RUNNING;
+        // share the threads between the nodes running at the moment
+        limit = std::max(1, threads / running);
+    }
+
+    int result = NODE_SKIPPED;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!skip) {
+        report(n, NODE_RUNNING, 0);
+        result = NODE_DONE;
+        setThreadLimit(limit);
+        try {
+            StageScope scope(nodes[n].name.c_str());
+            nodes[n].run();
+        } catch (CCancelled &) {
+            result = NODE_SKIPPED;
+        } catch (CError &err) {
+            logPrintf(log_error, "%s: %s\n", nodes[n].name.c_str(), err.message);
+            result = NODE_FAILED;
+        } catch (std::exception &err) {
+            logPrintf(log_error, "%s: %s\n", nodes[n].name.c_str(), err.what());
+            result = NODE_FAILED;
+        }
+        setThreadLimit(0);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<int> ready;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        memoryInUse -= nodes[n].memory;
+        running--;
+        finished++;
+        state[n] = result;
+        if (result != NODE_DONE)
+            failed++;
+        for (size_t i = 0; i < dependents[n].size(); i++) {
+            int d = dependents[n][i];
+            if (result != NODE_DONE)
+                state[d] = NODE_SKIPPED;
+            if (--pending[d] == 0)
+                ready.push_back(d);
+        }
+    }
+    report(n, result, seconds);
+
+    // the first dependent ends up on top of the queue, so it runs next on this worker
+    for (int i = (int)ready.size() - 1; i >= 0; i--)
+        push(worker, ready[i]);
+    std::lock_guard<std::mutex> guard(lock);
+    wakeup.notify_all();
+}
+
+void StageScheduler::work(int worker)
+{
+    while (true) {
+        int n = -1;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (finished == (int)nodes.size())
+                break;
+            // nodes waiting for memory go first, so they are not starved by smaller ones
+            if (!deferred.empty() && fits(deferred.front())) {
+                n = deferred.front();
+                deferred.pop_front();
+                memoryInUse += nodes[n].memory;
+                running++;
+            } else if (queued == 0) {
+                wakeup.wait(guard);
+                continue;
+            }
+        }
+        if (n < 0) {
+            if (!pop(worker, n) && !steal(worker, n))
+                continue; // taken by another worker
+            std::lock_guard<std::mutex> guard(lock);
+            if (!fits(n)) {
+                deferred.push_back(n);
+                continue;
+            }
+            memoryInUse += nodes[n].memory;
+            running++;
+        }
+        execute(worker, n);
+    }
+}
+
+int StageScheduler::run(int nthreads, size_t budget, const StageProgress &progressfn)
+{
+    // a caller with a thread limit (a daemon connection, see Daemon.h) also limits the workers
+    int callerLimit = getThreadLimit();
+    threads = (callerLimit > 0) ? std::min(numThreads(), callerLimit) : numThreads();
+    nworkers = (nthreads > 0) ? nthreads : threads;
+    if (callerLimit > 0)
+        nworkers = std::min(nworkers, callerLimit);
+    memoryBudget = budget;
+    progress = progressfn;
+    queues.clear();
+    for (int w = 0; w < nworkers; w++)
+        queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+    deferred.clear();
+    queued = running = finished = failed = 0;
+    memoryInUse = 0;
+
+    int nnodes = (int)nodes.size();
+    dependents.assign(nnodes, std::vector<int>());
+    pending.assign(nnodes, 0);
+    state.assign(nnodes, NODE_WAITING);
+    for (int n = 0; n < nnodes; n++) {
+        for (size_t i = 0; i < nodes[n].deps.size(); i++) {
+            int d = nodes[n].deps[i];
+            if (d < 0 || d >= n)
+                throw CError("StageScheduler: dependencies of node %d need to be added before it", n);
+            dependents[d].push_back(n);
+            pending[n]++;
+        }
+    }
+    // deal out the initially ready nodes round robin
+    int w = 0;
+    for (int n = 0; n < nnodes; n++) {
+        if (pending[n] == 0) {
+            push(w, n);
+            w = (w + 1) % nworkers;
+        }
+    }
+
+    // the workers are stopped by the caller's cancellation flag
+    const std::atomic<bool> *cancel = activeCancelFlag();
+    std::vector<std::thread> workers;
+    for (int t = 1; t < nworkers; t++)
+        workers.push_back(std::thread([this, t, cancel]() {
+            CancelScope scope(cancel);
+            work(t);
+        }));
+    work(0);
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+    return failed;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// scene layout
+
+SceneLayout::SceneLayout(const std::string &scene, const std::string &ext)
+: scene(scene), ext(ext)
+{
+}
+
+static std::string posdir(const std::string &dir, int proj, int pos)
+{
+    char buf[100];
+    sprintf(buf, "/proj%d/pos%d", proj, pos);
+    return dir + buf;
+}
+
+std::string SceneLayout::decoded(int proj, int pos, bool rectified) const
+{
+    return posdir(scene + "/computed/decoded/" + (rectified ? "rectified" : "unrectified"), proj, pos);
+}
+
+std::string SceneLayout::disparity(int proj, int pos, bool rectified) const
+{
+    return posdir(scene + "/computed/disparity/" + (rectified ? "rectified" : "unrectified"), proj, pos);
+}
+
+std::string SceneLayout::merged(int pos, bool rectified) const
+{
+    return scene + "/computed/merged/" + (rectified ? "rectified" : "unrectified") + "/pos" + std::to_string(pos);
+}
+
+std::string SceneLayout::reprojected(int proj, int pos) const
+{
+    return posdir(scene + "/computed/reprojected", proj, pos);
+}
+
+std::string SceneLayout::merged2(int pos) const
+{
+    return scene + "/computed/merged2/pos" + std::to_string(pos);
+}
+
+std::string SceneLayout::metadataFile(int direction, int proj, int pos) const
+{
+    return posdir(scene + "/computed/metadata", proj, pos) + "/metadata" + std::to_string(direction) + ".yml";
+}
+
+std::string SceneLayout::intrinsics() const
+{
+    return scene + "/computed/calibration/intrinsics.yml";
+}
+
+std::string SceneLayout::extrinsics(int left, int right) const
+{
+    return scene + "/computed/calibration/extrinsics/extrinsics" + std::to_string(left) + std::to_string(right) + ".yml";
+}
+
+std::string SceneLayout::calibrationSettings() const
+{
+    return scene + "/settings/calibration.yml";
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// scene graph
+
+SceneParams::SceneParams()
+: dXmin(-1080), dXmax(1080), dYmin(-1), dYmax(1),
+  viewThresh(0.5), filterYthresh(0.75), filterKx(3), filterKy(0), filterMinCompSize(20), filterMaxHoleSize(200),
+  mergeMinGroup(2), mergeMaxDiff(1.0), mergeThresh(0.5),
+  reprojKx(3), reprojMaxHoleSize(200),
+  merge2MaxDiff(1.0), merge2Thresh(1.0), merge2MinCompSize(20), merge2MaxHoleSize(20),
+  finalDmin(-UNK), finalDmax(UNK), finalMinCompSize(20), finalCompThresh(2.0)
+{
+}
+
+void makedirs(const std::string &dir)
+{
+    for (size_t i = 1; i <= dir.size(); i++) {
+        if (i == dir.size() || dir[i] == '/') {
+            std::string sub = dir.substr(0, i);
+            if (mkdir(sub.c_str(), 0755) != 0 && errno != EEXIST)
+                throw CError("cannot create directory %s", sub.c_str());
+        }
+    }
+}
+
+// image is in the active session or on disk
+static bool available(const std::string &path)
+{
+    int w, h, nb;
+    PipelineSession *session = activeSession();
+    if (session != NULL && session->shape(path.c_str(), w, h, nb))
+        return true;
+    return access(path.c_str(), R_OK) == 0;
+}
+
+// stripe angle stored in the metadata file written when the images were taken
+double readAngle(const std::string &metadata)
+{
+    FILE *fp = fopen(metadata.c_str(), "r");
+    if (fp == NULL)
+        throw CError("cannot open metadata file %s", metadata.c_str());
+    char line[1000];
+    double angle = 0;
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), fp) != NULL) {
+        char *s = line + strspn(line, " \t\"");
+        if (strncmp(s, "angle", 5) == 0) {
+            s = strchr(s, ':');
+            found = (s != NULL && sscanf(s + 1, "%lf", &angle) == 1);
+        }
+    }
+    fclose(fp);
+    if (!found)
+        throw CError("could not load angle from metadata file %s", metadata.c_str());
+    return angle;
+}
+
+// size of one float band of the images in bytes, from the header of path.  if it can't be read,
+// the size of full-resolution phone images is assumed, so that the memory budget rather
+// overestimates the steps than letting too many of them run at once
+static size_t imageBytes(const std::string &path)
+{
+    const int width = 4032, height = 3024;
+    CShape sh;
+    try {
+        sh = pipelineShape(path.c_str());
+    } catch (CError &err) {
+        logPrintf(log_warning, "%s; assuming %dx%d images for the memory estimates\n", err.message, width, height);
+        sh = CShape(width, height, 1);
+    }
+    return (size_t)sh.width * sh.height * sizeof(float);
+}
+
+// same test as filterReliableReprojected in ImageProcessor2.swift, on the "before" and "after"
+// lines of the reprojection log (compared %, rms, bad %, bad threshold)
+bool reliableReprojection(const std::string &logfile)
+{
+    std::string text;
+    if (!pipelineReadText(text, logfile.c_str()))
+        return false;
+    float vals[2][4];
+    int nlines = 0;
+    std::istringstream in(text);
+    std::string line;
+    while (nlines < 2 && std::getline(in, line)) {
+        if (sscanf(line.c_str(), "%*s compared: %f rms: %f bad: %f badthresh: %f",
+                   &vals[nlines][0], &vals[nlines][1], &vals[nlines][2], &vals[nlines][3]) == 4)
+            nlines++;
+    }
+    if (nlines < 2)
+        return false;
+    float fracfrac = vals[1][0] / vals[0][0]; // fraction of reproj frac vs orig frac
+    bool reliable = fracfrac >= 0.3 && vals[1][0] >= 5 && vals[0][2] <= 50 && vals[1][2] <= 10 && vals[1][1] <= 0.75;
+    logPrintf(log_verbose, "%s%s\n", reliable ? "reliable: " : "not reliable: ", logfile.c_str());
+    return reliable;
+}
+
+// printf into a string (parameters of a step, as part of its manifest key)
+static std::string strprintf(const char *fmt, ...)
+{
+    char buf[1000];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+static char *cstr(std::string &s)
+{
+    return &s[0];
+}
+
+static std::vector<char *> cstrs(std::vector<std::string> &v)
+{
+    std::vector<char *> p;
+    for (size_t i = 0; i < v.size(); i++)
+        p.push_back(cstr(v[i]));
+    return p;
+}
+
+static void crosscheck(std::string dir0, std::string dir1, int pos0, int pos1, float thresh, int xonly, int halfocc,
+                       std::string in_suffix, std::string out_suffix)
+{
+    crosscheckDisparities(cstr(dir0), cstr(dir1), pos0, pos1, thresh, xonly, halfocc, cstr(in_suffix), cstr(out_suffix));
+}
+
+// dir/disp<pos0><pos1><xy>-<suffix><ext>
+static std::string dispfile(const std::string &dir, int pos0, int pos1, char xy, const std::string &suffix, const std::string &ext)
+{
+    return dir + "/disp" + std::to_string(pos0) + std::to_string(pos1) + xy + "-" + suffix + ext;
+}
+
+// dir/result<posID><uv>-<suffix><ext>
+static std::string codefile(const std::string &dir, const std::string &posID, char uv, const std::string &suffix, const std::string &ext)
+{
+    return dir + "/result" + posID + uv + "-" + suffix + ext;
+}
+
+// filter disp<pos0><pos1>(x|y)-<in_suffix><ext> in dir (x only if !withy)
+static void filter(const std::string &dir, int pos0, int pos1, bool withy, const std::string &in_suffix, const std::string &out_suffix,
+                   const std::string &ext, float ythresh, int kx, int ky, int mincompsize, int maxholesize)
+{
+    std::string dispx = dispfile(dir, pos0, pos1, 'x', in_suffix, ext), dispy = dispfile(dir, pos0, pos1, 'y', in_suffix, ext);
+    std::string outx = dispfile(dir, pos0, pos1, 'x', out_suffix, ext), outy = dispfile(dir, pos0, pos1, 'y', out_suffix, ext);
+    filterDisparities(cstr(dispx), withy ? cstr(dispy) : NULL, cstr(outx), withy ? cstr(outy) : NULL,
+                      pos0, pos1, ythresh, kx, ky, mincompsize, maxholesize);
+}
+
+// the merge state of a merge2 step is described by a text file next to it, one map per line:
+//   maxdiff <maxdiff>
+//   base <hash> <file>     merge1 and view disparities the state was initialized with
+//   rdisp <hash> <file>    reprojected disparities folded into the state
+// with content hashes of the maps from the manifest
+
+// line of merge state list for file, false if it has no content hash
+static bool mergeStateEntry(StageManifest *manifest, const char *tag, const std::string &file, std::string &entry)
+{
+    unsigned long long hash;
+    if (!manifest->filehash(file, hash))
+        return false;
+    char buf[100];
+    snprintf(buf, sizeof(buf), "%s %016llx ", tag, hash);
+    entry = buf + file + "\n";
+    return true;
+}
+
+// final merge of the disparities of one position into dir.  if incremental and the merge state
+// in statefile was computed from the same merge1 and view disparities and from reprojected
+// disparities that are all still in rd, only the new ones are folded in; otherwise the state
+// is computed from scratch.  an added projector changes the merge1 disparities and adds view
+// disparities, so it always rebuilds the state; the update applies when only the set of reliable
+// reprojected disparities grows, e.g. once the reprojection of another projector succeeds
+static void merge2(const std::string &dir, const std::string &pairID, float maxdiff, StageManifest *manifest, bool incremental,
+                   std::string inmd, const std::vector<std::string> &vd, const std::vector<std::string> &rd,
+                   std::string outd, std::string outsd, std::string outn, std::string statefile)
+{
+    std::string listfile = dir + "/disp" + pairID + "x-state.txt";
+    std::string list = strprintf("maxdiff %g\n", maxdiff), entry;
+    std::vector<std::string> rdentries(rd.size());
+    bool hashed = (manifest != NULL);
+    std::vector<std::string> base = {inmd};
+    base.insert(base.end(), vd.begin(), vd.end());
+    for (size_t i = 0; hashed && i < base.size(); i++) {
+        hashed = mergeStateEntry(manifest, "base", base[i], entry);
+        list += entry;
+    }
+    for (size_t i = 0; hashed && i < rd.size(); i++)
+        hashed = mergeStateEntry(manifest, "rdisp", rd[i], rdentries[i]);
+
+    // reprojected disparities that are not yet in the state
+    std::vector<std::string> newrd;
+    std::string oldlist;
+    bool update = incremental && hashed && available(statefile) && pipelineReadText(oldlist, listfile.c_str()) &&
+                  oldlist.compare(0, list.size(), list) == 0;
+    if (update) {
+        std::set<std::string> merged;
+        std::istringstream in(oldlist.substr(list.size()));
+        std::string line;
+        while (std::getline(in, line))
+            merged.insert(line + "\n");
+        for (size_t i = 0; i < rd.size(); i++) {
+            if (merged.erase(rdentries[i]) == 0)
+                newrd.push_back(rd[i]);
+        }
+        // maps that were merged before but are no longer merged (or have changed) can't be taken out
+        update = merged.empty();
+    }
+
+    // the old list no longer describes the state once it is being rewritten: an empty list matches
+    // no state, so if this step is cancelled or fails, the next run computes the state from scratch
+    pipelineWriteText("", listfile.c_str(), "merge2");
+    if (update) {
+        logPrintf(log_verbose, "merge2: folding %d new reprojected disparities into %s\n", (int)newrd.size(), statefile.c_str());
+        if (!newrd.empty()) {
+            std::vector<char *> pr = cstrs(newrd);
+            if (!mergeDisparityMaps2Update(maxdiff, (int)pr.size(), cstr(statefile), pr.data()))
+                throw CCancelled();
+        }
+        list = oldlist;
+    } else {
+        std::vector<std::string> v = vd, r = rd;
+        std::vector<char *> pv = cstrs(v), pr = cstrs(r);
+        if (!mergeDisparityMaps2Init(maxdiff, (int)pv.size(), (int)pr.size(), cstr(statefile), cstr(inmd), pv.data(), pr.data()))
+            throw CCancelled();
+    }
+    for (size_t i = 0; hashed && i < rd.size(); i++) {
+        if (!update || std::find(newrd.begin(), newrd.end(), rd[i]) != newrd.end())
+            list += rdentries[i];
+    }
+    pipelineWriteText(hashed ? list : "", listfile.c_str(), "merge2");
+    mergeDisparityMaps2Finalize(cstr(statefile), cstr(outd), cstr(outsd), cstr(outn));
+}
+
+// number of steps that still have to read each input of the scene graph
+struct StepReaders {
+    std::mutex lock;
+    std::map<std::string, int> count;
+};
+
+// a step that reads inputs is finished: with an active session, the images and texts that no
+// remaining step reads are written to disk and dropped from memory
+static void evictUnread(StepReaders &readers, const std::vector<std::string> &inputs)
+{
+    PipelineSession *session = activeSession();
+    std::vector<std::string> unread;
+    {
+        std::lock_guard<std::mutex> guard(readers.lock);
+        for (size_t i = 0; i < inputs.size(); i++)
+            readers.count[inputs[i]]--;
+        if (session == NULL)
+            return;
+        std::vector<std::string> paths = session->resident();
+        for (size_t i = 0; i < paths.size(); i++) {
+            std::map<std::string, int>::iterator it = readers.count.find(paths[i]);
+            if (it == readers.count.end() || it->second <= 0)
+                unread.push_back(paths[i]);
+        }
+    }
+    for (size_t i = 0; i < unread.size(); i++)
+        session->evict(unread[i].c_str());
+}
+
+// adds the steps of the scene graph to the scheduler.  with a manifest, a step only runs if its
+// outputs are not up to date; steps of the forced stage and all steps depending on them always run.
+// if only is given, just the steps of that stage or operation run (always), the others do nothing
+struct SceneGraphBuilder {
+    SceneGraphBuilder(StageScheduler &sched, StageManifest *manifest, const std::string &force, const std::string &only,
+                      const ProcessingParams &params)
+    : sched(sched), manifest(manifest), force(force), only(only), params(params), readers(new StepReaders()) {}
+
+    int step(const std::string &stage, const std::string &op, const std::string &name, const std::vector<int> &deps, size_t memory,
+             const std::vector<std::string> &inputs, const std::vector<std::string> &outputs,
+             const std::string &params, const std::function<void()> &fn);
+
+    StageScheduler &sched;
+    StageManifest *manifest;
+    std::string force, only;
+    std::vector<bool> forced;   // indexed by node
+    ProcessingParams params;    // used by all steps
+    std::shared_ptr<StepReaders> readers;
+};
+
+int SceneGraphBuilder::step(const std::string &stage, const std::string &op, const std::string &name, const std::vector<int> &deps,
+                            size_t memory, const std::vector<std::string> &inputs, const std::vector<std::string> &outputs,
+                            const std::string &params, const std::function<void()> &fn)
+{
+    if (!only.empty() && only != stage && only != op) {
+        forced.push_back(false);
+        return sched.add(name, deps, 0, []() {});
+    }
+    bool rerun = (stage == force) || !only.empty();
+    for (size_t i = 0; i < deps.size(); i++)
+        rerun = rerun || forced[deps[i]];
+    forced.push_back(rerun);
+
+    for (size_t i = 0; i < inputs.size(); i++)
+        readers->count[inputs[i]]++;
+
+    StageManifest *m = manifest;
+    std::string args = stage + " " + params;
+    ProcessingParams pp = this->params;
+    std::shared_ptr<StepReaders> r = readers;
+    return sched.add(name, deps, memory, [=]() {
+        ParamsScope use(&pp);
+        unsigned long long key = 0;
+        if (m != NULL) {
+            key = m->key(inputs, args);
+            if (!rerun && m->upToDate(outputs, key)) {
+                logPrintf(log_info, "%s: up to date\n", name.c_str());
+                evictUnread(*r, inputs);
+                return;
+            }
+            // outputs are about to change: if the step fails, they must not count as up to date
+            m->invalidate(outputs);
+        }
+        fn();
+        // the entry points return early when cancelled, their outputs are not complete then
+        checkCancel();
+        if (m != NULL) {
+            if (activeSession() != NULL)
+                m->recordLater(inputs, args, outputs); // outputs and inputs may be in memory only
+            else
+                m->record(outputs, key);
+        }
+        evictUnread(*r, inputs);
+    });
+}
+
+void buildSceneGraph(StageScheduler &sched, const SceneLayout &layout,
+                     const std::vector<int> &projectors, const std::vector<int> &positions,
+                     StageManifest *manifest, const std::string &forceStage,
+                     const SceneParams &sp, const std::string &onlyStage)
+{
+    int nproj = (int)projectors.size(), npos = (int)positions.size();
+    if (nproj == 0 || npos == 0)
+        return;
+    size_t B = imageBytes(codefile(layout.decoded(projectors[0], positions[0], false), std::to_string(positions[0]), 'u', "0initial", ".pfm"));
+    // the entry points name some of their outputs themselves, with the extension of their parameters
+    const std::string &ext = layout.ext;
+    ProcessingParams processing = sp.processing;
+    processing.mapExt = ext;
+    SceneGraphBuilder graph(sched, manifest, forceStage, onlyStage, processing);
+    // merge2 steps may update their merge state unless steps are forced to run
+    bool incremental = manifest != NULL && forceStage.empty() && onlyStage.empty();
+    std::string refineparams = sp.processing.describe("refine");
+    const char *uv = "uv", *xy = "xy";
+
+    // refine the unrectified decoded images
+    // refine[p][i][dir]
+    std::vector<std::vector<std::vector<int> > > refine(nproj, std::vector<std::vector<int> >(npos, std::vector<int>(2)));
+    for (int p = 0; p < nproj; p++) {
+        for (int i = 0; i < npos; i++) {
+            for (int dir = 0; dir < 2; dir++) {
+                int proj = projectors[p], pos = positions[i];
+                std::string outdir = layout.decoded(proj, pos, false), posID = std::to_string(pos);
+                std::string impath = codefile(outdir, posID, uv[dir], "0initial", ".pfm");
+                std::string metadata = layout.metadataFile(dir, proj, pos);
+                std::vector<std::string> outputs;
+                for (const char *suffix : {"1filtered", "2holefilled", "3refined1", "4refined2"})
+                    outputs.push_back(codefile(outdir, posID, uv[dir], suffix, ext));
+                char name[100];
+                sprintf(name, "refine proj%d pos%d %c", proj, pos, uv[dir]);
+                refine[p][i][dir] = graph.step("refine", "refine", name, {}, 6 * B, {impath, metadata}, outputs, refineparams, [=]() {
+                    std::string o = outdir, im = impath, id = posID;
+                    refineDecodedIm(cstr(o), dir, cstr(im), readAngle(metadata), cstr(id));
+                });
+            }
+        }
+    }
+
+    for (int i = 0; i + 1 < npos; i++) {
+        int left = positions[i], right = positions[i+1];
+        int sides[2] = {left, right};
+        std::string pairID = std::to_string(left) + std::to_string(right);
+        std::string pairname = "pos" + pairID;
+
+        // per projector: rectify, refine & compute disparities, then cross-check & filter
+        // (rectify -d and disparity -r)
+        std::vector<int> checked;
+        std::vector<std::string> viewdisps[2];      // cross-checked disparities of all projectors, per side
+        for (int p = 0; p < nproj; p++) {
+            int proj = projectors[p];
+            std::string projname = "proj" + std::to_string(proj) + " " + pairname;
+            std::string disp[2] = {layout.disparity(proj, left, true), layout.disparity(proj, right, true)};
+
+            std::vector<std::string> inputs = {layout.intrinsics(), layout.extrinsics(left, right), layout.calibrationSettings()};
+            std::vector<std::string> outputs;
+            for (int s = 0; s < 2; s++) {
+                for (int dir = 0; dir < 2; dir++) {
+                    inputs.push_back(codefile(layout.decoded(proj, sides[s], false), std::to_string(sides[s]), uv[dir], "2holefilled", ext));
+                    inputs.push_back(layout.metadataFile(dir, proj, sides[s]));
+                    outputs.push_back(codefile(layout.decoded(proj, sides[s], true), pairID, uv[dir], "4refined2", ext));
+                    outputs.push_back(dispfile(disp[s], left, right, xy[dir], "0initial", ext));
+                }
+            }
+            std::vector<int> deps = {refine[p][i][0], refine[p][i][1], refine[p][i+1][0], refine[p][i+1][1]};
+            std::string range = strprintf("%d %d %d %d ", sp.dXmin, sp.dXmax, sp.dYmin, sp.dYmax) + refineparams + " " + sp.processing.describe("match");
+            int match = graph.step("rectify", "rectify", "rectify & match " + projname, deps, 20 * B, inputs, outputs, range, [=]() {
+                std::string intr = layout.intrinsics(), extr = layout.extrinsics(left, right), settings = layout.calibrationSettings();
+                std::string decoded0 = layout.decoded(proj, left, false), decoded1 = layout.decoded(proj, right, false);
+                std::string rect0 = layout.decoded(proj, left, true), rect1 = layout.decoded(proj, right, true);
+                std::string disp0 = disp[0], disp1 = disp[1];
+                makedirs(rect0); makedirs(rect1); makedirs(disp0); makedirs(disp1);
+                // stripe angles, indexed [2*camera + direction]
+                double angles[4];
+                for (int k = 0; k < 4; k++)
+                    angles[k] = readAngle(layout.metadataFile(k%2, proj, sides[k/2]));
+                rectifyRefineDisparities(cstr(intr), cstr(extr), cstr(settings), cstr(decoded0), cstr(decoded1),
+                                         cstr(rect0), cstr(rect1), cstr(disp0), cstr(disp1), left, right, angles,
+                                         sp.dXmin, sp.dXmax, sp.dYmin, sp.dYmax);
+            });
+
+            // disparity files of both sides with given suffix
+            auto both = [&](const std::string &suffix) {
+                std::vector<std::string> files;
+                for (int s = 0; s < 2; s++)
+                    for (int d = 0; d < 2; d++)
+                        files.push_back(dispfile(disp[s], left, right, xy[d], suffix, ext));
+                return files;
+            };
+            int check1 = graph.step("disparity", "crosscheck", "crosscheck1 " + projname, {match}, 8 * B, both("0initial"), both("1crosscheck1"),
+                                    strprintf("%g 0 0", sp.viewThresh), [=]() {
+                crosscheck(disp[0], disp[1], left, right, sp.viewThresh, 0, 0, "0initial", "1crosscheck1");
+            });
+            std::vector<int> filtered;
+            for (int s = 0; s < 2; s++) {
+                std::string dir = disp[s];
+                std::vector<std::string> in = {dispfile(dir, left, right, 'x', "1crosscheck1", ext), dispfile(dir, left, right, 'y', "1crosscheck1", ext)};
+                std::vector<std::string> out = {dispfile(dir, left, right, 'x', "2filtered", ext), dispfile(dir, left, right, 'y', "2filtered", ext)};
+                std::string fparams = strprintf("%g %d %d %d %d", sp.filterYthresh, sp.filterKx, sp.filterKy, sp.filterMinCompSize, sp.filterMaxHoleSize);
+                filtered.push_back(graph.step("disparity", "filter", "filter " + projname + " pos" + std::to_string(sides[s]), {check1}, 6 * B,
+                                              in, out, fparams, [=]() {
+                    filter(dir, left, right, true, "1crosscheck1", "2filtered", ext,
+                           sp.filterYthresh, sp.filterKx, sp.filterKy, sp.filterMinCompSize, sp.filterMaxHoleSize);
+                }));
+            }
+            checked.push_back(graph.step("disparity", "crosscheck", "crosscheck2 " + projname, filtered, 8 * B, both("2filtered"), both("3crosscheck2"),
+                                         strprintf("%g 1 0", sp.viewThresh), [=]() {
+                crosscheck(disp[0], disp[1], left, right, sp.viewThresh, 1, 0, "2filtered", "3crosscheck2");
+            }));
+            for (int s = 0; s < 2; s++)
+                for (int d = 0; d < 2; d++)
+                    viewdisps[s].push_back(dispfile(disp[s], left, right, xy[d], "3crosscheck2", ext));
+        }
+
+        // merge the disparities of all projectors (merge -r)
+        std::string mergeddir[2] = {layout.merged(left, true), layout.merged(right, true)};
+        std::vector<int> merged;
+        for (int s = 0; s < 2; s++) {
+            int pos = sides[s];
+            std::string dir = mergeddir[s];
+            std::vector<std::string> in = viewdisps[s];
+            std::vector<std::string> out = {dispfile(dir, left, right, 'x', "0initial", ext), dispfile(dir, left, right, 'y', "0initial", ext)};
+            merged.push_back(graph.step("merge", "merge", "merge " + pairname + " pos" + std::to_string(pos), checked, (2 * nproj + 2) * B,
+                                        in, out, strprintf("%d %g", sp.mergeMinGroup, sp.mergeMaxDiff), [=]() {
+                // projectors for which both disparities exist
+                std::vector<std::string> inx, iny;
+                for (size_t k = 0; k + 1 < in.size(); k += 2) {
+                    if (available(in[k]) && available(in[k+1])) {
+                        inx.push_back(in[k]);
+                        iny.push_back(in[k+1]);
+                    }
+                }
+                makedirs(dir);
+                std::string outx = out[0], outy = out[1];
+                std::vector<char *> px = cstrs(inx), py = cstrs(iny);
+                mergeDisparities(px.data(), py.data(), cstr(outx), cstr(outy), (int)px.size(), sp.mergeMinGroup, sp.mergeMaxDiff);
+            }));
+        }
+        std::vector<std::string> mergein, mergeout;
+        for (int s = 0; s < 2; s++) {
+            for (int d = 0; d < 2; d++) {
+                mergein.push_back(dispfile(mergeddir[s], left, right, xy[d], "0initial", ext));
+                mergeout.push_back(dispfile(mergeddir[s], left, right, xy[d], "1crosscheck", ext));
+            }
+        }
+        int mergecheck = graph.step("merge", "crosscheck", "crosscheck merged " + pairname, merged, 8 * B, mergein, mergeout,
+                                    strprintf("%g 1 0", sp.mergeThresh), [=]() {
+            crosscheck(mergeddir[0], mergeddir[1], left, right, sp.mergeThresh, 1, 0, "0initial", "1crosscheck");
+        });
+
+        // reproject the merged disparities with each projector (reproject), and merge them with
+        // the view disparities (merge2)
+        std::vector<int> merged2;
+        for (int s = 0; s < 2; s++) {
+            int pos = sides[s];
+            std::string posname = pairname + " pos" + std::to_string(pos);
+            std::string dispx = dispfile(mergeddir[s], left, right, 'x', "1crosscheck", ext);
+            std::string dispy = dispfile(mergeddir[s], left, right, 'y', "1crosscheck", ext);
+            std::vector<std::string> codex, codey, outx, outy, err, mat, log, filtered, view;
+            for (int p = 0; p < nproj; p++) {
+                std::string code = layout.decoded(projectors[p], pos, true);
+                std::string dir = layout.reprojected(projectors[p], pos);
+                codex.push_back(codefile(code, pairID, 'u', "4refined2", ext));
+                codey.push_back(codefile(code, pairID, 'v', "4refined2", ext));
+                outx.push_back(dispfile(dir, left, right, 'x', "0initial", ext));
+                outy.push_back(dispfile(dir, left, right, 'y', "0initial", ext));
+                err.push_back(dir + "/error" + pairID + ext);
+                mat.push_back(dir + "/mat" + pairID + ".txt");
+                log.push_back(dir + "/log" + pairID + ".txt");
+                filtered.push_back(dispfile(dir, left, right, 'x', "1filtered", ext));
+                view.push_back(dispfile(layout.disparity(projectors[p], pos, true), left, right, 'x', "2filtered", ext));
+            }
+            std::vector<std::string> in = {dispx}, out;
+            in.insert(in.end(), codex.begin(), codex.end());
+            in.insert(in.end(), codey.begin(), codey.end());
+            for (auto files : {outx, outy, err, mat, log, filtered})
+                out.insert(out.end(), files.begin(), files.end());
+            int reproj = graph.step("reproject", "reproject", "reproject " + posname, {mergecheck}, (4 * nproj + 2) * B, in, out,
+                                    strprintf("-1 %d 0 0 %d ", sp.reprojKx, sp.reprojMaxHoleSize) + sp.processing.describe("reproject"), [=]() {
+                std::vector<std::string> cx = codex, cy = codey, ox = outx, oy = outy, e = err, m = mat, l = log;
+                std::string dx = dispx, dy = dispy;
+                for (int p = 0; p < nproj; p++)
+                    makedirs(layout.reprojected(projectors[p], pos));
+                std::vector<char *> pcx = cstrs(cx), pcy = cstrs(cy), pox = cstrs(ox), poy = cstrs(oy);
+                std::vector<char *> perr = cstrs(e), pmat = cstrs(m), plog = cstrs(l);
+                reprojectDisparitiesBatch(cstr(dx), cstr(dy), nproj, pcx.data(), pcy.data(), pox.data(), poy.data(),
+                                          perr.data(), pmat.data(), plog.data());
+                for (int p = 0; p < nproj; p++)
+                    filter(layout.reprojected(projectors[p], pos), left, right, false, "0initial", "1filtered", ext, -1, sp.reprojKx, 0, 0, sp.reprojMaxHoleSize);
+            });
+
+            std::string dir = layout.merged2(pos);
+            in = {dispx};
+            in.insert(in.end(), view.begin(), view.end());
+            in.insert(in.end(), filtered.begin(), filtered.end());
+            in.insert(in.end(), log.begin(), log.end());
+            out = {dispfile(dir, left, right, 'x', "0initial", ext), dir + "/disp" + pairID + "x-sd" + ext,
+                   dir + "/disp" + pairID + "x-nsamples.pgm", dir + "/disp" + pairID + "x-state.pmf",
+                   dir + "/disp" + pairID + "x-state.txt", dispfile(dir, left, right, 'x', "1filtered", ext)};
+            std::string m2params = strprintf("%g -1 0 0 %d %d", sp.merge2MaxDiff, sp.merge2MinCompSize, sp.merge2MaxHoleSize);
+            merged2.push_back(graph.step("merge2", "merge2", "merge2 " + posname, {reproj}, (2 * nproj + 6) * B, in, out, m2params, [=]() {
+                std::vector<std::string> vd, rd;
+                for (int p = 0; p < nproj; p++) {
+                    if (available(view[p]))
+                        vd.push_back(view[p]);
+                    if (reliableReprojection(log[p]))
+                        rd.push_back(filtered[p]);
+                }
+                makedirs(dir);
+                // folds in newly reliable reprojected disparities if nothing else changed (see merge2)
+                merge2(dir, pairID, sp.merge2MaxDiff, manifest, incremental, dispx, vd, rd, out[0], out[1], out[2], out[3]);
+                filter(dir, left, right, false, "0initial", "1filtered", ext, -1, 0, 0, sp.merge2MinCompSize, sp.merge2MaxHoleSize);
+            }));
+        }
+
+        // cross-check and filter the merged results
+        std::string m2dir[2] = {layout.merged2(left), layout.merged2(right)};
+        auto m2files = [&](const std::string &suffix, bool withy) {
+            std::vector<std::string> files;
+            for (int s = 0; s < 2; s++)
+                for (int d = 0; d < (withy ? 2 : 1); d++)
+                    files.push_back(dispfile(m2dir[s], left, right, xy[d], suffix, ext));
+            return files;
+        };
+        std::string m2check = strprintf("%g 1 1", sp.merge2Thresh);
+        int m2check1 = graph.step("merge2", "crosscheck", "crosscheck1 merged2 " + pairname, merged2, 8 * B,
+                                  m2files("1filtered", false), m2files("2crosscheck1", true), m2check, [=]() {
+            crosscheck(m2dir[0], m2dir[1], left, right, sp.merge2Thresh, 1, 1, "1filtered", "2crosscheck1");
+        });
+        std::vector<int> m2filtered;
+        for (int s = 0; s < 2; s++) {
+            std::string dir = m2dir[s];
+            m2filtered.push_back(graph.step("merge2", "filter", "filter merged2 " + pairname + " pos" + std::to_string(sides[s]), {m2check1}, 6 * B,
+                                            {dispfile(dir, left, right, 'x', "2crosscheck1", ext)}, {dispfile(dir, left, right, 'x', "3filtered", ext)},
+                                            strprintf("-1 0 0 %d %d", sp.merge2MinCompSize, sp.merge2MaxHoleSize), [=]() {
+                filter(dir, left, right, false, "2crosscheck1", "3filtered", ext, -1, 0, 0, sp.merge2MinCompSize, sp.merge2MaxHoleSize);
+            }));
+        }
+        int m2check2 = graph.step("merge2", "crosscheck", "crosscheck2 merged2 " + pairname, m2filtered, 8 * B,
+                                  m2files("3filtered", false), m2files("4crosscheck2", true), m2check, [=]() {
+            crosscheck(m2dir[0], m2dir[1], left, right, sp.merge2Thresh, 1, 1, "3filtered", "4crosscheck2");
+        });
+
+        // clip, remove small components and make sd and nsamples consistent in one pass over the
+        // cross-checked results
+        for (int s = 0; s < 2; s++) {
+            std::string dir = m2dir[s], prefix = dir + "/disp" + pairID + "x-";
+            std::vector<std::string> in = {dispfile(dir, left, right, 'x', "4crosscheck2", ext), prefix + "sd" + ext, prefix + "nsamples.pgm"};
+            std::vector<std::string> out = {dispfile(dir, left, right, 'x', "5final", ext), prefix + "5final-sd" + ext, prefix + "5final-nsamples.pgm"};
+            graph.step("merge2", "finalize", "finalize merged2 " + pairname + " pos" + std::to_string(sides[s]), {m2check2}, 4 * B, in, out,
+                       strprintf("%g %g %d %g", sp.finalDmin, sp.finalDmax, sp.finalMinCompSize, sp.finalCompThresh), [=]() {
+                std::vector<std::string> i = in, o = out;
+                finalizeDisparities(cstr(i[0]), cstr(i[1]), cstr(i[2]), NULL, cstr(o[0]), cstr(o[1]), cstr(o[2]),
+                                    sp.finalDmin, sp.finalDmax, sp.finalMinCompSize, sp.finalCompThresh);
+            });
+        }
+    }
+}
+
+int processScene(const SceneLayout &layout, const std::vector<int> &projectors, const std::vector<int> &positions,
+                 int nthreads, size_t budget, bool incremental, const std::string &forceStage, const SceneParams &sp)
+{
+    std::unique_ptr<StageManifest> manifest;
+    if (incremental) {
+        makedirs(layout.scene + "/computed");
+        manifest.reset(new StageManifest(layout.scene + "/computed/manifest.txt"));
+    }
+    StageScheduler sched;
+    buildSceneGraph(sched, layout, projectors, positions, manifest.get(), forceStage, sp);
+
+    // rectification reads the hole-filled images written by the refine stage from disk
+    PipelineSession *session = activeSession();
+    if (session != NULL)
+        session->setCheckpoint("refine", true);
+
+    logPrintf(log_info, "processing %d steps\n", sched.size());
+    int failed = sched.run(nthreads, budget);
+    if (failed > 0)
+        logPrintf(log_error, "%d of %d steps failed or were skipped\n", failed, sched.size());
+    if (manifest) {
+        // the manifest can only record images that are on disk
+        if (session != NULL)
+            session->flush();
+        manifest->recordPending();
+        manifest->save();
+    }
+    return failed;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// C interface
+
+// process the decoded images of a scene (refine, rectify & match, merge, reproject, merge2) for the
+// given projectors and positions, running independent steps in parallel with nthreads workers
+// (0: numThreads()) within memorymb MB of memory (0: unlimited).
+// if incremental != 0, steps whose outputs are up to date according to the manifest
+// computed/manifest.txt are skipped; forcestage (NULL: none) selects a stage that is run again
+// together with all following steps.  with an active pipeline session, the images in the session
+// count against memorymb, and after each step the images no remaining step reads are written to
+// disk and dropped from the session.  incremental processing writes the remaining images at the
+// end, so the manifest can record them.  the steps
+// use the parameters of the calling thread (currentParams); their mapExt selects .pfm or .cfm
+// code and disparity maps.  returns the number of steps that
+// failed or were skipped because a step they depend on failed or processing was cancelled.  the
+// progress of the whole scene is reported as stage "scene"
+extern "C" int processScene(char *scenedir, int nproj, int *projectors, int npos, int *positions, int nthreads, int memorymb,
+                            int incremental, char *forcestage)
+{
+    SceneParams sp;
+    sp.processing = currentParams();
+    return processScene(SceneLayout(scenedir, sp.processing.mapExt), std::vector<int>(projectors, projectors + nproj),
+                        std::vector<int>(positions, positions + npos), nthreads, (size_t)std::max(memorymb, 0) << 20,
+                        incremental != 0, (forcestage != NULL) ? forcestage : "", sp);
+}
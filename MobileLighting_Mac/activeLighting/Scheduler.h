@@ -0,0 +1,156 @@
+//
+//  Scheduler.h
+//  activeLighting
+//
+//  runs the processing stages of a scene as a dependency graph
+//
+
+#ifndef Scheduler_h
+#define Scheduler_h
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Params.h"
+
+// one unit of work of the graph, e.g. refining one decoded image or merging the
+// disparities of one stereo pair.  memory is the estimated peak memory of run() in bytes
+struct StageNode {
+    std::string name;
+    std::vector<int> deps;      // nodes that need to finish before this one can run
+    size_t memory;
+    std::function<void()> run;
+};
+
+enum StageNodeState { NODE_WAITING, NODE_RUNNING, NODE_DONE, NODE_FAILED, NODE_SKIPPED };
+
+// called whenever a node changes state; done / total count the finished (done, failed or
+// skipped) nodes, seconds is the run time of the node (0 when it starts)
+typedef std::function<void(const StageNode &node, int state, int done, int total, double seconds)> StageProgress;
+
+// runs the nodes of a dependency graph on a pool of worker threads.
+// each worker has its own queue of ready nodes: nodes made ready by a worker go to its own
+// queue (so dependent stages tend to run where their inputs are still in cache), and idle
+// workers steal from the other queues.  a node only starts if its memory estimate fits into
+// the budget next to the nodes already running (a node runs alone if it exceeds the budget
+// by itself).  if a node fails, all nodes depending on it are skipped.  once processing is
+// cancelled (see Progress.h), the running nodes stop and all remaining ones are skipped
+class StageScheduler {
+public:
+    StageScheduler();
+
+    int add(const std::string &name, const std::vector<int> &deps, size_t memory, const std::function<void()> &run);
+    int size() const { return (int)nodes.size(); }
+    const StageNode &node(int i) const { return nodes[i]; }
+
+    // run all nodes with nthreads workers (0: numThreads()) and a memory budget in bytes
+    // (0: unlimited); returns the number of nodes that failed or were skipped
+    int run(int nthreads, size_t budget, const StageProgress &progress = StageProgress());
+
+private:
+    struct WorkerQueue {
+        std::mutex lock;
+        std::deque<int> nodes;
+    };
+    void push(int worker, int n);
+    bool pop(int worker, int &n);
+    bool steal(int worker, int &n);
+    bool fits(int n) const;
+    void work(int worker);
+    void execute(int worker, int n);
+    void report(int n, int state, double seconds);
+
+    std::vector<StageNode> nodes;
+    std::vector<std::vector<int> > dependents;
+    std::vector<int> pending;           // unfinished dependencies of each node
+    std::vector<int> state;
+    std::vector<std::unique_ptr<WorkerQueue> > queues;
+
+    std::mutex lock;                    // guards the members below
+    std::condition_variable wakeup;
+    std::deque<int> deferred;           // ready nodes waiting for memory
+    int queued;                         // nodes in the worker queues
+    int running, finished, failed;
+    size_t memoryInUse, memoryBudget;
+    int nworkers;
+    int threads;                        // threads shared by the running nodes
+    StageProgress progress;
+};
+
+// paths of a scene directory, same layout as DirectoryStructure.swift.  the code and disparity
+// maps written by the steps of buildSceneGraph have extension ext: .pfm, or .cfm for compressed
+// maps (see imageLib/ImageIOcfm.cpp); the decoded images taken by the app are always .pfm
+struct SceneLayout {
+    SceneLayout(const std::string &scene, const std::string &ext = ".pfm");
+
+    std::string decoded(int proj, int pos, bool rectified) const;
+    std::string disparity(int proj, int pos, bool rectified) const;
+    std::string merged(int pos, bool rectified) const;
+    std::string reprojected(int proj, int pos) const;
+    std::string merged2(int pos) const;
+    std::string metadataFile(int direction, int proj, int pos) const;
+    std::string intrinsics() const;
+    std::string extrinsics(int left, int right) const;
+    std::string calibrationSettings() const;
+
+    std::string scene;
+    std::string ext;
+};
+
+// create dir and all its missing parent directories
+void makedirs(const std::string &dir);
+
+// stripe angle stored in the metadata file written when the images were taken
+double readAngle(const std::string &metadata);
+
+// the reprojection log of a projector says that its reprojected disparities are used by merge2
+bool reliableReprojection(const std::string &logfile);
+
+class StageManifest;
+
+// parameters of the scene steps (defaults: the values the app uses)
+struct SceneParams {
+    SceneParams();
+
+    int dXmin, dXmax, dYmin, dYmax;     // disparity search range of rectify & match
+    float viewThresh;                   // cross-check threshold of the disparities
+    float filterYthresh;                // filter of the cross-checked disparities
+    int filterKx, filterKy, filterMinCompSize, filterMaxHoleSize;
+    int mergeMinGroup;                  // merge of the projectors
+    float mergeMaxDiff, mergeThresh;
+    int reprojKx, reprojMaxHoleSize;    // filter of the reprojected disparities
+    float merge2MaxDiff, merge2Thresh;  // merge2 and its cross-checks
+    int merge2MinCompSize, merge2MaxHoleSize;
+    float finalDmin, finalDmax;         // clipping and component removal of the final merge2 results
+    int finalMinCompSize;               // (see finalizeDisparities)
+    float finalCompThresh;
+    ProcessingParams processing;        // refine, match and reproject (see Params.h)
+};
+
+// add the nodes processing the decoded images of the given projectors and positions
+// (refine, rectify & match, merge, reproject, merge2 including the final clipping and component
+// removal; the same steps as the refine, rectify -d, disparity -r, merge -r, reproject and merge2
+// commands) to sched.  stereo pairs are
+// consecutive positions.
+// with a manifest, steps whose outputs are up to date are skipped (see Manifest.h), except for
+// the steps of forceStage (refine, rectify, disparity, merge, reproject or merge2) and all steps
+// after them.
+// if onlyStage is given (a stage as above, or one of the operations crosscheck, filter and
+// finalize), only
+// its steps run, always; the inputs of the first of them must exist
+void buildSceneGraph(StageScheduler &sched, const SceneLayout &layout,
+                     const std::vector<int> &projectors, const std::vector<int> &positions,
+                     StageManifest *manifest = NULL, const std::string &forceStage = "",
+                     const SceneParams &params = SceneParams(), const std::string &onlyStage = "");
+
+// build and run the scene graph of the given projectors and positions with step parameters sp, as
+// processScene() (activeLighting.h) does with the parameters of the calling thread; budget is the
+// memory budget in bytes (0: unlimited)
+int processScene(const SceneLayout &layout, const std::vector<int> &projectors, const std::vector<int> &positions,
+                 int nthreads, size_t budget, bool incremental, const std::string &forceStage, const SceneParams &sp);
+
+#endif /* Scheduler_h */
@@ -0,0 +1,579 @@
+//
+//  Session.cpp
+//  activeLighting
+//
+//  in-memory pipeline session: keeps the images of the processing stages in memory
+//
+
+#include "Session.h"
+#include "Utils.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "flowIO.h"
+#include <atomic>
+
+// read from the pool threads of the stages, set from the host's thread
+static std::atomic<PipelineSession *> currentSession(NULL);
+
+// contents of text file path, false if it cannot be read
+static bool readTextFile(std::string &text, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return false;
+    text.clear();
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        text.append(buf, n);
+    fclose(fp);
+    return true;
+}
+
+static void writeTextFile(const std::string &text, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        throw CError("cannot write %s", path);
+    fwrite(text.data(), 1, text.size(), fp);
+    fclose(fp);
+    logPrintf(log_verbose, "Wrote %s\n", path);
+}
+
+PipelineSession::PipelineSession()
+{
+}
+
+void PipelineSession::setCheckpoint(const std::string &stage, bool enabled)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (enabled)
+        checkpoints.insert(stage);
+    else
+        checkpoints.erase(stage);
+}
+
+bool PipelineSession::checkpointed(const std::string &stage)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return checkpoints.count(stage) > 0 || checkpoints.count("all") > 0;
+}
+
+bool PipelineSession::lookup(const char *path, Entry &e)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::map<std::string, Entry>::iterator it = images.find(path);
+    if (it == images.end())
+        return false;
+    e = it->second;
+    return true;
+}
+
+// copy of the image (or the band) stored in entry e
+void PipelineSession::extract(const Entry &e, CFloatImage &img)
+{
+    CFloatImage src = e.img;
+    CShape sh = src.Shape();
+    if (e.band < 0) {
+        img = copyImage(src);
+    } else {
+        sh.nBands = 1;
+        img.ReAllocate(sh);
+        for (int y = 0; y < sh.height; y++) {
+            float *s = &src.Pixel(0, y, e.band);
+            float *d = &img.Pixel(0, y, 0);
+            for (int x = 0; x < sh.width; x++)
+                d[x] = s[x * src.Shape().nBands];
+        }
+    }
+}
+
+void PipelineSession::save(const std::string &path, const Entry &e)
+{
+    CFloatImage img;
+    if (e.band < 0)
+        img = e.img;
+    else
+        extract(e, img);
+    if (e.bytes) {
+        CByteImage bimg;
+        CopyPixels(img, bimg);
+        WriteImageVerb(bimg, path.c_str(), logEnabled(log_verbose));
+    } else {
+        WriteImageVerb(img, path.c_str(), logEnabled(log_verbose));
+    }
+}
+
+void PipelineSession::read(CFloatImage &img, const char *path)
+{
+    Entry e;
+    if (lookup(path, e)) {
+        logPrintf(log_verbose, "Reading image %s from session\n", path);
+        extract(e, img);
+    } else {
+        ReadImageVerb(img, path, logEnabled(log_verbose));
+    }
+}
+
+void PipelineSession::readFlo(CFloatImage &flo, const char *xpath, const char *ypath)
+{
+    Entry ex, ey;
+    if (ypath != NULL && lookup(xpath, ex) && lookup(ypath, ey) && ex.band == 0 && ey.band == 1 &&
+        ex.img.Shape().nBands == 2 && &ex.img.Pixel(0, 0, 0) == &ey.img.Pixel(0, 0, 0)) {
+        // both halves of the same flo image: no need to merge
+        logPrintf(log_verbose, "Reading flo image %s, %s from session\n", xpath, ypath);
+        ex.band = -1;
+        extract(ex, flo);
+        return;
+    }
+    CFloatImage x, y;
+    read(x, xpath);
+    if (ypath == NULL) {
+        y.ReAllocate(x.Shape());
+        y.FillPixels(UNK);
+    } else {
+        read(y, ypath);
+    }
+    flo = mergeToFloImage(x, y);
+}
+
+void PipelineSession::read(CByteImage &img, const char *path)
+{
+    Entry e;
+    if (lookup(path, e)) {
+        logPrintf(log_verbose, "Reading image %s from session\n", path);
+        CFloatImage fimg;
+        extract(e, fimg);
+        CopyPixels(fimg, img);
+    } else {
+        ReadImageVerb(img, path, logEnabled(log_verbose));
+    }
+}
+
+bool PipelineSession::readText(std::string &text, const char *path)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<std::string, Text>::iterator it = texts.find(path);
+        if (it != texts.end()) {
+            text = it->second.text;
+            return true;
+        }
+    }
+    return readTextFile(text, path);
+}
+
+void PipelineSession::write(CFloatImage img, const char *path, const char *stage)
+{
+    Entry e;
+    e.img = img;
+    e.band = -1;
+    e.saved = checkpointed(stage);
+    e.bytes = false;
+    if (e.saved)
+        save(path, e);
+    std::lock_guard<std::mutex> guard(lock);
+    images[path] = e;
+}
+
+void PipelineSession::write(CByteImage img, const char *path, const char *stage)
+{
+    Entry e;
+    CopyPixels(img, e.img);
+    e.band = -1;
+    e.saved = checkpointed(stage);
+    e.bytes = true;
+    if (e.saved)
+        save(path, e);
+    std::lock_guard<std::mutex> guard(lock);
+    images[path] = e;
+}
+
+void PipelineSession::writeText(const std::string &text, const char *path, const char *stage)
+{
+    Text t;
+    t.text = text;
+    t.saved = checkpointed(stage);
+    if (t.saved)
+        writeTextFile(text, path);
+    std::lock_guard<std::mutex> guard(lock);
+    texts[path] = t;
+}
+
+void PipelineSession::writeFlo(CFloatImage flo, const char *xpath, const char *ypath, const char *stage)
+{
+    const char *paths[2] = {xpath, ypath};
+    bool saved = checkpointed(stage);
+    for (int band = 0; band < 2; band++) {
+        if (paths[band] == NULL)
+            continue;
+        Entry e;
+        e.img = flo;
+        e.band = band;
+        e.saved = saved;
+        e.bytes = false;
+        if (saved)
+            save(paths[band], e);
+        std::lock_guard<std::mutex> guard(lock);
+        images[paths[band]] = e;
+    }
+}
+
+void PipelineSession::put(const char *name, const float *data, int width, int height, int nbands, int stride)
+{
+    CFloatImage img(width, height, nbands);
+    for (int y = 0; y < height; y++)
+        memcpy(&img.Pixel(0, y, 0), data + y * stride, width * nbands * sizeof(float));
+    Entry e;
+    e.img = img;
+    e.band = -1;
+    e.saved = false;
+    e.bytes = false;
+    std::lock_guard<std::mutex> guard(lock);
+    images[name] = e;
+}
+
+bool PipelineSession::shape(const char *name, int &width, int &height, int &nbands)
+{
+    Entry e;
+    if (!lookup(name, e))
+        return false;
+    CShape sh = e.img.Shape();
+    width = sh.width;
+    height = sh.height;
+    nbands = (e.band < 0) ? sh.nBands : 1;
+    return true;
+}
+
+void PipelineSession::get(const char *name, float *data, int width, int height, int nbands, int stride)
+{
+    CFloatImage img;
+    read(img, name);
+    CShape sh = img.Shape();
+    if (sh.width != width || sh.height != height || sh.nBands != nbands)
+        throw CError("image %s has another shape than the buffer", name);
+    if (stride < width * nbands)
+        throw CError("buffer rows of %s overlap", name);
+    for (int y = 0; y < sh.height; y++)
+        memcpy(data + y * stride, &img.Pixel(0, y, 0), sh.width * sh.nBands * sizeof(float));
+}
+
+bool PipelineSession::unsaved(const char *path)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::map<std::string, Entry>::iterator it = images.find(path);
+    if (it != images.end())
+        return !it->second.saved;
+    std::map<std::string, Text>::iterator tt = texts.find(path);
+    return tt != texts.end() && !tt->second.saved;
+}
+
+void PipelineSession::release(const char *name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    images.erase(name);
+    texts.erase(name);
+}
+
+void PipelineSession::evict(const char *path)
+{
+    std::lock_guard<std::mutex> evicting(evictLock);
+    Entry e;
+    Text t;
+    bool image = lookup(path, e), text = false;
+    if (!image) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<std::string, Text>::iterator it = texts.find(path);
+        if (it == texts.end())
+            return;
+        t = it->second;
+        text = true;
+    }
+    if (image && !e.saved)
+        save(path, e);
+    if (text && !t.saved)
+        writeTextFile(t.text, path);
+
+    // a step may have stored a new version of path while it was written
+    std::lock_guard<std::mutex> guard(lock);
+    if (image) {
+        std::map<std::string, Entry>::iterator it = images.find(path);
+        if (it != images.end() && it->second.band == e.band && &it->second.img.Pixel(0, 0, 0) == &e.img.Pixel(0, 0, 0))
+            images.erase(it);
+    } else {
+        std::map<std::string, Text>::iterator it = texts.find(path);
+        if (it != texts.end() && it->second.text == t.text)
+            texts.erase(it);
+    }
+}
+
+std::vector<std::string> PipelineSession::resident()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::string> paths;
+    for (std::map<std::string, Entry>::iterator it = images.begin(); it != images.end(); ++it)
+        paths.push_back(it->first);
+    for (std::map<std::string, Text>::iterator it = texts.begin(); it != texts.end(); ++it)
+        paths.push_back(it->first);
+    return paths;
+}
+
+size_t PipelineSession::residentBytes()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::set<float *> buffers;
+    size_t bytes = 0;
+    for (std::map<std::string, Entry>::iterator it = images.begin(); it != images.end(); ++it) {
+        CShape sh = it->second.img.Shape();
+        if (buffers.insert(&it->second.img.Pixel(0, 0, 0)).second)
+            bytes += (size_t)sh.width * sh.height * sh.nBands * sizeof(float);
+    }
+    for (std::map<std::string, Text>::iterator it = texts.begin(); it != texts.end(); ++it)
+        bytes += it->second.text.size();
+    return bytes;
+}
+
+void PipelineSession::flush()
+{
+    std::lock_guard<std::mutex> evicting(evictLock);
+    std::map<std::string, Entry> unsaved;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (std::map<std::string, Entry>::iterator it = images.begin(); it != images.end(); ++it) {
+            if (!it->second.saved) {
+                unsaved[it->first] = it->second;
+                it->second.saved = true;
+            }
+        }
+    }
+    std::map<std::string, std::string> unsavedTexts;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (std::map<std::string, Text>::iterator it = texts.begin(); it != texts.end(); ++it) {
+            if (!it->second.saved) {
+                unsavedTexts[it->first] = it->second.text;
+                it->second.saved = true;
+            }
+        }
+    }
+    for (std::map<std::string, Entry>::iterator it = unsaved.begin(); it != unsaved.end(); ++it)
+        save(it->first, it->second);
+    for (std::map<std::string, std::string>::iterator it = unsavedTexts.begin(); it != unsavedTexts.end(); ++it)
+        writeTextFile(it->second, it->first.c_str());
+}
+
+
+PipelineSession *activeSession()
+{
+    return currentSession;
+}
+
+void pipelineRead(CFloatImage &img, const char *path)
+{
+    StageScope scope("read image");
+    PipelineSession *session = currentSession.load();
+    if (session != NULL)
+        session->read(img, path);
+    else
+        ReadImageVerb(img, path, logEnabled(log_verbose));
+}
+
+void pipelineReadFlo(CFloatImage &flo, const char *xpath, const char *ypath)
+{
+    StageScope scope("read image");
+    PipelineSession *session = currentSession.load();
+    if (session != NULL) {
+        session->readFlo(flo, xpath, ypath);
+        return;
+    }
+    CFloatImage x, y;
+    ReadImageVerb(x, xpath, logEnabled(log_verbose));
+    if (ypath == NULL) {
+        y.ReAllocate(x.Shape());
+        y.FillPixels(UNK);
+    } else {
+        ReadImageVerb(y, ypath, logEnabled(log_verbose));
+    }
+    flo = mergeToFloImage(x, y);
+}
+
+void pipelineWrite(CFloatImage img, const char *path, const char *stage)
+{
+    StageScope scope("write image");
+    PipelineSession *session = currentSession.load();
+    if (session != NULL)
+        session->write(img, path, stage);
+    else
+        WriteImageVerb(img, path, logEnabled(log_verbose));
+}
+
+void pipelineWriteFlo(CFloatImage flo, const char *xpath, const char *ypath, const char *stage)
+{
+    StageScope scope("write image");
+    PipelineSession *session = currentSession.load();
+    if (session != NULL) {
+        session->writeFlo(flo, xpath, ypath, stage);
+        return;
+    }
+    pair<CFloatImage,CFloatImage> split = splitFloImage(flo);
+    WriteImageVerb(split.first, xpath, logEnabled(log_verbose));
+    if (ypath != NULL)
+        WriteImageVerb(split.second, ypath, logEnabled(log_verbose));
+}
+
+void pipelineRead(CByteImage &img, const char *path)
+{
+    StageScope scope("read image");
+    PipelineSession *session = currentSession.load();
+    if (session != NULL)
+        session->read(img, path);
+    else
+        ReadImageVerb(img, path, logEnabled(log_verbose));
+}
+
+void pipelineWrite(CByteImage img, const char *path, const char *stage)
+{
+    StageScope scope("write image");
+    PipelineSession *session = currentSession.load();
+    if (session != NULL)
+        session->write(img, path, stage);
+    else
+        WriteImageVerb(img, path, logEnabled(log_verbose));
+}
+
+bool pipelineReadText(std::string &text, const char *path)
+{
+    PipelineSession *session = currentSession.load();
+    if (session != NULL)
+        return session->readText(text, path);
+    return readTextFile(text, path);
+}
+
+void pipelineWriteText(const std::string &text, const char *path, const char *stage)
+{
+    PipelineSession *session = currentSession.load();
+    if (session != NULL) {
+        session->writeText(text, path, stage);
+        return;
+    }
+    writeTextFile(text, path);
+}
+
+CShape pipelineShape(const char *path)
+{
+    int width, height, nbands;
+    PipelineSession *session = currentSession.load();
+    if (session != NULL && session->shape(path, width, height, nbands))
+        return CShape(width, height, nbands);
+    const char *dot = strrchr(path, '.');
+    if (dot != NULL && strcmp(dot, ".flo") == 0)
+        return ReadFlowFileShape(path);
+    return ReadImageShape(path);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// C interface
+
+// create a new session; it becomes the active session used by all pipeline entry points
+extern "C" void *pipelineSessionCreate()
+{
+    PipelineSession *session = new PipelineSession();
+    currentSession = session;
+    return session;
+}
+
+// make session the active one (NULL: no session, stages read and write files)
+extern "C" void pipelineSessionActivate(void *session)
+{
+    currentSession = (PipelineSession *)session;
+}
+
+extern "C" void pipelineSessionDestroy(void *session)
+{
+    PipelineSession *expected = (PipelineSession *)session;
+    currentSession.compare_exchange_strong(expected, NULL);
+    delete (PipelineSession *)session;
+}
+
+// stage is one of refine, disparity, crosscheck, filter, merge, reproject, merge2, or all
+extern "C" void pipelineSessionCheckpoint(void *session, char *stage, int enabled)
+{
+    ((PipelineSession *)session)->setCheckpoint(stage, enabled != 0);
+}
+
+// the functions below that return int return 1 on success and 0 on failure, after logging the error
+
+extern "C" int pipelineSessionPutImage(void *session, char *name, float *data, int width, int height, int nbands, int stride)
+{
+    try {
+        ((PipelineSession *)session)->put(name, data, width, height, nbands, stride);
+    } catch (CError &err) {
+        logPrintf(log_error, "pipelineSessionPutImage %s: %s\n", name, err.message);
+        return 0;
+    }
+    return 1;
+}
+
+// returns 0 if the session does not hold an image called name
+extern "C" int pipelineSessionImageShape(void *session, char *name, int *width, int *height, int *nbands)
+{
+    try {
+        return ((PipelineSession *)session)->shape(name, *width, *height, *nbands) ? 1 : 0;
+    } catch (CError &err) {
+        logPrintf(log_error, "pipelineSessionImageShape %s: %s\n", name, err.message);
+        return 0;
+    }
+}
+
+// shape of image name in the active session or on disk, without reading the pixels;
+// returns 0 if there is no such image
+extern "C" int pipelineImageShape(char *name, int *width, int *height, int *nbands)
+{
+    CShape sh;
+    try {
+        sh = pipelineShape(name);
+    } catch (CError &) {
+        return 0;
+    }
+    *width = sh.width;
+    *height = sh.height;
+    *nbands = sh.nBands;
+    return 1;
+}
+
+// images written as .cfm files (compressed float maps) are rounded to multiples of precision,
+// 0 keeps them exactly (the default); unknown pixels are always kept
+extern "C" void setFloatMapPrecision(float precision)
+{
+    SetFloatMapPrecision(precision);
+}
+
+// copy image into data, a buffer of height rows of width pixels with nbands bands (stride = distance
+// between rows in floats); reads it from disk if needed.  fails if the image has another shape
+extern "C" int pipelineSessionGetImage(void *session, char *name, float *data, int width, int height, int nbands, int stride)
+{
+    try {
+        ((PipelineSession *)session)->get(name, data, width, height, nbands, stride);
+    } catch (CError &err) {
+        logPrintf(log_error, "pipelineSessionGetImage %s: %s\n", name, err.message);
+        return 0;
+    }
+    return 1;
+}
+
+extern "C" void pipelineSessionRelease(void *session, char *name)
+{
+    ((PipelineSession *)session)->release(name);
+}
+
+extern "C" int pipelineSessionFlush(void *session)
+{
+    try {
+        ((PipelineSession *)session)->flush();
+    } catch (CError &err) {
+        logPrintf(log_error, "pipelineSessionFlush: %s\n", err.message);
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,112 @@
+//
+//  Session.h
+//  activeLighting
+//
+//  in-memory pipeline session: keeps the images of the processing stages in memory
+//
+
+#ifndef Session_h
+#define Session_h
+
+#include "imageLib.h"
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// a pipeline session holds the images written by the stages (refine, disparity, crosscheck,
+// filter, merge, reproject, merge2), keyed by the path they would be saved to.  a later stage
+// asking for that path gets the image from memory instead of re-reading the PFM file.
+// 2-band (flo) results are stored once and shared by their x and y paths, so a following
+// stage that wants the flo image gets it without splitting and re-merging the bands.
+// images are only written to disk for stages selected with setCheckpoint(), by evict(), or by
+// flush().  processScene() evicts the images that no remaining step reads after each step, so a
+// scene does not have to fit into memory, and counts the resident images against its budget.
+class PipelineSession {
+public:
+    PipelineSession();
+
+    // select whether results of stage are saved to disk ("all" selects all stages)
+    void setCheckpoint(const std::string &stage, bool enabled);
+    bool checkpointed(const std::string &stage);
+
+    // image at path, from memory if available, otherwise read from disk.
+    // the result is a copy, so stages can modify it in place
+    void read(CFloatImage &img, const char *path);
+    // flo image with x and y bands from xpath and ypath (ypath == NULL: y band is UNK)
+    void readFlo(CFloatImage &flo, const char *xpath, const char *ypath);
+    // byte image (numbers of samples), stored as float and saved as a byte image
+    void read(CByteImage &img, const char *path);
+    // text file (reprojection matrices and logs); false if it is neither in memory nor on disk
+    bool readText(std::string &text, const char *path);
+
+    // store result img of stage as path; the session takes over img, so the caller must not
+    // modify it afterwards
+    void write(CFloatImage img, const char *path, const char *stage);
+    // store bands 0 and 1 of flo as xpath and ypath (ypath == NULL: drop y band)
+    void writeFlo(CFloatImage flo, const char *xpath, const char *ypath, const char *stage);
+    void write(CByteImage img, const char *path, const char *stage);
+    void writeText(const std::string &text, const char *path, const char *stage);
+
+    // buffers supplied or requested by the caller; stride is the distance between rows in floats.
+    // get() throws CError if the image does not have the shape of the buffer
+    void put(const char *name, const float *data, int width, int height, int nbands, int stride);
+    bool shape(const char *name, int &width, int &height, int &nbands);
+    void get(const char *name, float *data, int width, int height, int nbands, int stride);
+
+    // path is held in memory and not written to disk yet
+    bool unsaved(const char *path);
+
+    void release(const char *name);
+    // write path to disk unless it is saved already and drop it from memory; later reads
+    // of path go to the file
+    void evict(const char *path);
+    // write all images that are not yet saved to disk
+    void flush();
+
+    // paths of the images and texts held in memory, and their size in bytes (the bands of a
+    // flo image count once)
+    std::vector<std::string> resident();
+    size_t residentBytes();
+
+private:
+    struct Entry {
+        CFloatImage img;    // stored image
+        int band;           // band of img stored under this name, or -1 for all bands
+        bool saved;         // also on disk
+        bool bytes;         // came from a byte image, saved as one
+    };
+    struct Text {
+        std::string text;
+        bool saved;
+    };
+    bool lookup(const char *path, Entry &e);
+    void extract(const Entry &e, CFloatImage &img);
+    void save(const std::string &path, const Entry &e);
+
+    std::mutex lock;
+    std::mutex evictLock;       // one evict() or flush() at a time, so no file is written twice at once
+    std::map<std::string, Entry> images;
+    std::map<std::string, Text> texts;
+    std::set<std::string> checkpoints;
+};
+
+// the session used by the C entry points, NULL if none is active
+PipelineSession *activeSession();
+
+// image I/O of the pipeline stages: goes through the active session, or directly to disk if
+// there is none (same as ReadImageVerb / WriteImageVerb)
+void pipelineRead(CFloatImage &img, const char *path);
+void pipelineReadFlo(CFloatImage &flo, const char *xpath, const char *ypath);
+void pipelineWrite(CFloatImage img, const char *path, const char *stage);
+void pipelineWriteFlo(CFloatImage flo, const char *xpath, const char *ypath, const char *stage);
+void pipelineRead(CByteImage &img, const char *path);
+void pipelineWrite(CByteImage img, const char *path, const char *stage);
+bool pipelineReadText(std::string &text, const char *path);
+void pipelineWriteText(const std::string &text, const char *path, const char *stage);
+// shape of the image at path, from the active session or from the header of the file without
+// reading its pixels (.flo files have 2 bands)
+CShape pipelineShape(const char *path);
+
+#endif /* Session_h */
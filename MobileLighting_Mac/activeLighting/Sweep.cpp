@@ -0,0 +1,353 @@
+//
+//  Sweep.cpp
+//  activeLighting
+//
+//  parameter sweeps: evaluate a grid of parameter settings of a stage on inputs loaded once
+//
+
+#include "Sweep.h"
+#include "Scheduler.h"
+#include "Parallel.h"
+#include "Session.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "Utils.h"
+#include "Disparities.h"
+#include "Decode.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// sweep
+
+// number of settings of step (all combinations of its parameter values)
+static int settings(const SweepStep &step)
+{
+    int n = 1;
+    for (size_t i = 0; i < step.params.size(); i++)
+        n *= (int)step.params[i].values.size();
+    return n;
+}
+
+// parameter values of setting k of step, the last parameter changing fastest
+static std::vector<float> settingValues(const SweepStep &step, int k)
+{
+    int np = (int)step.params.size();
+    std::vector<float> values(np);
+    for (int i = np - 1; i >= 0; i--) {
+        int n = (int)step.params[i].values.size();
+        values[i] = step.params[i].values[k % n];
+        k /= n;
+    }
+    return values;
+}
+
+// compare band 0 of img with band 0 of reference (if not empty)
+static void compare(CFloatImage img, CFloatImage reference, SweepResult &res)
+{
+    CShape sh = img.Shape();
+    bool hasref = reference.Shape().width > 0;
+    if (hasref && (reference.Shape().width != sh.width || reference.Shape().height != sh.height))
+        throw CError("sweep: reference image has a different size");
+    long long n = 0, ncov = 0, nbad = 0;
+    double sd = 0;
+    for (int y = 0; y < sh.height; y++) {
+        for (int x = 0; x < sh.width; x++) {
+            float d = img.Pixel(x, y, 0), g = hasref ? reference.Pixel(x, y, 0) : 0;
+            if (g == UNK)
+                continue;
+            n++;
+            if (d == UNK)
+                continue;
+            ncov++;
+            nbad += fabs(d - g) > 1;
+            sd += (double)(d - g) * (d - g);
+        }
+    }
+    long long nd = std::max(ncov, 1LL);
+    res.coverage = 100.0 * ncov / std::max(n, 1LL);
+    res.bad = hasref ? 100.0 * nbad / nd : -1;
+    res.rms = hasref ? sqrt(sd / nd) : -1;
+}
+
+struct SweepRunner {
+    SweepRunner(const std::string &name, const std::vector<SweepStep> &steps, CFloatImage reference, const std::string &outdir)
+    : name(name), steps(steps), reference(reference), outdir(outdir) {}
+
+    // evaluate the settings of step s on img, the result of setting index of the steps before
+    void descend(int s, CFloatImage img, int index, const std::vector<float> &values, double seconds);
+    void finish(int index, CFloatImage img, const std::vector<float> &values, double seconds);
+
+    std::string name;
+    const std::vector<SweepStep> &steps;
+    CFloatImage reference;
+    std::string outdir;
+    std::vector<SweepResult> results;
+};
+
+void SweepRunner::descend(int s, CFloatImage img, int index, const std::vector<float> &values, double seconds)
+{
+    const SweepStep &step = steps[s];
+    int n = settings(step);
+    bool last = (s + 1 == (int)steps.size());
+    std::vector<CFloatImage> out(n);
+    std::vector<double> secs(n);
+    parallelFor(n, [&](int k) {
+        std::vector<float> v = values, sv = settingValues(step, k);
+        v.insert(v.end(), sv.begin(), sv.end());
+        CFloatImage copy = copyImage(img);
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        CFloatImage result = step.apply(copy, sv);
+        secs[k] = seconds + std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if (last)
+            finish(index * n + k, result, v, secs[k]);
+        else
+            out[k] = result;
+    });
+    if (last)
+        return;
+    // depth first, so only the results along one path of the grid are kept
+    for (int k = 0; k < n; k++) {
+        std::vector<float> v = values, sv = settingValues(step, k);
+        v.insert(v.end(), sv.begin(), sv.end());
+        descend(s + 1, out[k], index * n + k, v, secs[k]);
+        out[k].DeAllocate();
+    }
+}
+
+void SweepRunner::finish(int index, CFloatImage img, const std::vector<float> &values, double seconds)
+{
+    SweepResult &res = results[index];
+    res.values = values;
+    res.seconds = seconds;
+    compare(img, reference, res);
+    char filename[1000];
+    snprintf(filename, sizeof(filename), "%s/%s-%d.pfm", outdir.c_str(), name.c_str(), index);
+    res.output = filename;
+    if (img.Shape().nBands > 1)
+        WriteBand(img, 0, 1, filename, 0);
+    else
+        WriteImageVerb(img, filename, 0);
+}
+
+std::vector<SweepResult> runSweep(const std::string &name, CFloatImage input, const std::vector<SweepStep> &steps,
+                                  CFloatImage reference, const std::string &outdir)
+{
+    StageScope scope("sweep");
+    if (steps.empty())
+        throw CError("sweep %s: no steps", name.c_str());
+    int total = 1;
+    for (size_t s = 0; s < steps.size(); s++)
+        total *= settings(steps[s]);
+    logPrintf(log_info, "sweep %s: %d settings\n", name.c_str(), total);
+    SweepRunner runner(name, steps, reference, outdir);
+    runner.results.resize(total);
+    runner.descend(0, input, 0, std::vector<float>(), 0);
+    instrumentCount("settings", total);
+    return runner.results;
+}
+
+void reportSweep(const std::vector<SweepStep> &steps, const std::vector<SweepResult> &results, const std::string &csvfile)
+{
+    FILE *csv = NULL;
+    if (!csvfile.empty()) {
+        csv = fopen(csvfile.c_str(), "w");
+        if (csv == NULL)
+            throw CError("sweep: cannot write %s", csvfile.c_str());
+    }
+    logFlush();     // the table follows the messages of the sweep
+    printf("%4s", "k");
+    if (csv) fprintf(csv, "k");
+    for (size_t s = 0; s < steps.size(); s++) {
+        for (size_t i = 0; i < steps[s].params.size(); i++) {
+            printf(" %12s", steps[s].params[i].name.c_str());
+            if (csv) fprintf(csv, ",%s", steps[s].params[i].name.c_str());
+        }
+    }
+    printf("  coverage     bad>1      rms   seconds  output\n");
+    if (csv) fprintf(csv, ",coverage,bad,rms,seconds,output\n");
+    for (size_t k = 0; k < results.size(); k++) {
+        const SweepResult &r = results[k];
+        printf("%4d", (int)k);
+        if (csv) fprintf(csv, "%d", (int)k);
+        for (size_t i = 0; i < r.values.size(); i++) {
+            printf(" %12g", r.values[i]);
+            if (csv) fprintf(csv, ",%g", r.values[i]);
+        }
+        if (r.rms >= 0)
+            printf("  %7.2f%%  %7.2f%%  %7.3f", r.coverage, r.bad, r.rms);
+        else
+            printf("  %7.2f%%  %8s  %7s", r.coverage, "-", "-");
+        printf("  %8.3f  %s\n", r.seconds, r.output.c_str());
+        if (csv) fprintf(csv, ",%.4f,%.4f,%.4f,%.4f,%s\n", r.coverage, r.bad, r.rms, r.seconds, r.output.c_str());
+    }
+    if (csv)
+        fclose(csv);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// stages
+
+static SweepStep sweepStep(const char *name0, const std::vector<float> &values0, const char *name1 = NULL,
+                           const std::vector<float> &values1 = std::vector<float>(), const char *name2 = NULL,
+                           const std::vector<float> &values2 = std::vector<float>())
+{
+    SweepStep step;
+    step.params.push_back({name0, values0});
+    if (name1 != NULL)
+        step.params.push_back({name1, values1});
+    if (name2 != NULL)
+        step.params.push_back({name2, values2});
+    return step;
+}
+
+// each step runs one of the operations of runFilter (the others are disabled by their parameters)
+std::vector<SweepStep> filterSweep(const std::vector<float> &ythresh, const std::vector<float> &kx, const std::vector<float> &ky,
+                                   const std::vector<float> &mincompsize, const std::vector<float> &maxholesize)
+{
+    std::vector<SweepStep> steps;
+    steps.push_back(sweepStep("ythresh", ythresh));
+    steps.back().apply = [](CFloatImage img, const std::vector<float> &v) {
+        return runFilter(img, v[0], 0, 0, 0, 0);
+    };
+    steps.push_back(sweepStep("kx", kx, "ky", ky));
+    steps.back().apply = [](CFloatImage img, const std::vector<float> &v) {
+        return runFilter(img, -1, (int)v[0], (int)v[1], 0, 0);
+    };
+    steps.push_back(sweepStep("mincompsize", mincompsize));
+    steps.back().apply = [](CFloatImage img, const std::vector<float> &v) {
+        return runFilter(img, -1, 0, 0, (int)v[0], 0);
+    };
+    steps.push_back(sweepStep("maxholesize", maxholesize));
+    steps.back().apply = [](CFloatImage img, const std::vector<float> &v) {
+        return runFilter(img, -1, 0, 0, 0, (int)v[0]);
+    };
+    return steps;
+}
+
+std::vector<SweepStep> refineSweep(int direction, double angle, const ProcessingParams &base, const std::vector<float> &radius,
+                                   const std::vector<float> &fraction, const std::vector<float> &maxdiff)
+{
+    std::vector<SweepStep> steps;
+    steps.push_back(sweepStep("filterradius", radius, "filterfraction", fraction, "filtermaxdiff", maxdiff));
+    steps.back().apply = [=](CFloatImage img, const std::vector<float> &v) {
+        ProcessingParams params = base;
+        params.filterRadius = (int)v[0];
+        params.filterFraction = v[1];
+        params.filterMaxDiff = v[2];
+        char none[1] = "";  // nothing is saved
+        return refineCodeImage(none, direction, img, angle, none, 0, params);
+    };
+    return steps;
+}
+
+std::vector<SweepStep> merge2Sweep(const std::vector<CFloatImage> &vdisps, const std::vector<CFloatImage> &rdisps,
+                                   const std::vector<float> &maxdiff, const std::vector<float> &mincompsize,
+                                   const std::vector<float> &maxholesize)
+{
+    std::vector<SweepStep> steps;
+    steps.push_back(sweepStep("maxdiff", maxdiff));
+    steps.back().apply = [=](CFloatImage img, const std::vector<float> &v) {
+        std::vector<CFloatImage> vd = vdisps, rd = rdisps;
+        CFloatImage state = initMergeState(img, vd.data(), (int)vd.size(), rd.data(), (int)rd.size(), v[0]);
+        CFloatImage outd, outsd;
+        CByteImage outn;
+        finalizeMergeState(state, outd, outsd, outn);
+        CFloatImage blank(outd.Shape());
+        blank.FillPixels(UNK);
+        return mergeToFloImage(outd, blank);
+    };
+    steps.push_back(sweepStep("mincompsize", mincompsize));
+    steps.back().apply = [](CFloatImage img, const std::vector<float> &v) {
+        return runFilter(img, -1, 0, 0, (int)v[0], 0);
+    };
+    steps.push_back(sweepStep("maxholesize", maxholesize));
+    steps.back().apply = [](CFloatImage img, const std::vector<float> &v) {
+        return runFilter(img, -1, 0, 0, 0, (int)v[0]);
+    };
+    return steps;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// scene sweeps
+
+SweepConfig::SweepConfig()
+: projector(0), left(0), right(1), position(0), direction(0)
+{
+}
+
+// values of a parameter: those swept, otherwise value
+static std::vector<float> sweepValues(const SweepConfig &cfg, const char *name, float value)
+{
+    std::map<std::string, std::vector<float> >::const_iterator it = cfg.values.find(name);
+    if (it == cfg.values.end() || it->second.empty())
+        return std::vector<float>(1, value);
+    return it->second;
+}
+
+void runSceneSweep(const SceneLayout &layout, const std::vector<int> &projectors, const SceneParams &sp, const SweepConfig &cfg)
+{
+    std::string pairID = std::to_string(cfg.left) + std::to_string(cfg.right);
+    std::string pos = std::to_string(cfg.position);
+    if (cfg.stage != "refine" && cfg.position != cfg.left && cfg.position != cfg.right)
+        throw CError("sweep: position %d is not part of the stereo pair", cfg.position);
+
+    CFloatImage input;
+    std::vector<SweepStep> steps;
+    if (cfg.stage == "filter") {
+        std::string disp = layout.disparity(cfg.projector, cfg.position, true) + "/disp" + pairID;
+        pipelineReadFlo(input, (disp + "x-1crosscheck1" + layout.ext).c_str(), (disp + "y-1crosscheck1" + layout.ext).c_str());
+        steps = filterSweep(sweepValues(cfg, "ythresh", sp.filterYthresh), sweepValues(cfg, "kx", sp.filterKx),
+                            sweepValues(cfg, "ky", sp.filterKy), sweepValues(cfg, "mincompsize", sp.filterMinCompSize),
+                            sweepValues(cfg, "maxholesize", sp.filterMaxHoleSize));
+    } else if (cfg.stage == "refine") {
+        if (cfg.direction != 0 && cfg.direction != 1)
+            throw CError("sweep: direction %d is not 0 or 1", cfg.direction);
+        std::string code = layout.decoded(cfg.projector, cfg.position, false) + "/result" + pos + "uv"[cfg.direction] + "-0initial.pfm";
+        pipelineRead(input, code.c_str());
+        double angle = readAngle(layout.metadataFile(cfg.direction, cfg.projector, cfg.position));
+        const ProcessingParams &pp = sp.processing;
+        steps = refineSweep(cfg.direction, angle, pp, sweepValues(cfg, "filterradius", pp.filterRadius),
+                            sweepValues(cfg, "filterfraction", pp.filterFraction), sweepValues(cfg, "filtermaxdiff", pp.filterMaxDiff));
+    } else if (cfg.stage == "merge2") {
+        std::string dispx = layout.merged(cfg.position, true) + "/disp" + pairID + "x-1crosscheck" + layout.ext;
+        pipelineRead(input, dispx.c_str());
+        // the view and reprojected disparities merge2 of the scene graph uses
+        std::vector<CFloatImage> vd, rd;
+        for (size_t p = 0; p < projectors.size(); p++) {
+            std::string view = layout.disparity(projectors[p], cfg.position, true) + "/disp" + pairID + "x-2filtered" + layout.ext;
+            std::string dir = layout.reprojected(projectors[p], cfg.position);
+            CFloatImage img;
+            if (access(view.c_str(), F_OK) == 0) {
+                pipelineRead(img, view.c_str());
+                vd.push_back(img);
+            }
+            if (reliableReprojection(dir + "/log" + pairID + ".txt")) {
+                pipelineRead(img, (dir + "/disp" + pairID + "x-1filtered" + layout.ext).c_str());
+                rd.push_back(img);
+            }
+        }
+        logPrintf(log_info, "sweep merge2: %d view and %d reprojected disparities\n", (int)vd.size(), (int)rd.size());
+        steps = merge2Sweep(vd, rd, sweepValues(cfg, "maxdiff", sp.merge2MaxDiff), sweepValues(cfg, "mincompsize", sp.merge2MinCompSize),
+                            sweepValues(cfg, "maxholesize", sp.merge2MaxHoleSize));
+    } else {
+        throw CError("sweep: unknown stage %s", cfg.stage.c_str());
+    }
+
+    CFloatImage reference;
+    if (!cfg.reference.empty())
+        pipelineRead(reference, cfg.reference.c_str());
+    std::string outdir = cfg.outdir.empty() ? layout.scene + "/computed/sweep" : cfg.outdir;
+    if (mkdir(outdir.c_str(), 0755) != 0 && errno != EEXIST)
+        throw CError("cannot create directory %s", outdir.c_str());
+
+    std::vector<SweepResult> results = runSweep(cfg.stage, input, steps, reference, outdir);
+    reportSweep(steps, results, outdir + "/" + cfg.stage + ".csv");
+}
@@ -0,0 +1,91 @@
+//
+//  Sweep.h
+//  activeLighting
+//
+//  parameter sweeps: evaluate a grid of parameter settings of a stage on inputs loaded once
+//
+
+#ifndef Sweep_h
+#define Sweep_h
+
+#include "imageLib.h"
+#include "Params.h"
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+struct SceneLayout;
+struct SceneParams;
+
+// one parameter of a sweep and the values it takes
+struct SweepParam {
+    std::string name;
+    std::vector<float> values;
+};
+
+// a step of a sweep: computes its result from the result of the previous step (or the input),
+// using one value of each of its parameters.  apply gets its own copy of the image
+struct SweepStep {
+    std::vector<SweepParam> params;
+    std::function<CFloatImage(CFloatImage img, const std::vector<float> &values)> apply;
+};
+
+// a setting evaluated by a sweep
+struct SweepResult {
+    std::vector<float> values;  // of all parameters, in step order
+    double coverage;            // % of pixels with a value (of the pixels known in the reference)
+    double bad;                 // % of them differing from the reference by more than 1 (-1: no reference)
+    double rms;                 // rms difference from the reference (-1: no reference)
+    double seconds;             // time of all steps leading to the result
+    std::string output;
+};
+
+// evaluates all combinations of the parameter values of the steps, which are applied in order
+// to input.  the result of a step is computed once and shared by all combinations with the same
+// values up to that step; the settings of a step are evaluated in parallel.  the final result
+// of combination k (band 0) is written to outdir/<name>-<k>.pfm and compared with reference
+// (band 0; an empty image: no comparison).  results are in the order of the combinations, the
+// values of the last parameter changing fastest
+std::vector<SweepResult> runSweep(const std::string &name, CFloatImage input, const std::vector<SweepStep> &steps,
+                                  CFloatImage reference, const std::string &outdir);
+
+// print a table of the results and write it as csv file (unless csvfile is empty)
+void reportSweep(const std::vector<SweepStep> &steps, const std::vector<SweepResult> &results, const std::string &csvfile);
+
+// steps of the sweeps of the stages (a single value keeps a parameter fixed):
+// runFilter of flo disparities (ythresh, kx & ky, mincompsize, maxholesize; same results as
+// runFilter with the combined parameters)
+std::vector<SweepStep> filterSweep(const std::vector<float> &ythresh, const std::vector<float> &kx, const std::vector<float> &ky,
+                                   const std::vector<float> &mincompsize, const std::vector<float> &maxholesize);
+
+// refinement of a decoded code image with the code filter parameters of ProcessingParams
+// (filterradius, filterfraction, filtermaxdiff); the other parameters are those of base
+std::vector<SweepStep> refineSweep(int direction, double angle, const ProcessingParams &base, const std::vector<float> &radius,
+                                   const std::vector<float> &fraction, const std::vector<float> &maxdiff);
+
+// merge2 of the merged disparities (the input) with view and reprojected disparities (maxdiff),
+// followed by the filter of the merged result (mincompsize, maxholesize)
+std::vector<SweepStep> merge2Sweep(const std::vector<CFloatImage> &vdisps, const std::vector<CFloatImage> &rdisps,
+                                   const std::vector<float> &maxdiff, const std::vector<float> &mincompsize,
+                                   const std::vector<float> &maxholesize);
+
+// sweep of a stage of a scene, as set up by the driver (see Main.cpp)
+struct SweepConfig {
+    SweepConfig();
+
+    std::string stage;          // filter, refine or merge2
+    int projector;              // filter, refine
+    int left, right;            // stereo pair (filter, merge2)
+    int position;               // refine, and side of the pair (filter, merge2)
+    int direction;              // refine: 0 (u) or 1 (v)
+    std::string outdir;         // default: <scene>/computed/sweep
+    std::string reference;      // image the results are compared with (optional)
+    std::map<std::string, std::vector<float> > values;  // swept parameters (others: from SceneParams)
+};
+
+// loads the inputs of the stage (the same files the scene graph uses), runs the sweep and
+// writes outdir/<stage>-<k>.pfm and outdir/<stage>.csv
+void runSceneSweep(const SceneLayout &layout, const std::vector<int> &projectors, const SceneParams &sp, const SweepConfig &cfg);
+
+#endif /* Sweep_h */
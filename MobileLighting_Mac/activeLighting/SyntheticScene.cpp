@@ -0,0 +1,259 @@
+//
+//  SyntheticScene.cpp
+//  activeLighting
+//
+//  synthetic code images with known ground-truth disparities, for benchmarks
+//
+//  the scene is a set of planar patches seen by a rectified stereo pair and lit by projectors.
+//  for each camera pixel the nearest patch along its ray is found; the pixel gets the projector
+//  coordinates of that point as code values (unless the point is in the projector's shadow), and
+//  its ground-truth disparity from the position of the point in the other camera (which is marked
+//  as occluded if the point is not visible there).  the code values are then degraded like real
+//  decoded images: gaussian noise, rounding to integer codes, random outliers, and undecodable holes
+//
+
+#include "SyntheticScene.h"
+#include "Utils.h"
+#include "Parallel.h"
+#include <math.h>
+#include <random>
+#include <algorithm>
+
+// rays hit a patch at P = O + t D; a point is visible from O if nothing is hit before t = 1
+#define VISIBLE_T (1 - 1e-6)
+
+static double dot(const double *a, const double *b)
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void normalize(double *a)
+{
+    double n = sqrt(dot(a, a));
+    for (int i = 0; i < 3; i++)
+        a[i] /= n;
+}
+
+static void cross(const double *a, const double *b, double *r)
+{
+    r[0] = a[1] * b[2] - a[2] * b[1];
+    r[1] = a[2] * b[0] - a[0] * b[2];
+    r[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// nearest intersection t > 0 of ray O + t D with the patches, INFINITY if none
+static double raycast(const std::vector<ScenePatch> &patches, const double *O, const double *D)
+{
+    double tmin = INFINITY;
+    for (size_t i = 0; i < patches.size(); i++) {
+        const ScenePatch &p = patches[i];
+        double nd = dot(p.n, D);
+        if (fabs(nd) < 1e-12)
+            continue;
+        double t = (p.c - dot(p.n, O)) / nd;
+        if (t <= 1e-9 || t >= tmin)
+            continue;
+        if (p.xmin < p.xmax) {
+            double x = O[0] + t * D[0], y = O[1] + t * D[1];
+            if (x < p.xmin || x > p.xmax || y < p.ymin || y > p.ymax)
+                continue;
+        }
+        tmin = t;
+    }
+    return tmin;
+}
+
+static bool visibleFrom(const std::vector<ScenePatch> &patches, const double *O, const double *P)
+{
+    double D[3] = {P[0] - O[0], P[1] - O[1], P[2] - O[2]};
+    return raycast(patches, O, D) >= VISIBLE_T;
+}
+
+void defaultSyntheticScene(std::vector<ScenePatch> &patches, std::vector<SceneProjector> &projectors, int nproj)
+{
+    patches.clear();
+    // slanted background z = 3.2 + 0.25 x
+    patches.push_back({{-0.25, 0, 1}, 3.2, 0, 0, 0, 0});
+    // ramp z = 2.6 + 0.5 y on the left
+    patches.push_back({{0, -0.5, 1}, 2.6, -1.0, -0.35, -0.5, 0.6});
+    // box front z = 2.0 on the right: occlusion steps and shadows on the background
+    patches.push_back({{0, 0, 1}, 2.0, 0.15, 0.7, -0.4, 0.3});
+
+    static const double centers[4][3] = {{-0.4, -0.3, 0.2}, {0.6, -0.3, 0.1}, {0.1, 0.4, 0.0}, {-0.8, 0.2, 0.2}};
+    projectors.clear();
+    for (int p = 0; p < nproj; p++) {
+        SceneProjector proj;
+        for (int i = 0; i < 3; i++)
+            proj.center[i] = centers[p % 4][i] + 0.1 * (p / 4);
+        proj.target[0] = 0;
+        proj.target[1] = 0;
+        proj.target[2] = 3;
+        proj.focal = 800;
+        projectors.push_back(proj);
+    }
+}
+
+SyntheticSceneParams defaultSyntheticSceneParams(int width, int height)
+{
+    SyntheticSceneParams params;
+    params.width = width;
+    params.height = height;
+    params.focal = 0;
+    params.baseline = 0.15;
+    params.ncodes = 1024;
+    params.noise = 0.3;
+    params.outliers = 0.002;
+    params.holes = 20;
+    params.maxholeradius = 4;
+    params.seed = 1;
+    return params;
+}
+
+// rotation (rows) of a projector looking from center to target, with image y pointing down
+static void lookAt(const SceneProjector &proj, double R[3][3])
+{
+    double up[3] = {0, 1, 0};
+    for (int i = 0; i < 3; i++)
+        R[2][i] = proj.target[i] - proj.center[i];
+    normalize(R[2]);
+    cross(up, R[2], R[0]);
+    normalize(R[0]);
+    cross(R[2], R[0], R[1]);
+}
+
+void generateSyntheticScene(const SyntheticSceneParams &params, const std::vector<ScenePatch> &patches,
+                            const std::vector<SceneProjector> &projectors, SyntheticScene &scene)
+{
+    int w = params.width, h = params.height;
+    int nproj = (int)projectors.size();
+    double f = (params.focal > 0) ? params.focal : 0.9 * w;
+    double cx = 0.5 * (w - 1), cy = 0.5 * (h - 1);
+    double camcenters[2][3] = {{0, 0, 0}, {params.baseline, 0, 0}};
+    std::vector<double> rot(9 * nproj);
+    for (int p = 0; p < nproj; p++)
+        lookAt(projectors[p], (double (*)[3])&rot[9 * p]);
+
+    CShape sh(w, h, 1);
+    scene.codes.assign(nproj, std::vector<std::vector<CFloatImage> >(2, std::vector<CFloatImage>(2)));
+    for (int p = 0; p < nproj; p++)
+        for (int c = 0; c < 2; c++)
+            for (int d = 0; d < 2; d++)
+                scene.codes[p][c][d].ReAllocate(sh);
+
+    for (int c = 0; c < 2; c++) {
+        scene.gtdisp[c].ReAllocate(sh);
+        scene.occluded[c].ReAllocate(sh);
+        const double *O = camcenters[c], *O2 = camcenters[1 - c];
+
+        parallelFor(h, [&](int y) {
+            // one generator per row, so the result doesn't depend on the number of threads
+            std::mt19937 rng(params.seed * 7919u + c * 104729u + y);
+            std::normal_distribution<double> noise(0, params.noise);
+            std::uniform_real_distribution<double> uniform(0, 1);
+            for (int x = 0; x < w; x++) {
+                double D[3] = {(x - cx) / f, (y - cy) / f, 1};
+                double t = raycast(patches, O, D);
+                double P[3] = {O[0] + t * D[0], O[1] + t * D[1], O[2] + t * D[2]};
+                bool hit = (t < INFINITY);
+
+                // ground truth
+                float gt = UNK;
+                bool occluded = true;
+                if (hit) {
+                    double x2 = f * (P[0] - O2[0]) / P[2] + cx;
+                    gt = (float)(x2 - x);
+                    occluded = x2 < 0 || x2 > w - 1 || !visibleFrom(patches, O2, P);
+                }
+                scene.gtdisp[c].Pixel(x, y, 0) = gt;
+                scene.occluded[c].Pixel(x, y, 0) = occluded;
+
+                // codes
+                for (int p = 0; p < nproj; p++) {
+                    const SceneProjector &proj = projectors[p];
+                    const double *R = &rot[9 * p];
+                    float code[2] = {UNK, UNK};
+                    if (hit && visibleFrom(patches, proj.center, P)) {
+                        double Q[3] = {P[0] - proj.center[0], P[1] - proj.center[1], P[2] - proj.center[2]};
+                        double pz = dot(&R[6], Q);
+                        double uv[2] = {proj.focal * dot(&R[0], Q) / pz + 0.5 * params.ncodes,
+                                        proj.focal * dot(&R[3], Q) / pz + 0.5 * params.ncodes};
+                        for (int d = 0; d < 2; d++) {
+                            double v = uv[d] + (params.noise > 0 ? noise(rng) : 0);
+                            if (pz > 0 && uv[d] >= 0 && uv[d] < params.ncodes)
+                                code[d] = (float)std::max(0.0, std::min(params.ncodes - 1.0, floor(v)));
+                            if (code[d] != UNK && uniform(rng) < params.outliers)
+                                code[d] = (float)floor(uniform(rng) * params.ncodes);
+                        }
+                    }
+                    for (int d = 0; d < 2; d++)
+                        scene.codes[p][c][d].Pixel(x, y, 0) = code[d];
+                }
+            }
+        });
+
+        // holes: disks where decoding failed, independently for each projector
+        std::mt19937 rng(params.seed * 31u + c);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        int nholes = (int)round(params.holes * w * h / 1e6);
+        for (int p = 0; p < nproj; p++) {
+            for (int i = 0; i < nholes; i++) {
+                int x0 = (int)(uniform(rng) * w), y0 = (int)(uniform(rng) * h);
+                int r = 1 + (int)(uniform(rng) * params.maxholeradius);
+                for (int y = std::max(0, y0 - r); y <= std::min(h - 1, y0 + r); y++)
+                    for (int x = std::max(0, x0 - r); x <= std::min(w - 1, x0 + r); x++)
+                        if ((x - x0) * (x - x0) + (y - y0) * (y - y0) <= r * r)
+                            for (int d = 0; d < 2; d++)
+                                scene.codes[p][c][d].Pixel(x, y, 0) = UNK;
+            }
+        }
+    }
+}
+
+void syntheticDispRange(SyntheticScene &scene, int margin, int &dmin, int &dmax)
+{
+    float lo = INFINITY, hi = -INFINITY;
+    for (int c = 0; c < 2; c++) {
+        CShape sh = scene.gtdisp[c].Shape();
+        for (int y = 0; y < sh.height; y++) {
+            for (int x = 0; x < sh.width; x++) {
+                float g = scene.gtdisp[c].Pixel(x, y, 0);
+                if (g == UNK)
+                    continue;
+                lo = std::min(lo, g);
+                hi = std::max(hi, g);
+            }
+        }
+    }
+    if (lo > hi)
+        throw CError("syntheticDispRange: scene has no ground truth");
+    dmin = (int)floor(lo) - margin;
+    dmax = (int)ceil(hi) + margin;
+}
+
+DispAccuracy dispAccuracy(CFloatImage disp, CFloatImage gt, CByteImage occluded)
+{
+    CShape sh = gt.Shape();
+    long long n[2] = {0, 0}, ncov[2] = {0, 0}, nbad = 0;   // indexed by occluded
+    double sd = 0;
+    for (int y = 0; y < sh.height; y++) {
+        for (int x = 0; x < sh.width; x++) {
+            float d = disp.Pixel(x, y, 0), g = gt.Pixel(x, y, 0);
+            if (g == UNK)
+                continue;
+            int occ = occluded.Pixel(x, y, 0) != 0;
+            n[occ]++;
+            if (d == UNK)
+                continue;
+            ncov[occ]++;
+            nbad += fabs(d - g) > 1;
+            sd += (double)(d - g) * (d - g);
+        }
+    }
+    long long nd = std::max(ncov[0] + ncov[1], 1LL);
+    DispAccuracy acc;
+    acc.coverage = 100.0 * ncov[0] / std::max(n[0], 1LL);
+    acc.occcoverage = 100.0 * ncov[1] / std::max(n[1], 1LL);
+    acc.bad = 100.0 * nbad / nd;
+    acc.rms = sqrt(sd / nd);
+    return acc;
+}
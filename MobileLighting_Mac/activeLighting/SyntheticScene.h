@@ -0,0 +1,72 @@
+//
+//  SyntheticScene.h
+//  activeLighting
+//
+//  synthetic code images with known ground-truth disparities, for benchmarks
+//
+
+#ifndef SyntheticScene_h
+#define SyntheticScene_h
+
+#include "imageLib.h"
+#include <vector>
+
+// a planar patch n . P = c (world coordinates = left camera coordinates: x right, y down, z forward),
+// bounded to xmin..xmax, ymin..ymax in world x and y (unbounded if xmin >= xmax)
+struct ScenePatch {
+    double n[3], c;
+    double xmin, xmax, ymin, ymax;
+};
+
+// a projector looking at target from center; codes are its pixel coordinates, 0 .. ncodes-1
+struct SceneProjector {
+    double center[3], target[3];
+    double focal;
+};
+
+struct SyntheticSceneParams {
+    int width, height;
+    double focal;           // focal length of both cameras in pixels (0: 0.9 * width)
+    double baseline;        // right camera is at (baseline, 0, 0), both rectified
+    int ncodes;
+    double noise;           // standard deviation of code values (in codes) before rounding
+    double outliers;        // fraction of pixels with random codes
+    double holes;           // holes (undecodable disks) per megapixel
+    int maxholeradius;
+    unsigned seed;
+};
+
+// default scene: a slanted background plane, a ramp, and a box in front of it (occlusion steps and
+// projector shadows), lit by nproj projectors placed around the cameras
+void defaultSyntheticScene(std::vector<ScenePatch> &patches, std::vector<SceneProjector> &projectors, int nproj);
+SyntheticSceneParams defaultSyntheticSceneParams(int width, int height);
+
+// code images and ground truth of a stereo pair
+struct SyntheticScene {
+    // decoded code images as the decode step produces them (integer codes, UNK where undecodable),
+    // indexed [projector][camera][direction]
+    std::vector<std::vector<std::vector<CFloatImage> > > codes;
+    // ground-truth x disparities of both cameras (x position in the other camera minus x position),
+    // UNK where no surface is seen; y disparities are 0
+    CFloatImage gtdisp[2];
+    // 1 where the point is not visible in the other camera (occluded or outside of its image)
+    CByteImage occluded[2];
+};
+
+void generateSyntheticScene(const SyntheticSceneParams &params, const std::vector<ScenePatch> &patches,
+                            const std::vector<SceneProjector> &projectors, SyntheticScene &scene);
+
+// range of the ground-truth x disparities of both cameras, rounded outwards and widened by margin:
+// the search range matching needs for scene
+void syntheticDispRange(SyntheticScene &scene, int margin, int &dmin, int &dmax);
+
+// accuracy of disparities disp (band 0 is x) against ground truth
+struct DispAccuracy {
+    double coverage;    // percentage of unoccluded pixels with a disparity
+    double occcoverage; // percentage of occluded pixels with a disparity
+    double bad;         // percentage of all pixels with a disparity whose error is larger than 1 pixel
+    double rms;         // rms error of all pixels with a disparity
+};
+DispAccuracy dispAccuracy(CFloatImage disp, CFloatImage gt, CByteImage occluded);
+
+#endif /* SyntheticScene_h */
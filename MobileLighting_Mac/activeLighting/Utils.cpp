@@ -18,6 +18,7 @@
 #include <math.h>
 #include "opencv2/opencv.hpp"
 #include "Utils.h"
+#include "Log.h"
 #include "flowIO.h"
 
 
@@ -217,8 +218,8 @@ void medianfilter(CFloatImage src, CFloatImage &dst, int k, int b)
             dst.Pixel(x, y, b) = m;
             if (/* DISABLES CODE */ (0) && x == 182 && y == 975) {
                 for (int i=0; i < (int)v.size(); i++)
-                    printf("%5.1f ", v[i]);
-                printf("\nk=%d, rad = %d, v.size = %d, med = %g\n", k, rad, (int)v.size(), m);
+                    logPrintf(log_debug, "%5.1f ", v[i]);
+                logPrintf(log_debug, "\nk=%d, rad = %d, v.size = %d, med = %g\n", k, rad, (int)v.size(), m);
             }
         }
     }
@@ -345,7 +346,7 @@ vector<struct ccomp> computeUnkComponents(CFloatImage img, int b, CIntImage &com
             }
         }
     }
-    printf("found %d componenents\n", n-1);
+    logPrintf(log_verbose, "found %d componenents\n", n-1);
     
     return comp;
 }
@@ -427,7 +428,7 @@ vector<struct ccomp> computeDispComponents(CFloatImage img, int b, CIntImage &co
             }
         }
     }
-    printf("found %d components\n", n);
+    logPrintf(log_verbose, "found %d components\n", n);
     
     return comp;
 }
@@ -700,6 +701,16 @@ pair<CFloatImage, CFloatImage> splitFloImage(CFloatImage &merged)
     return pair<CFloatImage, CFloatImage>(x,y);
 }
 
+// exact copy of img (CopyPixels would clip UNK values to FLT_MAX)
+CFloatImage copyImage(CFloatImage &img)
+{
+    CShape sh = img.Shape();
+    CFloatImage copy(sh);
+    for (int y = 0; y < sh.height; y++)
+        memcpy(&copy.Pixel(0, y, 0), &img.Pixel(0, y, 0), sh.width * sh.nBands * sizeof(float));
+    return copy;
+}
+
 void WriteBand(CFloatImage& img, int band, float scale, const char* filename, int verbose)
 {
     CShape sh = img.Shape();
@@ -763,14 +774,14 @@ vector<CFloatImage> splitNBandImage(CFloatImage &merged)
 void ReadFlowFileVerb(CFloatImage& img, const char* filename, int verbose)
 {
     if (verbose)
-        fprintf(stderr, "Reading image %s\n", filename);
+        logPrintf(log_verbose, "Reading image %s\n", filename);
     ReadFlowFile(img, filename);
 }
 
 void WriteFlowFileVerb(CFloatImage img, const char* filename, int verbose)
 {
     if (verbose)
-        fprintf(stderr, "Writing image %s\n", filename);
+        logPrintf(log_verbose, "Writing image %s\n", filename);
     WriteFlowFile(img, filename);
 }
 
@@ -74,6 +74,9 @@ CFloatImage mergeToFloImage(CFloatImage &x, CFloatImage &y);
 // split .flo image into to float images
 pair<CFloatImage,CFloatImage> splitFloImage(CFloatImage &merged);
 
+// exact copy of img (CopyPixels would clip UNK values to FLT_MAX)
+CFloatImage copyImage(CFloatImage &img);
+
 // save one band of a flo image
 void WriteBand(CFloatImage& img, int band, float scale, const char* filename, int verbose);
 
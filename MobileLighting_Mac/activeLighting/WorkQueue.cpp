@@ -0,0 +1,430 @@
+//
+//  WorkQueue.cpp
+//  activeLighting
+//
+//  distributes the nodes of a scene graph to worker processes through a queue on a shared filesystem
+//
+//  jobs are files <node>.<attempt>, so a worker that lost its lease can't finish a job that was
+//  given to another worker in the meantime: the rename of its running/ file fails, and stale
+//  results of earlier attempts are ignored by the coordinator.  leases are checked against the
+//  clock of the coordinator only (the mtime of a running job has to change within lease seconds),
+//  so the clocks of the nodes don't need to agree
+//
+
+#include "WorkQueue.h"
+#include "Scheduler.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "imageLib.h"
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <utime.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static const char *subdirs[] = {"pending", "running", "done", "failed", "tmp", NULL};
+
+WorkQueueOptions::WorkQueueOptions()
+: lease(60), maxAttempts(3), poll(0.5)
+{
+}
+
+static void sleepSeconds(double seconds)
+{
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+}
+
+static std::string jobName(int n, int attempt)
+{
+    char buf[100];
+    sprintf(buf, "%06d.%d", n, attempt);
+    return buf;
+}
+
+// job files <node>.<attempt> of subdir
+static std::vector<std::pair<int, int> > listJobs(const std::string &dir)
+{
+    std::vector<std::pair<int, int> > jobs;
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL)
+        throw CError("cannot read directory %s", dir.c_str());
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        int n, attempt;
+        char c;
+        if (sscanf(e->d_name, "%d.%d%c", &n, &attempt, &c) == 2)
+            jobs.push_back(std::make_pair(n, attempt));
+    }
+    closedir(d);
+    std::sort(jobs.begin(), jobs.end());
+    return jobs;
+}
+
+static std::string readFile(const std::string &path)
+{
+    std::string s;
+    FILE *fp = fopen(path.c_str(), "r");
+    if (fp == NULL)
+        return s;
+    char buf[1000];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+        s.append(buf, len);
+    fclose(fp);
+    return s;
+}
+
+static void writeFile(const std::string &path, const std::string &contents)
+{
+    FILE *fp = fopen(path.c_str(), "w");
+    if (fp == NULL)
+        throw CError("cannot write %s", path.c_str());
+    fwrite(contents.data(), 1, contents.size(), fp);
+    fclose(fp);
+}
+
+// write path through a temporary file in dir/tmp, so readers never see a partial file
+static void publishFile(const std::string &dir, const std::string &path, const std::string &contents)
+{
+    char buf[100];
+    sprintf(buf, "/tmp/%d.%ld", (int)getpid(), (long)std::hash<std::string>()(path));
+    std::string tmp = dir + buf;
+    writeFile(tmp, contents);
+    if (rename(tmp.c_str(), path.c_str()) != 0)
+        throw CError("cannot create %s", path.c_str());
+}
+
+static std::string graphDescription(const StageScheduler &sched)
+{
+    std::string s;
+    for (int n = 0; n < sched.size(); n++)
+        s += sched.node(n).name + "\n";
+    return s;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// coordinator
+
+struct QueueCoordinator {
+    QueueCoordinator(const StageScheduler &sched, const std::string &dir, const WorkQueueOptions &opt)
+    : sched(sched), dir(dir), opt(opt), finished(0), failed(0) {}
+
+    void setup();
+    void publish(int n);
+    void finish(int n, int result, const std::string &info);
+    void retry(int n, const char *why);
+    void scan();
+    int run();
+
+    // lease of a running job: mtime of its file and when the coordinator saw it change
+    struct Lease {
+        time_t mtime;
+        long mtimensec;
+        std::chrono::steady_clock::time_point seen;
+    };
+
+    const StageScheduler &sched;
+    std::string dir;
+    WorkQueueOptions opt;
+    std::string runid;
+    std::vector<std::vector<int> > dependents;
+    std::vector<int> pending;           // unfinished dependencies of each node
+    std::vector<int> state;
+    std::vector<int> attempts;
+    std::map<int, Lease> leases;        // indexed by node
+    int finished, failed;
+};
+
+// create the queue directories, remove the files of an earlier run, and publish the graph
+void QueueCoordinator::setup()
+{
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        throw CError("cannot create directory %s", dir.c_str());
+    for (int i = 0; subdirs[i] != NULL; i++) {
+        std::string sub = dir + "/" + subdirs[i];
+        if (mkdir(sub.c_str(), 0755) != 0 && errno != EEXIST)
+            throw CError("cannot create directory %s", sub.c_str());
+        DIR *d = opendir(sub.c_str());
+        if (d == NULL)
+            throw CError("cannot read directory %s", sub.c_str());
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL)
+            if (e->d_name[0] != '.')
+                unlink((sub + "/" + e->d_name).c_str());
+        closedir(d);
+    }
+    unlink((dir + "/finished").c_str());
+
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    runid = std::string(host) + "." + std::to_string(getpid()) + "." + std::to_string((long)time(NULL));
+    publishFile(dir, dir + "/graph", runid + "\n" + graphDescription(sched));
+}
+
+void QueueCoordinator::publish(int n)
+{
+    state[n] = NODE_RUNNING;
+    attempts[n]++;
+    publishFile(dir, dir + "/pending/" + jobName(n, attempts[n]), sched.node(n).name + "\n");
+}
+
+void QueueCoordinator::finish(int n, int result, const std::string &info)
+{
+    std::vector<int> ready;
+    state[n] = result;
+    finished++;
+    if (result != NODE_DONE)
+        failed++;
+    leases.erase(n);
+    int total = sched.size();
+    const char *name = sched.node(n).name.c_str();
+    switch (result) {
+        case NODE_DONE:
+            logPrintf(log_info, "[%d/%d] %s: done (%s)\n", finished, total, name, info.c_str());
+            break;
+        case NODE_FAILED:
+            logPrintf(log_error, "[%d/%d] %s: FAILED after %d attempts\n", finished, total, name, attempts[n]);
+            break;
+        case NODE_SKIPPED:
+            logPrintf(log_warning, "[%d/%d] %s: skipped\n", finished, total, name);
+            break;
+    }
+    for (size_t i = 0; i < dependents[n].size(); i++) {
+        int d = dependents[n][i];
+        if (result != NODE_DONE)
+            state[d] = NODE_SKIPPED;
+        if (--pending[d] == 0)
+            ready.push_back(d);
+    }
+    for (size_t i = 0; i < ready.size(); i++) {
+        if (state[ready[i]] == NODE_SKIPPED)
+            finish(ready[i], NODE_SKIPPED, "");
+        else
+            publish(ready[i]);
+    }
+}
+
+void QueueCoordinator::retry(int n, const char *why)
+{
+    leases.erase(n);
+    if (attempts[n] >= opt.maxAttempts) {
+        finish(n, NODE_FAILED, why);
+        return;
+    }
+    logPrintf(log_warning, "%s: %s, retrying (attempt %d of %d)\n", sched.node(n).name.c_str(), why, attempts[n] + 1, opt.maxAttempts);
+    publish(n);
+}
+
+// collect the finished jobs and check the leases of the running ones
+void QueueCoordinator::scan()
+{
+    std::vector<std::pair<int, int> > jobs = listJobs(dir + "/done");
+    for (size_t i = 0; i < jobs.size(); i++) {
+        int n = jobs[i].first;
+        std::string path = dir + "/done/" + jobName(n, jobs[i].second);
+        std::string info = readFile(path);
+        unlink(path.c_str());
+        if (n < sched.size() && state[n] == NODE_RUNNING && jobs[i].second == attempts[n]) {
+            info.erase(std::remove(info.begin(), info.end(), '\n'), info.end());
+            finish(n, NODE_DONE, info);
+        }
+    }
+
+    jobs = listJobs(dir + "/failed");
+    for (size_t i = 0; i < jobs.size(); i++) {
+        int n = jobs[i].first;
+        std::string path = dir + "/failed/" + jobName(n, jobs[i].second);
+        std::string msg = readFile(path);
+        unlink(path.c_str());
+        if (n < sched.size() && state[n] == NODE_RUNNING && jobs[i].second == attempts[n]) {
+            logPrintf(log_error, "%s: %s", sched.node(n).name.c_str(), msg.c_str());
+            retry(n, "failed");
+        }
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    jobs = listJobs(dir + "/running");
+    for (size_t i = 0; i < jobs.size(); i++) {
+        int n = jobs[i].first;
+        std::string path = dir + "/running/" + jobName(n, jobs[i].second);
+        if (n >= sched.size() || state[n] != NODE_RUNNING || jobs[i].second != attempts[n]) {
+            unlink(path.c_str());   // lost its lease earlier
+            continue;
+        }
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            continue;               // finished in the meantime
+#ifdef __APPLE__
+        long nsec = st.st_mtimespec.tv_nsec;
+#else
+        long nsec = st.st_mtim.tv_nsec;
+#endif
+        std::map<int, Lease>::iterator it = leases.find(n);
+        if (it == leases.end() || it->second.mtime != st.st_mtime || it->second.mtimensec != nsec) {
+            Lease lease = {st.st_mtime, nsec, now};
+            leases[n] = lease;
+        } else if (std::chrono::duration<double>(now - it->second.seen).count() > opt.lease) {
+            // taking the file away makes the worker's rename to done/ or failed/ fail
+            if (unlink(path.c_str()) == 0)
+                retry(n, "lease expired");
+        }
+    }
+}
+
+int QueueCoordinator::run()
+{
+    int nnodes = sched.size();
+    dependents.assign(nnodes, std::vector<int>());
+    pending.assign(nnodes, 0);
+    state.assign(nnodes, NODE_WAITING);
+    attempts.assign(nnodes, 0);
+    for (int n = 0; n < nnodes; n++) {
+        const std::vector<int> &deps = sched.node(n).deps;
+        for (size_t i = 0; i < deps.size(); i++) {
+            dependents[deps[i]].push_back(n);
+            pending[n]++;
+        }
+    }
+
+    setup();
+    logPrintf(log_info, "coordinating %d jobs in %s\n", nnodes, dir.c_str());
+    for (int n = 0; n < nnodes; n++)
+        if (pending[n] == 0)
+            publish(n);
+    while (finished < nnodes) {
+        sleepSeconds(opt.poll);
+        scan();
+    }
+    publishFile(dir, dir + "/finished", runid + "\n");
+    return failed;
+}
+
+int coordinateWorkQueue(const StageScheduler &sched, const std::string &dir, const WorkQueueOptions &opt)
+{
+    StageScope scope("coordinate");
+    QueueCoordinator coordinator(sched, dir, opt);
+    return coordinator.run();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// worker
+
+// keeps touching the file of a running job, so the coordinator knows the worker is alive
+class LeaseKeeper {
+public:
+    LeaseKeeper(const std::string &path, double interval)
+    : path(path), stop(false), thread(&LeaseKeeper::keep, this, interval) {}
+    ~LeaseKeeper() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        wakeup.notify_all();
+        thread.join();
+    }
+private:
+    void keep(double interval) {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!wakeup.wait_for(guard, std::chrono::duration<double>(interval), [this]() { return stop; }))
+            utime(path.c_str(), NULL);
+    }
+
+    std::string path;
+    bool stop;
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::thread thread;
+};
+
+// id of the current run once the coordinator published the graph and hasn't finished yet,
+// empty otherwise
+static std::string currentRun(const std::string &dir, const std::string &graph)
+{
+    std::string s = readFile(dir + "/graph");
+    size_t eol = s.find('\n');
+    if (eol == std::string::npos)
+        return "";
+    std::string runid = s.substr(0, eol);
+    if (readFile(dir + "/finished") == runid + "\n")
+        return "";
+    if (s.substr(eol + 1) != graph)
+        throw CError("work queue %s: the coordinator's graph differs (different scene or parameters)", dir.c_str());
+    return runid;
+}
+
+int runWorkQueue(const StageScheduler &sched, const std::string &dir, const WorkQueueOptions &opt, const std::string &workerid)
+{
+    std::string graph = graphDescription(sched);
+    logPrintf(log_info, "worker %s: waiting for jobs in %s\n", workerid.c_str(), dir.c_str());
+    while (currentRun(dir, graph).empty())
+        sleepSeconds(opt.poll);
+
+    int njobs = 0;
+    while (!currentRun(dir, graph).empty()) {
+        // claim the first pending job that no other worker takes first
+        std::vector<std::pair<int, int> > jobs = listJobs(dir + "/pending");
+        std::string job;
+        for (size_t i = 0; i < jobs.size() && job.empty(); i++) {
+            std::string name = jobName(jobs[i].first, jobs[i].second);
+            if (rename((dir + "/pending/" + name).c_str(), (dir + "/running/" + name).c_str()) == 0)
+                job = name;
+        }
+        if (job.empty()) {
+            sleepSeconds(opt.poll);
+            continue;
+        }
+        int n = atoi(job.c_str());
+        if (n >= sched.size())
+            throw CError("work queue %s: job out of range", dir.c_str());
+
+        const StageNode &node = sched.node(n);
+        std::string running = dir + "/running/" + job;
+        std::string result = "done", info;
+        logPrintf(log_info, "worker %s: %s: started\n", workerid.c_str(), node.name.c_str());
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        try {
+            LeaseKeeper keeper(running, opt.lease / 4);
+            StageScope scope(node.name.c_str());
+            node.run();
+        } catch (CError &err) {
+            result = "failed";
+            info = err.message;
+        } catch (std::exception &err) {
+            result = "failed";
+            info = err.what();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        char buf[100];
+        sprintf(buf, "%.1f s", seconds);
+        info = workerid + ", " + (info.empty() ? buf : info) + "\n";
+        njobs++;
+
+        // report through the job file; if it is gone, the lease was lost and the job runs elsewhere
+        FILE *fp = fopen(running.c_str(), "r+");
+        if (fp != NULL) {
+            fputs(info.c_str(), fp);
+            fflush(fp);
+            if (ftruncate(fileno(fp), info.size()) != 0)
+                perror(running.c_str());
+            fclose(fp);
+        }
+        if (fp == NULL || rename(running.c_str(), (dir + "/" + result + "/" + job).c_str()) != 0)
+            logPrintf(log_warning, "worker %s: %s: lease lost, result dropped\n", workerid.c_str(), node.name.c_str());
+        else
+            logPrintf(log_info, "worker %s: %s: %s (%s)\n", workerid.c_str(), node.name.c_str(), result.c_str(), info.substr(0, info.size() - 1).c_str());
+    }
+    logPrintf(log_info, "worker %s: %d jobs run\n", workerid.c_str(), njobs);
+    return njobs;
+}
@@ -0,0 +1,46 @@
+//
+//  WorkQueue.h
+//  activeLighting
+//
+//  distributes the nodes of a scene graph to worker processes through a queue on a shared filesystem
+//
+
+#ifndef WorkQueue_h
+#define WorkQueue_h
+
+#include <string>
+
+class StageScheduler;
+
+// the coordinator and all workers build the same graph (same scene, projectors, positions and
+// parameters) and exchange node numbers through the queue directory, which has to be on a
+// filesystem shared by all nodes (usually <scene>/computed/queue).  the nodes read their
+// inputs from and write their outputs to the scene directory.
+//
+// a job is a file named by its node number that moves between the subdirectories
+//   pending/   published by the coordinator once all dependencies are done
+//   running/   claimed by a worker (atomic rename), which touches the file while it runs (lease)
+//   done/      finished by the worker
+//   failed/    failed in the worker; the file holds the error message
+// the coordinator retries failed jobs and jobs whose lease expired (the worker died or hangs)
+// up to maxAttempts times in total; after that the job fails and all jobs depending on it are
+// skipped.  the file "finished" tells the workers to exit.
+// testWorkQueue.sh runs local workers on one queue, one of them hanging and one dying while they
+// hold a job
+struct WorkQueueOptions {
+    WorkQueueOptions();
+
+    double lease;       // seconds without touching the job file after which a job is given up
+    int maxAttempts;
+    double poll;        // seconds between scans of the queue directory
+};
+
+// publish the nodes of sched in dir and wait until all of them are done; returns the number
+// of nodes that failed or were skipped
+int coordinateWorkQueue(const StageScheduler &sched, const std::string &dir, const WorkQueueOptions &opt);
+
+// run jobs of the queue in dir one after the other until the coordinator finishes; returns
+// the number of jobs run.  workerid names the worker in the job files
+int runWorkQueue(const StageScheduler &sched, const std::string &dir, const WorkQueueOptions &opt, const std::string &workerid);
+
+#endif /* WorkQueue_h */
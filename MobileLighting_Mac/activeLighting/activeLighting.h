@@ -8,3 +8,46 @@ void filterDisparities(char *dispx, char *dispy, char *outx, char *outy, int pos
 void mergeDisparities(char *imgsx[], char *imgsy[], char *outx, char *outy, int count, int mingroup, float maxdiff);
 void reprojectDisparities(char *dispx_file, char *dispy_file, char *codex_file, char *codey_file, char *outx_file, char *outy_file, char *err_file, char *mat_file, char *log_file);
 void mergeDisparityMaps2(float maxdiff, int nV, int nR, char* outdfile, char* outsdfile, char* outnfile, char *inmdfile, char **invdfiles, char **inrdfiles);
+int mergeDisparityMaps2Init(float maxdiff, int nV, int nR, char *statefile, char *inmdfile, char **invdfiles, char **inrdfiles);
+int mergeDisparityMaps2Update(float maxdiff, int nR, char *statefile, char **inrdfiles);
+void mergeDisparityMaps2Finalize(char *statefile, char* outdfile, char* outsdfile, char* outnfile);
+void finalizeDisparities(char *indfile, char *insdfile, char *innfile, char *mfile, char *outdfile, char *outsdfile, char *outnfile, float dmin, float dmax, int mincompsize, float compthresh);
+void reprojectDisparitiesBatch(char *dispx_file, char *dispy_file, int nproj, char **codex_files, char **codey_files, char **outx_files, char **outy_files, char **err_files, char **mat_files, char **log_files);
+void setRectificationCache(char *cachedir, int fixedpoint, int enabled);
+void setRectificationContextCache(int npairs);
+void setProcessingParams(char *yamlfile);
+void rectifyImagesBatch(char *intr, char *settings, int npairs, char **extr_files, char **size_files, int njobs, int *job_pairs, int *job_cameras, int *job_ambient, char **in_files, char **out_files);
+void rectifyRefineDisparities(char *intr, char *extr, char *settings, char *decodeddir0, char *decodeddir1, char *rectdir0, char *rectdir1, char *outdir0, char *outdir1, int pos0, int pos1, double *angles, int dXmin, int dXmax, int dYmin, int dYmax);
+void *pipelineSessionCreate(void);
+void pipelineSessionActivate(void *session);
+void pipelineSessionDestroy(void *session);
+void pipelineSessionCheckpoint(void *session, char *stage, int enabled);
+int pipelineSessionPutImage(void *session, char *name, float *data, int width, int height, int nbands, int stride);
+int pipelineSessionImageShape(void *session, char *name, int *width, int *height, int *nbands);
+int pipelineImageShape(char *name, int *width, int *height, int *nbands);
+void setFloatMapPrecision(float precision);
+int pipelineSessionGetImage(void *session, char *name, float *data, int width, int height, int nbands, int stride);
+void pipelineSessionRelease(void *session, char *name);
+int pipelineSessionFlush(void *session);
+int processScene(char *scenedir, int nproj, int *projectors, int npos, int *positions, int nthreads, int memorymb, int incremental, char *forcestage);
+void instrumentationStart(int hwcounters);
+void instrumentationStop(char *tracefile, char *csvfile);
+void setLoggingLevel(int level);
+void loggingFlush(void);
+void setProgressCallback(void (*callback)(const char *stage, double fraction, void *userdata), void *userdata);
+void processingCancel(int cancel);
+int processingCancelled(void);
+#define DAEMON_PING 0
+#define DAEMON_SHUTDOWN 1
+#define DAEMON_THREADS 2
+#define DAEMON_REFINE 3
+#define DAEMON_RECTIFY_DISPARITY 4
+#define DAEMON_CROSSCHECK 5
+#define DAEMON_FILTER 6
+#define DAEMON_MERGE 7
+#define DAEMON_REPROJECT 8
+#define DAEMON_MERGE2 9
+#define DAEMON_PROCESS_SCENE 10
+#define DAEMON_PARAMS 11
+#define DAEMON_CANCEL 12
+int daemonRequest(char *socketpath, int op, int nints, int *ints, int ndoubles, double *doubles, int nstrings, char **strings, char *errmsg, int errlen);
@@ -14,30 +14,53 @@
 #include "Disparities.h"
 #include "Reproject.h"
 #include "Decode.h"
+#include "Parallel.h"
+#include "Session.h"
+#include "Instrument.h"
+#include "Log.h"
+#include "Progress.h"
 #include <assert.h>
 
-extern "C" void refineDecodedIm(char *outdir, int direction, char* decodedIm, double angle, char *posID) {
-    refine(outdir, direction, decodedIm, angle, posID);	// returns final CFloatImage, ignore
+// the PFM images of the entry points below are read and written via pipelineRead/pipelineWrite,
+// so with an active pipeline session they stay in memory between stages (see Session.h).
+// the code and disparity maps whose names the entry points make up themselves have the
+// extension of the current parameters (ProcessingParams::mapExt, .pfm by default)
+//
+// when processing is cancelled (processingCancel), the long-running entry points return without
+// writing their results (see Progress.h)
+
+extern "C" void refineDecodedIm(char *outdir, int direction, char* decodedIm, double angle, char *posID) try {
+    StageScope scope("refine");
+    //refine(outdir, direction, decodedIm, angle, posID);	// returns final CFloatImage, ignore
+    CFloatImage fval, fval2;
+    char filename[1000];
+    PipelineSession *session = activeSession();
+    pipelineRead(fval, decodedIm);
+    // in a session, intermediate results are only saved if the refine stage is checkpointed
+    int save = (session == NULL || session->checkpointed("refine")) ? REFINE_SAVE_INTERMEDIATE : 0;
+    fval2 = refineCodeImage(outdir, direction, fval, angle, posID, save);
+    sprintf(filename, "%s/result%s%c-4refined2%s", outdir, posID, direction == 0 ? 'u' : 'v', currentParams().mapExt.c_str());
+    pipelineWrite(fval2, filename, "refine");
+} catch (CCancelled &) {
 }
 
 extern "C" void computeMaps(char *impath, char *intr, char *extr, char *settings) {
-    printf("%s\n%s\n%s\n", impath, intr, extr);
-    CFloatImage im;
-    ReadImage(im, impath);
-    CShape sh = im.Shape();
-    printf("decoded image dimensions: [%d x %d]\n", sh.width, sh.height);
+    StageScope scope("compute maps");
+    logPrintf(log_verbose, "%s\n%s\n%s\n", impath, intr, extr);
+    CShape sh = pipelineShape(impath);   // only the header is read
+    logPrintf(log_verbose, "decoded image dimensions: [%d x %d]\n", sh.width, sh.height);
     computemaps(sh.width, sh.height, intr, extr, settings);
 }
 
-extern "C" void disparitiesOfRefinedImgs(char *posdir0, char *posdir1, char *outdir0, char *outdir1, int pos0, int pos1, int rectified, int dXmin, int dXmax, int dYmin, int dYmax) {
+static void saveInitialDisparities(CFloatImage fdisp0, CFloatImage fdisp1, char *outdir0, char *outdir1, int pos0, int pos1);
+
+extern "C" void disparitiesOfRefinedImgs(char *posdir0, char *posdir1, char *outdir0, char *outdir1, int pos0, int pos1, int rectified, int dXmin, int dXmax, int dYmin, int dYmax) try {
+    StageScope scope("disparity");
     // in0, in1 are flo images, need to create
     // so inputs should be to directories?
-    int verbose = 1;
-    
-    CFloatImage x, y;
     CFloatImage merged0, merged1;
     CFloatImage fdisp0, fdisp1;
-    char filename[1000]; //, in0[1000], in1[1000];
+    char filename[1000], filename2[1000]; //, in0[1000], in1[1000];
     
     char leftID[50], rightID[50];
     if (rectified) {
@@ -49,152 +72,194 @@ extern "C" void disparitiesOfRefinedImgs(char *posdir0, char *posdir1, char *out
     }
     
     // first create necessary FLO files for computeDisparities()
-    sprintf(filename, "%s/result%su-4refined2.pfm", posdir0, leftID);
-    ReadImageVerb(x, filename, 1);
-    sprintf(filename, "%s/result%sv-4refined2.pfm", posdir0, leftID);
-    ReadImageVerb(y, filename, 1);
-    merged0 = mergeToFloImage(x, y);
-
-    sprintf(filename, "%s/result%su-4refined2.pfm", posdir1, rightID);
-    ReadImageVerb(x, filename, 0);
-    sprintf(filename, "%s/result%sv-4refined2.pfm", posdir1, rightID);
-    ReadImageVerb(y, filename, 0);
-    merged1 = mergeToFloImage(x, y);
+    std::string ext = currentParams().mapExt;
+    sprintf(filename, "%s/result%su-4refined2%s", posdir0, leftID, ext.c_str());
+    sprintf(filename2, "%s/result%sv-4refined2%s", posdir0, leftID, ext.c_str());
+    pipelineReadFlo(merged0, filename, filename2);
+
+    sprintf(filename, "%s/result%su-4refined2%s", posdir1, rightID, ext.c_str());
+    sprintf(filename2, "%s/result%sv-4refined2%s", posdir1, rightID, ext.c_str());
+    pipelineReadFlo(merged1, filename, filename2);
 
     computeDisparities(merged0, merged1, fdisp0, fdisp1, dXmin, dXmax, dYmin, dYmax);
     
+    saveInitialDisparities(fdisp0, fdisp1, outdir0, outdir1, pos0, pos1);
+} catch (CCancelled &) {
+}
+
+// save flo disparity maps as x and y "0initial" disparities
+static void saveInitialDisparities(CFloatImage fdisp0, CFloatImage fdisp1, char *outdir0, char *outdir1, int pos0, int pos1) {
     // now need to separate L(fdisp(0|1)) into u,v files corresponding to x-, y- disparities.
-    // pair<CFloatImage,CFloatImage> splitFloImage(CFloatImage &merged);
-    pair<CFloatImage,CFloatImage> ppos0, ppos1;
-    ppos0 = splitFloImage(fdisp0);
-    ppos1 = splitFloImage(fdisp1);
-    CFloatImage fx0,fy0,fx1,fy1;
-    fx0 = ppos0.first;
-    fy0 = ppos0.second;
-    fx1 = ppos1.first;
-    fy1 = ppos1.second;
+    // (done by pipelineWriteFlo, unless the flo images stay in a session)
+    char px0[1000], py0[1000], px1[1000], py1[1000];
+    std::string ext = currentParams().mapExt;
+    sprintf(px0, "%s/disp%d%dx-0initial%s", outdir0, pos0, pos1, ext.c_str());
+    sprintf(py0, "%s/disp%d%dy-0initial%s", outdir0, pos0, pos1, ext.c_str());
+    sprintf(px1, "%s/disp%d%dx-0initial%s", outdir1, pos0, pos1, ext.c_str());
+    sprintf(py1, "%s/disp%d%dy-0initial%s", outdir1, pos0, pos1, ext.c_str());
     
-    char px0[100], py0[100], px1[100], py1[100];
-    sprintf(px0, "%s/disp%d%dx-0initial.pfm", outdir0, pos0, pos1);
-    sprintf(py0, "%s/disp%d%dy-0initial.pfm", outdir0, pos0, pos1);
-    sprintf(px1, "%s/disp%d%dx-0initial.pfm", outdir1, pos0, pos1);
-    sprintf(py1, "%s/disp%d%dy-0initial.pfm", outdir1, pos0, pos1);
-    
-    WriteImageVerb(fx0, px0, verbose);
-    WriteImageVerb(fy0, py0, verbose);
-    WriteImageVerb(fx1, px1, verbose);
-    WriteImageVerb(fy1, py1, verbose);
+    pipelineWriteFlo(fdisp0, px0, py0, "disparity");
+    pipelineWriteFlo(fdisp1, px1, py1, "disparity");
 }
 
-extern "C" void crosscheckDisparities(char *posdir0, char *posdir1, int pos0, int pos1, float thresh, int xonly, int halfocc, char *in_suffix, char *out_suffix) {
-    CFloatImage x0,x1,y0,y1;
-    char buffer[100];
-    sprintf(buffer, "%s/disp%d%dx-%s.pfm", posdir0, pos0, pos1, in_suffix);
-    ReadImageVerb(x0, buffer, 1);
-    sprintf(buffer, "%s/disp%d%dx-%s.pfm", posdir1, pos0, pos1, in_suffix);
-    ReadImageVerb(x1, buffer, 1);
+// rectify, refine, and match the decoded images of stereo pair (pos0, pos1) in one call:
+// reads the unrectified hole-filled images result<pos>[uv]-2holefilled<ext> from decodeddir0/1,
+// rectifies them in memory and refines them (no "0rectified" files are written and read back),
+// saves the refined images result<pos0><pos1>[uv]-4refined2<ext> to rectdir0/1 (needed for
+// reprojection), and matches the refined images in memory, saving the "0initial" disparities.
+// each rectified image is still held in full while it is refined, so this saves the file round
+// trips between the steps, not memory.
+// angles[2*camera + direction] is the stripe angle used for refinement
+extern "C" void rectifyRefineDisparities(char *intr, char *extr, char *settings, char *decodeddir0, char *decodeddir1, char *rectdir0, char *rectdir1, char *outdir0, char *outdir1, int pos0, int pos1, double *angles, int dXmin, int dXmax, int dYmin, int dYmax) try {
+    StageScope scope("rectify+refine+disparity");
+    char *decodeddirs[2] = {decodeddir0, decodeddir1};
+    char *rectdirs[2] = {rectdir0, rectdir1};
+    int positions[2] = {pos0, pos1};
+    char posID[50];
+    sprintf(posID, "%d%d", pos0, pos1);
+    std::string ext = currentParams().mapExt;
     
-    if (xonly) {
-        // create blank images for ydisps
-        CShape sh = x0.Shape();
-        y0.ReAllocate(sh);
-        y1.ReAllocate(sh);
-        y0.FillPixels(UNK);
-        y1.FillPixels(UNK);
-    } else {
-        sprintf(buffer, "%s/disp%d%dy-%s.pfm", posdir0, pos0, pos1, in_suffix);
-        ReadImageVerb(y0, buffer, 1);
-        sprintf(buffer, "%s/disp%d%dy-%s.pfm", posdir1, pos0, pos1, in_suffix);
-        ReadImageVerb(y1, buffer, 1);
+    // unrectified images, indexed [2*camera + direction]
+    CFloatImage unrect[4], refined[4];
+    for (int i = 0; i < 4; i++) {
+        char filename[1000];
+        sprintf(filename, "%s/result%d%c-2holefilled%s", decodeddirs[i/2], positions[i/2], (i%2 == 0) ? 'u' : 'v', ext.c_str());
+        pipelineRead(unrect[i], filename);
     }
+    CShape sh = unrect[0].Shape();
+    std::shared_ptr<const RectificationContext> ctx = rectificationContext(sh.width, sh.height, intr, extr, settings);
     
-    CFloatImage d0 = mergeToFloImage(x0, y0);
-    CFloatImage d1 = mergeToFloImage(x1, y1);
-    pair<CFloatImage,CFloatImage> outputs = runCrossCheck(d0, d1, thresh, xonly, halfocc);
-    pair<CFloatImage,CFloatImage> crosscheck0, crosscheck1;
-    crosscheck0 = splitFloImage(outputs.first);
-    crosscheck1 = splitFloImage(outputs.second);
+    parallelFor(4, [&](int i) {
+        CShape shi = unrect[i].Shape();
+        if (shi != sh)
+            throw CError("rectifyRefineDisparities: all images need to have same size");
+        if (&unrect[i].Pixel(0, 1, 0) < &unrect[i].Pixel(0, 0, 0))
+            unrect[i] = copyImage(unrect[i]);   // stored bottom-up, a cv::Mat can't step backwards
+        int stride = (int)(&unrect[i].Pixel(0, 1, 0) - &unrect[i].Pixel(0, 0, 0));
+        cv::Mat src(shi.height, shi.width, CV_32FC1, &unrect[i].Pixel(0, 0, 0), stride * sizeof(float));
+        RectifiedView view(*ctx, i/2, src);
+        
+        CFloatImage rect(shi);
+        view.materialize(&rect.Pixel(0, 0, 0), (int)(&rect.Pixel(0, 1, 0) - &rect.Pixel(0, 0, 0)));
+        refined[i] = refineCodeImage(rectdirs[i/2], i%2, rect, angles[i], posID, 0);
+        char filename[1000];
+        sprintf(filename, "%s/result%s%c-4refined2%s", rectdirs[i/2], posID, (i%2 == 0) ? 'u' : 'v', ext.c_str());
+        pipelineWrite(refined[i], filename, "refine");
+    });
+    
+    CFloatImage merged0 = mergeToFloImage(refined[0], refined[1]);
+    CFloatImage merged1 = mergeToFloImage(refined[2], refined[3]);
+    CFloatImage fdisp0, fdisp1;
+    computeDisparities(merged0, merged1, fdisp0, fdisp1, dXmin, dXmax, dYmin, dYmax);
     
-    CFloatImage ccx0, ccy0, ccx1, ccy1;
-    ccx0 = crosscheck0.first;
-    ccx1 = crosscheck1.first;
-    ccy0 = crosscheck0.second;
-    ccy1 = crosscheck1.second;
+    saveInitialDisparities(fdisp0, fdisp1, outdir0, outdir1, pos0, pos1);
+} catch (CCancelled &) {
+}
+
+extern "C" void crosscheckDisparities(char *posdir0, char *posdir1, int pos0, int pos1, float thresh, int xonly, int halfocc, char *in_suffix, char *out_suffix) {
+    StageScope scope("crosscheck");
+    char x0[1000], x1[1000], y0[1000], y1[1000];
+    std::string ext = currentParams().mapExt;
+    sprintf(x0, "%s/disp%d%dx-%s%s", posdir0, pos0, pos1, in_suffix, ext.c_str());
+    sprintf(x1, "%s/disp%d%dx-%s%s", posdir1, pos0, pos1, in_suffix, ext.c_str());
+    sprintf(y0, "%s/disp%d%dy-%s%s", posdir0, pos0, pos1, in_suffix, ext.c_str());
+    sprintf(y1, "%s/disp%d%dy-%s%s", posdir1, pos0, pos1, in_suffix, ext.c_str());
     
-    sprintf(buffer, "%s/disp%d%dx-%s.pfm", posdir0, pos0, pos1, out_suffix);
-    WriteImageVerb(ccx0, buffer, 1);
-    sprintf(buffer, "%s/disp%d%dx-%s.pfm", posdir1, pos0, pos1, out_suffix);
-    WriteImageVerb(ccx1, buffer, 1);
+    // if xonly, use blank images for ydisps
+    CFloatImage d0, d1;
+    pipelineReadFlo(d0, x0, xonly ? NULL : y0);
+    pipelineReadFlo(d1, x1, xonly ? NULL : y1);
+    pair<CFloatImage,CFloatImage> outputs = runCrossCheck(d0, d1, thresh, xonly, halfocc);
     
-//    if (!xonly) {
-        sprintf(buffer, "%s/disp%d%dy-%s.pfm", posdir0, pos0, pos1, out_suffix);
-        WriteImageVerb(ccy0, buffer, 1);
-        sprintf(buffer, "%s/disp%d%dy-%s.pfm", posdir1, pos0, pos1, out_suffix);
-        WriteImageVerb(ccy1, buffer, 1);
-//    }
+    sprintf(x0, "%s/disp%d%dx-%s%s", posdir0, pos0, pos1, out_suffix, ext.c_str());
+    sprintf(x1, "%s/disp%d%dx-%s%s", posdir1, pos0, pos1, out_suffix, ext.c_str());
+    sprintf(y0, "%s/disp%d%dy-%s%s", posdir0, pos0, pos1, out_suffix, ext.c_str());
+    sprintf(y1, "%s/disp%d%dy-%s%s", posdir1, pos0, pos1, out_suffix, ext.c_str());
+    pipelineWriteFlo(outputs.first, x0, y0, "crosscheck");
+    pipelineWriteFlo(outputs.second, x1, y1, "crosscheck");
 }
 
 // CFloatImage runFilter(CFloatImage img, float ythresh, int kx, int ky, int mincompsize, int maxholesize);
 extern "C" void filterDisparities(char *dispx, char *dispy, char *outx, char *outy, int pos0, int pos1, float ythresh, int kx, int ky, int mincompsize, int maxholesize) {
+    StageScope scope("filter");
     assert (dispx != NULL);
     assert (outx != NULL);
     
-    CFloatImage x, y;
-    ReadImageVerb(x, dispx, 1);
-    if (dispy == NULL) {
-        y.ReAllocate(x.Shape());
-        y.FillPixels(INFINITY);
-    } else {
-        ReadImageVerb(y, dispy, 1);
-    }
-    CFloatImage merged = mergeToFloImage(x, y);
+    CFloatImage merged;
+    pipelineReadFlo(merged, dispx, dispy); // y disparities are UNK if dispy == NULL
     
     CFloatImage mergedResult = runFilter(merged, ythresh, kx, ky, mincompsize, maxholesize);
-    pair<CFloatImage,CFloatImage> imgpair = splitFloImage(mergedResult);
-    x = imgpair.first;
-    y = imgpair.second;
-    
-    WriteImageVerb(x, outx, 1);
-    if (outy != NULL)
-        WriteImageVerb(y, outy, 1);
+    pipelineWriteFlo(mergedResult, outx, outy, "filter");
 }
 
 //CFloatImage mergeDisparityMaps(CFloatImage images[], int count, int mingroup, float maxdiff)
-extern "C" void mergeDisparities(char *imgsx[], char *imgsy[], char *outx, char *outy, int count, int mingroup, float maxdiff) {
+extern "C" void mergeDisparities(char *imgsx[], char *imgsy[], char *outx, char *outy, int count, int mingroup, float maxdiff) try {
+    StageScope scope("merge");
     CFloatImage images[count];
     for (int i = 0; i < count; ++i) {
-        CFloatImage x, y, flo;
-        ReadImageVerb(x, imgsx[i], 1);
-        if (imgsy != NULL) {
-            ReadImageVerb(y, imgsy[i], 1);
-        } else {    // if should ignore imgsy
-            y.ReAllocate(x.Shape());
-            y.FillPixels(INFINITY);
-        }
-        flo = mergeToFloImage(x, y);
-        images[i] = flo;
+        // if should ignore imgsy, y disparities are UNK
+        pipelineReadFlo(images[i], imgsx[i], (imgsy != NULL) ? imgsy[i] : NULL);
     }
     CFloatImage result = mergeDisparityMaps(images, count, mingroup, maxdiff);
-    pair<CFloatImage,CFloatImage> flo = splitFloImage(result);
-    WriteImageVerb(flo.first, outx, 1);
-    WriteImageVerb(flo.second, outy, 1);
+    pipelineWriteFlo(result, outx, outy, "merge");
 //    WriteImageVerb(result, out, 1);
+} catch (CCancelled &) {
 }
 
 //CFloatImage reproject(CFloatImage dispflo, CFloatImage codeflo, char* outFile, char* errFile, char* matfile);
-extern "C" void reprojectDisparities(char *dispx_file, char *dispy_file, char *codex_file, char *codey_file, char *outx_file, char *outy_file, char *err_file, char *mat_file, char *log_file) {
-    CFloatImage dispx, dispy, disp;
-    CFloatImage codex, codey, code;
-    CFloatImage outx, outy, out;
-    ReadImageVerb(dispx, dispx_file, 1);
-    ReadImageVerb(dispy, dispy_file, 1);
-    ReadImageVerb(codex, codex_file, 1);
-    ReadImageVerb(codey, codey_file, 1);
-    disp = mergeToFloImage(dispx, dispy);
-    code = mergeToFloImage(codex, codey);
+extern "C" void reprojectDisparities(char *dispx_file, char *dispy_file, char *codex_file, char *codey_file, char *outx_file, char *outy_file, char *err_file, char *mat_file, char *log_file) try {
+    StageScope scope("reproject");
+    CFloatImage disp, code;
+    pipelineReadFlo(disp, dispx_file, dispy_file);
+    pipelineReadFlo(code, codex_file, codey_file);
     
     CFloatImage floresult = reproject(disp, code, err_file, mat_file, log_file);
-    pair<CFloatImage,CFloatImage> splitresult = splitFloImage(floresult);
-    WriteImageVerb(splitresult.first, outx_file, 1);
-    WriteImageVerb(splitresult.second, outy_file, 1);
+    pipelineWriteFlo(floresult, outx_file, outy_file, "reproject");
+} catch (CCancelled &) {
+}
+
+// same as calling reprojectDisparities for nproj projectors with the same view disparities,
+// but reads the view disparities only once and processes the projectors in parallel
+// (dispy_file is not read since reprojection only uses x disparities; all outy files are UNK)
+extern "C" void reprojectDisparitiesBatch(char *dispx_file, char *dispy_file, int nproj, char **codex_files, char **codey_files, char **outx_files, char **outy_files, char **err_files, char **mat_files, char **log_files) try {
+    StageScope scope("reproject");
+    CFloatImage dispx;
+    pipelineRead(dispx, dispx_file);
+    
+    parallelFor(nproj, [&](int i) {
+        CFloatImage codex, codey;
+        pipelineRead(codex, codex_files[i]);
+        pipelineRead(codey, codey_files[i]);
+        
+        CFloatImage outx = reprojectDisp(dispx, codex, codey, err_files[i], mat_files[i], log_files[i]);
+        CFloatImage outy(outx.Shape());
+        outy.FillPixels(UNK);
+        pipelineWrite(outx, outx_files[i], "reproject");
+        pipelineWrite(outy, outy_files[i], "reproject");
+    });
+} catch (CCancelled &) {
+}
+
+// rectify images of several stereo pairs at once: pair p uses extrinsics extr_files[p], and
+// its maps are computed for the size of image size_files[p] (as in computeMaps).
+// job j rectifies in_files[j] to out_files[j] with the maps of camera job_cameras[j] of pair
+// job_pairs[j]; it is an ambient image if job_ambient[j] != 0 (job_ambient may be NULL)
+extern "C" void rectifyImagesBatch(char *intr, char *settings, int npairs, char **extr_files, char **size_files, int njobs, int *job_pairs, int *job_cameras, int *job_ambient, char **in_files, char **out_files) try {
+    StageScope scope("rectify");
+    std::vector<RectificationContext> pairs(npairs);
+    parallelFor(npairs, [&](int p) {
+        CShape sh = pipelineShape(size_files[p]);
+        pairs[p] = *rectificationContext(sh.width, sh.height, intr, extr_files[p], settings);
+    });
+    
+    std::vector<RectifyJob> jobs(njobs);
+    for (int j = 0; j < njobs; j++) {
+        jobs[j].pair = job_pairs[j];
+        jobs[j].camera = job_cameras[j];
+        jobs[j].ambient = (job_ambient != NULL && job_ambient[j] != 0);
+        jobs[j].inpath = in_files[j];
+        jobs[j].outpath = out_files[j];
+    }
+    rectifyBatch(pairs, jobs);
+} catch (CCancelled &) {
 }
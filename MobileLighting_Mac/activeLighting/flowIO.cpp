@@ -42,8 +42,8 @@ bool unknown_flow(float *f) {
     return unknown_flow(f[0], f[1]);
 }
 
-// read a flow file into 2-band image
-void ReadFlowFile(CFloatImage& img, const char* filename)
+// open a flow file and read its header, leaving the stream at the data
+static FILE *ReadFlowHeader(const char* filename, int &width, int &height)
 {
     if (filename == NULL)
 	throw CError("ReadFlowFile: empty filename");
@@ -56,7 +56,6 @@ void ReadFlowFile(CFloatImage& img, const char* filename)
     if (stream == 0)
         throw CError("ReadFlowFile: could not open %s", filename);
     
-    int width, height;
     float tag;
 
     if ((int)fread(&tag,    sizeof(float), 1, stream) != 1 ||
@@ -74,6 +73,15 @@ void ReadFlowFile(CFloatImage& img, const char* filename)
     if (height < 1 || height > 99999)
 	throw CError("ReadFlowFile(%s): illegal height %d", filename, height);
 
+    return stream;
+}
+
+// read a flow file into 2-band image
+void ReadFlowFile(CFloatImage& img, const char* filename)
+{
+    int width, height;
+    FILE *stream = ReadFlowHeader(filename, width, height);
+
     int nBands = 2;
     CShape sh(width, height, nBands);
     img.ReAllocate(sh);
@@ -92,6 +100,15 @@ void ReadFlowFile(CFloatImage& img, const char* filename)
     fclose(stream);
 }
 
+// shape of a flow file, from its header only
+CShape ReadFlowFileShape(const char* filename)
+{
+    int width, height;
+    FILE *stream = ReadFlowHeader(filename, width, height);
+    fclose(stream);
+    return CShape(width, height, 2);
+}
+
 // write a 2-band image into flow file 
 void WriteFlowFile(CFloatImage img, const char* filename)
 {
@@ -14,6 +14,9 @@ bool unknown_flow(float *f);
 // read a flow file into 2-band image
 void ReadFlowFile(CFloatImage& img, const char* filename);
 
+// shape of a flow file (2 bands), reading only its header
+CShape ReadFlowFileShape(const char* filename);
+
 // write a 2-band image into flow file 
 void WriteFlowFile(CFloatImage img, const char* filename);
 
@@ -12,6 +12,9 @@
 //
 ///////////////////////////////////////////////////////////////////////////
 
+#ifndef ERROR_H
+#define ERROR_H
+
 namespace std {}
 using namespace std;
 
@@ -29,3 +32,5 @@ struct CError : public exception
     CError(const char* fmt, const char *s, int d) { snprintf(message, MSGLEN, fmt, s, d); }
     char message[MSGLEN];
 };
+
+#endif // ERROR_H
@@ -104,6 +104,20 @@ void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
     m_memory.ReAllocate(nBytes, memory, deleteWhenDone);
 }
 
+void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
+                        void *memory, int nBytes, void (*deleteFunction)(void *ptr),
+                        void *memStart, int rowSize)
+{
+    // Wrap memory that is released by deleteFunction
+    m_shape     = s;                        // image shape (dimensions)
+    m_pTI       = &ti;                      // pointer to type_info class
+    m_bandSize  = bandSize;                 // size of each band in bytes
+    m_pixSize   = m_bandSize * s.nBands;    // stride between pixels in bytes
+    m_rowSize   = rowSize;                  // stride between rows in bytes
+    m_memStart  = (char *) memStart;        // start of addressable memory
+    m_memory.ReAllocate(nBytes, memory, true, deleteFunction);
+}
+
 void CImage::DeAllocate()
 {
     // Release the memory & set to default values
@@ -123,6 +123,12 @@ public:
                     void *memory, bool deleteWhenDone, int rowSize);
     void ReAllocate(CShape s, const type_info& ti, int bandSize,
                     bool evenIfSameShape = false);
+    void ReAllocate(CShape s, const type_info& ti, int bandSize,
+                    void *memory, int nBytes, void (*deleteFunction)(void *ptr),
+                    void *memStart, int rowSize);
+        // wrap memory owned elsewhere (e.g., a file mapping): pixel (0, 0) is at memStart,
+        // rows are rowSize bytes apart (negative if stored bottom-up), and
+        // deleteFunction(memory) is called when the last image using it is gone
     void DeAllocate(void);      // release the memory & set to default values
 
     CShape Shape(void)              { return m_shape; }
@@ -170,6 +176,8 @@ public:
 
     void ReAllocate(CShape s, bool evenIfSameShape = false);
     void ReAllocate(CShape s, T *memory, bool deleteWhenDone, int rowSize);
+    void ReAllocate(CShape s, void *memory, int nBytes, void (*deleteFunction)(void *ptr),
+                    T *memStart, int rowSize);
 
     T& Pixel(int x, int y, int band);
 
@@ -208,6 +216,15 @@ inline void CImageOf<T>::ReAllocate(CShape s, T *memory,
 {
     CImage::ReAllocate(s, typeid(T), sizeof(T), memory, deleteWhenDone, rowSize);
 }
+
+template <class T>
+inline void CImageOf<T>::ReAllocate(CShape s, void *memory, int nBytes,
+                                    void (*deleteFunction)(void *ptr),
+                                    T *memStart, int rowSize)
+{
+    CImage::ReAllocate(s, typeid(T), sizeof(T), memory, nBytes, deleteFunction,
+                       memStart, rowSize);
+}
     
 template <class T>
 inline T& CImageOf<T>::Pixel(int x, int y, int band)
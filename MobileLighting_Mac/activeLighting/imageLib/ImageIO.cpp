@@ -13,10 +13,12 @@
 //  - PMF (multiband float) - homegrown, non-standard
 //  - PFM (1-band float, see http://netpbm.sourceforge.net/doc/pfm.html)
 //  - PNG (requires ImageIOpng.cpp, and pnglib and zlib packages)
+//  - CFM (compressed multiband float) - homegrown, requires ImageIOcfm.cpp and zlib
 //
 // SEE ALSO
 //  ImageIO.h            longer description
 //  ImageIOpng.cpp       png reader/writer
+//  ImageIOcfm.cpp       cfm reader/writer
 //
 // Copyright © Richard Szeliski and Daniel Scharstein, 2001.
 // added PFM 10/2/2013 DS
@@ -29,16 +31,40 @@
 #include "ImageIO.h"
 #include <vector>
 
+// Comment out next line if you don't have mmap (PFM files are then read and written with stdio)
+#define HAVE_MMAP
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#endif
+
 // Comment out next line if you don't have the PNG library
 #define HAVE_PNG_LIB
 
 #ifdef HAVE_PNG_LIB
 // implemented in ImageIOpng.cpp
 void ReadFilePNG(CByteImage& img, const char* filename);
+CShape ReadFilePNGShape(const char* filename);
 void WriteFilePNG(CByteImage img, const char* filename);
 #endif
 
 
+// Comment out next line if you don't have the zlib library
+#define HAVE_ZLIB
+
+#ifdef HAVE_ZLIB
+// implemented in ImageIOcfm.cpp
+void ReadFileCFM(CFloatImage& img, const char* filename);
+CShape ReadFileCFMShape(const char* filename);
+void WriteFileCFM(CFloatImage img, const char* filename, float precision);
+#endif
 
 // Comment out next line if not using jpeg library
 //#define HAVE_JPEG_READER
@@ -137,13 +163,10 @@ inline uchar* CTargaRLC::getBytes(int nBytes, FILE *stream)
     return m_buffer;
 }
 
-void ReadFileTGA(CByteImage& img, const char* filename)
+// read the header and colormap of a Targa file, leaving stream at the pixels
+static void ReadTGAHeader(FILE *stream, const char* filename, CTargaHead &h,
+                          uchar colormap[TargaCMapSize][TargaCMapBands], bool &isGray)
 {
-    // Open the file and read the header
-    FILE *stream = fopen(filename, "rb");
-    if (stream == 0)
-        throw CError("ReadFileTGA: could not open %s", filename);
-    CTargaHead h;
     if ((int)fread(&h, sizeof(CTargaHead), 1, stream) != 1)
 	    throw CError("ReadFileTGA(%s): file is too short", filename);
 
@@ -156,12 +179,9 @@ void ReadFileTGA(CByteImage& img, const char* filename)
         if (nread != h.idLength)
 	        throw CError("ReadFileTGA(%s): file is too short", filename);
     }
-    //bool isRun = (h.imageType & 8) != 0;
-    bool reverseRows = (h.descriptor & TargaScreenOrigin) != 0;
     int fileBytes = (h.pixelSize + 7) / 8;
 
     // Read the colormap
-    uchar colormap[TargaCMapSize][TargaCMapBands];
     int cMapSize = 0;
     bool grayRamp = false;
     if (h.colorMapType == 1)
@@ -184,10 +204,26 @@ void ReadFileTGA(CByteImage& img, const char* filename)
         }
         grayRamp = (i == cMapSize);    // didn't break out too soon
     }
-    bool isGray = 
+    isGray = 
         h.imageType == TargaRawBW || h.imageType == TargaRunBW ||
         (grayRamp &&
 	 (h.imageType == TargaRawColormap || h.imageType == TargaRunColormap));
+}
+
+void ReadFileTGA(CByteImage& img, const char* filename)
+{
+    // Open the file and read the header
+    FILE *stream = fopen(filename, "rb");
+    if (stream == 0)
+        throw CError("ReadFileTGA: could not open %s", filename);
+    CTargaHead h;
+    uchar colormap[TargaCMapSize][TargaCMapBands];
+    bool isGray;
+    ReadTGAHeader(stream, filename, h, colormap, isGray);
+    //bool isRun = (h.imageType & 8) != 0;
+    bool reverseRows = (h.descriptor & TargaScreenOrigin) != 0;
+    int fileBytes = (h.pixelSize + 7) / 8;
+
     bool isRaw = h.imageType == TargaRawBW || h.imageType == TargaRawRGB ||
         (h.imageType == TargaRawRGB && isGray);
 
@@ -433,6 +469,43 @@ int littleendian()
 }
 
 
+#ifdef HAVE_MMAP
+
+// file mappings wrapped by images, with their lengths (never destroyed, images may be
+// released while the process exits)
+static std::mutex mappingLock;
+static std::map<void *, size_t> *mappings = new std::map<void *, size_t>;
+
+// delete function of the images wrapping a mapping
+static void unmapFile(void *ptr)
+{
+    size_t length;
+    {
+        std::lock_guard<std::mutex> guard(mappingLock);
+        std::map<void *, size_t>::iterator it = mappings->find(ptr);
+        if (it == mappings->end())
+            return;
+        length = it->second;
+        mappings->erase(it);
+    }
+    munmap(ptr, length);
+}
+
+// size the file to length bytes, reserving its blocks so that writing through a mapping
+// cannot fail on a full disk
+static int preallocate(int fd, size_t length)
+{
+#ifdef __APPLE__
+    fstore_t store = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)length, 0};
+    fcntl(fd, F_PREALLOCATE, &store);  // not supported by all file systems, the file is then sparse
+    return ftruncate(fd, length);
+#else
+    return posix_fallocate(fd, 0, length);
+#endif
+}
+
+#endif
+
 // 1-band PFM image, see http://netpbm.sourceforge.net/doc/pfm.html
 // 3-band not yet supported
 void ReadFilePFM(CFloatImage& img, const char* filename)
@@ -464,6 +537,57 @@ void ReadFilePFM(CFloatImage& img, const char* filename)
     // Set the image shape
     CShape sh(width, height, 1);
     
+#ifdef HAVE_MMAP
+    int needSwap = ((scalef < 0) != littleendian());
+    size_t offset = ftell(fp);
+    size_t rowBytes = (size_t)width * sizeof(float);
+    size_t length = offset + rowBytes * height;
+
+    // map the file, privately: changes to the image are not written back
+    struct stat st;
+    void *map = MAP_FAILED;
+    int tooShort = (fstat(fileno(fp), &st) != 0 || (size_t)st.st_size < length);
+    if (! tooShort)
+        map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+    if (fclose(fp))
+        tooShort = 1;           // the mapping stays valid
+    if (tooShort) {
+        if (map != MAP_FAILED)
+            munmap(map, length);
+        throw CError("ReadFilePFM(%s): file is too short", filename);
+    }
+    if (map == MAP_FAILED)
+        throw CError("ReadFilePFM(%s): could not map file", filename);
+    char *data = (char *)map + offset;
+
+    if (! needSwap && offset % sizeof(float) == 0 && height > 0) {
+        // wrap the pixels where they are: PFM stores rows bottom-to-top, so row 0 is the
+        // last one in the file and the rows are -rowBytes apart
+        {
+            std::lock_guard<std::mutex> guard(mappingLock);
+            (*mappings)[map] = length;
+        }
+        img.ReAllocate(sh, map, (int)length, unmapFile,
+                       (float *)(data + (height-1) * rowBytes), -(int)rowBytes);
+        return;
+    }
+
+    // other endianness, or a header that leaves the pixels unaligned: copy them
+    img.ReAllocate(sh);
+    for (int y = 0; y < height; y++) {
+        uchar* ptr = (uchar *) img.PixelAddress(0, y, 0);
+        memcpy(ptr, data + (height-1-y) * rowBytes, rowBytes);
+        if (needSwap) { // if endianness doesn't agree, swap bytes
+            uchar tmp = 0;
+            for (int x = 0; x < width; x++) {
+                tmp = ptr[0]; ptr[0] = ptr[3]; ptr[3] = tmp;
+                tmp = ptr[1]; ptr[1] = ptr[2]; ptr[2] = tmp;
+                ptr += 4;
+            }
+        }
+    }
+    munmap(map, length);
+#else
     // Allocate the image if necessary
     img.ReAllocate(sh);
 
@@ -493,6 +617,7 @@ void ReadFilePFM(CFloatImage& img, const char* filename)
     }
     if (fclose(fp))
         throw CError("ReadFilePGM(%s): error closing file", filename);
+#endif
     }
 
 
@@ -599,6 +724,52 @@ void WriteFilePFM(CFloatImage img, const char* filename, float scalefactor=1/255
     if (nBands != 1)
 	throw CError("WriteFilePFM(%s): can only write 1-band image as pfm for now", filename);
 	
+#ifdef HAVE_MMAP
+    // sign of scalefact indicates endianness, see pfms specs
+    if (littleendian())
+	scalefactor = -scalefactor;
+
+    // the header: 3 lines: Pf, dimensions, scale factor (negative val == little endian), the
+    // scale factor padded with zeros so that the pixels start at a multiple of 4 bytes and
+    // readers can map them in place
+    char header[100];
+    int hlen = snprintf(header, sizeof(header) - sizeof(float), "Pf\n%d %d\n%f", sh.width, sh.height, scalefactor);
+    while ((hlen + 1) % sizeof(float) != 0)
+        header[hlen++] = '0';
+    header[hlen++] = '\n';
+
+    size_t rowBytes = (size_t)sh.width * sizeof(float);
+    size_t length = hlen + rowBytes * sh.height;
+
+    // fill a temporary file of the final size through a mapping, then rename it: images
+    // still mapping an older file of the same name keep its contents
+    static std::atomic<int> counter(0);
+    std::string tmpname = std::string(filename) + "." + std::to_string(getpid()) + "." +
+                          std::to_string(counter++) + ".tmp";
+    int fd = open(tmpname.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
+        throw CError("WriteFilePFM: could not open %s", filename);
+    void *map = MAP_FAILED;
+    if (preallocate(fd, length) == 0)
+        map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        unlink(tmpname.c_str());
+        throw CError("WriteFilePFM(%s): could not allocate file", filename);
+    }
+
+    memcpy(map, header, hlen);
+    // write rows -- pfm stores rows in inverse order!
+    char *data = (char *)map + hlen;
+    for (int y = 0; y < sh.height; y++)
+        memcpy(data + (sh.height-1-y) * rowBytes, img.PixelAddress(0, y, 0), rowBytes);
+
+    int err = munmap(map, length);
+    if (close(fd) != 0 || err != 0 || rename(tmpname.c_str(), filename) != 0) {
+        unlink(tmpname.c_str());
+        throw CError("WriteFilePFM(%s): error closing file", filename);
+    }
+#else
     // Open the file
     FILE *stream = fopen(filename, "wb");
     if (stream == 0)
@@ -622,6 +793,7 @@ void WriteFilePFM(CFloatImage img, const char* filename, float scalefactor=1/255
     // close file
     if (fclose(stream))
         throw CError("WriteFilePFM(%s): error closing file", filename);
+#endif
 }
 
 
@@ -673,6 +845,17 @@ void ReadImage (CImage& img, const char* filename)
         else
            throw CError("ReadImage(%s): wrong image type for PFM", filename);
     }
+#ifdef HAVE_ZLIB
+    else if (strcmp(dot, ".cfm") == 0)
+    {
+        if ((&img.PixType()) == 0)
+	    img.ReAllocate(CShape(), typeid(float), sizeof(float), true);
+        if (img.PixType() == typeid(float))
+            ReadFileCFM(*(CFloatImage *) &img, filename);
+        else
+           throw CError("ReadImage(%s): wrong image type for CFM", filename);
+    }
+#endif
 #ifdef HAVE_PNG_LIB
     else if (strcmp(dot, ".PNG") == 0 || strcmp(dot, ".png") == 0)
     {
@@ -743,6 +926,15 @@ void WriteImage(CImage& img, const char* filename)
         else
            throw CError("WriteImage(%s): can only write CFloatImage in PFM format", filename);
     }
+#ifdef HAVE_ZLIB
+    else if (strcmp(dot, ".cfm") == 0)
+    {
+        if (img.PixType() == typeid(float))
+            WriteFileCFM(*(CFloatImage *) &img, filename, FloatMapPrecision());
+        else
+           throw CError("WriteImage(%s): can only write CFloatImage in CFM format", filename);
+    }
+#endif
 #ifdef HAVE_PNG_LIB
     else if (strcmp(dot, ".PNG") == 0 || strcmp(dot, ".png") == 0)
     {
@@ -756,6 +948,67 @@ void WriteImage(CImage& img, const char* filename)
         throw CError("WriteImage(%s): file type not supported", filename);
 }
 
+// shape of the image ReadImage allocates for an uninitialized image, reading only the header
+CShape ReadImageShape(const char* filename)
+{
+    if (filename == NULL)
+	throw CError("ReadImageShape: empty filename");
+
+    // Determine the file extension
+    const char *dot = strrchr(filename, '.');
+    if (dot == NULL)
+	throw CError("ReadImageShape: extension required in filename '%s'", filename);
+
+#ifdef HAVE_PNG_LIB
+    if (strcmp(dot, ".PNG") == 0 || strcmp(dot, ".png") == 0)
+        return ReadFilePNGShape(filename);
+#endif
+#ifdef HAVE_ZLIB
+    if (strcmp(dot, ".cfm") == 0)
+        return ReadFileCFMShape(filename);
+#endif
+
+    int isTGA = (strcmp(dot, ".TGA") == 0 || strcmp(dot, ".tga") == 0);
+    if (! isTGA && strcmp(dot, ".pgm") != 0 && strcmp(dot, ".ppm") != 0 &&
+        strcmp(dot, ".pmf") != 0 && strcmp(dot, ".pfm") != 0)
+        throw CError("ReadImageShape(%s): file type not supported", filename);
+
+    FILE *stream = fopen(filename, "rb");
+    if (stream == 0)
+        throw CError("ReadImageShape: could not open %s", filename);
+
+    CShape sh;
+    try {
+        if (isTGA) {
+            CTargaHead h;
+            uchar colormap[TargaCMapSize][TargaCMapBands];
+            bool isGray;
+            ReadTGAHeader(stream, filename, h, colormap, isGray);
+            sh = CShape(h.width, h.height, (isGray) ? 1 : 4);
+        } else {
+            int width = 0, height = 0, nBands = 0;
+            if (strcmp(dot, ".pgm") == 0) {
+                read_header(stream, "PGM", 'P', '5', &width, &height, &nBands, 1);
+                nBands = 1;
+            } else if (strcmp(dot, ".ppm") == 0) {
+                read_header(stream, "PGM", 'P', '6', &width, &height, &nBands, 1);
+                nBands = 4;
+            } else if (strcmp(dot, ".pmf") == 0) {
+                read_header(stream, "PMF", 'P', '9', &width, &height, &nBands, 1);
+            } else {
+                read_header(stream, "PFM", 'P', 'f', &width, &height, &nBands, 0);
+                nBands = 1;
+            }
+            sh = CShape(width, height, nBands);
+        }
+    } catch (CError &) {
+        fclose(stream);
+        throw;
+    }
+    fclose(stream);
+    return sh;
+}
+
 // read an image and perhaps tell the user you're doing so
 void ReadImageVerb(CImage& img, const char* filename, int verbose) {
 	if (verbose)
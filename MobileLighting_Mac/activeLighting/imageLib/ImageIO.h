@@ -21,10 +21,12 @@
 //  - PMF (multiband float) - homegrown, non-standard
 //  - PFM (1-band float, see http://netpbm.sourceforge.net/doc/pfm.html)
 //  - PNG (requires ImageIOpng.cpp, and pnglib and zlib packages)
+//  - CFM (compressed multiband float) - homegrown, see ImageIOcfm.cpp
 //
 // SEE ALSO
 //  ImageIO.cpp          implementation
 //  ImageIOpng.cpp       png reader/writer
+//  ImageIOcfm.cpp       cfm reader/writer
 //
 // Copyright © Richard Szeliski and Daniel Scharstein, 2001.
 // added PFM 10/2/2013 DS
@@ -35,7 +37,22 @@
 void ReadImage (CImage& img, const char* filename);
 void WriteImage(CImage& img, const char* filename);
 
+// shape (width, height, and bands) of the image that ReadImage would return for an
+// uninitialized image, from the header of the file without reading the pixels
+CShape ReadImageShape(const char* filename);
+
 void ReadImageVerb (CImage& img, const char* filename, int verbose);
 void WriteImageVerb(CImage& img, const char* filename, int verbose);
 
 void WriteFilePFM(CFloatImage img, const char* filename, float scalefactor);
+
+// precision of the values written to CFM files by WriteImage: they are rounded to multiples
+// of precision, 0 (the default) keeps them exactly.  unknown values (+infinity) are always kept
+void SetFloatMapPrecision(float precision);
+float FloatMapPrecision();
+
+// the CFM reader and writer process bands of rows with fn(i, arg) for i = 0 .. n-1, by default
+// on up to std::thread::hardware_concurrency() threads; an application with its own threads can
+// supply a function running them (NULL: the default).  fn does not throw
+typedef void (*ImageIOParallelFor)(int n, void (*fn)(int i, void *arg), void *arg);
+void SetImageIOParallelFor(ImageIOParallelFor parallelFor);
@@ -0,0 +1,430 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  ImageIOcfm.cpp -- reads and writes compressed float maps (CFM)
+//
+// DESCRIPTION
+//  CFM is a homegrown format for the float code and disparity maps, which
+//  are mostly unknown (+infinity) or smooth.  The rows are split into
+//  bands that are compressed independently (and in parallel):
+//  - a bitmask marks the known values, unknown ones take no other space
+//  - the known values are optionally quantized to multiples of a precision
+//    (lossless otherwise), predicted from their left, upper and upper-left
+//    neighbors, and the prediction residuals are stored as byte planes
+//  - each band is compressed with zlib
+//
+//  All numbers are stored little endian.
+//
+//  bytes   contents
+//
+//  0-3     "CFM1"
+//  4-15    width, height, nBands (uint32)
+//  16-19   precision (float), 0 if lossless
+//  20-23   rows per band
+//  24-27   number of bands nb
+//  28-31   0 (reserved)
+//  32-     nb pairs of uint32: compressed and uncompressed size of each band
+//          followed by the compressed bands
+//
+//  An uncompressed band of n values, m of them known, holds
+//  - the bitmask, (n+7)/8 bytes, bit i (LSB first) set if value i is known
+//  - the number of exceptions e (uint32), then e pairs of uint32: index of
+//    a known value that could not be quantized (e.g., NaN) and its bits
+//  - 4 planes of m bytes: bytes 0..3 of the zigzagged residuals
+//
+// SEE ALSO
+//  ImageIO.cpp
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "Image.h"
+#include "Error.h"
+#include "ImageIO.h"
+#include <zlib.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CFM_MAGIC "CFM1"
+#define CFM_HEADER 32
+#define CFM_BANDROWS 64     // rows per compressed band
+#define CFM_LEVEL 1         // zlib compression level, higher levels gain little on the residuals
+
+typedef unsigned char uchar;
+
+static std::atomic<float> floatMapPrecision(0);
+
+void SetFloatMapPrecision(float precision)
+{
+    floatMapPrecision = (precision > 0) ? precision : 0;
+}
+
+float FloatMapPrecision()
+{
+    return floatMapPrecision;
+}
+
+//
+// parallel bands
+//
+
+static void threadParallelFor(int n, void (*fn)(int i, void *arg), void *arg)
+{
+    int nt = (int)std::thread::hardware_concurrency();
+    if (nt > n)
+        nt = n;
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int i; (i = next++) < n; )
+            fn(i, arg);
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < nt; t++)
+        threads.push_back(std::thread(work));
+    work();
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+}
+
+static std::atomic<ImageIOParallelFor> bandParallelFor(threadParallelFor);
+
+void SetImageIOParallelFor(ImageIOParallelFor parallelFor)
+{
+    bandParallelFor = (parallelFor != NULL) ? parallelFor : threadParallelFor;
+}
+
+//
+// helpers
+//
+
+static void put32(uchar *p, uint32_t v)
+{
+    p[0] = (uchar)v; p[1] = (uchar)(v >> 8); p[2] = (uchar)(v >> 16); p[3] = (uchar)(v >> 24);
+}
+
+static uint32_t get32(const uchar *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t floatBits(float v)
+{
+    uint32_t u;
+    memcpy(&u, &v, sizeof(u));
+    return u;
+}
+
+static float bitsFloat(uint32_t u)
+{
+    float v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+// unknown values are +infinity (UNK in activeLighting), the bit pattern is compared so that
+// NaNs and -infinity are kept as known values
+static bool isKnown(float v)
+{
+    return floatBits(v) != 0x7f800000;
+}
+
+// lossless: the bits of v as an integer that increases with v
+static uint32_t orderedBits(float v)
+{
+    uint32_t u = floatBits(v);
+    return (u & 0x80000000) ? u ^ 0x7fffffff : u;
+}
+
+static float orderedFloat(uint32_t u)
+{
+    return bitsFloat((u & 0x80000000) ? u ^ 0x7fffffff : u);
+}
+
+// the prediction of value i of a band with w*nB values per row from its known neighbors;
+// q holds the integers of the values predicted before
+static uint32_t predict(const std::vector<uint32_t> &q, const std::vector<uchar> &known, int i, int x, int y, int nB, int rowLen)
+{
+    bool l = x > 0 && known[i - nB], u = y > 0 && known[i - rowLen];
+    if (l && u && known[i - rowLen - nB])
+        return q[i - nB] + q[i - rowLen] - q[i - rowLen - nB];
+    if (l)
+        return q[i - nB];
+    if (u)
+        return q[i - rowLen];
+    return 0;
+}
+
+//
+// bands
+//
+
+struct CFMJob {
+    int width, height, nBands, nbands;
+    float precision;
+    CFloatImage *img;
+    std::vector<std::vector<uchar> > packed;    // compressed bands
+    std::vector<uint32_t> rawSize;              // their uncompressed sizes
+    std::vector<int> failed;                    // a band could not be compressed or is corrupt
+};
+
+static void compressBand(int band, void *arg)
+{
+    CFMJob &job = *(CFMJob *)arg;
+    int y0 = band * CFM_BANDROWS, y1 = std::min(y0 + CFM_BANDROWS, job.height);
+    int nB = job.nBands, rowLen = job.width * nB, n = (y1 - y0) * rowLen;
+    double step = job.precision;
+
+    std::vector<uint32_t> q(n), exceptions;
+    std::vector<uchar> known(n);
+    std::vector<uchar> raw((n + 7) / 8 + 4, 0);
+    std::vector<uint32_t> residuals;
+    residuals.reserve(n);
+    for (int y = 0, i = 0; y < y1 - y0; y++) {
+        float *row = &job.img->Pixel(0, y0 + y, 0);
+        for (int x = 0; x < job.width; x++) {
+            for (int b = 0; b < nB; b++, i++) {
+                float v = row[x * nB + b];
+                known[i] = isKnown(v);
+                if (! known[i])
+                    continue;
+                raw[i / 8] |= 1 << (i % 8);
+                uint32_t pred = predict(q, known, i, x, y, nB, rowLen);
+                if (step == 0) {
+                    q[i] = orderedBits(v);
+                } else {
+                    double k = v / step;
+                    if (k > -(1 << 30) && k < (1 << 30)) {  // false if NaN
+                        q[i] = (uint32_t)(int32_t)lrint(k);
+                    } else {
+                        exceptions.push_back(i);
+                        exceptions.push_back(floatBits(v));
+                        q[i] = pred;
+                    }
+                }
+                uint32_t r = q[i] - pred;
+                residuals.push_back((r << 1) ^ (uint32_t)((int32_t)r >> 31));   // zigzag
+            }
+        }
+    }
+
+    size_t m = residuals.size(), pos = (n + 7) / 8;
+    put32(&raw[pos], (uint32_t)(exceptions.size() / 2));
+    pos += 4;
+    raw.resize(pos + 4 * exceptions.size() + 4 * m);
+    for (size_t e = 0; e < exceptions.size(); e++, pos += 4)
+        put32(&raw[pos], exceptions[e]);
+    for (int k = 0; k < 4; k++)
+        for (size_t j = 0; j < m; j++)
+            raw[pos++] = (uchar)(residuals[j] >> (8 * k));
+
+    uLongf len = compressBound(raw.size());
+    std::vector<uchar> &out = job.packed[band];
+    out.resize(len);
+    if (compress2(&out[0], &len, &raw[0], raw.size(), CFM_LEVEL) != Z_OK) {
+        job.failed[band] = 1;
+        return;
+    }
+    out.resize(len);
+    job.rawSize[band] = (uint32_t)raw.size();
+}
+
+static void decompressBand(int band, void *arg)
+{
+    CFMJob &job = *(CFMJob *)arg;
+    int y0 = band * CFM_BANDROWS, y1 = std::min(y0 + CFM_BANDROWS, job.height);
+    int nB = job.nBands, rowLen = job.width * nB, n = (y1 - y0) * rowLen;
+    double step = job.precision;
+
+    size_t maskBytes = (n + 7) / 8;
+    if (job.rawSize[band] < maskBytes + 4 || job.rawSize[band] > maskBytes + 4 + 12 * (size_t)n) {
+        job.failed[band] = 1;
+        return;
+    }
+    std::vector<uchar> raw(job.rawSize[band]);
+    uLongf len = raw.size();
+    std::vector<uchar> &in = job.packed[band];
+    if (uncompress(&raw[0], &len, in.empty() ? NULL : &in[0], in.size()) != Z_OK || len != raw.size()) {
+        job.failed[band] = 1;
+        return;
+    }
+
+    std::vector<uchar> known(n);
+    size_t m = 0;
+    for (int i = 0; i < n; i++)
+        m += known[i] = (raw[i / 8] >> (i % 8)) & 1;
+    size_t ne = get32(&raw[maskBytes]);
+    const uchar *exc = &raw[maskBytes + 4];
+    const uchar *planes = exc + 8 * ne;
+    if (ne > (size_t)n || len != maskBytes + 4 + 8 * ne + 4 * m) {
+        job.failed[band] = 1;
+        return;
+    }
+
+    std::vector<uint32_t> q(n);
+    size_t j = 0, e = 0;
+    for (int y = 0, i = 0; y < y1 - y0; y++) {
+        float *row = &job.img->Pixel(0, y0 + y, 0);
+        for (int x = 0; x < job.width; x++) {
+            for (int b = 0; b < nB; b++, i++) {
+                float &v = row[x * nB + b];
+                if (! known[i]) {
+                    v = INFINITY;
+                    continue;
+                }
+                uint32_t z = planes[j] | (uint32_t)planes[m + j] << 8 |
+                    (uint32_t)planes[2 * m + j] << 16 | (uint32_t)planes[3 * m + j] << 24;
+                j++;
+                q[i] = predict(q, known, i, x, y, nB, rowLen) + ((z >> 1) ^ (0 - (z & 1)));
+                if (e < ne && get32(exc + 8 * e) == (uint32_t)i)
+                    v = bitsFloat(get32(exc + 8 * e++ + 4));
+                else if (step == 0)
+                    v = orderedFloat(q[i]);
+                else
+                    v = (float)((int32_t)q[i] * step);
+            }
+        }
+    }
+}
+
+//
+// files
+//
+
+void WriteFileCFM(CFloatImage img, const char* filename, float precision)
+{
+    CShape sh = img.Shape();
+    CFMJob job;
+    job.width = sh.width;
+    job.height = sh.height;
+    job.nBands = sh.nBands;
+    job.nbands = (sh.height + CFM_BANDROWS - 1) / CFM_BANDROWS;
+    job.precision = (precision > 0) ? precision : 0;
+    job.img = &img;
+    job.packed.resize(job.nbands);
+    job.rawSize.resize(job.nbands);
+    job.failed.resize(job.nbands);
+    bandParallelFor.load()(job.nbands, compressBand, &job);
+    for (int i = 0; i < job.nbands; i++)
+        if (job.failed[i])
+            throw CError("WriteFileCFM(%s): could not compress band %d", filename, i);
+
+    std::vector<uchar> header(CFM_HEADER + 8 * job.nbands);
+    memcpy(&header[0], CFM_MAGIC, 4);
+    put32(&header[4], sh.width);
+    put32(&header[8], sh.height);
+    put32(&header[12], sh.nBands);
+    put32(&header[16], floatBits(job.precision));
+    put32(&header[20], CFM_BANDROWS);
+    put32(&header[24], job.nbands);
+    put32(&header[28], 0);
+    for (int i = 0; i < job.nbands; i++) {
+        put32(&header[CFM_HEADER + 8 * i], (uint32_t)job.packed[i].size());
+        put32(&header[CFM_HEADER + 8 * i + 4], job.rawSize[i]);
+    }
+
+    // write a temporary file, then rename it (as WriteFilePFM does): readers never see a
+    // partly written file, and images still mapping an older file keep its contents
+    static std::atomic<int> counter(0);
+    std::string tmpname = std::string(filename) + "." + std::to_string(getpid()) + "." +
+                          std::to_string(counter++) + ".tmp";
+    FILE *stream = fopen(tmpname.c_str(), "wb");
+    if (stream == 0)
+        throw CError("WriteFileCFM: could not open %s", filename);
+    bool ok = fwrite(&header[0], 1, header.size(), stream) == header.size();
+    for (int i = 0; ok && i < job.nbands; i++)
+        ok = fwrite(&job.packed[i][0], 1, job.packed[i].size(), stream) == job.packed[i].size();
+    if (fclose(stream) != 0 || ! ok || rename(tmpname.c_str(), filename) != 0) {
+        unlink(tmpname.c_str());
+        throw CError("WriteFileCFM(%s): error writing file", filename);
+    }
+}
+
+// read the header of a CFM file, leaving stream at the band table
+static CShape ReadCFMHeader(FILE *stream, const char* filename, float &precision, int &nbands)
+{
+    uchar header[CFM_HEADER];
+    if (fread(header, 1, CFM_HEADER, stream) != CFM_HEADER)
+        throw CError("ReadFileCFM(%s): file is too short", filename);
+    if (memcmp(header, CFM_MAGIC, 4) != 0)
+        throw CError("ReadFileCFM(%s): wrong magic code", filename);
+    int width = get32(&header[4]), height = get32(&header[8]), nBands = get32(&header[12]);
+    precision = bitsFloat(get32(&header[16]));
+    nbands = get32(&header[24]);
+    if (width < 0 || height < 0 || nBands < 1 || get32(&header[20]) != CFM_BANDROWS ||
+        nbands != (height + CFM_BANDROWS - 1) / CFM_BANDROWS)
+        throw CError("ReadFileCFM(%s): invalid header", filename);
+    return CShape(width, height, nBands);
+}
+
+CShape ReadFileCFMShape(const char* filename)
+{
+    FILE *stream = fopen(filename, "rb");
+    if (stream == 0)
+        throw CError("ReadFileCFM: could not open %s", filename);
+    float precision;
+    int nbands;
+    CShape sh;
+    try {
+        sh = ReadCFMHeader(stream, filename, precision, nbands);
+    } catch (CError &) {
+        fclose(stream);
+        throw;
+    }
+    fclose(stream);
+    return sh;
+}
+
+void ReadFileCFM(CFloatImage& img, const char* filename)
+{
+    FILE *stream = fopen(filename, "rb");
+    if (stream == 0)
+        throw CError("ReadFileCFM: could not open %s", filename);
+
+    CFMJob job;
+    bool ok = true;
+    try {
+        fseek(stream, 0, SEEK_END);
+        long remaining = ftell(stream) - CFM_HEADER;
+        fseek(stream, 0, SEEK_SET);
+        CShape sh = ReadCFMHeader(stream, filename, job.precision, job.nbands);
+        job.width = sh.width;
+        job.height = sh.height;
+        job.nBands = sh.nBands;
+        img.ReAllocate(sh);
+        job.img = &img;
+        job.packed.resize(job.nbands);
+        job.rawSize.resize(job.nbands);
+        job.failed.resize(job.nbands);
+        std::vector<uchar> table(8 * job.nbands);
+        ok = fread(table.empty() ? NULL : &table[0], 1, table.size(), stream) == table.size();
+        remaining -= table.size();
+        for (int i = 0; ok && i < job.nbands; i++) {
+            remaining -= get32(&table[8 * i]);
+            if (remaining < 0) {
+                ok = false;
+                break;
+            }
+            job.packed[i].resize(get32(&table[8 * i]));
+            job.rawSize[i] = get32(&table[8 * i + 4]);
+            ok = fread(job.packed[i].empty() ? NULL : &job.packed[i][0], 1, job.packed[i].size(), stream) == job.packed[i].size();
+        }
+    } catch (CError &) {
+        fclose(stream);
+        throw;
+    }
+    fclose(stream);
+    if (! ok)
+        throw CError("ReadFileCFM(%s): file is too short", filename);
+
+    bandParallelFor.load()(job.nbands, decompressBand, &job);
+    for (int i = 0; i < job.nbands; i++)
+        if (job.failed[i])
+            throw CError("ReadFileCFM(%s): band %d is corrupt", filename, i);
+}
@@ -106,13 +106,10 @@ CByteImage removeRedundantBands(CByteImage img)
 }
 
 
-void ReadFilePNG(CByteImage& img, const char* filename)
+// read the header of the PNG file stream and register the transformations applied while
+// reading it (png_ptr and info_ptr are set up); returns the shape of the image to read
+static CShape ReadPNGHeader(FILE *stream)
 {
-    // open the PNG input file
-    FILE *stream = fopen(filename, "rb");
-    if (stream == 0)
-        throw CError("ReadFilePNG: could not open %s", filename);
-
     // first check the eight byte PNG signature
     png_byte pbSig[8];
     fread(pbSig, 1, 8, stream);
@@ -248,8 +245,20 @@ void ReadFilePNG(CByteImage& img, const char* filename)
 		throw CError("ReadFilePNG: Can't handle nBands=%d", nBands);
 	}
 
-	// Set the image shape
-	CShape sh(width, height, nBands);
+	return CShape(width, height, nBands);
+}
+
+
+void ReadFilePNG(CByteImage& img, const char* filename)
+{
+    // open the PNG input file
+    FILE *stream = fopen(filename, "rb");
+    if (stream == 0)
+        throw CError("ReadFilePNG: could not open %s", filename);
+
+    // read the header and set the image shape
+    CShape sh = ReadPNGHeader(stream);
+    int height = sh.height;
 
 	// Allocate the image if necessary
 	img.ReAllocate(sh);
@@ -272,6 +281,19 @@ void ReadFilePNG(CByteImage& img, const char* filename)
 }
 
 
+// shape of the image ReadFilePNG reads, from the header only
+CShape ReadFilePNGShape(const char* filename)
+{
+    FILE *stream = fopen(filename, "rb");
+    if (stream == 0)
+        throw CError("ReadFilePNG: could not open %s", filename);
+    CShape sh = ReadPNGHeader(stream);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(stream);
+    return sh;
+}
+
+
 void WriteFilePNG(CByteImage img, const char* filename)
 {
 	img = removeRedundantBands(img);
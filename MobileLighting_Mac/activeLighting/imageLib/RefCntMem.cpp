@@ -31,8 +31,7 @@ void CRefCntMem::DecrementCount()
     // Decrement the reference count and delete if done
     if (m_ptr)
     {
-        m_ptr->m_refCnt -= 1;
-        if (m_ptr->m_refCnt == 0)
+        if (--m_ptr->m_refCnt == 0)
         {
             if (m_ptr->m_deleteWhenDone)
             {
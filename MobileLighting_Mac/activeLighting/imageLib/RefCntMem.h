@@ -13,6 +13,9 @@
 //  the including class to achieve a similar kind of memory sharing as
 //  is found in garbage collected languages such as Java and C#.
 //
+//  The reference count is atomic, so copies of the same memory object
+//  can be created and destroyed in different threads.
+//
 // SEE ALSO
 //  RefCntMem.cpp       implementation
 //  Image.h             class that uses a CRefCntMem object
@@ -22,10 +25,12 @@
 //
 ///////////////////////////////////////////////////////////////////////////
 
+#include <atomic>
+
 struct CRefCntMemPtr         // shared component of reference counted memory
 {
     void *m_memory;         // allocated memory
-    int m_refCnt;           // reference count
+    std::atomic<int> m_refCnt;  // reference count
     int m_nBytes;           // number of bytes
     bool m_deleteWhenDone;  // delete memory when ref-count drops to 0
     void (*m_delFn)(void *ptr); // optional delete function
@@ -11,11 +11,19 @@
 
 #include "ImageIOpfm.h"
 #include "opencv2/opencv.hpp"
+#include "../Log.h"    // messages go through the log of activeLighting
 #include <iostream>
 #include <stdio.h>
 #include <fstream>
 #include <iomanip>
 #include <cmath>
+#include <sstream>
+#include <atomic>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace cv;
 using namespace std;
@@ -50,6 +58,21 @@ void swapBytes(float* fptr) { // if endianness doesn't agree, swap bytes
 	tmp = ptr[1]; ptr[1] = ptr[2]; ptr[2] = tmp;
 }
 
+/*
+ *  Sizes the file to length bytes, reserving its blocks
+ *  so that writing through a mapping cannot fail on a
+ *  full disk
+ */
+static int preallocate(int fd, size_t length){
+#ifdef __APPLE__
+    fstore_t store = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)length, 0};
+    fcntl(fd, F_PREALLOCATE, &store);  // not supported by all file systems, the file is then sparse
+    return ftruncate(fd, length);
+#else
+    return posix_fallocate(fd, 0, length);
+#endif
+}
+
 /*
  *  Reads a .pfm file image file into an 
  *  opencv Mat structure with type
@@ -62,16 +85,33 @@ void swapBytes(float* fptr) { // if endianness doesn't agree, swap bytes
  */
 int ReadFilePFM(Mat &im, string path){
 
-    // create fstream object to read in pfm file 
-    // open the file in binary
-    fstream file(path.c_str(), ios::in | ios::binary);
-    
+    // map the pfm file, the pixels are copied
+    // straight from the mapping
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0){
+        logPrintf(log_error, "%s: could not open file\n", path.c_str());
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    size_t length = st.st_size;
+    void *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);      // the mapping stays valid
+    if (map == MAP_FAILED){
+        logPrintf(log_error, "%s: could not map file\n", path.c_str());
+        return -1;
+    }
+    const char *data = (const char *) map;
+
+    // the header is parsed from its first bytes
+    istringstream file(string(data, min(length, (size_t) 256)));
+
     // init variables 
     string bands;           // what type is the image   "Pf" = grayscale    (1-band)
                             //                          "PF" = color        (3-band)
-    int width, height;      // width and height of the image
-    float scalef, fvalue;   // scale factor and temp value to hold pixel value
-    Vec3f vfvalue;          // temp value to hold 3-band pixel value
+    int width = 0, height = 0;  // width and height of the image
+    float scalef = 0;       // scale factor
 
     // extract header information, skips whitespace 
     file >> bands;
@@ -84,12 +124,8 @@ int ReadFilePFM(Mat &im, string path){
     int littleEndianMachine = littleendian();
     int needSwap = (littleEndianFile != littleEndianMachine);
 
-    cout << setfill('=') << setw(19) << "=" << endl;
-    cout << "Reading image to pfm file: " << path << endl;
-    cout << "Little Endian?: "  << ((needSwap) ? "false" : "true")   << endl;
-    cout << "width: "           << width                             << endl;
-    cout << "height: "          << height                            << endl;
-    cout << "scale: "           << scalef                            << endl;
+    logPrintf(log_debug, "===================\nReading image to pfm file: %s\nLittle Endian?: %s\nwidth: %d\nheight: %d\nscale: %g\n",
+              path.c_str(), needSwap ? "false" : "true", width, height, scalef);
 
     // skip SINGLE newline character after reading third arg
     char c = file.get();
@@ -97,48 +133,52 @@ int ReadFilePFM(Mat &im, string path){
         c = file.get();
     if (c != '\n') {
         if (c == ' ' || c == '\t' || c == '\r'){
-            cout << "newline expected";
+            logPrintf(log_error, "%s: newline expected\n", path.c_str());
+            munmap(map, length);
             return -1;
         }
         else{
-        	cout << "whitespace expected";
+        	logPrintf(log_error, "%s: whitespace expected\n", path.c_str());
+            munmap(map, length);
             return -1;
         }
     }
     
+    int type;
     if(bands == "Pf"){          // handle 1-band image 
-        cout << "Reading grayscale image (1-band)" << endl; 
-        cout << "Reading into CV_32FC1 image" << endl;
-        im = Mat::zeros(height, width, CV_32FC1);
-        for (int i=height-1; i >= 0; --i) {
-            for(int j=0; j < width; ++j){
-                file.read((char*) &fvalue, sizeof(fvalue));
-                if(needSwap){
-                	swapBytes(&fvalue);
-                }
-                im.at<float>(i,j) = (float) fvalue;
-            }
-        }
+        logPrintf(log_debug, "Reading grayscale image (1-band)\nReading into CV_32FC1 image\n");
+        type = CV_32FC1;
     }else if(bands == "PF"){    // handle 3-band image
-        cout << "Reading color image (3-band)" << endl;
-        cout << "Reading into CV_32FC3 image" << endl; 
-        im = Mat::zeros(height, width, CV_32FC3);
-        for (int i=height-1; i >= 0; --i) {
-            for(int j=0; j < width; ++j){
-                file.read((char*) &vfvalue, sizeof(vfvalue));
-                if(needSwap){
-                	swapBytes(&vfvalue[0]);
-                	swapBytes(&vfvalue[1]);
-                	swapBytes(&vfvalue[2]);
-                }
-                im.at<Vec3f>(i,j) = vfvalue;
-            }
-        }
+        logPrintf(log_debug, "Reading color image (3-band)\nReading into CV_32FC3 image\n");
+        type = CV_32FC3;
     }else{
-        cout << "unknown bands description";
+        logPrintf(log_error, "%s: unknown bands description\n", path.c_str());
+        munmap(map, length);
         return -1;
     }
-    cout << setfill('=') << setw(19) << "=" << endl << endl;
+
+    // a Mat cannot step backwards through the rows
+    // stored bottom-to-top, so they are copied
+    size_t offset = (size_t) file.tellg();
+    size_t nfloats = (size_t) width * CV_MAT_CN(type);
+    size_t rowBytes = nfloats * sizeof(float);
+    if (file.fail() || width < 0 || height < 0 || length < offset + rowBytes * height){
+        logPrintf(log_error, "%s: file is too short\n", path.c_str());
+        munmap(map, length);
+        return -1;
+    }
+    im.create(height, width, type);
+    for (int i=height-1; i >= 0; --i) {
+        float *row = im.ptr<float>(i);
+        memcpy(row, data + offset + (height-1-i) * rowBytes, rowBytes);
+        if(needSwap){
+            for(size_t j=0; j < nfloats; ++j){
+            	swapBytes(&row[j]);
+            }
+        }
+    }
+    munmap(map, length);
+    logPrintf(log_debug, "===================\n\n");
     return 0;
 }
 
@@ -155,17 +195,10 @@ int ReadFilePFM(Mat &im, string path){
  */
 int WriteFilePFM(const Mat &im, string path, float scalef=1/255.0){
 
-    // create fstream object to write out pfm file 
-    // open the file in binary
-    fstream file(path.c_str(), ios::out | ios::binary);
-
-    
     // init variables 
     int type = im.type();
     string bands;
     int width = im.size().width, height = im.size().height;     // width and height of the image 
-    float fvalue;       // scale factor and temp value to hold pixel value
-    Vec3f vfvalue;      // temp value to hold 3-band pixel value
 
 
     switch(type){       // determine identifier string based on image type
@@ -176,7 +209,7 @@ int WriteFilePFM(const Mat &im, string path, float scalef=1/255.0){
             bands = "PF";   // color
             break;
         default:
-            cout << "Unsupported image type, must be CV_32FC1 or CV_32FC3";
+            logPrintf(log_error, "%s: unsupported image type, must be CV_32FC1 or CV_32FC3\n", path.c_str());
             return -1;
     }
 
@@ -184,43 +217,64 @@ int WriteFilePFM(const Mat &im, string path, float scalef=1/255.0){
     if(littleendian())
         scalef = -scalef;
 
-    // insert header information 
-    file << bands   << "\n";
-    file << width   << "\n";
-    file << height  << "\n";
-    file << scalef  << "\n";
-
-    cout << setfill('=') << setw(19) << "=" << endl;
-    cout << "Writing image to pfm file: " << path << endl;
-    cout << "Little Endian?: "  << ((littleendian()) ? "true" : "false")   	<< endl;
-    cout << "width: "           << width                             		<< endl;
-    cout << "height: "          << height                            		<< endl;
-    cout << "scale: "           << scalef                            		<< endl;
+    // insert header information, the scale factor is
+    // indented so that the pixels start at a multiple
+    // of 4 bytes and readers can map them in place
+    ostringstream header;
+    header << bands   << "\n";
+    header << width   << "\n";
+    header << height  << "\n";
+    ostringstream scale;
+    scale << scalef   << "\n";
+    size_t hlen = header.str().size() + scale.str().size();
+    header << string((sizeof(float) - hlen % sizeof(float)) % sizeof(float), ' ') << scale.str();
+    string hdr = header.str();
+
+    logPrintf(log_debug, "===================\nWriting image to pfm file: %s\nLittle Endian?: %s\nwidth: %d\nheight: %d\nscale: %g\n",
+              path.c_str(), littleendian() ? "true" : "false", width, height, scalef);
     
     if(bands == "Pf"){          // handle 1-band image 
-        cout << "Writing grayscale image (1-band)" << endl; 
-        cout << "Writing into CV_32FC1 image" << endl;
-        for (int i=height-1; i >= 0; --i) {
-            for(int j=0; j < width; ++j){
-                fvalue = im.at<float>(i,j);
-                file.write((char*) &fvalue, sizeof(fvalue));
-                
-            }
-        }
-    }else if(bands == "PF"){    // handle 3-band image
-        cout << "writing color image (3-band)" << endl;
-        cout << "writing into CV_32FC3 image" << endl; 
-        for (int i=height-1; i >= 0; --i) {
-            for(int j=0; j < width; ++j){
-                vfvalue = im.at<Vec3f>(i,j);
-                file.write((char*) &vfvalue, sizeof(vfvalue));
-            }
-        }
-    }else{
-        cout << "unknown bands description";
+        logPrintf(log_debug, "Writing grayscale image (1-band)\nWriting into CV_32FC1 image\n");
+    }else{                      // handle 3-band image
+        logPrintf(log_debug, "writing color image (3-band)\nwriting into CV_32FC3 image\n");
+    }
+
+    // fill a temporary file of the final size through
+    // a mapping, then rename it over the pfm file
+    static std::atomic<int> counter(0);
+    string tmppath = path + "." + to_string(getpid()) + "." + to_string(counter++) + ".tmp";
+    size_t rowBytes = (size_t) width * im.elemSize();
+    size_t length = hdr.size() + rowBytes * height;
+    int fd = open(tmppath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd < 0){
+        logPrintf(log_error, "%s: could not open file\n", path.c_str());
+        return -1;
+    }
+    void *map = MAP_FAILED;
+    if (preallocate(fd, length) == 0)
+        map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED){
+        logPrintf(log_error, "%s: could not allocate file\n", path.c_str());
+        close(fd);
+        unlink(tmppath.c_str());
+        return -1;
+    }
+
+    char *data = (char *) map;
+    memcpy(data, hdr.data(), hdr.size());
+    data += hdr.size();
+    for (int i=height-1; i >= 0; --i) {
+        memcpy(data, im.ptr(i), rowBytes);
+        data += rowBytes;
+    }
+
+    int err = munmap(map, length);
+    if (close(fd) != 0 || err != 0 || rename(tmppath.c_str(), path.c_str()) != 0){
+        logPrintf(log_error, "%s: error closing file\n", path.c_str());
+        unlink(tmppath.c_str());
         return -1;
     }
-    cout << setfill('=') << setw(19) << "=" << endl << endl;
+    logPrintf(log_debug, "===================\n\n");
     return 0;
 }
 
@@ -0,0 +1,106 @@
+#!/bin/bash
+# exercises the work queue (see WorkQueue.h) with several local worker processes on one queue
+# directory, on a synthetic scene written by Benchmark:
+#   - worker A is stopped while it holds a job (a hung worker) and resumed after its lease expired
+#   - worker B is killed while it holds a job (a dead worker)
+#   - workers C and D have to finish the graph, including the two jobs given up by A and B
+# the coordinator has to retry both jobs after the lease expired, every step has to be done once,
+# and the final disparities have to be the same as those of a single process run.
+#
+# usage: testWorkQueue.sh [workdir]     (default: a new temporary directory)
+# needs ActiveLighting and Benchmark (make ActiveLighting Benchmark) in this directory
+
+set -e
+bin=$(cd "$(dirname "$0")" && pwd)
+dir=${1:-$(mktemp -d)}
+mkdir -p "$dir"
+dir=$(cd "$dir" && pwd)
+scene=$dir/scene640x480
+queue=$scene/computed/queue
+lease=2
+
+fail() {
+    echo "FAILED: $*" >&2
+    kill -KILL $(jobs -p) 2>/dev/null || true
+    exit 1
+}
+
+# scene with decoded images and calibration (the end-to-end run of Benchmark leaves it in place)
+echo "writing synthetic scene to $scene"
+"$bin/Benchmark" -s 640x480 -p 2 -t 1 -o "$dir" -k > "$dir/benchmark.log" 2>&1 || fail "Benchmark, see $dir/benchmark.log"
+
+cat > "$dir/params.yml" <<EOF
+%YAML:1.0
+threads: 1
+incremental: 0
+disparity: { dXmin: -100, dXmax: 100 }
+queue: { lease: $lease, attempts: 3 }
+EOF
+
+# reference: all steps in one process
+"$bin/ActiveLighting" process "$scene" "$dir/params.yml" > "$dir/process.log" 2>&1 || fail "process, see $dir/process.log"
+for pos in 0 1; do
+    cp "$scene/computed/merged2/pos$pos/disp01x-5final.pfm" "$dir/reference$pos.pfm"
+done
+rm -rf "$scene/computed/merged2"
+
+"$bin/ActiveLighting" coordinate "$scene" "$dir/params.yml" > "$dir/coordinator.log" 2>&1 &
+coordinator=$!
+
+# start worker $1 and stop it as soon as it holds a job other than $2; sets pid and job
+startheld() {
+    "$bin/ActiveLighting" worker "$scene" "$dir/params.yml" > "$dir/worker$1.log" 2>&1 &
+    pid=$!
+    job=""
+    while [ -z "$job" ]; do
+        kill -0 $pid 2>/dev/null || fail "worker $1 exited"
+        if [ -n "$(ls "$queue/running" 2>/dev/null | grep -v "^$2\$")" ]; then
+            # the other jobs in running/ can only be held by this worker
+            kill -STOP $pid
+            job=$(ls "$queue/running" | grep -v "^$2\$" | head -1)
+            if [ -z "$job" ]; then
+                kill -CONT $pid
+            fi
+        fi
+        sleep 0.01
+    done
+}
+
+startheld A none
+a=$pid ajob=$job
+echo "worker A ($a) stopped holding job $ajob"
+startheld B $ajob
+b=$pid bjob=$job
+{ kill -KILL $b; wait $b; } 2>/dev/null || true
+echo "worker B ($b) killed holding job $bjob"
+
+for w in C D; do
+    "$bin/ActiveLighting" worker "$scene" "$dir/params.yml" > "$dir/worker$w.log" 2>&1 &
+done
+
+# resume A once the coordinator gave up its job; its late result has to be ignored
+for i in $(seq 100); do
+    [ "$(grep -c "lease expired" "$dir/coordinator.log")" -ge 2 ] && break
+    sleep 0.1
+done
+kill -CONT $a
+echo "worker A resumed"
+
+wait $coordinator || fail "coordinator exit status $?, see $dir/coordinator.log"
+for pid in $(jobs -p); do
+    wait $pid || true
+done
+
+# both jobs were given to another worker, and every step was done exactly once
+[ "$(grep -c "lease expired, retrying" "$dir/coordinator.log")" -eq 2 ] || fail "expected 2 expired leases, see $dir/coordinator.log"
+for job in $ajob $bjob; do
+    name=$(sed -n "$((10#${job%.*} + 2))p" "$queue/graph")
+    grep -q "\] $name: done" "$dir/coordinator.log" || fail "job $job ($name) was not done again"
+done
+nodes=$(($(wc -l < "$queue/graph") - 1))
+[ "$(grep -c ": done (" "$dir/coordinator.log")" -eq $nodes ] || fail "not all $nodes steps were done once"
+for pos in 0 1; do
+    cmp -s "$scene/computed/merged2/pos$pos/disp01x-5final.pfm" "$dir/reference$pos.pfm" ||
+        fail "pos$pos: distributed result differs from the single process run"
+done
+echo "OK: $nodes steps, 2 expired leases retried, results match ($dir)"
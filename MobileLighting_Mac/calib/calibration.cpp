@@ -75,10 +75,40 @@ the use of this software, even if advised of the possibility of such damage.
 #include <algorithm>
 #include <functional>
 
+#include "calibration_hooks.h"
+
 using namespace cv;
 using namespace aruco;
 using namespace std;
 
+//instrumentation hooks, see calibration_hooks.h
+static void *(*stageBegin)(const char *stage) = NULL;
+static void (*stageEnd)(void *handle) = NULL;
+static void (*stageCount)(const char *counter, long long n) = NULL;
+
+void setCalibrationHooks(void *(*begin)(const char *stage), void (*end)(void *handle),
+                         void (*count)(const char *counter, long long n))
+{
+    stageBegin = begin;
+    stageEnd = end;
+    stageCount = count;
+}
+
+// a calibration step, reported to the hooks from construction to destruction
+class CalibStage {
+public:
+    CalibStage(const char *name) : handle(stageBegin != NULL ? stageBegin(name) : NULL) {}
+    ~CalibStage() { if (stageEnd != NULL) stageEnd(handle); }
+private:
+    void *handle;
+};
+
+static void calibCount(const char *counter, long long n)
+{
+    if (stageCount != NULL)
+        stageCount(counter, n);
+}
+
 //tmp for scaling images during rectification 
 //int rf  = 2;
 
@@ -849,6 +879,8 @@ void getSharedPoints(intrinsicCalibration &inCal, intrinsicCalibration &inCal2)
 // Detects the pattern on a chessboard image
 void chessboardDetect(Settings s, Mat &img, intrinsicCalibration &inCal)
 {
+    CalibStage scope("calib: detect chessboard");
+    calibCount("images", 1);
     //create grayscale copy for cornerSubPix function
     Mat imgGray;
     cvtColor(img, imgGray, COLOR_BGR2GRAY);
@@ -869,6 +901,7 @@ void chessboardDetect(Settings s, Mat &img, intrinsicCalibration &inCal)
 
         //add these image points to the overall calibration vector
         inCal.imagePoints.push_back(imagePointsBuf);
+        calibCount("corners detected", imagePointsBuf.size());
 
         //find the corresponding objectPoints
         calcChessboardCorners(s, objectPointsBuf);
@@ -1027,6 +1060,8 @@ void setUpAruco( Settings s, intrinsicCalibration &inCal, intrinsicCalibration &
 
 void  arucoDetect(Settings s, Mat &img, intrinsicCalibration &InCal, Ptr<ChessBoard> currentBoard){
 
+  CalibStage scope("calib: detect aruco");
+  calibCount("images", 1);
 
   Ptr<aruco::DetectorParameters> detectorParams = aruco::DetectorParameters::create();
 
@@ -1045,6 +1080,7 @@ void  arucoDetect(Settings s, Mat &img, intrinsicCalibration &InCal, Ptr<ChessBo
                        detectorParams, currentBoard->rejected);
   
   if (currentBoard->ids.size() > 0){ 
+    calibCount("markers detected", currentBoard->ids.size());
     InCal.allCorners.push_back(currentBoard->corners); 
     InCal.allIds.push_back(currentBoard->ids);
     s.imageSize = img.size();
@@ -1264,6 +1300,7 @@ vector<int> thresholdImage(stereoCalibration sterCal, Mat rectifiedImage, int vi
 void rectifyImages(Settings s, intrinsicCalibration &inCal,
                    intrinsicCalibration &inCal2, stereoCalibration &sterCal)
 {
+    CalibStage scope("calib: rectify");
     Mat rmap[2][2];
 
     //Precompute maps for remap()
@@ -1336,6 +1373,7 @@ void rectifyImages(Settings s, intrinsicCalibration &inCal,
 // camera matrix and distortion coefficients
 bool runIntrinsicCalibration(Settings s, intrinsicCalibration &inCal)
 {
+    CalibStage scope("calib: intrinsics");
     if (s.useIntrinsicInput)     //precalculated intrinsic have been inputted. Use these
     {
         inCal.cameraMatrix = s.intrinsicInput.cameraMatrix;
@@ -1365,6 +1403,7 @@ bool runIntrinsicCalibration(Settings s, intrinsicCalibration &inCal)
 // the rotation and translation between them
 stereoCalibration runStereoCalibration(Settings s, intrinsicCalibration &inCal, intrinsicCalibration &inCal2)
 {
+    CalibStage scope("calib: stereo");
     stereoCalibration sterCal;
     if (s.useIntrinsicInput)     //precalculated intrinsic have been inputted. Use these
     {
@@ -1452,6 +1491,7 @@ void runCalibrationAndSave(Settings s, intrinsicCalibration &inCal, intrinsicCal
 // Main function. Detects patterns on images, runs calibration and saves results
 int calibrateWithSettings( const string inputSettingsFile )
 {
+    CalibStage scope("calibrate");
     Settings s;
     FileStorage fs(inputSettingsFile, FileStorage::READ);   // Read the settings
     if (!fs.isOpened())
@@ -0,0 +1,19 @@
+//
+//  calibration_hooks.h
+//  MobileLighting_Mac
+//
+//  instrumentation hooks of the calibration steps
+//
+
+#ifndef calibration_hooks_h
+#define calibration_hooks_h
+
+// the calibration library does not depend on the activeLighting library; the app installs
+// these hooks (see calibration_wrapper.cpp) so the calibration steps show up in the stage
+// instrumentation (activeLighting/Instrument.h).  without hooks the steps are not recorded.
+//   begin(stage)       a step starts, returns a handle passed to end() when it finishes
+//   count(counter, n)  add n to counter of the running step
+void setCalibrationHooks(void *(*begin)(const char *stage), void (*end)(void *handle),
+                         void (*count)(const char *counter, long long n));
+
+#endif /* calibration_hooks_h */
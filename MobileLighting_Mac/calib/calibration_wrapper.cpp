@@ -9,6 +9,14 @@
 #include <stdio.h>
 #include <string>
 #include <vector>
+#include "calibration_hooks.h"
+#include "../activeLighting/Instrument.h"
+
+// the calibration steps are recorded by the instrumentation of the activeLighting library,
+// which the app links together with the calibration library
+static void *beginStage(const char *stage) { return new StageScope(stage); }
+static void endStage(void *scope) { delete (StageScope *)scope; }
+static const bool calibrationInstrumented = (setCalibrationHooks(beginStage, endStage, instrumentCount), true);
 
 int calibrateWithSettings(std::string);  // this is the function in calibrate.cpp
 extern "C" int CalibrateWithSettings(const char *inputSettingsFile) {   // this is the wrapped function for bridging to swift
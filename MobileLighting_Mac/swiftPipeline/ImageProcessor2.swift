@@ -44,7 +44,9 @@ func decodedImageHandler(_ decodedImPath: String, horizontal: Bool, projector: I
 
 // computes & saves disparity maps for images of the given image position pair taken with the given projector
 // NOW: also refines disparity maps
-func disparityMatch(proj: Int, leftpos: Int, rightpos: Int, rectified: Bool) {
+// if initialComputed is set, the initial disparities already exist (see rectifyAndMatch) and
+//    only the cross-checking and filtering steps are run
+func disparityMatch(proj: Int, leftpos: Int, rightpos: Int, rectified: Bool, initialComputed: Bool = false) {
     var refinedDirLeft: [CChar], refinedDirRight: [CChar]
 //    if rectified {
 //        refinedDirLeft = (dirStruc.subdir(dirStruc.refined, proj: proj, pos: leftpos) + "/left").cString(using: .ascii)!
@@ -73,11 +75,13 @@ func disparityMatch(proj: Int, leftpos: Int, rightpos: Int, rectified: Bool) {
         ymin = 0
         ymax = 0
     }
-    disparitiesOfRefinedImgs(&refinedDirLeft, &refinedDirRight,
-                             &disparityDirLeft,
-                             &disparityDirRight,
-                             l, r, rectified ? 1 : 0,
-                             xmin, xmax, ymin, ymax)
+    if !initialComputed {
+        disparitiesOfRefinedImgs(&refinedDirLeft, &refinedDirRight,
+                                 &disparityDirLeft,
+                                 &disparityDirRight,
+                                 l, r, rectified ? 1 : 0,
+                                 xmin, xmax, ymin, ymax)
+    }
     
     
     var in_suffix = "0initial".cString(using: .ascii)!
@@ -115,34 +119,82 @@ func disparityMatch(proj: Int, leftpos: Int, rightpos: Int, rectified: Bool) {
 }
 
 func rectify(left: Int, right: Int, proj: Int) {
+    rectify(pairs: [(left, right)], proj: proj)
+}
+
+// rectify the decoded images of several stereo pairs for one projector at once
+// (maps of all pairs are computed concurrently, then all images are rectified concurrently)
+func rectify(pairs: [(Int, Int)], proj: Int) {
     var intr = *dirStruc.intrinsicsYML
-    var extr = *dirStruc.extrinsicsYML(left: left, right: right)
     var settings = *dirStruc.calibrationSettingsFile
-    let rectdirleft = dirStruc.decoded(proj: proj, pos: left, rectified: true)
-    let rectdirright = dirStruc.decoded(proj: proj, pos: right, rectified: true)
-    var result0l = *"\(dirStruc.decoded(proj: proj, pos: left, rectified: false))/result\(left)u-2holefilled.pfm"
-    var result0r = *"\(dirStruc.decoded(proj: proj, pos: right, rectified: false))/result\(right)u-2holefilled.pfm"
-    var result1l = *"\(dirStruc.decoded(proj: proj, pos: left, rectified: false))/result\(left)v-2holefilled.pfm"
-    var result1r = *"\(dirStruc.decoded(proj: proj, pos: right, rectified: false))/result\(right)v-2holefilled.pfm"
-    computeMaps(&result0l, &intr, &extr, &settings)
+    var extrfiles = [String](), sizefiles = [String]()
+    var jobpairs = [Int32](), jobcameras = [Int32](), infiles = [String](), outfiles = [String]()
+    for (i, (left, right)) in pairs.enumerated() {
+        let rectdirleft = dirStruc.decoded(proj: proj, pos: left, rectified: true)
+        let rectdirright = dirStruc.decoded(proj: proj, pos: right, rectified: true)
+        let result0l = "\(dirStruc.decoded(proj: proj, pos: left, rectified: false))/result\(left)u-2holefilled.pfm"
+        let result0r = "\(dirStruc.decoded(proj: proj, pos: right, rectified: false))/result\(right)u-2holefilled.pfm"
+        let result1l = "\(dirStruc.decoded(proj: proj, pos: left, rectified: false))/result\(left)v-2holefilled.pfm"
+        let result1r = "\(dirStruc.decoded(proj: proj, pos: right, rectified: false))/result\(right)v-2holefilled.pfm"
+        extrfiles.append(dirStruc.extrinsicsYML(left: left, right: right))
+        sizefiles.append(result0l)
+        
+        let outpaths = [rectdirleft + "/result\(left)\(right)u-0rectified.pfm",
+            rectdirleft + "/result\(left)\(right)v-0rectified.pfm",
+            rectdirright + "/result\(left)\(right)u-0rectified.pfm",
+            rectdirright + "/result\(left)\(right)v-0rectified.pfm",
+            ]
+        for path in outpaths {
+            let dir = path.split(separator: "/").dropLast().joined(separator: "/")
+            do { try FileManager.default.createDirectory(atPath: dir, withIntermediateDirectories: true, attributes: nil) }
+            catch { print("rectify: could not create dir at \(dir).") }
+        }
+        infiles += [result0l, result1l, result0r, result1r]
+        outfiles += outpaths
+        jobpairs += [Int32](repeating: Int32(i), count: 4)
+        jobcameras += [0, 0, 1, 1]
+    }
+    var cextr = *extrfiles, csize = *sizefiles, cin = *infiles, cout = *outfiles
+    var extrPtrs = **cextr, sizePtrs = **csize, inPtrs = **cin, outPtrs = **cout
+    rectifyImagesBatch(&intr, &settings, Int32(pairs.count), &extrPtrs, &sizePtrs, Int32(jobpairs.count), &jobpairs, &jobcameras, nil, &inPtrs, &outPtrs)
+}
 
-    var outpaths = [rectdirleft + "/result\(left)\(right)u-0rectified.pfm",
-        rectdirleft + "/result\(left)\(right)v-0rectified.pfm",
-        rectdirright + "/result\(left)\(right)u-0rectified.pfm",
-        rectdirright + "/result\(left)\(right)v-0rectified.pfm",
-        ]
-    for path in outpaths {
-        let dir = path.split(separator: "/").dropLast().joined(separator: "/")
+// rectifies, refines & matches the decoded images of one stereo pair in a single step,
+//    without writing and re-reading the intermediate rectified images
+//    (equivalent to rectify, refine -r, and disparity -r for the pair)
+func rectifyAndMatch(left: Int, right: Int, proj: Int) {
+    var intr = *dirStruc.intrinsicsYML
+    var extr = *dirStruc.extrinsicsYML(left: left, right: right)
+    var settings = *dirStruc.calibrationSettingsFile
+    var decodedLeft = *dirStruc.decoded(proj: proj, pos: left, rectified: false)
+    var decodedRight = *dirStruc.decoded(proj: proj, pos: right, rectified: false)
+    let rectdirs = [dirStruc.decoded(proj: proj, pos: left, rectified: true), dirStruc.decoded(proj: proj, pos: right, rectified: true)]
+    let dispdirs = [dirStruc.disparity(proj: proj, pos: left, rectified: true), dirStruc.disparity(proj: proj, pos: right, rectified: true)]
+    for dir in rectdirs + dispdirs {
         do { try FileManager.default.createDirectory(atPath: dir, withIntermediateDirectories: true, attributes: nil) }
-        catch { print("rectify: could not create dir at \(dir).") }
+        catch { print("rectifyAndMatch: could not create dir at \(dir).") }
     }
-    var coutpaths = outpaths.map {
-        return $0.cString(using: .ascii)!
+    
+    // stripe angles, indexed [2*camera + direction]
+    var angles = [Double]()
+    for pos in [left, right] {
+        for direction in [0, 1] {
+            let metadatapath = dirStruc.metadataFile(direction, proj: proj, pos: pos)
+            guard let metadataStr = try? String(contentsOfFile: metadatapath),
+                let metadata: Yaml = try? Yaml.load(metadataStr),
+                let angle: Double = metadata.dictionary?["angle"]?.double else {
+                    print("rectifyAndMatch error: could not load metadata file \(metadatapath).")
+                    return
+            }
+            angles.append(angle)
+        }
     }
-    rectifyDecoded(0, &result0l, &coutpaths[0])
-    rectifyDecoded(0, &result1l, &coutpaths[1])
-    rectifyDecoded(1, &result0r, &coutpaths[2])
-    rectifyDecoded(1, &result1r, &coutpaths[3])
+    
+    var rectLeft = *rectdirs[0], rectRight = *rectdirs[1]
+    var dispLeft = *dispdirs[0], dispRight = *dispdirs[1]
+    rectifyRefineDisparities(&intr, &extr, &settings, &decodedLeft, &decodedRight, &rectLeft, &rectRight,
+                             &dispLeft, &dispRight, Int32(left), Int32(right), &angles, -1080, 1080, -1, 1)
+    disparityMatch(proj: proj, leftpos: left, rightpos: right, rectified: true, initialComputed: true)
 }
 
 // merge disparity maps for one stereo pair across all projectors
@@ -260,21 +312,22 @@ func reproject(left leftpos: Int, right rightpos: Int) {
     let projDirs = try! FileManager.default.contentsOfDirectory(atPath: dirStruc.disparity(true))
     let projectors = getIDs(projDirs.map{return String($0.split(separator: "/").last!)}, prefix: "proj", suffix: "")
     
-    for proj in projectors {
-        for pos in [leftpos, rightpos] {
-            var dispx: [CChar], dispy: [CChar], codex: [CChar], codey: [CChar], outx: [CChar], outy: [CChar], errfile: [CChar], matfile: [CChar], logfile: [CChar]
-
-            dispx = *(dirStruc.merged(pos: pos, rectified: true) + "/disp\(leftpos)\(rightpos)x-1crosscheck.pfm")
-            dispy = *(dirStruc.merged(pos: pos, rectified: true) + "/disp\(leftpos)\(rightpos)y-1crosscheck.pfm")
-            codex = *"\(dirStruc.decoded(proj: proj, pos: pos, rectified: true))/result\(leftpos)\(rightpos)u-4refined2.pfm"
-            codey = *"\(dirStruc.decoded(proj: proj, pos: pos, rectified: true))/result\(leftpos)\(rightpos)v-4refined2.pfm"
-            outx = (dirStruc.reprojected(proj: proj, pos: pos) + "/disp\(leftpos)\(rightpos)x-0initial.pfm").cString(using: .ascii)!
-            outy = (dirStruc.reprojected(proj: proj, pos: pos) + "/disp\(leftpos)\(rightpos)y-0initial.pfm").cString(using: .ascii)!
-            errfile = (dirStruc.reprojected(proj: proj, pos: pos) + "/error\(leftpos)\(rightpos).pfm").cString(using: .ascii)!
-            matfile = (dirStruc.reprojected(proj: proj, pos: pos) + "/mat\(leftpos)\(rightpos).txt").cString(using: .ascii)!
-            logfile = *(dirStruc.reprojected(proj: proj, pos: pos) + "/log\(leftpos)\(rightpos).txt")
-            reprojectDisparities(&dispx, &dispy, &codex, &codey, &outx, &outy, &errfile, &matfile, &logfile)
-            
+    for pos in [leftpos, rightpos] {
+        // reproject all projectors at once (view disparities are read only once)
+        var dispx = *(dirStruc.merged(pos: pos, rectified: true) + "/disp\(leftpos)\(rightpos)x-1crosscheck.pfm")
+        var dispy = *(dirStruc.merged(pos: pos, rectified: true) + "/disp\(leftpos)\(rightpos)y-1crosscheck.pfm")
+        var codex = *projectors.map { "\(dirStruc.decoded(proj: $0, pos: pos, rectified: true))/result\(leftpos)\(rightpos)u-4refined2.pfm" }
+        var codey = *projectors.map { "\(dirStruc.decoded(proj: $0, pos: pos, rectified: true))/result\(leftpos)\(rightpos)v-4refined2.pfm" }
+        var outx = *projectors.map { dirStruc.reprojected(proj: $0, pos: pos) + "/disp\(leftpos)\(rightpos)x-0initial.pfm" }
+        var outy = *projectors.map { dirStruc.reprojected(proj: $0, pos: pos) + "/disp\(leftpos)\(rightpos)y-0initial.pfm" }
+        var errfiles = *projectors.map { dirStruc.reprojected(proj: $0, pos: pos) + "/error\(leftpos)\(rightpos).pfm" }
+        var matfiles = *projectors.map { dirStruc.reprojected(proj: $0, pos: pos) + "/mat\(leftpos)\(rightpos).txt" }
+        var logfiles = *projectors.map { dirStruc.reprojected(proj: $0, pos: pos) + "/log\(leftpos)\(rightpos).txt" }
+        var codexPtrs = **codex, codeyPtrs = **codey, outxPtrs = **outx, outyPtrs = **outy
+        var errPtrs = **errfiles, matPtrs = **matfiles, logPtrs = **logfiles
+        reprojectDisparitiesBatch(&dispx, &dispy, Int32(projectors.count), &codexPtrs, &codeyPtrs, &outxPtrs, &outyPtrs, &errPtrs, &matPtrs, &logPtrs)
+        
+        for proj in projectors {
             /*
             need to add code for using nonlinear reprojection -- but need warpdisp code first.
             */
@@ -285,9 +338,9 @@ func reproject(left leftpos: Int, right rightpos: Int) {
             var out_suffix_x = *"/disp\(leftpos)\(rightpos)x-1filtered.pfm"
             var out_suffix_y = *"/disp\(leftpos)\(rightpos)y-1filtered.pfm"
             
-            dispx = dir + in_suffix_x
-            outx = dir + out_suffix_x
-            outy = dir + out_suffix_y
+            var dispx = dir + in_suffix_x
+            var outx = dir + out_suffix_x
+            var outy = dir + out_suffix_y
             
             filterDisparities(&dispx, nil, &outx, nil, Int32(leftpos), Int32(rightpos), -1, 3, 0, 0, 200)
         }
@@ -324,8 +377,16 @@ func mergeReprojected(left leftpos: Int, right rightpos: Int) {
         var outdfile = *(dirStruc.merged2(pos) + "/disp\(leftpos)\(rightpos)x-0initial.pfm")
         var outsdfile = *(dirStruc.merged2(pos) + "/disp\(leftpos)\(rightpos)x-sd.pfm")
         var outnfile = *(dirStruc.merged2(pos) + "/disp\(leftpos)\(rightpos)x-nsamples.pgm")
+        // merge state as written by the merge2 steps of processScene.  it is computed from scratch here,
+        // so the list of its maps that processScene keeps next to it no longer applies
+        var statefile = *(dirStruc.merged2(pos) + "/disp\(leftpos)\(rightpos)x-state.pmf")
+        try? FileManager.default.removeItem(atPath: dirStruc.merged2(pos) + "/disp\(leftpos)\(rightpos)x-state.txt")
         
-         mergeDisparityMaps2(MERGE2_MAXDIFF, nV, nR, &outdfile, &outsdfile, &outnfile, &inmdfile, &viewDispsPtrs, &reprojDispsPtrs)
+        guard mergeDisparityMaps2Init(MERGE2_MAXDIFF, nV, nR, &statefile, &inmdfile, &viewDispsPtrs, &reprojDispsPtrs) != 0 else {
+            // cancelled: the state file was not written
+            return
+        }
+        mergeDisparityMaps2Finalize(&statefile, &outdfile, &outsdfile, &outnfile)
         
         // filter merged results
         var indispx = outdfile
@@ -352,6 +413,50 @@ func mergeReprojected(left leftpos: Int, right rightpos: Int) {
     in_suffix = *"3filtered"
     out_suffix = *"4crosscheck2"
     crosscheckDisparities(&leftdir, &rightdir, Int32(leftpos), Int32(rightpos), 1, 1, 1, &in_suffix, &out_suffix)
+    
+    // remove small components left by the cross-check and make sd and nsamples consistent with
+    // the final disparities, in one pass (no clipping, no manual mask)
+    for pos in [leftpos, rightpos] {
+        let prefix = dirStruc.merged2(pos) + "/disp\(leftpos)\(rightpos)x-"
+        var indispx = *(prefix + "4crosscheck2.pfm")
+        var insdfile = *(prefix + "sd.pfm")
+        var innfile = *(prefix + "nsamples.pgm")
+        var outx = *(prefix + "5final.pfm")
+        var outsdfile = *(prefix + "5final-sd.pfm")
+        var outnfile = *(prefix + "5final-nsamples.pgm")
+        finalizeDisparities(&indispx, &insdfile, &innfile, nil, &outx, &outsdfile, &outnfile, -Float.infinity, Float.infinity, 20, 2.0)
+    }
+}
+
+// runs all processing steps (refine, rectify -d, disparity -r, merge -r, reproject, merge2)
+//    for the given projectors and positions; steps that do not depend on each other run in parallel
+//    memoryMB limits the estimated memory of the steps running at the same time together with the
+//    images held in memory (0: no limit)
+//    steps whose outputs are still up to date are skipped, except for the steps of stage forceFrom
+//    (refine, rectify, disparity, merge, reproject or merge2) and all steps after it
+// inMemory: keep the intermediate images in a pipeline session; each one is written once no
+//    remaining step reads it, the rest when done
+func processAll(projectors: [Int], positions: [Int], memoryMB: Int = 0, forceFrom: String? = nil, inMemory: Bool = false) {
+    let session: UnsafeMutableRawPointer? = inMemory ? pipelineSessionCreate() : nil
+    var scene = *dirStruc.scene
+    var projs = projectors.map { Int32($0) }
+    var poss = positions.map { Int32($0) }
+    var failed: Int32
+    if let stage = forceFrom {
+        var cstage = *stage
+        failed = processScene(&scene, Int32(projs.count), &projs, Int32(poss.count), &poss, 0, Int32(memoryMB), 1, &cstage)
+    } else {
+        failed = processScene(&scene, Int32(projs.count), &projs, Int32(poss.count), &poss, 0, Int32(memoryMB), 1, nil)
+    }
+    if let session = session {
+        if pipelineSessionFlush(session) == 0 {
+            print("process: not all images of the session could be written")
+        }
+        pipelineSessionDestroy(session)
+    }
+    if failed > 0 {
+        print("process: \(failed) steps failed or were skipped")
+    }
 }
 
 func filterReliableReprojected(_ reprojDirs: [String], left leftpos: Int, right rightpos: Int) -> [String] {